@@ -20,6 +20,15 @@
 #define CFG_RECORD_FALL_THROUGH_COUNT 1
 
 
+/// Should basic block execution counts be sampled? If so, then the execution
+/// counters are only incremented during the bursts of a sampled policy (see
+/// `granary/sampling.h`), and so the counts are proportional to, rather than
+/// equal to, the true execution counts.
+#ifndef CFG_SAMPLE_EXEC_COUNT
+#   define CFG_SAMPLE_EXEC_COUNT 0
+#endif
+
+
 /// Should we record indirect branch targets?
 #define CFG_RECORD_INDIRECT_TARGETS 0
 
@@ -255,6 +255,45 @@ namespace client {
     }
 
 
+#if CFG_RECORD_EXEC_COUNT && CFG_SAMPLE_EXEC_COUNT
+    /// Label the checking version of a basic block so that it is reported on
+    /// alongside the fully instrumented version. Its execution count remains
+    /// zero.
+    granary::instrumentation_policy cfg_check_policy::visit_app_instructions(
+        granary::cpu_state_handle,
+        granary::basic_block_state &bb,
+        granary::instruction_list &ls
+    ) throw() {
+        if(!ls.is_stub()) {
+            ls.prepend(persistent_label_(bb.label));
+        }
+        return *this;
+    }
+
+
+    granary::instrumentation_policy cfg_check_policy::visit_host_instructions(
+        granary::cpu_state_handle cpu,
+        granary::basic_block_state &bb,
+        granary::instruction_list &ls
+    ) throw() {
+        return visit_app_instructions(cpu, bb, ls);
+    }
+
+
+#   if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
+    granary::interrupt_handled_state cfg_check_policy::handle_interrupt(
+        granary::cpu_state_handle,
+        granary::thread_state_handle,
+        granary::basic_block_state &,
+        granary::interrupt_stack_frame &,
+        granary::interrupt_vector
+    ) throw() {
+        return granary::INTERRUPT_DEFER;
+    }
+#   endif
+#endif
+
+
 #if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
 
     granary::interrupt_handled_state cfg_policy::handle_interrupt(
@@ -11,8 +11,16 @@
 
 #include "granary/client.h"
 
+#include "clients/cfg/config.h"
+
 #ifndef GRANARY_INIT_POLICY
-#   define GRANARY_INIT_POLICY (client::cfg_policy())
+#   if CFG_RECORD_EXEC_COUNT && CFG_SAMPLE_EXEC_COUNT
+#       define GRANARY_INIT_POLICY \
+            (granary::sampled_policy<client::cfg_check_policy, \
+                                     client::cfg_policy>())
+#   else
+#       define GRANARY_INIT_POLICY (client::cfg_policy())
+#   endif
 #endif
 
 
@@ -51,6 +59,14 @@ namespace client {
     };
 
 
+#if CFG_RECORD_EXEC_COUNT && CFG_SAMPLE_EXEC_COUNT
+    /// Used to instrument the checking version of every basic block when
+    /// execution counts are sampled. This only labels basic blocks, so that
+    /// they can be reported on, and doesn't count their executions.
+    DECLARE_POLICY(cfg_check_policy, true);
+#endif
+
+
 #if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
     /// Handle an interrupt in kernel code. Returns true iff the client handles
     /// the interrupt.
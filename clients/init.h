@@ -30,6 +30,11 @@
 #endif
 
 
+#ifdef CLIENT_WATCHPOINT_PROFILE
+#   define CLIENT_init
+#endif
+
+
 #ifdef CLIENT_ENTRY
 #   define CLIENT_init
 #endif
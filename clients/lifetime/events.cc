@@ -0,0 +1,110 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#include "clients/lifetime/events.h"
+#include "clients/lifetime/metadata.h"
+
+#include "granary/allocator.h"
+#include "granary/state.h"
+
+using namespace granary;
+
+namespace client {
+
+static_assert(wp::MAX_NUM_WATCHPOINTS <= (1U << 24),
+    "Descriptor indexes must fit in the descriptor index of access events.");
+
+// List of all event buffers, so that the events of every CPU can be folded
+// at report time.
+static std::atomic<event_buffer *> EVENT_BUFFERS(ATOMIC_VAR_INIT(nullptr));
+
+// Allocate a new event buffer and add it to the list of all event buffers.
+static event_buffer *allocate_event_buffer(void) throw() {
+  auto buffer = allocate_memory<event_buffer>();
+  auto next = EVENT_BUFFERS.load(std::memory_order_relaxed);
+  do {
+    buffer->next = next;
+  } while (!EVENT_BUFFERS.compare_exchange_weak(next, buffer));
+  return buffer;
+}
+
+// Fold a single access event into the read or write counters of the accessed
+// object's data structure. Bytes outside of the data structure are ignored, as
+// are events whose object has since been freed.
+static void fold_event(const access_event &event) throw() {
+  auto obj_meta = object_metadata::access(event.descriptor_index);
+  auto ds_meta = obj_meta->data_structure;
+  if (!ds_meta ||
+      event.generation != (obj_meta->generation & EVENT_GENERATION_MASK)) {
+    return;
+  }
+
+  auto counters = event.is_write ? ds_meta->num_writes : ds_meta->num_reads;
+  const unsigned end = event.byte_offset + event.num_bytes;
+  for (unsigned i = event.byte_offset; i < end && i < ds_meta->num_bytes; ++i) {
+    __sync_fetch_and_add(&(counters[i]), 1U);
+  }
+}
+
+// Fold all buffered events in `buffer` into the read/write counters.
+static void fold_events(event_buffer *buffer) throw() {
+  buffer->consumer_lock.acquire();
+  auto head = buffer->head.load(std::memory_order_relaxed);
+  const auto tail = buffer->tail.load(std::memory_order_acquire);
+  for (; head < tail; ++head) {
+    fold_event(buffer->events[head & (EVENT_BUFFER_SIZE - 1)]);
+  }
+  buffer->head.store(tail, std::memory_order_release);
+  buffer->consumer_lock.release();
+}
+
+// Record an access to the watched address `addr` in the current CPU's event
+// buffer. If the buffer is full then it is folded on the spot.
+void record_access(uintptr_t addr, unsigned long num_bytes,
+                   bool is_write) throw() {
+  auto obj_meta = wp::descriptor_of(addr);
+  if (!obj_meta->data_structure || !is_current_object(addr, obj_meta)) {
+    return;  // Access to a freed object.
+  }
+
+  auto byte_offset = wp::unwatched_address(addr) -
+                     wp::unwatched_address(obj_meta->base_addr);
+
+  access_event event;
+  event.descriptor_index = static_cast<uint32_t>(wp::combined_index_of(addr));
+  event.generation = obj_meta->generation & EVENT_GENERATION_MASK;
+  event.is_write = is_write;
+  event.num_bytes = MAX_EVENT_NUM_BYTES;
+  if (num_bytes < MAX_EVENT_NUM_BYTES) {
+    event.num_bytes = static_cast<uint32_t>(num_bytes);
+  }
+  event.byte_offset = MAX_EVENT_BYTE_OFFSET;
+  if (byte_offset < MAX_EVENT_BYTE_OFFSET) {
+    event.byte_offset = static_cast<uint32_t>(byte_offset);
+  }
+
+  IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+  cpu_state_handle cpu;
+  auto buffer = cpu->events;
+  if (!buffer) {
+    buffer = cpu->events = allocate_event_buffer();
+  }
+
+  const auto tail = buffer->tail.load(std::memory_order_relaxed);
+  const auto head = buffer->head.load(std::memory_order_acquire);
+  if (EVENT_BUFFER_SIZE <= (tail - head)) {
+    fold_events(buffer);
+  }
+  buffer->events[tail & (EVENT_BUFFER_SIZE - 1)] = event;
+  buffer->tail.store(tail + 1, std::memory_order_release);
+  IF_KERNEL( granary_store_flags(flags); )
+}
+
+// Fold all buffered events of all CPUs into the read/write counters.
+void fold_all_events(void) throw() {
+  auto buffer = EVENT_BUFFERS.load(std::memory_order_acquire);
+  for (; buffer; buffer = buffer->next) {
+    fold_events(buffer);
+  }
+}
+
+}  // namespace client
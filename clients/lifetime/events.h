@@ -0,0 +1,83 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef CLIENTS_LIFETIME_EVENTS_H_
+#define CLIENTS_LIFETIME_EVENTS_H_
+
+#include <atomic>
+
+#include "granary/globals.h"
+#include "granary/spin_lock.h"
+
+namespace client {
+
+// A compact record of one access to a watched object.
+struct access_event {
+  // Index of the accessed object's meta-data in `DESCRIPTORS`.
+  uint32_t descriptor_index:24;
+
+  // Low-order bits of the generation of the accessed object's meta-data at
+  // the time of the access. Events from a previous lifetime of some meta-data
+  // are not folded into the data structure of its current lifetime.
+  uint32_t generation:8;
+
+  // Whether or not this access was a write.
+  uint32_t is_write:1;
+
+  // Number of accessed bytes. Accesses of more bytes are truncated.
+  uint32_t num_bytes:7;
+
+  // Offset of the first accessed byte from the object's base address. Offsets
+  // that don't fit are saturated, and so are ignored when folded.
+  uint32_t byte_offset:24;
+} __attribute__((packed));
+
+static_assert(8 == sizeof(access_event),
+    "Access events are expected to be 8 bytes.");
+
+enum {
+  // Number of events that fit in a CPU's event buffer. This must be a power
+  // of two.
+  EVENT_BUFFER_SIZE = 4096,
+
+  EVENT_GENERATION_MASK = (1U << 8) - 1,
+  MAX_EVENT_NUM_BYTES = (1U << 7) - 1,
+  MAX_EVENT_BYTE_OFFSET = (1U << 24) - 1
+};
+
+static_assert(0 == (EVENT_BUFFER_SIZE & (EVENT_BUFFER_SIZE - 1)),
+    "The event buffer size must be a power of two.");
+
+// A ring buffer of access events. Each buffer is owned by a single CPU (or by
+// a single thread in user space), which is the only producer of events into
+// the buffer. Events are consumed by folding them into the read/write counters
+// of the accessed objects' data structures, either by the producer when the
+// buffer fills up, or by the reporter.
+struct event_buffer {
+  // Index of the next event to be consumed.
+  std::atomic<uint64_t> head;
+
+  // Index of the next event to be produced.
+  std::atomic<uint64_t> tail;
+
+  // Serializes consumers of this buffer. The producer never needs to take
+  // this lock unless the buffer is full.
+  granary::atomic_spin_lock consumer_lock;
+
+  // Next event buffer in the list of all event buffers.
+  event_buffer *next;
+
+  access_event events[EVENT_BUFFER_SIZE];
+};
+
+// Record an access to the watched address `addr` in the current CPU's event
+// buffer.
+void record_access(uintptr_t addr, unsigned long num_bytes,
+                   bool is_write) throw();
+
+// Fold all buffered events of all CPUs into the read/write counters of the
+// accessed data structures.
+void fold_all_events(void) throw();
+
+}  // namespace client
+
+#endif  // CLIENTS_LIFETIME_EVENTS_H_
@@ -1,5 +1,6 @@
 /* Copyright 2014 Peter Goodman, all rights reserved. */
 
+#include "clients/lifetime/events.h"
 #include "clients/lifetime/metadata.h"
 #include "clients/lifetime/instrument.h"
 
@@ -7,40 +8,48 @@ using namespace granary;
 
 namespace client {
 
-// A function invoked on every memory read of a watched address `addr`.
+// Read the value of `num_bytes` bytes at the watched address `addr`. Returns
+// false if the value isn't an integral value.
+static bool read_value(uintptr_t addr, unsigned long num_bytes,
+                       uint64_t &value) {
+  auto unwatched_addr = wp::unwatched_address(addr);
+  switch (num_bytes) {
+    case 1: value = *reinterpret_cast<uint8_t *>(unwatched_addr); return true;
+    case 2: value = *reinterpret_cast<uint16_t *>(unwatched_addr); return true;
+    case 4: value = *reinterpret_cast<uint32_t *>(unwatched_addr); return true;
+    case 8: value = *reinterpret_cast<uint64_t *>(unwatched_addr); return true;
+    default: return false;
+  }
+}
+
+// A function invoked on every memory read of a watched address `addr`. The
+// read is buffered, and later folded into the read counters of the accessed
+// bytes. The value being read is added to the value sketch of the field being
+// read, so that we can find effectively constant fields.
 void on_read(uintptr_t addr, unsigned long num_bytes) {
+  record_access(addr, num_bytes, false);
+
   auto obj_meta = wp::descriptor_of(addr);
   auto ds_meta = obj_meta->data_structure;
-  auto byte_offset_in_struct = addr - obj_meta->base_addr;
-  granary::printf(
-      "Reading %d bytes from address %lx, %u bytes into struct of size %u\n",
-      num_bytes, addr, byte_offset_in_struct, ds_meta->num_bytes);
+  auto byte_offset_in_struct = wp::unwatched_address(addr) -
+                               wp::unwatched_address(obj_meta->base_addr);
+  if (!ds_meta || byte_offset_in_struct >= ds_meta->num_bytes ||
+      !is_current_object(addr, obj_meta)) {
+    return;
+  }
 
-  // TODO(akshay):
-  //    1) Update read counter for the associated bytes.
-  //    2) Determine the value being read. This will required using
-  //       the `unwatched_addr` function on `addr`, then casting it to an
-  //       pointer to an integral type whose size matches `num_bytes`, de-
-  //       referencing the pointer (to read the data).
-  //    3) Store the value being read into the `ds_meta` somehow.
-  //        a) We might want to store some number of values and the number of
-  //           times we saw that value. If the number of distinct values seen
-  //           exceeds some small threshold, then treat the field as non-
-  //           constant.
+  auto &sketch(ds_meta->values[byte_offset_in_struct]);
+  uint64_t value = 0;
+  if (!sketch.is_overflowed() && read_value(addr, num_bytes, value)) {
+    sketch.observe(value);
+  }
 }
 
-// A function invoked on every memory write to a watched address `addr`.
+// A function invoked on every memory write to a watched address `addr`. For
+// writes we don't care about the value being written, because specializing on
+// writes is unlikely to lead very far at a large scale.
 void on_write(uintptr_t addr, unsigned long num_bytes) {
-  auto obj_meta = wp::descriptor_of(addr);
-  auto ds_meta = obj_meta->data_structure;
-  auto byte_offset_in_struct = addr - obj_meta->base_addr;
-  granary::printf(
-      "Writing %d bytes to address %lx, %u bytes into struct of size %u\n",
-      num_bytes, addr, byte_offset_in_struct, ds_meta->num_bytes);
-
-  // TODO(akshay): Similar to above, but for writes. For writes we don't care
-  //               about the value being written, because specializing on writes
-  //               is unlikely to lead very far at a large scale.
+  record_access(addr, num_bytes, true);
 }
 
 // Versions of the above functions that are safe to call from within
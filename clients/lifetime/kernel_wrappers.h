@@ -22,7 +22,13 @@ FUNCTION_WRAPPER(APP, __kmalloc, (void *), (size_t size, gfp_t gfp), {
 #if defined(CAN_WRAP_kfree) && CAN_WRAP_kfree
 #define APP_WRAPPER_FOR_kfree
 FUNCTION_WRAPPER_VOID(APP, kfree, (void *addr), {
-  kfree(unwatched_address_check(addr));
+  if(is_watched_address(addr)) {
+    if(client::is_current_object(addr)) {
+      free_descriptor_of(addr);
+    }
+    addr = unwatched_address(addr);
+  }
+  kfree(addr);
 })
 #endif
 
@@ -1,9 +1,10 @@
 /* Copyright 2014 Peter Goodman, all rights reserved. */
 
 #include "clients/lifetime/metadata.h"
+#include "clients/watchpoints/descriptor_allocator.h"
 
 #include "granary/allocator.h"
-#include "granary/hash_table.h"
+#include "granary/state.h"
 
 using namespace granary;
 
@@ -13,41 +14,26 @@ namespace client {
 // base address
 object_metadata DESCRIPTORS[wp::MAX_NUM_WATCHPOINTS];
 
-// Boolean flag that tells us if we should even try to allocate descriptors for
-// objects. We can run out of descriptors pretty quickly.
-//
-// TODO(akshay): Recycle descriptors by modifying `object_metadata::free`.
-static std::atomic<bool> try_allocate(ATOMIC_VAR_INIT(true));
-
-// Hash table mapping allocator return addresses to data structure descriptors.
-// The idea here is that an (allocator, object size) pair generally represents
-// a data structure.
-//
-// TODO(akshay): Future generalization, map a pair of a return address and
-//               object size to the data structure metadata pointer.
-//
-// TODO(akshay): Future concurrency concern: guard this with a spin lock.
-static static_data<hash_table<void *, data_structure_metadata *>> addr_to_ds;
+// Global pools of free object meta-data, one per inherited index. Meta-data
+// freed on one CPU is handed back out on another CPU by way of these pools.
+static wp::descriptor_pool<object_metadata> POOLS[WP_NUM_INHERITED_INDEXES];
 
-// Because the hash table is wrapped up in a `static_data` template, we need
-// to manually construct it *as if* it were just its plain old type.
+// Concurrent hash table mapping (allocator return address, object size) pairs
+// to data structure descriptors. The idea here is that an (allocator, object
+// size) pair generally represents a data structure.
 //
-// The `static_data` type serves as a dummy contained of proper size/alignment
-// for some more complex data structure so that we can defer the data
-// structure's initialization until long after some of the more "core" Granary
-// components have been initialized. If we didn't have this deferral mechanism
-// then we risk that the data structure is constructed too early, which leads
-// to undefined behaviour, or it is never constructed (in the case of the
-// kernel, which generally doesn't call static constructors when loading in
-// modules!).
-STATIC_INITIALISE_ID(lifetime_client, {
-  addr_to_ds.construct();
-})
+// Each bucket is a lock-free, insert-only list of data structure meta-data,
+// chained through `next_in_bucket`. Meta-data is never removed from a bucket,
+// so a bucket can be walked without synchronization.
+enum {
+  NUM_DATA_STRUCTURE_BUCKETS = 4096
+};
+static std::atomic<data_structure_metadata *>
+    DATA_STRUCTURE_BUCKETS[NUM_DATA_STRUCTURE_BUCKETS];
 
-// Return the index of some object_metadata in the DESCRIPTORS array.
-inline static uintptr_t index_of(const object_metadata *desc) throw() {
-  return desc - &(DESCRIPTORS[0]);
-}
+// List of all data structure meta-data, for reporting.
+static std::atomic<data_structure_metadata *> DATA_STRUCTURES(
+    ATOMIC_VAR_INIT(nullptr));
 
 // Initialize the `data_structure_metadata` structure.
 //
@@ -94,6 +80,7 @@ inline static uintptr_t index_of(const object_metadata *desc) throw() {
 //                                num_bytes = 99,
 //                                num_reads -> [0, 0, ... 0],  // 99 counters
 //                                num_writes -> [0, 0, ... 0],
+//                                values -> [{}, {}, ... {}],  // 99 sketches
 //                                allocator_addres -> cache_return_address}
 //
 static data_structure_metadata *create_data_structure_meta(
@@ -104,68 +91,164 @@ static data_structure_metadata *create_data_structure_meta(
   desc->num_bytes = size;
   desc->num_reads = shadow;
   desc->num_writes = &(shadow[size]);
+  desc->values = allocate_memory<value_sketch>(size);
   desc->allocator_address = allocator_address;
   return desc;
 }
 
-// Return some newly allocated object_metadata for an object.
-static object_metadata *allocate(void *addr, size_t size,
-                                 void *allocator_addr) throw() {
-  uintptr_t index = wp::next_counter_index(0);
-  if(index < wp::MAX_NUM_WATCHPOINTS) {
-
-    // Find the data-structure meta-data that we will associate with this
-    // object. If we don't have any data structure meta-data associated with the
-    // return address of our allocator then created the data-structure meta-data
-    // on the spot.
-    //
-    // TODO(akshay): Synchronization.
-    data_structure_metadata *ds_meta(nullptr);
-    if (!addr_to_ds->load(allocator_addr, ds_meta)) {
-      ds_meta = create_data_structure_meta(size, allocator_addr);
-      addr_to_ds->store(allocator_addr, ds_meta);
+// Free a `data_structure_metadata` structure that was never published.
+static void free_data_structure_meta(data_structure_metadata *desc) {
+  free_memory<value_sketch>(desc->values, desc->num_bytes);
+  free_memory<unsigned>(desc->num_reads, desc->num_bytes * 2);
+  free_memory<data_structure_metadata>(desc);
+}
+
+// Returns the bucket of data structure meta-data for an (allocator, object
+// size) pair.
+static std::atomic<data_structure_metadata *> &bucket_of(
+    void *allocator_address, size_t size) {
+  auto hash = reinterpret_cast<uintptr_t>(allocator_address);
+  hash ^= size * 0x9E3779B97F4A7C15ULL;
+  hash ^= hash >> 29;
+  return DATA_STRUCTURE_BUCKETS[hash % NUM_DATA_STRUCTURE_BUCKETS];
+}
+
+// Look for the data structure meta-data of an (allocator, object size) pair
+// in the bucket list starting at `desc` and ending at `end`.
+static data_structure_metadata *find_data_structure_meta(
+    data_structure_metadata *desc, data_structure_metadata *end,
+    void *allocator_address, size_t size) {
+  for (; desc != end; desc = desc->next_in_bucket) {
+    if (desc->allocator_address == allocator_address &&
+        desc->num_bytes == size) {
+      return desc;
+    }
+  }
+  return nullptr;
+}
+
+// Get the data structure meta-data for an (allocator, object size) pair,
+// creating it if it doesn't exist. If several CPUs race to create the same
+// meta-data then only one of them wins, and the others use the winner's
+// meta-data.
+static data_structure_metadata *get_data_structure_meta(
+    size_t size, void *allocator_address) {
+  auto &bucket(bucket_of(allocator_address, size));
+  auto head = bucket.load(std::memory_order_acquire);
+  auto ds_meta = find_data_structure_meta(
+      head, nullptr, allocator_address, size);
+  if (ds_meta) {
+    return ds_meta;
+  }
+
+  auto new_ds_meta = create_data_structure_meta(size, allocator_address);
+  for (auto checked_head = head; ; checked_head = head) {
+    new_ds_meta->next_in_bucket = head;
+    if (bucket.compare_exchange_weak(head, new_ds_meta,
+                                     std::memory_order_acq_rel)) {
+      break;
     }
 
-    // Find this object's meta-data based on the allocated "counter index".
-    auto obj_meta = &(DESCRIPTORS[index]);
+    // Someone else added to the bucket; only the newly added meta-data needs
+    // to be checked.
+    ds_meta = find_data_structure_meta(
+        head, checked_head, allocator_address, size);
+    if (ds_meta) {
+      free_data_structure_meta(new_ds_meta);
+      return ds_meta;
+    }
+  }
 
-    // Initialize the `object_metadata` structure to point to its associated
-    // data structure.
-    obj_meta->base_addr = (uintptr_t) addr;
-    obj_meta->data_structure = ds_meta;
+  auto next = DATA_STRUCTURES.load(std::memory_order_relaxed);
+  do {
+    new_ds_meta->next = next;
+  } while (!DATA_STRUCTURES.compare_exchange_weak(next, new_ds_meta));
+  return new_ds_meta;
+}
 
-    return obj_meta;
+// Returns the list of all data structures seen so far.
+data_structure_metadata *first_data_structure(void) throw() {
+  return DATA_STRUCTURES.load(std::memory_order_acquire);
+}
 
-  } else {
-    try_allocate.store(false, std::memory_order_release);
+// Return some newly allocated object_metadata for an object. The object's
+// "inherited index" comes from the address bits of the object itself (see
+// `clients/watchpoints/config.h`), and each inherited index has its own
+// space of counter indexes. Running out of counter indexes for one inherited
+// index doesn't stop us from watching objects elsewhere in the address space.
+//
+// Meta-data of freed objects is reused before any new counter indexes are
+// allocated.
+static object_metadata *allocate(uintptr_t &counter_index,
+                                 uintptr_t inherited_index,
+                                 void *addr, size_t size,
+                                 void *allocator_addr) throw() {
+  auto obj_meta = wp::allocate_descriptor(
+      DESCRIPTORS, POOLS, counter_index, inherited_index);
+  if (!obj_meta) {
     return nullptr;
   }
+
+  // Find the data-structure meta-data that we will associate with this
+  // object. If we don't have any data structure meta-data associated with the
+  // return address of our allocator and the size of this object then create
+  // the data-structure meta-data on the spot.
+  auto ds_meta = get_data_structure_meta(size, allocator_addr);
+
+  // Initialize the `object_metadata` structure to point to its associated
+  // data structure.
+  obj_meta->base_addr = (uintptr_t) addr;
+  obj_meta->data_structure = ds_meta;
+
+  // Tag the counter index with the meta-data's generation, so that pointers
+  // to this object can be told apart from stale pointers to earlier objects.
+  counter_index = wp::tag_counter_index(counter_index, obj_meta->generation);
+
+  return obj_meta;
 }
 
-// Allocate and initialize a watchpoint descriptor. For now we just allow a
-// fixed number to be allocated.
+// Allocate and initialize a watchpoint descriptor. At most a fixed number of
+// objects can be live at once per inherited index.
 bool object_metadata::allocate_and_init(
-    object_metadata *&desc, uintptr_t &index, uintptr_t,
+    object_metadata *&desc, uintptr_t &index, uintptr_t inherited_index,
                                  void *addr_, size_t size_,
                                  void *allocator_addr_) throw() {
-  if (try_allocate.load(std::memory_order_acquire) &&
-      (desc = allocate(addr_, size_, allocator_addr_))) {
-
-    // Assign to the `index` out parameter. The value assigned here will taint
-    // (i.e. replace) the 15 high-order bits of an address, and the 16th highest
-    // order bit will be 0 (in user space) and 1 (in kernel space).
-    index = index_of(desc);
 
-    // Tell the watchpoints system that we were able to allocate a watchpoint
-    // index for this address.
-    return true;
+#if WP_USE_INHERITED_INDEX
+  // Objects spanning more than one inherited index would need their meta-data
+  // duplicated into each spanned part of `DESCRIPTORS`, so don't watch them.
+  if(1 < wp::num_inherited_indexes_spanned((uintptr_t) addr_, size_)) {
+    return false;
   }
-  return false;
+#endif
+
+  // Assign to the `index` out parameter. The value assigned here will taint
+  // (i.e. replace) the 15 high-order bits of an address, and the 16th highest
+  // order bit will be 0 (in user space) and 1 (in kernel space).
+  //
+  // Tell the watchpoints system whether or not we were able to allocate a
+  // watchpoint index for this address.
+  desc = allocate(index, inherited_index, addr_, size_, allocator_addr_);
+  return nullptr != desc;
 }
 
-// Free the descriptor.
-void object_metadata::free(object_metadata *, uintptr_t) throw() {
-  // TODO(akshay): Implement me in the future.
+// Free the descriptor by putting it into this CPU's cache of free meta-data,
+// so that its counter index can be reused by a future allocation.
+//
+// Bumping the generation makes sure that accesses through stale pointers to
+// the freed object, as well as accesses to it that are still buffered, are
+// never attributed to the object that next reuses this meta-data.
+//
+// Note: Without generations in tainted pointers, stale pointers couldn't be
+//       told apart from pointers to the next object, so the meta-data of
+//       freed objects is never reused.
+void object_metadata::free(object_metadata *obj_meta, uintptr_t) throw() {
+  obj_meta->data_structure = nullptr;
+  obj_meta->generation++;
+
+#if WP_GENERATION_WIDTH
+  wp::free_descriptor(DESCRIPTORS, POOLS, obj_meta);
+#endif  // WP_GENERATION_WIDTH
 }
 
 // Get the descriptor of a watchpoint based on its index.
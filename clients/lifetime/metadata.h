@@ -4,6 +4,7 @@
 #define CLIENTS_LIFETIME_METADATA_H_
 
 #include "clients/watchpoints/instrument.h"
+#include "clients/lifetime/value_sketch.h"
 
 namespace client {
 
@@ -16,14 +17,41 @@ struct data_structure_metadata {
   unsigned *num_reads;
   unsigned *num_writes;
 
+  // Sketches of the values read from the various bytes of the data-structure,
+  // indexed by the offset of the first byte read.
+  value_sketch *values;
+
   void *allocator_address;
+
+  // Next data structure in the list of all data structures.
+  data_structure_metadata *next;
+
+  // Next data structure in the same bucket of the allocation site table.
+  data_structure_metadata *next_in_bucket;
 };
 
+// Returns the list of all data structures seen so far.
+data_structure_metadata *first_data_structure(void) throw();
+
 // Meta-data about allocated objects.
 struct object_metadata {
-  uintptr_t base_addr;
+  // The base address of a live object, or the next free meta-data in a
+  // descriptor cache (see `clients/watchpoints/descriptor_cache.h`).
+  union {
+    uintptr_t base_addr;
+    object_metadata *next_free_descriptor;
+  };
+  // The data structure of a live object, or `nullptr` if the object has been
+  // freed.
   data_structure_metadata *data_structure;
 
+  // Number of times that this meta-data has been freed. The low-order bits of
+  // the generation are stored in every tainted pointer to an object (see
+  // `WP_GENERATION_WIDTH`), so the generation distinguishes stale pointers to,
+  // and buffered accesses to, an earlier object from those to the object that
+  // currently owns this meta-data.
+  uint32_t generation;
+
   // IGNORE STUFF BELOW HERE: it's just watchpoints-specific stuff.
 
   static bool allocate_and_init(
@@ -61,6 +89,26 @@ struct descriptor_type {
 };
 
 }  // namespace wp
+
+// Returns true iff the watched address `addr` was tainted for the object that
+// currently owns `obj_meta`, and not for an earlier object that owned the same
+// meta-data. Only the low-order `WP_GENERATION_WIDTH` bits of the generation
+// are compared, so a stale pointer aliases the current object again once its
+// meta-data has been reused `2^WP_GENERATION_WIDTH` times.
+inline bool is_current_object(uintptr_t addr,
+                              const object_metadata *obj_meta) throw() {
+  return wp::generation_of(addr) ==
+         (obj_meta->generation & wp::MAX_GENERATION);
+}
+
+// Returns true iff the watched pointer `ptr` points to the object that
+// currently owns its meta-data.
+template <typename T>
+inline bool is_current_object(T *ptr) throw() {
+  return is_current_object(reinterpret_cast<uintptr_t>(ptr),
+                           wp::descriptor_of(ptr));
+}
+
 }  // namespace client
 
 #endif  // CLIENTS_LIFETIME_METADATA_H_
@@ -1,18 +1,102 @@
 /* Copyright 2014 Peter Goodman, all rights reserved. */
 
+#include "clients/lifetime/events.h"
 #include "clients/lifetime/metadata.h"
 
+#if !CONFIG_ENV_KERNEL
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+using namespace granary;
+
 namespace client {
 
 extern object_metadata DESCRIPTORS[];
 
+// Header of the binary dump of data structure statistics.
+struct dump_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+// Per-data structure header in the binary dump. Each of these is followed by
+// `num_bytes` read counters and then `num_bytes` write counters, each a 32-bit
+// unsigned integer, and then by `num_bytes` value sketches.
+struct dump_data_structure {
+  uint64_t allocator_address;
+  uint32_t num_bytes;
+  uint32_t padding;
+};
+
+// A value sketch in the binary dump. The field at this sketch's offset is
+// non-constant if `num_values` exceeds `VALUE_SKETCH_SIZE`.
+struct dump_value_sketch {
+  uint64_t values[VALUE_SKETCH_SIZE];
+  uint32_t counts[VALUE_SKETCH_SIZE];
+  uint32_t num_values;
+  uint32_t padding;
+};
+
+enum : uint32_t {
+  DUMP_MAGIC = 0x544C5247U,  // "GRLT" in little endian.
+  DUMP_VERSION = 2
+};
+
+// Write some binary data to the dump. In user space this goes to
+// `lifetime.bin`; in kernel space it goes through the relay channel.
+static void dump(int IF_USER( fd ), const void *data, size_t size) throw() {
+#if CONFIG_ENV_KERNEL
+  log(reinterpret_cast<const char *>(data), size);
+#else
+  auto bytes = reinterpret_cast<const char *>(data);
+  while (size) {
+    auto written = write(fd, bytes, size);
+    if (0 >= written) {
+      return;
+    }
+    bytes += written;
+    size -= static_cast<size_t>(written);
+  }
+#endif
+}
+
 /// Report on all instrumented basic blocks.
 void report(void) throw() {
-  // TODO(akshay): For each `data_structure_metadata`, dump all the statistics
-  //               that we have about that data-structure using `granary::log`
-  //               (it's like `printf`, but you might need to use `sprintf` for
-  //               formatting. Take a look at `clients/cfg/report.cc` for an
-  //               example.).
+  fold_all_events();
+
+  int fd = -1;
+  IF_USER( fd = open("lifetime.bin", O_CREAT | O_TRUNC | O_WRONLY, 0644); )
+  IF_USER( if (0 > fd) return; )
+
+  dump_header header = {DUMP_MAGIC, DUMP_VERSION};
+  dump(fd, &header, sizeof header);
+
+  for (auto ds_meta = first_data_structure(); ds_meta;
+       ds_meta = ds_meta->next) {
+    dump_data_structure ds = {
+      reinterpret_cast<uint64_t>(ds_meta->allocator_address),
+      ds_meta->num_bytes,
+      0
+    };
+    dump(fd, &ds, sizeof ds);
+    dump(fd, ds_meta->num_reads, ds_meta->num_bytes * sizeof(unsigned));
+    dump(fd, ds_meta->num_writes, ds_meta->num_bytes * sizeof(unsigned));
+
+    for (unsigned i = 0; i < ds_meta->num_bytes; ++i) {
+      const value_sketch &sketch(ds_meta->values[i]);
+      dump_value_sketch dumped_sketch;
+      for (unsigned j = 0; j < VALUE_SKETCH_SIZE; ++j) {
+        dumped_sketch.values[j] = sketch.values[j].load();
+        dumped_sketch.counts[j] = sketch.counts[j].load();
+      }
+      dumped_sketch.num_values = sketch.num_values.load();
+      dumped_sketch.padding = 0;
+      dump(fd, &dumped_sketch, sizeof dumped_sketch);
+    }
+  }
+
+  IF_USER( close(fd); )
 
   // TODO(akshay): When reporting return addresses, we want to convert them
   //               from their cache code address back into native code
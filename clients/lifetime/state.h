@@ -0,0 +1,25 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef CLIENTS_LIFETIME_STATE_H_
+#define CLIENTS_LIFETIME_STATE_H_
+
+#include "clients/watchpoints/descriptor_cache.h"
+
+namespace client {
+
+struct object_metadata;
+struct event_buffer;
+
+#define CLIENT_cpu_state
+struct cpu_state {
+  // Caches of free object meta-data for this CPU, one per inherited index.
+  wp::descriptor_cache<object_metadata> free_list[WP_NUM_INHERITED_INDEXES];
+
+  // Buffer of accesses to watched objects by this CPU. This is allocated on
+  // this CPU's first access to a watched object.
+  event_buffer *events;
+};
+
+}  // namespace client
+
+#endif  // CLIENTS_LIFETIME_STATE_H_
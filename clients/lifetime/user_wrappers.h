@@ -17,10 +17,14 @@ FUNCTION_WRAPPER(APP, realloc, (void *), (void *ptr, size_t size), {
     ptr = unwatched_address(ptr);
   }
   void *new_ptr(realloc(ptr, size));
+
+  // The old object is gone if it was either moved/resized or freed (by a
+  // zero-sized `realloc`), so recycle its meta-data. Stale pointers to an
+  // already freed object must not recycle the meta-data of its successor.
+  if(old_ptr && (new_ptr || !size) && client::is_current_object(old_ptr)) {
+    free_descriptor_of(old_ptr);
+  }
   if(new_ptr) {
-    if(ptr != new_ptr && new_ptr && old_ptr) {
-      free_descriptor_of(old_ptr);
-    }
     add_watchpoint(new_ptr, new_ptr, size, ret_address);
   }
   return new_ptr;
@@ -68,7 +72,9 @@ FUNCTION_WRAPPER(APP, calloc, (void *), (size_t count, size_t size), {
 #   define APP_WRAPPER_FOR_free
 FUNCTION_WRAPPER_VOID(APP, free, (void *ptr), {
   if(is_watched_address(ptr)) {
-    free_descriptor_of(ptr);
+    if(client::is_current_object(ptr)) {
+      free_descriptor_of(ptr);
+    }
     ptr = unwatched_address(ptr);
   }
   return free(ptr);
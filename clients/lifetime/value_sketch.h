@@ -0,0 +1,71 @@
+/* Copyright 2014 Peter Goodman, all rights reserved. */
+
+#ifndef CLIENTS_LIFETIME_VALUE_SKETCH_H_
+#define CLIENTS_LIFETIME_VALUE_SKETCH_H_
+
+#include <atomic>
+
+#include "granary/globals.h"
+
+namespace client {
+
+enum {
+  // Number of distinct values that are remembered for a field before the
+  // field is treated as non-constant.
+  VALUE_SKETCH_SIZE = 4
+};
+
+// A bounded sketch of the values read from a field, i.e. from a byte offset
+// of some data structure. The sketch remembers up to `VALUE_SKETCH_SIZE`
+// distinct values and how often each was seen. Once more distinct values
+// are seen, the sketch overflows, and the field is treated as non-constant
+// and is no longer tracked.
+//
+// Updates are lock-free. Two CPUs racing to add the same new value might
+// each claim a slot for it, which can make a sketch overflow early; this
+// only makes the sketch more conservative.
+struct value_sketch {
+  std::atomic<uint64_t> values[VALUE_SKETCH_SIZE];
+  std::atomic<uint32_t> counts[VALUE_SKETCH_SIZE];
+
+  // Number of claimed slots in `values`. This can exceed
+  // `VALUE_SKETCH_SIZE`, in which case the sketch has overflowed.
+  std::atomic<uint32_t> num_values;
+
+  // Returns true if more than `VALUE_SKETCH_SIZE` distinct values were seen.
+  inline bool is_overflowed(void) const throw() {
+    return VALUE_SKETCH_SIZE < num_values.load(std::memory_order_relaxed);
+  }
+
+  // Record that `value` was read from the field.
+  void observe(uint64_t value) throw() {
+    auto num_claimed = num_values.load(std::memory_order_acquire);
+    if (VALUE_SKETCH_SIZE < num_claimed) {
+      return;
+    }
+
+    // Look for an existing slot for this value. A slot's count is only
+    // published after its value, so a non-zero count means a valid value.
+    for (unsigned i = 0; i < num_claimed && i < VALUE_SKETCH_SIZE; ++i) {
+      if (counts[i].load(std::memory_order_acquire) &&
+          value == values[i].load(std::memory_order_relaxed)) {
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+
+    // Claim a new slot. Claiming one past the last slot marks the sketch as
+    // overflowed.
+    const auto i = num_values.fetch_add(1, std::memory_order_acq_rel);
+    if (i < VALUE_SKETCH_SIZE) {
+      values[i].store(value, std::memory_order_relaxed);
+      counts[i].store(1, std::memory_order_release);
+    } else {
+      num_values.store(VALUE_SKETCH_SIZE + 1, std::memory_order_relaxed);
+    }
+  }
+};
+
+}  // namespace client
+
+#endif  // CLIENTS_LIFETIME_VALUE_SKETCH_H_
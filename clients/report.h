@@ -20,6 +20,8 @@
  || defined(CLIENT_WATCHPOINT_PROFILE) \
  || defined(CLIENT_WATCHPOINT_AUGMENT) \
  || defined(CLIENT_WATCHPOINT_USER) \
+ || defined(CLIENT_WATCHPOINT_LEAK) \
+ || defined(CLIENT_SHADOW_MEMORY) \
  || defined(CLIENT_RCUDBG) \
  || defined(CLIENT_LIFETIME)
 #   define CLIENT_report
@@ -25,6 +25,11 @@
 #endif
 
 
+#ifdef CLIENT_LIFETIME
+#   include "clients/lifetime/state.h"
+#endif
+
+
 #ifdef CLIENT_WATCHPOINT_STATS
 #   include "clients/watchpoints/clients/stats/state.h"
 #endif
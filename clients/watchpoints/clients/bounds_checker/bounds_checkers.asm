@@ -66,6 +66,27 @@ END_FUNC(granary_detected_overflow)
     END_FUNC(CAT(CAT(granary_bounds_check_, CAT(size, _)), reg)) @N@@N@@N@
 
 
+/// Combine the counter index in RDX with the inherited index of the watched
+/// address in RDI. This clobbers RSI.
+#if WP_USE_INHERITED_INDEX
+#   define COMBINE_INHERITED_INDEX \
+    shl $ WP_INHERITED_INDEX_WIDTH, %rdx; @N@\
+    mov %rdi, %rsi; @N@\
+    shr $ WP_INHERITED_INDEX_GRANULARITY, %rsi; @N@\
+    and $ (WP_NUM_INHERITED_INDEXES - 1), %rsi; @N@\
+    or %rsi, %rdx; @N@
+#else
+#   define COMBINE_INHERITED_INDEX
+#endif
+
+
+/// The 32-bit bounds of a wide descriptor. Wide descriptors point to the full
+/// (low 48 bits) bounds of an object that crosses a 4GB boundary. See
+/// `bound_descriptor::WIDE_LOWER_BOUND` and `wide_bound_descriptor`.
+#define WIDE_LOWER_BOUND 0xFFFFFFFF
+#define WIDE_UPPER_BOUND 0
+
+
 #define GENERIC_BOUNDS_CHECKER(size) \
     DECLARE_FUNC(CAT(granary_bounds_check_, size)) @N@\
     GLOBAL_LABEL(CAT(granary_bounds_check_, size):) @N@@N@\
@@ -77,6 +98,7 @@ END_FUNC(granary_detected_overflow)
     COMMENT(Get the index into RDX.) @N@\
     mov %rdi, %rdx; COMMENT(Copy the watched address into RDX.)@N@\
     shr $49, %rdx; COMMENT(Shift the index into the low 15 bits.)@N@\
+    COMBINE_INHERITED_INDEX \
     shl $4, %rdx; COMMENT(Scale the index by sizeof(bound_descriptor).)@N@\
     @N@\
     COMMENT(Get a pointer to the descriptor. The descriptor table is an array) @N@\
@@ -86,16 +108,37 @@ END_FUNC(granary_detected_overflow)
     @N@\
     COMMENT(Check the lower bounds against the low 32 bits of the watched address.) @N@\
     cmp (%rsi), %edi; @N@\
-    jl .CAT(Lgranary_underflow_, size); @N@\
+    jb .CAT(Lgranary_check_wide_, size); @N@\
+    @N@\
+    COMMENT(Check the upper bounds against the low 32 bits of the end of the) @N@\
+    COMMENT(access. An access that crosses a 4GB boundary is re-checked against) @N@\
+    COMMENT(the full bounds.) @N@\
+    mov %edi, %edx; @N@\
+    add $ size, %edx; @N@\
+    jc .CAT(Lgranary_check_wide_, size); @N@\
+    cmp 4(%rsi), %edx; @N@\
+    jbe .CAT(Lgranary_done_, size); @N@\
+    @N@\
+.CAT(Lgranary_check_wide_, size): @N@\
+    COMMENT(Only wide descriptors have full bounds.) @N@\
+    cmpl $ WIDE_LOWER_BOUND, (%rsi); @N@\
+    jne .CAT(Lgranary_overflow_, size); @N@\
+    cmpl $ WIDE_UPPER_BOUND, 4(%rsi); @N@\
+    jne .CAT(Lgranary_overflow_, size); @N@\
+    mov 8(%rsi), %rsi; COMMENT(Get a pointer to the full bounds.) @N@\
+    test %rsi, %rsi; @N@\
+    jz .CAT(Lgranary_overflow_, size); @N@\
+    @N@\
+    COMMENT(Check the full bounds against the low 48 bits of the watched address.) @N@\
+    mov %rdi, %rdx; @N@\
+    shl $16, %rdx; @N@\
+    shr $16, %rdx; @N@\
+    cmp (%rsi), %rdx; @N@\
+    jb .CAT(Lgranary_overflow_, size); @N@\
+    add $ size, %rdx; @N@\
+    cmp 8(%rsi), %rdx; @N@\
+    jbe .CAT(Lgranary_done_, size); @N@\
     @N@\
-    COMMENT(Check the upper bounds against the low 32 bits of the watched address.) @N@\
-    mov 4(%rsi), %rsi; @N@\
-    sub $ size, %rsi; @N@\
-    cmp %edi, %esi; @N@\
-    jge .CAT(Lgranary_done_, size); @N@\
-.CAT(Lgranary_underflow_, size): @N@\
-    mov $ size, %rsi; @N@\
-    jmp SHARED_SYMBOL(granary_detected_overflow); @N@\
 .CAT(Lgranary_overflow_, size): @N@\
     mov $ size, %rsi; @N@\
     jmp SHARED_SYMBOL(granary_detected_overflow); @N@\
@@ -9,6 +9,7 @@
 
 #include "clients/watchpoints/utils.h"
 #include "clients/watchpoints/clients/bounds_checker/instrument.h"
+#include "clients/watchpoints/descriptor_allocator.h"
 
 
 using namespace granary;
@@ -79,6 +80,22 @@ namespace client { namespace wp {
     bound_descriptor DESCRIPTORS[MAX_NUM_WATCHPOINTS];
 
 
+    /// Global pools of free descriptors, one per inherited index. These
+    /// balance free descriptors across the CPU-private descriptor caches.
+    static descriptor_pool<bound_descriptor> POOLS[WP_NUM_INHERITED_INDEXES];
+
+
+    /// Global pool of free wide descriptors.
+    static descriptor_pool<wide_bound_descriptor> WIDE_POOL;
+
+
+#if WP_USE_INHERITED_INDEX
+    /// Global pool of free descriptors of objects that spanned more than one
+    /// inherited index.
+    static descriptor_pool<bound_descriptor> SPANNING_POOL;
+#endif /* WP_USE_INHERITED_INDEX */
+
+
     inline static uintptr_t index_of(const bound_descriptor *desc) throw() {
         return desc - &(DESCRIPTORS[0]);
     }
@@ -91,45 +108,79 @@ namespace client { namespace wp {
         uintptr_t &counter_index,
         const uintptr_t inherited_index
     ) throw() {
-        counter_index = 0;
-        desc = nullptr;
+        desc = allocate_descriptor(
+            DESCRIPTORS, POOLS, counter_index, inherited_index);
+        return nullptr != desc;
+    }
+
+
+#if WP_USE_INHERITED_INDEX
+    /// Allocate a watchpoint descriptor for an object that spans more than
+    /// one inherited index, where `inherited_index` is the inherited index of
+    /// the object's base address.
+    static bool allocate_spanning(
+        bound_descriptor *&desc,
+        uintptr_t &counter_index,
+        const uintptr_t inherited_index
+    ) throw() {
+        bound_descriptor *free_desc(nullptr);
 
         IF_KERNEL( eflags flags(granary_disable_interrupts()); )
         cpu_state_handle state;
-        bound_descriptor *&free_list(state->free_list);
-        if(free_list) {
-            desc = free_list;
-            free_list = free_list->next_free_descriptor;
-        }
+        free_desc = pop_free_descriptor(
+            state->spanning_free_list, SPANNING_POOL);
         IF_KERNEL( granary_store_flags(flags); )
 
-        // We got a descriptor from the CPU-private free list.
-        //
-        // TODO: Make the free-list support the idea of inherited index, even
-        //       though the assembly does not yet support this indexing method.
-        counter_index = 0;
-        if(desc) {
+        // Spanning counter indexes are never used by non-spanning objects, so
+        // the counter index of any dead spanning object can be reused.
+        if(free_desc) {
             uintptr_t inherited_index_;
             destructure_combined_index(
-                index_of(desc), counter_index, inherited_index_);
-
-        // No descriptors in the free list, try to allocate one from our global
-        // pool of descriptors.
+                index_of(free_desc), counter_index, inherited_index_);
         } else {
-            counter_index = next_counter_index(inherited_index);
-            if(counter_index > MAX_NUM_WATCHPOINTS) {
+            counter_index = next_spanning_counter_index();
+            if(counter_index > MAX_COUNTER_INDEX) {
                 return false;
             }
-            desc = &(DESCRIPTORS[counter_index]);
         }
 
-        ASSERT(counter_index <= MAX_COUNTER_INDEX);
-        ASSERT(counter_index <= MAX_NUM_WATCHPOINTS);
-
+        desc = &(DESCRIPTORS[combined_index(counter_index, inherited_index)]);
         return true;
     }
 
 
+    /// Returns true iff a (live or freed) descriptor describes an object that
+    /// spans more than one inherited index.
+    ///
+    /// Note: The inherited index is within the low 32 bits of an address, so
+    ///       the 32-bit bounds are enough to find what the object spans. Wide
+    ///       objects cross a 4GB boundary, and so always span more than one
+    ///       inherited index.
+    inline static bool is_spanning(const bound_descriptor *desc) throw() {
+        if(desc->is_wide()) {
+            return true;
+        }
+        return 1 < num_inherited_indexes_spanned(
+            desc->lower_bound, desc->upper_bound - desc->lower_bound);
+    }
+#endif /* WP_USE_INHERITED_INDEX */
+
+
+    /// Allocate the full bounds for a wide descriptor.
+    static wide_bound_descriptor *allocate_wide(void) throw() {
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        cpu_state_handle state;
+        wide_bound_descriptor *wide(
+            pop_free_descriptor(state->wide_free_list, WIDE_POOL));
+        IF_KERNEL( granary_store_flags(flags); )
+
+        if(!wide) {
+            wide = allocate_memory<wide_bound_descriptor>();
+        }
+        return wide;
+    }
+
+
     /// Initialise a watchpoint descriptor.
     bool bound_descriptor::allocate_and_init(
         bound_descriptor *&desc,
@@ -144,6 +195,16 @@ namespace client { namespace wp {
             return false;
         }
 
+        const uintptr_t base(reinterpret_cast<uintptr_t>(base_address));
+
+#if WP_USE_INHERITED_INDEX
+        const uintptr_t num_spanned(num_inherited_indexes_spanned(base, size));
+        if(1 < num_spanned) {
+            if(!allocate_spanning(desc, counter_index, inherited_index)) {
+                return false;
+            }
+        } else
+#endif /* WP_USE_INHERITED_INDEX */
         if(!allocate(desc, counter_index, inherited_index)) {
             return false;
         }
@@ -151,13 +212,37 @@ namespace client { namespace wp {
         ASSERT(is_valid_address(desc));
         ASSERT(is_code_cache_address(unsafe_cast<const_app_pc>(ret_address)));
 
-        const uintptr_t base(reinterpret_cast<uintptr_t>(base_address));
-        desc->lower_bound = static_cast<uint32_t>(base);
-        desc->upper_bound = static_cast<uint32_t>(base + size);
-        desc->return_address = ret_address;
+        const uint32_t lower_bound(static_cast<uint32_t>(base));
+        const uint32_t upper_bound(static_cast<uint32_t>(base + size));
+
+        // Objects that cross a 4GB boundary (or that are at least 4GB big)
+        // can't be described by 32-bit bounds, so their full bounds are kept
+        // out-of-line in a wide descriptor.
+        if(upper_bound <= lower_bound || (size >> 32)) {
+            wide_bound_descriptor *wide(allocate_wide());
+            wide->lower_bound = wide_bound(base);
+            wide->upper_bound = wide->lower_bound + size;
+            wide->return_address = ret_address;
+
+            desc->wide = wide;
+            desc->lower_bound = WIDE_LOWER_BOUND;
+            desc->upper_bound = WIDE_UPPER_BOUND;
+        } else {
+            desc->lower_bound = lower_bound;
+            desc->upper_bound = upper_bound;
+            desc->return_address = ret_address;
+        }
 
-        // TODO: Handle roll-over across a 4GB boundary.
-        ASSERT(desc->upper_bound > desc->lower_bound);
+#if WP_USE_INHERITED_INDEX
+        // Duplicate the descriptor into the tables of the other inherited
+        // indexes spanned by the object, so that a watched address to any
+        // byte of the object finds a copy of the descriptor.
+        for(uintptr_t i(1); i < num_spanned; ++i) {
+            const uintptr_t spanned_index(
+                (inherited_index + i) & (NUM_INHERITED_INDEXES - 1));
+            DESCRIPTORS[combined_index(counter_index, spanned_index)] = *desc;
+        }
+#endif /* WP_USE_INHERITED_INDEX */
 
         return true;
     }
@@ -172,7 +257,7 @@ namespace client { namespace wp {
     }
 
 
-    /// Free a watchpoint descriptor by adding it to a free list.
+    /// Free a watchpoint descriptor by adding it to a descriptor cache.
     void bound_descriptor::free(
         bound_descriptor *desc,
         uintptr_t IF_TEST( index )
@@ -181,12 +266,232 @@ namespace client { namespace wp {
         ASSERT(is_valid_address(desc));
         ASSERT(index == index_of(desc));
 
+#if WP_USE_INHERITED_INDEX
+        const bool spanning(is_spanning(desc));
+#endif /* WP_USE_INHERITED_INDEX */
+
         IF_KERNEL( eflags flags(granary_disable_interrupts()); )
         cpu_state_handle state;
-        bound_descriptor *&free_list(state->free_list);
-        desc->next_free_descriptor = free_list;
-        free_list = desc;
+
+        // Recycle the full bounds of a wide descriptor. The 32-bit bounds are
+        // emptied first so that later bounds checks against this descriptor
+        // fail instead of following `wide` to its recycled bounds.
+        if(desc->is_wide()) {
+            wide_bound_descriptor *wide(desc->wide);
+            desc->lower_bound = 0;
+            desc->upper_bound = 0;
+            push_free_descriptor(state->wide_free_list, WIDE_POOL, wide);
+        }
+
+#if WP_USE_INHERITED_INDEX
+        if(spanning) {
+            push_free_descriptor(
+                state->spanning_free_list, SPANNING_POOL, desc);
+            IF_KERNEL( granary_store_flags(flags); )
+            return;
+        }
+#endif /* WP_USE_INHERITED_INDEX */
         IF_KERNEL( granary_store_flags(flags); )
+
+        free_descriptor(DESCRIPTORS, POOLS, desc);
+    }
+
+
+    /// Returns a memory operand of a specific size.
+    static operand_base_disp memory_operand(
+        operand_base_disp op,
+        int disp,
+        dynamorio::opnd_size_t size
+    ) throw() {
+        op.disp = disp;
+        op.size = size;
+        return op;
+    }
+
+
+    /// Add an inline bounds check of the `i`th watched operand of `tracker`,
+    /// where `desc` and `bound` are two dead registers. In-bounds accesses to
+    /// objects with 32-bit bounds are checked entirely inline. Everything else
+    /// falls back on `checker`, which re-checks the access (including against
+    /// the full bounds of wide descriptors) and reports any overflow.
+    static void add_inline_bounds_check(
+        instruction_list &ls,
+        watchpoint_tracker &tracker,
+        unsigned i,
+        dynamorio::reg_id_t desc_reg,
+        dynamorio::reg_id_t bound_reg,
+        app_pc checker
+    ) throw() {
+        const dynamorio::reg_id_t addr_reg(register_manager::scale(
+            tracker.regs[i].value.reg, REG_64));
+
+        const operand desc(desc_reg);
+        const operand bound(bound_reg);
+        const operand bound_32(register_manager::scale(bound_reg, REG_32));
+        const operand addr_32(register_manager::scale(addr_reg, REG_32));
+
+        instruction in(tracker.labels[i]);
+        instruction check_slow(label_());
+        instruction done(label_());
+
+        // Only save the flags if something might observe our clobbering of
+        // them.
+        const bool save_flags(!arithmetic_flags_are_dead_after(in));
+        if(save_flags) {
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+            in = ls.insert_after(in, pushf_());
+        }
+
+        // Compute the address of the descriptor of the watched address.
+        in = insert_descriptor_index_after(
+            ls, in, desc, operand(addr_reg), bound);
+        in = ls.insert_after(in, shl_(desc, int8_(4)));
+        in = ls.insert_after(in, mov_imm_(bound,
+            int64_(reinterpret_cast<uint64_t>(&(DESCRIPTORS[0])))));
+        in = ls.insert_after(in, add_(desc, bound));
+
+        // Check the low 32 bits of the access against the 32-bit bounds. An
+        // access whose end wraps around the low 32 bits can't be checked with
+        // the 32-bit bounds.
+        in = ls.insert_after(in, mov_ld_(bound_32, addr_32));
+        in = ls.insert_after(in, cmp_(bound_32,
+            memory_operand(*desc, 0, dynamorio::OPSZ_4)));
+        in = ls.insert_after(in, mangled(jb_(instr_(check_slow))));
+        in = ls.insert_after(in, add_(bound_32, int8_(tracker.sizes[i])));
+        in = ls.insert_after(in, mangled(jb_(instr_(check_slow))));
+        in = ls.insert_after(in, cmp_(bound_32,
+            memory_operand(*desc, 4, dynamorio::OPSZ_4)));
+        in = ls.insert_after(in, mangled(jbe_(instr_(done))));
+
+        // Out-of-bounds according to the 32-bit bounds.
+        in = ls.insert_after(in, check_slow);
+        in = insert_cti_after(ls, in, checker,
+            CTI_DONT_STEAL_REGISTER, operand(),
+            CTI_CALL);
+        in.set_mangled();
+
+        in = ls.insert_after(in, done);
+        if(save_flags) {
+            in = ls.insert_after(in, popf_());
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+        }
+    }
+
+
+    /// Registers that can be used to hold the element count and direction
+    /// during a bounds check of a REP-prefixed string instruction.
+    static const dynamorio::reg_id_t REP_SCRATCH_REGS[] = {
+        dynamorio::DR_REG_RAX,
+        dynamorio::DR_REG_RDX,
+        dynamorio::DR_REG_RBX
+    };
+
+
+    /// Add a bounds check of the `i`th watched operand of `tracker`, where
+    /// `tracker.in` is a REP-prefixed string instruction. Nothing is checked
+    /// if the instruction won't access any elements. Otherwise, the first
+    /// element is checked and, if the instruction is guaranteed to access
+    /// every element, then the last element (taking the direction flag into
+    /// account) is also checked. This checks the whole range accessed by the
+    /// instruction once, before the instruction executes natively.
+    static void add_rep_bounds_check(
+        instruction_list &ls,
+        watchpoint_tracker &tracker,
+        unsigned i,
+        unsigned size_index
+    ) throw() {
+        const dynamorio::reg_id_t addr_reg(register_manager::scale(
+            tracker.regs[i].value.reg, REG_64));
+
+        dynamorio::reg_id_t scratch[2];
+        for(unsigned r(0), s(0); s < 2; ++r) {
+            if(addr_reg != REP_SCRATCH_REGS[r]) {
+                scratch[s++] = REP_SCRATCH_REGS[r];
+            }
+        }
+
+        const operand last(scratch[0]);
+        const operand last_32(register_manager::scale(scratch[0], REG_32));
+        const operand flags(scratch[1]);
+        const operand counter(rep_counter_of(tracker.in));
+
+        // Conditionally terminated instructions (e.g. `REPNE SCAS`) might not
+        // access all elements, so only their first element is checked.
+        bool check_last_element(true);
+        switch(tracker.in.op_code()) {
+        case dynamorio::OP_rep_cmps:
+        case dynamorio::OP_repne_cmps:
+        case dynamorio::OP_rep_scas:
+        case dynamorio::OP_repne_scas:
+            check_last_element = false;
+            break;
+        default:
+            break;
+        }
+
+        instruction in(tracker.labels[i]);
+        instruction forward(label_());
+        instruction done(label_());
+
+        IF_USER( in = ls.insert_after(in,
+            lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+        in = ls.insert_after(in, pushf_());
+        in = ls.insert_after(in, push_(last));
+        in = ls.insert_after(in, push_(flags));
+
+        // Get the number of elements.
+        if(dynamorio::OPSZ_8 == counter.size) {
+            in = ls.insert_after(in, mov_ld_(last, counter));
+        } else if(dynamorio::OPSZ_4 == counter.size) {
+            in = ls.insert_after(in, mov_ld_(last_32, counter));
+        } else {
+            in = ls.insert_after(in, movzx_(last_32, counter));
+        }
+        in = ls.insert_after(in, test_(last, last));
+        in = ls.insert_after(in, mangled(jz_(instr_(done))));
+
+        // Check the first element.
+        in = insert_cti_after(ls, in,
+            unsafe_cast<app_pc>(BOUNDS_CHECKERS[
+                register_to_index(addr_reg)][size_index]),
+            CTI_DONT_STEAL_REGISTER, operand(),
+            CTI_CALL);
+        in.set_mangled();
+
+        if(check_last_element) {
+
+            // Compute the offset of the last element from the first.
+            in = ls.insert_after(in, dec_(last));
+            if(size_index) {
+                in = ls.insert_after(in, shl_(last, int8_(size_index)));
+            }
+
+            // The elements are accessed backward if the direction flag is set.
+            in = ls.insert_after(in, pushf_());
+            in = ls.insert_after(in, pop_(flags));
+            in = ls.insert_after(in, bt_(flags, int8_(10)));
+            in = ls.insert_after(in, mangled(jnb_(instr_(forward))));
+            in = ls.insert_after(in, neg_(last));
+            in = ls.insert_after(in, forward);
+
+            // Check the last element.
+            in = ls.insert_after(in, add_(last, operand(addr_reg)));
+            in = insert_cti_after(ls, in,
+                unsafe_cast<app_pc>(BOUNDS_CHECKERS[
+                    register_to_index(scratch[0])][size_index]),
+                CTI_DONT_STEAL_REGISTER, operand(),
+                CTI_CALL);
+            in.set_mangled();
+        }
+
+        in = ls.insert_after(in, done);
+        in = ls.insert_after(in, pop_(flags));
+        in = ls.insert_after(in, pop_(last));
+        in = ls.insert_after(in, popf_());
+        IF_USER( in = ls.insert_after(in,
+            lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
     }
 
 
@@ -204,8 +509,32 @@ namespace client { namespace wp {
         ASSERT(reg_index < 15);
         ASSERT(size_index < 5);
 
+        // REP-prefixed string instructions run natively on unwatched
+        // addresses, so check the whole range that they access up-front.
+        if(is_rep_string_instruction(tracker.in)) {
+            add_rep_bounds_check(ls, tracker, i, size_index);
+            return;
+        }
+
+        app_pc checker(
+            unsafe_cast<app_pc>(BOUNDS_CHECKERS[reg_index][size_index]));
+
+#if WP_BOUNDS_CHECK_INLINE
+        // Try to find two dead registers for an inline bounds check. These
+        // are only used within the check, so they don't need to be reserved
+        // in `tracker.live_regs`.
+        register_manager dead_regs(tracker.live_regs);
+        const dynamorio::reg_id_t desc_reg(dead_regs.get_zombie());
+        const dynamorio::reg_id_t bound_reg(dead_regs.get_zombie());
+        if(desc_reg && bound_reg) {
+            add_inline_bounds_check(
+                ls, tracker, i, desc_reg, bound_reg, checker);
+            return;
+        }
+#endif /* WP_BOUNDS_CHECK_INLINE */
+
         instruction call(insert_cti_after(ls, tracker.labels[i],
-                unsafe_cast<app_pc>(BOUNDS_CHECKERS[reg_index][size_index]),
+            checker,
             CTI_DONT_STEAL_REGISTER, operand(),
             CTI_CALL));
         call.set_mangled();
@@ -236,22 +565,30 @@ namespace client { namespace wp {
         const bound_descriptor *descriptor(descriptor_of(watched_addr));
         const uintptr_t unwatched_addr(unwatched_address(watched_addr));
 
-        uint32_t low_32(static_cast<uint32_t>(
-            reinterpret_cast<uintptr_t>(watched_addr)));
+        // Compare in the same form as the bounds of the descriptor.
+        uint64_t addr(static_cast<uint32_t>(watched_addr));
+        uint64_t lower_bound(descriptor->lower_bound);
+        uint64_t upper_bound(descriptor->upper_bound);
+        if(descriptor->is_wide()) {
+            addr = wide_bound(watched_addr);
+            lower_bound = descriptor->wide->lower_bound;
+            upper_bound = descriptor->wide->upper_bound;
+        }
 
         // Underflow.
-        if(low_32 < descriptor->lower_bound) {
+        if(addr < lower_bound) {
             IF_USER( printf("Access of size %u to %p in basic block %p underflowed\n",
                 size, unwatched_addr, *return_address_in_bb); )
 
         // Overflow.
         } else {
-            ASSERT((low_32 + size) > descriptor->upper_bound);
+            ASSERT((addr + size) > upper_bound);
             IF_USER( printf("Access of size %u to %p in basic block %p overflowed\n",
                 size, unwatched_addr, *return_address_in_bb); )
         }
 
         UNUSED(descriptor);
+        UNUSED(upper_bound);
         UNUSED(watched_addr);
         UNUSED(unwatched_addr);
         UNUSED(return_address_in_bb);
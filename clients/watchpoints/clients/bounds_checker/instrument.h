@@ -15,10 +15,37 @@
 #   define GRANARY_INIT_POLICY (client::watchpoint_bound_policy())
 #endif
 
+
+/// Enable if bounds checks should be done inline (when there are enough dead
+/// registers) instead of by calling out to the register-specific bounds
+/// checkers. The out-of-line checkers are still used to report overflows.
+#ifndef WP_BOUNDS_CHECK_INLINE
+#   define WP_BOUNDS_CHECK_INLINE 1
+#endif
+
 namespace client {
 
     namespace wp {
 
+        /// Specifies the full bounds of a watched object whose bounds can't
+        /// be represented by the low 32 bits of its addresses, i.e. objects
+        /// that cross a 4GB boundary or are at least 4GB big.
+        ///
+        /// Note: The bounds are the low 48 bits of the object's addresses,
+        ///       so that they can be compared against watched addresses
+        ///       without first computing the unwatched addresses.
+        struct wide_bound_descriptor {
+            uint64_t lower_bound;
+            uint64_t upper_bound;
+
+            /// Return address of the code that allocated this watched object.
+            void *return_address;
+
+            /// Next wide descriptor in a descriptor cache.
+            wide_bound_descriptor *next_free_descriptor;
+        };
+
+
         /// Specifies the bounds for the watched object.
         struct bound_descriptor {
 
@@ -26,6 +53,14 @@ namespace client {
                 FREE_LIST_END = ~static_cast<uint64_t>(0ULL)
             };
 
+            /// The 32-bit bounds of a wide descriptor. These bounds can't
+            /// describe any object, so a wide descriptor always fails the
+            /// 32-bit bounds check and falls back on its full bounds.
+            enum : uint32_t {
+                WIDE_LOWER_BOUND = ~static_cast<uint32_t>(0U),
+                WIDE_UPPER_BOUND = 0U
+            };
+
             struct {
                 /// Most objects won't be more than 16 pages big, so an
                 /// m16&16 parameter suffices (as opposed to m32&32).
@@ -34,12 +69,21 @@ namespace client {
             } __attribute__((packed));
 
             /// Low 32 bits of the return address of the code that allocated
-            /// this watched object.
+            /// this watched object. Wide descriptors instead point to their
+            /// full bounds.
             union {
                 void *return_address;
+                wide_bound_descriptor *wide;
                 bound_descriptor *next_free_descriptor;
             } __attribute__((packed));
 
+
+            /// Returns true iff this descriptor's bounds are in `wide`.
+            inline bool is_wide(void) const throw() {
+                return WIDE_LOWER_BOUND == lower_bound
+                    && WIDE_UPPER_BOUND == upper_bound;
+            }
+
             /// Allocate a watchpoint descriptor.
             static bool allocate(
                 bound_descriptor *&,
@@ -78,6 +122,17 @@ namespace client {
             "Bound descriptor type should be 16 bytes.");
 
 
+        static_assert(32 == sizeof(wide_bound_descriptor),
+            "Wide bound descriptor type should be 32 bytes.");
+
+
+        /// Returns the low 48 bits of an address, which is the form of the
+        /// bounds in a `wide_bound_descriptor`.
+        inline uint64_t wide_bound(uintptr_t addr) throw() {
+            return addr & ((1ULL << 48) - 1ULL);
+        }
+
+
         /// Specify the descriptor type to the generic watchpoint framework.
         template <typename>
         struct descriptor_type {
@@ -15,6 +15,14 @@
 #   include "clients/watchpoints/clients/bounds_checker/instrument.h"
 #endif
 
+#ifdef CLIENT_SHADOW_MEMORY
+#   include "clients/watchpoints/clients/shadow_memory/instrument.h"
+#endif
+
+#ifdef CLIENT_WATCHPOINT_PROFILE
+#   include "clients/watchpoints/clients/profiler/instrument.h"
+#endif
+
 #ifdef CLIENT_WATCHPOINT_LEAK
 #   include "clients/watchpoints/instrument.h"
 #   include "clients/watchpoints/clients/leak_detector/descriptor.h"
@@ -9,18 +9,37 @@
 #ifndef WATCHPOINT_BOUND_STATE_H_
 #define WATCHPOINT_BOUND_STATE_H_
 
+#include "clients/watchpoints/descriptor_cache.h"
+
 namespace client {
 
     namespace wp {
         struct bound_descriptor;
+        struct wide_bound_descriptor;
     }
 
 
 #define CLIENT_cpu_state
     struct cpu_state {
 
-        /// List of free bounds checking objects for this CPU.
-        wp::bound_descriptor *free_list;
+        /// Caches of free bounds checking objects for this CPU. There is one
+        /// cache per inherited index, as a descriptor can only be reused by
+        /// objects with the same inherited index.
+        wp::descriptor_cache<wp::bound_descriptor>
+            free_list[WP_NUM_INHERITED_INDEXES];
+
+
+        /// Cache of free wide descriptors, i.e. the full bounds of objects
+        /// that crossed a 4GB boundary.
+        wp::descriptor_cache<wp::wide_bound_descriptor> wide_free_list;
+
+
+#if WP_USE_INHERITED_INDEX
+        /// Cache of free descriptors of objects that spanned more than one
+        /// inherited index. Only the counter indexes of these descriptors
+        /// are reused.
+        wp::descriptor_cache<wp::bound_descriptor> spanning_free_list;
+#endif
     };
 
 }
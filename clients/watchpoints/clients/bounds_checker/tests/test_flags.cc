@@ -0,0 +1,103 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_flags.cc
+ *
+ *  Created on: 2014-02-16
+ *      Author: Peter Goodman
+ */
+
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "clients/watchpoints/clients/bounds_checker/instrument.h"
+
+namespace test {
+
+    static uint64_t WP_BOUND_FLAG_VALUES[2] = {0, 1};
+
+
+    /// Conditionally load `*ptr`, where the condition (`A`, i.e. `CF = 0` and
+    /// `ZF = 0`) is true. `RDX`, `RSI`, `R8` and `R9` are dead after the
+    /// `CMOVA`, which makes the inline bounds check available.
+    static uint64_t cmova_load(register uint64_t *ptr) throw() {
+        register uint64_t val;
+        ASM(
+            "movq $2, %0;"
+            "movq $1, %%rdx;"
+            "cmpq $0, %%rdx;"
+            "cmova (%1), %0;"
+            "movq $0, %%rdx;"
+            "movq $0, %%rsi;"
+            "movq $0, %%r8;"
+            "movq $0, %%r9;"
+            : "=&r"(val)
+            : "r"(ptr)
+            : "%rdx", "%rsi", "%r8", "%r9"
+        );
+        return val;
+    }
+
+
+    /// Store the condition `A` (`CF = 0` and `ZF = 0`), which is true, into
+    /// `*ptr`. `RDX`, `RSI`, `R8` and `R9` are dead after the `SETA`, which
+    /// makes the inline bounds check available.
+    static void seta_store(register uint8_t *ptr) throw() {
+        ASM(
+            "movq $1, %%rdx;"
+            "cmpq $0, %%rdx;"
+            "seta (%0);"
+            "movq $0, %%rdx;"
+            "movq $0, %%rsi;"
+            "movq $0, %%r8;"
+            "movq $0, %%r9;"
+            :
+            : "r"(ptr)
+            : "%rdx", "%rsi", "%r8", "%r9", "memory"
+        );
+    }
+
+
+    /// Test that bounds checks of watched operands of instructions that read
+    /// the arithmetic flags don't clobber those flags.
+    static void bounds_check_preserves_read_flags(void) {
+        using namespace client::wp;
+
+        granary::instrumentation_policy policy =
+            granary::policy_for<client::watchpoint_bound_policy>();
+
+        granary::app_pc cmova_pc((granary::app_pc) cmova_load);
+        granary::app_pc cmova_cache_pc(
+            granary::code_cache::find(cmova_pc, policy));
+        granary::basic_block call_cmova(cmova_cache_pc);
+
+        granary::app_pc seta_pc((granary::app_pc) seta_store);
+        granary::basic_block call_seta(
+            granary::code_cache::find(seta_pc, policy));
+
+        // The bounds checker records the (code cache) return address of the
+        // allocator of every watched object.
+        uint64_t *watched(&(WP_BOUND_FLAG_VALUES[0]));
+        ASSERT(ADDRESS_WATCHED == add_watchpoint(
+            watched, &(WP_BOUND_FLAG_VALUES[0]), sizeof WP_BOUND_FLAG_VALUES,
+            cmova_cache_pc));
+
+        // Access the last bytes of the object, so that an inline bounds check
+        // of the access ends with `ZF = 1`.
+        ASSERT(1 == call_cmova.call<uint64_t, uint64_t *>(watched + 1));
+
+        uint8_t *last_byte(
+            reinterpret_cast<uint8_t *>(watched) + sizeof WP_BOUND_FLAG_VALUES);
+        call_seta.call<void, uint8_t *>(last_byte - 1);
+        ASSERT(1 == reinterpret_cast<uint8_t *>(WP_BOUND_FLAG_VALUES)[
+            sizeof WP_BOUND_FLAG_VALUES - 1]);
+    }
+
+
+    ADD_TEST(bounds_check_preserves_read_flags,
+        "Test that bounds checks preserve the flags read by watched "
+        "instructions.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
@@ -10,7 +10,21 @@
 #define WATCHPOINT_BOUND_WRAPPERS_H_
 
 
-#include "clients/watchpoints/clients/bounds_checker/instrument.h"
+#ifdef CLIENT_WATCHPOINT_BOUND
+#   include "clients/watchpoints/clients/bounds_checker/instrument.h"
+#endif
+
+#ifdef CLIENT_SHADOW_MEMORY
+#   include "clients/watchpoints/clients/shadow_memory/instrument.h"
+#endif
+
+#ifdef CLIENT_WATCHPOINT_PROFILE
+#   include "clients/watchpoints/clients/profiler/instrument.h"
+#endif
+
+#ifdef CLIENT_WATCHPOINT_LEAK
+#   include "clients/watchpoints/clients/leak_detector/instrument.h"
+#endif
 
 
 using namespace client::wp;
@@ -22,6 +22,8 @@ namespace client {
         watched_policy /* name */,
         false /* auto-instrument */)
 
+    ELIDE_REDUNDANT_CHECKS(watched_policy)
+
     DECLARE_INSTRUMENTATION_POLICY(
         watchpoint_watched_policy,
         watched_policy /* app read/write policy */,
@@ -0,0 +1,122 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * descriptor.h
+ *
+ *  Created on: 2014-02-06
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_LEAK_DETECTOR_DESCRIPTOR_H_
+#define WATCHPOINT_LEAK_DETECTOR_DESCRIPTOR_H_
+
+#include <atomic>
+
+
+namespace client { namespace wp {
+
+
+    /// The states of a leak descriptor.
+    enum leak_descriptor_state : uint8_t {
+
+        /// The descriptor is on a free list, or has never been allocated.
+        LEAK_DESCRIPTOR_FREE        = 0,
+
+        /// The descriptor describes a live object.
+        LEAK_DESCRIPTOR_ALLOCATED   = 1
+    };
+
+
+    /// Specifies the bounds and the liveness of a watched object.
+    struct leak_descriptor {
+
+        /// Unwatched base address of the object.
+        uintptr_t base_address;
+
+        /// Size (in bytes) of the object.
+        uint32_t size;
+
+        /// Set by the instrumentation whenever the object is accessed, and
+        /// cleared by the leak scanner once per epoch.
+        std::atomic<uint8_t> accessed;
+
+        /// One of the `leak_descriptor_state`s.
+        std::atomic<uint8_t> state;
+
+        /// Number of consecutive epochs in which this object was neither
+        /// accessed nor reached. This saturates at 255.
+        uint8_t num_stale_epochs;
+
+        uint8_t padding;
+
+        /// The most recent epoch in which this object was reached from a
+        /// root, accessed, or allocated.
+        std::atomic<uint32_t> reached_epoch;
+
+        /// The most recent epoch in which the contents of this object were
+        /// scanned for watched pointers.
+        uint32_t scanned_epoch;
+
+        union {
+            /// Address of the code that allocated this object.
+            const void *return_address;
+
+            /// Next descriptor in the CPU-private free list.
+            leak_descriptor *next_free_descriptor;
+        };
+
+
+        /// Allocate a watchpoint descriptor.
+        static bool allocate(
+            leak_descriptor *&,
+            uintptr_t &,
+            const uintptr_t
+        ) throw();
+
+
+        /// Free a watchpoint descriptor.
+        static void free(leak_descriptor *, uintptr_t) throw();
+
+
+        /// Initialise a watchpoint descriptor.
+        static bool allocate_and_init(
+            leak_descriptor *&,
+            uintptr_t &,
+            const uintptr_t,
+            void *base_address,
+            size_t size,
+            void *return_address
+        ) throw();
+
+
+        /// Notify the leak policy that the descriptor can be assigned to the
+        /// index.
+        static void assign(leak_descriptor *, uintptr_t) throw() { }
+
+
+        /// Get the assigned descriptor for a given index.
+        static leak_descriptor *access(uintptr_t index) throw();
+    };
+
+
+    static_assert(32 == sizeof(leak_descriptor),
+        "Leak descriptor type should be 32 bytes.");
+
+
+    static_assert(12 == __builtin_offsetof(leak_descriptor, accessed),
+        "The inline instrumentation expects the `accessed` field to be at "
+        "offset 12 of a leak descriptor.");
+
+
+    /// Specify the descriptor type to the generic watchpoint framework.
+    template <typename>
+    struct descriptor_type {
+        typedef leak_descriptor type;
+        enum {
+            ALLOC_AND_INIT = true,
+            REINIT_WATCHED_POINTERS = false
+        };
+    };
+
+}}
+
+#endif /* WATCHPOINT_LEAK_DETECTOR_DESCRIPTOR_H_ */
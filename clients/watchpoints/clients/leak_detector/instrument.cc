@@ -0,0 +1,869 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * instrument.cc
+ *
+ *  Created on: 2014-02-06
+ *      Author: Peter Goodman
+ */
+
+#include "clients/watchpoints/utils.h"
+#include "clients/watchpoints/clients/leak_detector/instrument.h"
+#include "clients/watchpoints/descriptor_allocator.h"
+
+#include "granary/spin_lock.h"
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+using namespace granary;
+
+
+namespace client {
+
+
+    namespace wp {
+
+        /// Descriptors of all watched objects. This is page-aligned so that
+        /// the leak scanner can skip it page-by-page when scanning globals.
+        leak_descriptor DESCRIPTORS[MAX_NUM_WATCHPOINTS] \
+            __attribute__((aligned (PAGE_SIZE)));
+
+
+        /// Global pools of free descriptors, one per inherited index.
+        static descriptor_pool<leak_descriptor>
+            POOLS[WP_NUM_INHERITED_INDEXES];
+
+
+        /// One more than the highest descriptor index ever allocated. The
+        /// leak scanner only visits descriptors below this index.
+        static std::atomic<uintptr_t> HIGH_WATER_MARK = ATOMIC_VAR_INIT(0);
+
+
+        /// Current leak scanning epoch. Epochs begin at 1 so that descriptors
+        /// that have never been allocated are never considered reached.
+        static std::atomic<uint32_t> EPOCH = ATOMIC_VAR_INIT(1);
+
+
+        /// Number of objects that have been reported as leaked.
+        static uint64_t NUM_REPORTED_LEAKS = 0;
+
+
+        /// The states of a thread record.
+        enum leak_thread_state : uint8_t {
+            LEAK_THREAD_FREE        = 0,
+            LEAK_THREAD_CLAIMED     = 1,
+            LEAK_THREAD_LIVE        = 2
+        };
+
+
+        /// The stack of a thread that is a root of the leak scan.
+        struct leak_thread {
+            std::atomic<uint8_t> state;
+            uintptr_t stack_begin;
+            uintptr_t stack_end;
+        };
+
+
+        /// Records of the threads whose stacks are roots of the leak scan,
+        /// and one more than the highest index of a ever-claimed record.
+        static leak_thread THREADS[WP_LEAK_MAX_NUM_THREADS];
+        static std::atomic<unsigned> NUM_THREADS = ATOMIC_VAR_INIT(0);
+
+
+        /// The record of the current thread, if any. Thread records are
+        /// released by the destructor of `THREAD_KEY` when a thread exits.
+        static __thread leak_thread *THREAD = nullptr;
+        static pthread_key_t THREAD_KEY;
+        static pthread_once_t THREAD_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+
+        /// The phases of an epoch of the leak scanner.
+        enum leak_scan_phase {
+
+            /// Mark the objects pointed to by the writable segments of all
+            /// loaded objects.
+            SCAN_GLOBALS,
+
+            /// Mark the objects pointed to by the stacks of registered
+            /// threads.
+            SCAN_STACKS,
+
+            /// Mark accessed objects, and the objects pointed to by reached
+            /// objects.
+            SCAN_OBJECTS,
+
+            /// Update the staleness of every object, and report the leaks.
+            AGE_OBJECTS
+        };
+
+
+        /// Lock that ensures only one thread scans at a time. Threads that
+        /// fail to acquire this lock skip their scan slice instead of waiting.
+        static atomic_spin_lock SCANNER_LOCK;
+
+
+        /// Position of the leak scanner. All of the following are protected
+        /// by `SCANNER_LOCK`.
+        static leak_scan_phase PHASE = SCAN_GLOBALS;
+
+        /// Index of the segment, thread, or descriptor being visited.
+        static uintptr_t CURSOR = 0;
+
+        /// Address of the next word of the current range to scan, or 0 if
+        /// scanning of the range hasn't started.
+        static uintptr_t SCAN_ADDRESS = 0;
+
+        /// Set when an object that is behind the cursor is reached during
+        /// `SCAN_OBJECTS`. The objects are then visited again, so that the
+        /// newly reached object is itself scanned.
+        static bool REACHED_BEHIND_CURSOR = false;
+
+        /// Copy of the page being scanned.
+        static uintptr_t SCAN_BUFFER[PAGE_SIZE / sizeof(uintptr_t)] \
+            __attribute__((aligned (PAGE_SIZE)));
+
+
+        enum {
+
+            /// Number of pages whose residency is queried at once.
+            NUM_RESIDENCY_PAGES = 512
+        };
+
+
+        /// Residency of the pages in `[RESIDENCY_BEGIN, RESIDENCY_END)`. This
+        /// is reset at the start of every scan slice.
+        static unsigned char RESIDENCY[NUM_RESIDENCY_PAGES];
+        static uintptr_t RESIDENCY_BEGIN = 0;
+        static uintptr_t RESIDENCY_END = 0;
+
+
+        inline static uintptr_t index_of(const leak_descriptor *desc) throw() {
+            return desc - &(DESCRIPTORS[0]);
+        }
+
+
+        /// Make sure that the leak scanner will visit the record at `index`.
+        template <typename T>
+        static void update_high_water_mark(
+            std::atomic<T> &high_water_mark,
+            T index
+        ) throw() {
+            T mark(high_water_mark.load(std::memory_order_relaxed));
+            while(mark <= index) {
+                if(high_water_mark.compare_exchange_weak(mark, index + 1)) {
+                    break;
+                }
+            }
+        }
+
+
+        /// Release the record of an exiting thread.
+        static void unregister_thread(void *thread) throw() {
+            reinterpret_cast<leak_thread *>(thread)->state.store(
+                LEAK_THREAD_FREE, std::memory_order_release);
+        }
+
+
+        static void create_thread_key(void) throw() {
+            pthread_key_create(&THREAD_KEY, &unregister_thread);
+        }
+
+
+        /// Register the stack of the current thread as a root of the leak
+        /// scan, if it isn't already registered.
+        static void register_thread(void) throw() {
+            if(THREAD) {
+                return;
+            }
+
+            pthread_once(&THREAD_KEY_ONCE, &create_thread_key);
+
+            pthread_attr_t attr;
+            void *stack(nullptr);
+            size_t stack_size(0);
+            if(pthread_getattr_np(pthread_self(), &attr)) {
+                return;
+            }
+            const int failed(pthread_attr_getstack(&attr, &stack, &stack_size));
+            pthread_attr_destroy(&attr);
+            if(failed) {
+                return;
+            }
+
+            for(unsigned i(0); i < WP_LEAK_MAX_NUM_THREADS; ++i) {
+                leak_thread *thread(&(THREADS[i]));
+                uint8_t expected(LEAK_THREAD_FREE);
+                if(!thread->state.compare_exchange_strong(
+                    expected, LEAK_THREAD_CLAIMED)) {
+                    continue;
+                }
+
+                thread->stack_begin = reinterpret_cast<uintptr_t>(stack);
+                thread->stack_end = thread->stack_begin + stack_size;
+                thread->state.store(
+                    LEAK_THREAD_LIVE, std::memory_order_release);
+                update_high_water_mark(NUM_THREADS, i);
+
+                THREAD = thread;
+                pthread_setspecific(THREAD_KEY, thread);
+                return;
+            }
+        }
+
+
+        /// Allocate a watchpoint descriptor and assign `desc` and `index`
+        /// appropriately.
+        bool leak_descriptor::allocate(
+            leak_descriptor *&desc,
+            uintptr_t &counter_index,
+            const uintptr_t inherited_index
+        ) throw() {
+            desc = allocate_descriptor(
+                DESCRIPTORS, POOLS, counter_index, inherited_index);
+            if(!desc) {
+                return false;
+            }
+            update_high_water_mark(HIGH_WATER_MARK, index_of(desc));
+            return true;
+        }
+
+
+        /// Initialise a watchpoint descriptor, then do a slice of leak
+        /// scanning. Scanning is paced by allocations because an application
+        /// can only leak more memory by allocating more memory.
+        bool leak_descriptor::allocate_and_init(
+            leak_descriptor *&desc,
+            uintptr_t &counter_index,
+            const uintptr_t inherited_index,
+            void *base_address,
+            size_t size,
+            void *return_address
+        ) throw() {
+
+            if(!size || size > ~uint32_t(0)) {
+                return false;
+            }
+
+#if WP_USE_INHERITED_INDEX
+            // Only the bounds checker duplicates descriptors across inherited
+            // indexes; don't watch objects that span more than one.
+            if(1 < num_inherited_indexes_spanned(
+                reinterpret_cast<uintptr_t>(base_address), size)) {
+                return false;
+            }
+#endif /* WP_USE_INHERITED_INDEX */
+
+            register_thread();
+
+            if(!allocate(desc, counter_index, inherited_index)) {
+                return false;
+            }
+
+            ASSERT(is_valid_address(desc));
+
+            desc->base_address = reinterpret_cast<uintptr_t>(base_address);
+            desc->size = static_cast<uint32_t>(size);
+            desc->return_address = return_address;
+            desc->num_stale_epochs = 0;
+            desc->scanned_epoch = 0;
+
+            // A new object is live until proven otherwise. The `accessed` byte
+            // keeps it live into the next epoch, during which the allocator
+            // will have stored the pointer to it somewhere.
+            desc->reached_epoch.store(
+                EPOCH.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+            desc->accessed.store(1, std::memory_order_relaxed);
+            desc->state.store(
+                LEAK_DESCRIPTOR_ALLOCATED, std::memory_order_release);
+
+            scan_for_leaks();
+            return true;
+        }
+
+
+        /// Get the descriptor of a watchpoint based on its index.
+        leak_descriptor *leak_descriptor::access(
+            uintptr_t index
+        ) throw() {
+            ASSERT(index < MAX_NUM_WATCHPOINTS);
+            return &(DESCRIPTORS[index]);
+        }
+
+
+        /// Free a watchpoint descriptor by adding it to a descriptor cache.
+        /// The leak scanner never dereferences an object directly, so a racing
+        /// scan of the object's memory is safe even if the memory is
+        /// unmapped.
+        void leak_descriptor::free(
+            leak_descriptor *desc,
+            uintptr_t IF_TEST( index )
+        ) throw() {
+
+            ASSERT(is_valid_address(desc));
+            ASSERT(index == index_of(desc));
+
+            register_thread();
+
+            // Double free, or a free of an object that we never finished
+            // watching.
+            uint8_t expected(LEAK_DESCRIPTOR_ALLOCATED);
+            if(!desc->state.compare_exchange_strong(
+                expected, LEAK_DESCRIPTOR_FREE)) {
+                return;
+            }
+
+            free_descriptor(DESCRIPTORS, POOLS, desc);
+        }
+
+
+        /// Returns the current leak scanning epoch.
+        uint32_t leak_scan_epoch(void) throw() {
+            return EPOCH.load(std::memory_order_relaxed);
+        }
+
+
+        /// Returns the number of consecutive epochs in which the watched
+        /// object pointed to by `ptr` was neither accessed nor reachable.
+        unsigned num_stale_epochs_of(uintptr_t ptr) throw() {
+            if(!is_watched_address(ptr)) {
+                return 0;
+            }
+            return descriptor_of(ptr)->num_stale_epochs;
+        }
+
+
+        /// Returns the number of objects that have been reported as leaked.
+        uint64_t num_reported_leaks(void) throw() {
+            return NUM_REPORTED_LEAKS;
+        }
+
+
+        /// Report an object that has been stale for `WP_LEAK_STALE_EPOCHS`
+        /// epochs.
+        static void report_leak(const leak_descriptor *desc) throw() {
+            NUM_REPORTED_LEAKS += 1;
+            printf("Possible leak of %u bytes at %p (allocated by %p); "
+                   "not accessed or reachable for %u epochs.\n",
+                desc->size, reinterpret_cast<void *>(desc->base_address),
+                desc->return_address, WP_LEAK_STALE_EPOCHS);
+        }
+
+
+        /// Mark the object pointed to by `value` as reached in `epoch`, if
+        /// `value` is a watched pointer into a live object.
+        static void mark(uintptr_t value, uint32_t epoch) throw() {
+            if(!is_watched_address(value)) {
+                return;
+            }
+
+            const uintptr_t index(combined_index_of(value));
+            if(index >= MAX_NUM_WATCHPOINTS) {
+                return;
+            }
+
+            // Pointers one past the end of an object still keep it alive.
+            leak_descriptor *desc(&(DESCRIPTORS[index]));
+            const uintptr_t addr(unwatched_address(value));
+            if(LEAK_DESCRIPTOR_ALLOCATED != desc->state.load(
+                    std::memory_order_relaxed)
+            || addr < desc->base_address
+            || addr > (desc->base_address + desc->size)) {
+                return;
+            }
+
+            if(epoch == desc->reached_epoch.exchange(
+                epoch, std::memory_order_relaxed)) {
+                return;
+            }
+
+            if(SCAN_OBJECTS == PHASE && index < CURSOR) {
+                REACHED_BEHIND_CURSOR = true;
+            }
+        }
+
+
+        /// Returns the end of the scanner's own data structure that contains
+        /// `addr`, or 0 if `addr` isn't within one. These don't contain roots,
+        /// and `SCAN_BUFFER` contains stale copies of scanned memory.
+        static uintptr_t end_of_excluded_range(uintptr_t addr) throw() {
+            const uintptr_t descriptors(
+                reinterpret_cast<uintptr_t>(&(DESCRIPTORS[0])));
+            if(descriptors <= addr && addr < (descriptors + sizeof DESCRIPTORS)) {
+                return descriptors + sizeof DESCRIPTORS;
+            }
+
+            const uintptr_t buffer(reinterpret_cast<uintptr_t>(SCAN_BUFFER));
+            if(buffer <= addr && addr < (buffer + sizeof SCAN_BUFFER)) {
+                return buffer + sizeof SCAN_BUFFER;
+            }
+
+            return 0;
+        }
+
+
+        /// Returns true iff the page at `page` is resident. Residency is
+        /// queried for many pages (up to `end`) at once, unless some of those
+        /// pages are unmapped.
+        static bool is_resident(uintptr_t page, uintptr_t end) throw() {
+            if(RESIDENCY_BEGIN <= page && page < RESIDENCY_END) {
+                return 1 & RESIDENCY[(page - RESIDENCY_BEGIN) / PAGE_SIZE];
+            }
+
+            uintptr_t num_pages((end - page + PAGE_SIZE - 1) / PAGE_SIZE);
+            if(num_pages > NUM_RESIDENCY_PAGES) {
+                num_pages = NUM_RESIDENCY_PAGES;
+            }
+
+            void *addr(reinterpret_cast<void *>(page));
+            if(mincore(addr, num_pages * PAGE_SIZE, &(RESIDENCY[0]))) {
+                num_pages = 1;
+                if(mincore(addr, PAGE_SIZE, &(RESIDENCY[0]))) {
+                    RESIDENCY[0] = 0;
+                }
+            }
+
+            RESIDENCY_BEGIN = page;
+            RESIDENCY_END = page + num_pages * PAGE_SIZE;
+            return 1 & RESIDENCY[0];
+        }
+
+
+        /// Copy `size` bytes from `addr` into `SCAN_BUFFER`. Returns false if
+        /// any of the memory is unmapped or unreadable.
+        static bool read_memory(uintptr_t addr, size_t size) throw() {
+            struct iovec local;
+            struct iovec remote;
+            local.iov_base = &(SCAN_BUFFER[0]);
+            local.iov_len = size;
+            remote.iov_base = reinterpret_cast<void *>(addr);
+            remote.iov_len = size;
+            return static_cast<ssize_t>(size) == process_vm_readv(
+                getpid(), &local, 1, &remote, 1, 0);
+        }
+
+
+        /// Scan the words of `[begin, end)` for watched pointers, resuming at
+        /// `SCAN_ADDRESS` if it is within the range. Memory is copied (one
+        /// page at a time) instead of being dereferenced, so that unmapped or
+        /// unreadable pages, e.g. of a thread that has exited or of an object
+        /// that was freed, are skipped instead of faulting. Pages that aren't
+        /// resident are also skipped, as they are either untouched (and so
+        /// zero), or swapped out. Returns false if the budget ran out before
+        /// the end of the range.
+        static bool scan_range(
+            uintptr_t begin,
+            uintptr_t end,
+            uint32_t epoch,
+            int &budget
+        ) throw() {
+            begin = (begin + 7) & ~uintptr_t(7);
+            if(SCAN_ADDRESS < begin || SCAN_ADDRESS > end) {
+                SCAN_ADDRESS = begin;
+            }
+
+            while((SCAN_ADDRESS + sizeof(uintptr_t)) <= end) {
+                if(0 >= budget) {
+                    return false;
+                }
+
+                budget -= 1;
+
+                const uintptr_t skip_to(end_of_excluded_range(SCAN_ADDRESS));
+                if(skip_to) {
+                    SCAN_ADDRESS = skip_to;
+                    continue;
+                }
+
+                const uintptr_t page(SCAN_ADDRESS & ~uintptr_t(PAGE_SIZE - 1));
+                uintptr_t chunk_end(page + PAGE_SIZE);
+                if(chunk_end > end) {
+                    chunk_end = end & ~uintptr_t(7);
+                }
+
+                const size_t size(chunk_end - SCAN_ADDRESS);
+                if(is_resident(page, end) && read_memory(SCAN_ADDRESS, size)) {
+                    const unsigned num_words(size / sizeof(uintptr_t));
+                    for(unsigned i(0); i < num_words; ++i) {
+                        mark(SCAN_BUFFER[i], epoch);
+                    }
+                    budget -= num_words;
+                }
+
+                SCAN_ADDRESS = chunk_end;
+            }
+
+            return true;
+        }
+
+
+        /// Move the scanner on to the next segment, thread, or descriptor.
+        inline static void advance_cursor(void) throw() {
+            CURSOR += 1;
+            SCAN_ADDRESS = 0;
+        }
+
+
+        /// State of a scan of the writable segments of all loaded objects.
+        struct globals_scan {
+            uintptr_t index;
+            uint32_t epoch;
+            int budget;
+        };
+
+
+        /// Scan the writable segments of a loaded object, starting at the
+        /// `CURSOR`th writable segment (counting across all objects). This is
+        /// called by `dl_iterate_phdr` with the loader's lock held, so the
+        /// object can't be unloaded while it is being scanned.
+        static int scan_loaded_object(
+            struct dl_phdr_info *info,
+            size_t,
+            void *data
+        ) throw() {
+            globals_scan *scan(reinterpret_cast<globals_scan *>(data));
+            for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+                const ElfW(Phdr) &segment(info->dlpi_phdr[i]);
+                if(PT_LOAD != segment.p_type || !(PF_W & segment.p_flags)) {
+                    continue;
+                }
+
+                if(scan->index++ < CURSOR) {
+                    continue;
+                }
+
+                const uintptr_t begin(info->dlpi_addr + segment.p_vaddr);
+                const uintptr_t end(begin + segment.p_memsz);
+                if(!scan_range(begin, end, scan->epoch, scan->budget)) {
+                    return 1;
+                }
+
+                advance_cursor();
+            }
+            return 0;
+        }
+
+
+        /// Scan the globals of all loaded objects. Returns true when done.
+        static bool scan_globals(uint32_t epoch, int &budget) throw() {
+            globals_scan scan;
+            scan.index = 0;
+            scan.epoch = epoch;
+            scan.budget = budget;
+            const int stopped(dl_iterate_phdr(&scan_loaded_object, &scan));
+            budget = scan.budget;
+            return !stopped;
+        }
+
+
+        /// Scan the stacks of all registered threads. Only the live part of
+        /// the current thread's stack, i.e. above `stack_pointer`, is scanned.
+        /// Returns true when done.
+        static bool scan_stacks(
+            uintptr_t stack_pointer,
+            uint32_t epoch,
+            int &budget
+        ) throw() {
+            const unsigned num_threads(NUM_THREADS.load());
+            for(; CURSOR < num_threads; advance_cursor()) {
+                if(0 >= budget) {
+                    return false;
+                }
+
+                budget -= 1;
+
+                leak_thread *thread(&(THREADS[CURSOR]));
+                if(LEAK_THREAD_LIVE != thread->state.load(
+                    std::memory_order_acquire)) {
+                    continue;
+                }
+
+                uintptr_t begin(thread->stack_begin);
+                const uintptr_t end(thread->stack_end);
+                if(thread == THREAD
+                && begin < stack_pointer && stack_pointer < end) {
+                    begin = stack_pointer;
+                }
+
+                if(begin < end && !scan_range(begin, end, epoch, budget)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+
+        /// Visit every allocated object. Accessed objects are marked as
+        /// reached, and the contents of every reached object are scanned once
+        /// per epoch. Returns true when done.
+        static bool scan_objects(uint32_t epoch, int &budget) throw() {
+            const uintptr_t num_descriptors(HIGH_WATER_MARK.load());
+            for(;;) {
+                for(; CURSOR < num_descriptors; advance_cursor()) {
+                    if(0 >= budget) {
+                        return false;
+                    }
+
+                    budget -= 1;
+
+                    leak_descriptor *desc(&(DESCRIPTORS[CURSOR]));
+                    if(LEAK_DESCRIPTOR_ALLOCATED != desc->state.load(
+                        std::memory_order_acquire)) {
+                        continue;
+                    }
+
+                    if(desc->accessed.exchange(0, std::memory_order_relaxed)) {
+                        desc->reached_epoch.store(
+                            epoch, std::memory_order_relaxed);
+                    }
+
+                    if(epoch != desc->reached_epoch.load(
+                        std::memory_order_relaxed)
+                    || epoch == desc->scanned_epoch) {
+                        continue;
+                    }
+
+                    const uintptr_t begin(desc->base_address);
+                    if(!scan_range(begin, begin + desc->size, epoch, budget)) {
+                        return false;
+                    }
+
+                    desc->scanned_epoch = epoch;
+                }
+
+                if(!REACHED_BEHIND_CURSOR) {
+                    return true;
+                }
+
+                REACHED_BEHIND_CURSOR = false;
+                CURSOR = 0;
+                SCAN_ADDRESS = 0;
+            }
+        }
+
+
+        /// Update the staleness of every allocated object, and report the
+        /// objects that have just become stale for `WP_LEAK_STALE_EPOCHS`
+        /// epochs. Returns true when done.
+        static bool age_objects(uint32_t epoch, int &budget) throw() {
+            const uintptr_t num_descriptors(HIGH_WATER_MARK.load());
+            for(; CURSOR < num_descriptors; advance_cursor()) {
+                if(0 >= budget) {
+                    return false;
+                }
+
+                budget -= 1;
+
+                leak_descriptor *desc(&(DESCRIPTORS[CURSOR]));
+                if(LEAK_DESCRIPTOR_ALLOCATED != desc->state.load(
+                    std::memory_order_acquire)) {
+                    continue;
+                }
+
+                if(epoch == desc->reached_epoch.load(std::memory_order_relaxed)
+                || desc->accessed.load(std::memory_order_relaxed)) {
+                    desc->num_stale_epochs = 0;
+                    continue;
+                }
+
+                if(255 > desc->num_stale_epochs) {
+                    desc->num_stale_epochs += 1;
+                    if(WP_LEAK_STALE_EPOCHS == desc->num_stale_epochs) {
+                        report_leak(desc);
+                    }
+                }
+            }
+            return true;
+        }
+
+
+        /// Do a bounded amount of leak scanning. Each epoch marks the objects
+        /// pointed to by the roots (the writable segments of loaded objects,
+        /// and the stacks of threads that have allocated or freed watched
+        /// objects), as well as recently accessed objects, and then marks
+        /// transitively through the contents of the marked objects. Marking
+        /// is not atomic with respect to the application; instead, an object
+        /// is only reported after being neither accessed nor reached for
+        /// `WP_LEAK_STALE_EPOCHS` whole epochs.
+        ///
+        /// Note: Pointers held only in the registers of other threads, or
+        ///       only in unwatched heap memory, are not roots.
+        void scan_for_leaks(void) throw() {
+
+            // Spill the callee-saved registers onto the stack, so that they
+            // are scanned along with the rest of this thread's stack.
+            __builtin_unwind_init();
+
+            if(!SCANNER_LOCK.try_acquire()) {
+                return;
+            }
+
+            uintptr_t stack_pointer(0);
+            stack_pointer = reinterpret_cast<uintptr_t>(&stack_pointer);
+
+            const uint32_t epoch(EPOCH.load(std::memory_order_relaxed));
+            int budget(WP_LEAK_SCAN_BUDGET);
+            RESIDENCY_END = 0;
+
+            for(bool done(false); !done; ) {
+                switch(PHASE) {
+                case SCAN_GLOBALS:
+                    done = !scan_globals(epoch, budget);
+                    break;
+                case SCAN_STACKS:
+                    done = !scan_stacks(stack_pointer, epoch, budget);
+                    break;
+                case SCAN_OBJECTS:
+                    done = !scan_objects(epoch, budget);
+                    break;
+                case AGE_OBJECTS:
+                    done = !age_objects(epoch, budget);
+                    break;
+                }
+
+                if(done) {
+                    break;
+                }
+
+                CURSOR = 0;
+                SCAN_ADDRESS = 0;
+
+                // Finish at most one epoch per slice.
+                if(AGE_OBJECTS == PHASE) {
+                    PHASE = SCAN_GLOBALS;
+                    EPOCH.store(epoch + 1, std::memory_order_relaxed);
+                    done = true;
+                } else {
+                    PHASE = static_cast<leak_scan_phase>(PHASE + 1);
+                }
+            }
+
+            SCANNER_LOCK.release();
+        }
+
+
+        /// Registers that can be used to hold the descriptor address during
+        /// an inline access update.
+        static const dynamorio::reg_id_t SCRATCH_REGS[] = {
+            dynamorio::DR_REG_RAX,
+            dynamorio::DR_REG_RCX,
+            dynamorio::DR_REG_RDX
+        };
+
+
+        /// Add an inline update that marks the object of the `i`th watched
+        /// operand of `tracker` as accessed. The update is added after the
+        /// operand's watchpoint label, where the operand's register contains
+        /// the watched address. The `accessed` byte is only written if it is
+        /// not already set, so that frequently accessed objects don't have
+        /// their descriptors' cache lines bounce between CPUs.
+        static void add_access_update(
+            instruction_list &ls,
+            watchpoint_tracker &tracker,
+            unsigned i
+        ) throw() {
+            const dynamorio::reg_id_t addr_reg(register_manager::scale(
+                tracker.regs[i].value.reg, REG_64));
+
+            dynamorio::reg_id_t scratch[2];
+            for(unsigned r(0), s(0); s < 2; ++r) {
+                if(addr_reg != SCRATCH_REGS[r]) {
+                    scratch[s++] = SCRATCH_REGS[r];
+                }
+            }
+
+            const operand desc(scratch[0]);
+            const operand table(scratch[1]);
+
+            operand_base_disp accessed(*desc);
+            accessed.disp = 12;
+            accessed.size = dynamorio::OPSZ_1;
+
+            instruction in(tracker.labels[i]);
+            instruction done(label_());
+
+            // As with the shadow memory client, the flags are restored first
+            // so that the red zone guard also covers the `POPF`.
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+            in = ls.insert_after(in, push_(desc));
+            in = ls.insert_after(in, push_(table));
+            in = ls.insert_after(in, pushf_());
+
+            // Compute the address of the descriptor of the watched address.
+            in = insert_descriptor_index_after(
+                ls, in, desc, operand(addr_reg), table);
+            in = ls.insert_after(in, shl_(desc, int8_(5)));
+            in = ls.insert_after(in, mov_imm_(table,
+                int64_(reinterpret_cast<uint64_t>(&(DESCRIPTORS[0])))));
+            in = ls.insert_after(in, add_(desc, table));
+
+            // Mark the object as accessed.
+            in = ls.insert_after(in, cmp_(accessed, int8_(0)));
+            in = ls.insert_after(in, mangled(jnz_(instr_(done))));
+            in = ls.insert_after(in, mov_st_(accessed, int8_(1)));
+
+            in = ls.insert_after(in, done);
+            in = ls.insert_after(in, popf_());
+            in = ls.insert_after(in, pop_(table));
+            in = ls.insert_after(in, pop_(desc));
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+        }
+
+
+        /// Instrument a memory read.
+        void leak_policy::visit_read(
+            granary::basic_block_state &,
+            instruction_list &ls,
+            watchpoint_tracker &tracker,
+            unsigned i
+        ) throw() {
+            add_access_update(ls, tracker, i);
+        }
+
+
+        /// Instrument a memory write. Read-modify-write operands were already
+        /// instrumented as reads.
+        void leak_policy::visit_write(
+            granary::basic_block_state &,
+            instruction_list &ls,
+            watchpoint_tracker &tracker,
+            unsigned i
+        ) throw() {
+            if(!(SOURCE_OPERAND & tracker.ops[i].kind)) {
+                add_access_update(ls, tracker, i);
+            }
+        }
+
+
+#if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
+        interrupt_handled_state leak_policy::handle_interrupt(
+            cpu_state_handle,
+            thread_state_handle,
+            granary::basic_block_state &,
+            interrupt_stack_frame &,
+            interrupt_vector
+        ) throw() {
+            return INTERRUPT_DEFER;
+        }
+#endif /* CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT */
+
+    } /* wp namespace */
+
+
+    /// Register the initial thread, so that its stack is a root of the leak
+    /// scan even if it never allocates or frees a watched object.
+    void init(void) throw() {
+        wp::register_thread();
+    }
+
+} /* client namespace */
@@ -0,0 +1,92 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * instrument.h
+ *
+ *  Created on: 2014-02-06
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_LEAK_DETECTOR_INSTRUMENT_H_
+#define WATCHPOINT_LEAK_DETECTOR_INSTRUMENT_H_
+
+#include "clients/watchpoints/instrument.h"
+#include "clients/watchpoints/clients/leak_detector/descriptor.h"
+
+#ifndef GRANARY_INIT_POLICY
+#   define GRANARY_INIT_POLICY (client::watchpoint_leak_policy())
+#endif
+
+
+/// Number of consecutive epochs for which an object must be neither accessed
+/// nor reachable from a root before it is reported as a leak.
+#ifndef WP_LEAK_STALE_EPOCHS
+#   define WP_LEAK_STALE_EPOCHS 8
+#endif
+
+
+/// Maximum amount of work (in pointer-sized words scanned, pages skipped,
+/// and descriptors visited) done by a single slice of the leak scanner.
+#ifndef WP_LEAK_SCAN_BUDGET
+#   define WP_LEAK_SCAN_BUDGET 4096
+#endif
+
+
+/// Maximum number of threads whose stacks are scanned for roots.
+#ifndef WP_LEAK_MAX_NUM_THREADS
+#   define WP_LEAK_MAX_NUM_THREADS 1024
+#endif
+
+
+namespace client {
+
+    namespace wp {
+
+        static_assert(0 < WP_LEAK_STALE_EPOCHS && WP_LEAK_STALE_EPOCHS < 255,
+            "The number of stale epochs must be within [1, 255).");
+
+
+        /// Do a bounded amount of leak scanning. If another thread is already
+        /// scanning then this does nothing.
+        void scan_for_leaks(void) throw();
+
+
+        /// Returns the current leak scanning epoch.
+        uint32_t leak_scan_epoch(void) throw();
+
+
+        /// Returns the number of consecutive epochs in which the watched
+        /// object pointed to by `ptr` was neither accessed nor reachable.
+        unsigned num_stale_epochs_of(uintptr_t ptr) throw();
+
+
+        template <typename T>
+        inline unsigned num_stale_epochs_of(T *ptr) throw() {
+            return num_stale_epochs_of(reinterpret_cast<uintptr_t>(ptr));
+        }
+
+
+        /// Returns the number of objects that have been reported as leaked.
+        uint64_t num_reported_leaks(void) throw();
+
+
+#ifdef GRANARY_DONT_INCLUDE_CSTDLIB
+    } /* wp namespace */
+#else
+    } /* wp namespace */
+
+    DECLARE_READ_WRITE_POLICY(
+        leak_policy /* name */,
+        false /* auto-instrument */)
+
+    ELIDE_REDUNDANT_CHECKS(leak_policy)
+
+    DECLARE_INSTRUMENTATION_POLICY(
+        watchpoint_leak_policy,
+        leak_policy /* app read/write policy */,
+        leak_policy /* host read/write policy */,
+        { /* override declarations */ })
+
+#endif /* GRANARY_DONT_INCLUDE_CSTDLIB */
+} /* namespace client */
+
+#endif /* WATCHPOINT_LEAK_DETECTOR_INSTRUMENT_H_ */
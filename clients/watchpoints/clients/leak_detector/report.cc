@@ -0,0 +1,59 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * report.cc
+ *
+ *  Created on: 2014-02-06
+ *      Author: Peter Goodman
+ */
+
+#include "clients/watchpoints/clients/leak_detector/instrument.h"
+
+
+using namespace granary;
+
+
+namespace client {
+
+    namespace wp {
+        extern leak_descriptor DESCRIPTORS[MAX_NUM_WATCHPOINTS];
+    }
+
+
+    /// Report on the objects that are still stale.
+    void report(void) throw() {
+
+        uint64_t num_objects(0);
+        uint64_t num_stale_objects(0);
+        uint64_t num_stale_bytes(0);
+
+        for(unsigned i(0); i < wp::MAX_NUM_WATCHPOINTS; ++i) {
+            const wp::leak_descriptor &desc(wp::DESCRIPTORS[i]);
+            if(wp::LEAK_DESCRIPTOR_FREE == desc.state.load()) {
+                continue;
+            }
+
+            num_objects += 1;
+            if(WP_LEAK_STALE_EPOCHS <= desc.num_stale_epochs) {
+                num_stale_objects += 1;
+                num_stale_bytes += desc.size;
+            }
+        }
+
+        printf("\nLeak Detector (%u stale epochs)\n", WP_LEAK_STALE_EPOCHS);
+
+        printf("Number of leak scanning epochs: %u\n",
+            wp::leak_scan_epoch() - 1);
+
+        printf("Number of leak reports: %lu\n",
+            wp::num_reported_leaks());
+
+        printf("Number of live watched objects: %lu\n",
+            num_objects);
+
+        printf("Number of stale objects: %lu\n",
+            num_stale_objects);
+
+        printf("Number of stale bytes: %lu\n",
+            num_stale_bytes);
+    }
+}
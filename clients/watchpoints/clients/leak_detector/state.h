@@ -0,0 +1,32 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * state.h
+ *
+ *  Created on: 2014-02-06
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_LEAK_DETECTOR_STATE_H_
+#define WATCHPOINT_LEAK_DETECTOR_STATE_H_
+
+#include "clients/watchpoints/descriptor_cache.h"
+
+namespace client {
+
+    namespace wp {
+        struct leak_descriptor;
+    }
+
+
+#define CLIENT_cpu_state
+    struct cpu_state {
+
+        /// Caches of free leak descriptors for this CPU, one per inherited
+        /// index.
+        wp::descriptor_cache<wp::leak_descriptor>
+            free_list[WP_NUM_INHERITED_INDEXES];
+    };
+
+}
+
+#endif /* WATCHPOINT_LEAK_DETECTOR_STATE_H_ */
@@ -0,0 +1,202 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_leaks.cc
+ *
+ *  Created on: 2014-02-17
+ *      Author: Peter Goodman
+ */
+
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "clients/watchpoints/clients/leak_detector/instrument.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+namespace test {
+
+    enum {
+        WP_LEAK_OBJECT_SIZE = 32,
+
+        /// Objects 0 through 3 are reachable, and 4 through 6 are leaked.
+        WP_LEAK_NUM_OBJECTS = 7
+    };
+
+
+    /// Root of the chain of objects 0, 1 and 2.
+    static uintptr_t WP_LEAK_GLOBAL_ROOT = 0;
+
+
+    /// Complemented watched pointers to each object. These are hidden from
+    /// the leak scanner, as they aren't watched addresses.
+    static uintptr_t WP_LEAK_HIDDEN[WP_LEAK_NUM_OBJECTS] = {0};
+
+
+    /// Used to hand object 3 to, and to stop, the thread that holds a pointer
+    /// to object 3 on its stack.
+    static std::atomic<bool> WP_LEAK_THREAD_READY(false);
+    static std::atomic<bool> WP_LEAK_THREAD_DONE(false);
+
+
+    /// Watch the `i`th object of `memory`, and return its watched address.
+    static uintptr_t watch_object(uint8_t *memory, unsigned i) throw() {
+        uint8_t *object(memory + i * WP_LEAK_OBJECT_SIZE);
+        uint8_t *watched(object);
+        ASSERT(client::wp::ADDRESS_WATCHED == client::wp::add_watchpoint(
+            watched, object, WP_LEAK_OBJECT_SIZE,
+            __builtin_return_address(0)));
+        WP_LEAK_HIDDEN[i] = ~reinterpret_cast<uintptr_t>(watched);
+        return reinterpret_cast<uintptr_t>(watched);
+    }
+
+
+    /// Store the watched pointer `to` into the first word of the `i`th object
+    /// of `memory`.
+    static void link_object(uint8_t *memory, unsigned i, uintptr_t to) throw() {
+        *reinterpret_cast<uintptr_t *>(memory + i * WP_LEAK_OBJECT_SIZE) = to;
+    }
+
+
+    /// Watch object 3, and hold its only pointer on this thread's stack until
+    /// the test is done.
+    static void *hold_object_on_stack(void *memory) throw() {
+        volatile uintptr_t root(watch_object(
+            reinterpret_cast<uint8_t *>(memory), 3));
+        WP_LEAK_THREAD_READY.store(true);
+        while(!WP_LEAK_THREAD_DONE.load()) {
+            ASM("pause;");
+        }
+        return reinterpret_cast<void *>(root);
+    }
+
+
+    /// Watch objects 0, 1, 2, 4, 5 and 6. Objects 0, 1 and 2 form a chain
+    /// from a global root, object 4 isn't pointed to by anything, and objects
+    /// 5 and 6 only point to each other.
+    static DONT_OPTIMISE void watch_objects(uint8_t *memory) throw() {
+        WP_LEAK_GLOBAL_ROOT = watch_object(memory, 0);
+        link_object(memory, 0, watch_object(memory, 1));
+        link_object(memory, 1, watch_object(memory, 2));
+
+        watch_object(memory, 4);
+
+        const uintptr_t cycle(watch_object(memory, 5));
+        link_object(memory, 5, watch_object(memory, 6));
+        link_object(memory, 6, cycle);
+    }
+
+
+    /// Overwrite the dead part of this thread's stack that `watch_objects`
+    /// might have left watched pointers in.
+    static DONT_OPTIMISE void scrub_stack(void) throw() {
+        volatile uint8_t scrub[4096];
+        for(unsigned i(0); i < sizeof scrub; ++i) {
+            scrub[i] = 0;
+        }
+    }
+
+
+    /// Test that objects reachable from globals, thread stacks and other
+    /// reachable objects are not reported, and that unreachable objects
+    /// (including cycles) are reported.
+    ///
+    /// Note: Tests are run with a stack that is only 8-byte aligned, whereas
+    ///       `pthread_create` (and the leak scanner's use of libc) expects a
+    ///       16-byte aligned stack.
+    __attribute__((force_align_arg_pointer))
+    static void leaked_objects_are_reported(void) {
+        using namespace client::wp;
+
+        uint8_t *memory(reinterpret_cast<uint8_t *>(mmap(
+            nullptr, granary::PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)));
+        ASSERT(MAP_FAILED != memory);
+
+        pthread_t thread;
+        ASSERT(!pthread_create(
+            &thread, nullptr, &hold_object_on_stack, memory));
+        while(!WP_LEAK_THREAD_READY.load()) {
+            ASM("pause;");
+        }
+
+        watch_objects(memory);
+        scrub_stack();
+
+        // Every object is live in the epoch in which it was allocated, and,
+        // as they were all "accessed" by their allocation, in the next epoch.
+        const uint64_t num_leaks(num_reported_leaks());
+        const uint32_t last_epoch(
+            leak_scan_epoch() + WP_LEAK_STALE_EPOCHS + 2);
+        while(leak_scan_epoch() < last_epoch) {
+            scan_for_leaks();
+        }
+
+        for(unsigned i(0); i < 4; ++i) {
+            ASSERT(0 == num_stale_epochs_of(~(WP_LEAK_HIDDEN[i])));
+        }
+        for(unsigned i(4); i < WP_LEAK_NUM_OBJECTS; ++i) {
+            ASSERT(WP_LEAK_STALE_EPOCHS <=
+                num_stale_epochs_of(~(WP_LEAK_HIDDEN[i])));
+        }
+        ASSERT((num_leaks + 3) <= num_reported_leaks());
+
+        WP_LEAK_THREAD_DONE.store(true);
+        void *root(nullptr);
+        ASSERT(!pthread_join(thread, &root));
+        ASSERT(~(WP_LEAK_HIDDEN[3]) == reinterpret_cast<uintptr_t>(root));
+    }
+
+
+    static uint64_t WP_LEAK_ACCESSED_VALUES[2] = {1, 2};
+
+
+    /// Load `*ptr`.
+    static uint64_t load_word(register uint64_t *ptr) throw() {
+        register uint64_t val;
+        ASM(
+            "movq (%1), %0;"
+            : "=r"(val)
+            : "r"(ptr)
+        );
+        return val;
+    }
+
+
+    /// Test that accesses through watched addresses mark their objects as
+    /// accessed.
+    __attribute__((force_align_arg_pointer))
+    static void accesses_mark_objects(void) {
+        using namespace client::wp;
+
+        granary::instrumentation_policy policy =
+            granary::policy_for<client::watchpoint_leak_policy>();
+        granary::basic_block call_load(granary::code_cache::find(
+            (granary::app_pc) load_word, policy));
+
+        uint64_t *watched(&(WP_LEAK_ACCESSED_VALUES[0]));
+        ASSERT(ADDRESS_WATCHED == add_watchpoint(
+            watched, &(WP_LEAK_ACCESSED_VALUES[0]),
+            sizeof WP_LEAK_ACCESSED_VALUES, __builtin_return_address(0)));
+
+        leak_descriptor *desc(descriptor_of(watched));
+        desc->accessed.store(0);
+
+        ASSERT(2 == call_load.call<uint64_t, uint64_t *>(watched + 1));
+        ASSERT(1 == desc->accessed.load());
+    }
+
+
+    ADD_TEST(accesses_mark_objects,
+        "Test that the leak detector marks accessed watched objects.")
+
+
+    ADD_TEST(leaked_objects_are_reported,
+        "Test that the leak detector reports unreachable watched objects, but "
+        "not objects reachable from globals, thread stacks, or other "
+        "reachable objects.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
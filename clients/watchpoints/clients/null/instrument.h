@@ -22,6 +22,10 @@ namespace client {
         null_policy /* name */,
         false /* auto-instrument */)
 
+    ELIDE_REDUNDANT_CHECKS(null_policy)
+
+    COLD_WATCHED_ACCESSES(null_policy)
+
     DECLARE_INSTRUMENTATION_POLICY(
         watchpoint_null_policy,
         null_policy /* app read/write policy */,
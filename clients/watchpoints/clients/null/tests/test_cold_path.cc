@@ -0,0 +1,83 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_cold_path.cc
+ *
+ *  Created on: 2014-02-12
+ *      Author: Peter Goodman
+ */
+
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "clients/watchpoints/clients/null/instrument.h"
+
+namespace test {
+
+    static uint64_t WP_COLD_VALUES[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+
+    static uint64_t load(register uint64_t *ptr) throw() {
+        register uint64_t val;
+        ASM(
+            "movq (%1), %0;"
+            : "=r"(val)
+            : "r"(ptr)
+        );
+        return val;
+    }
+
+
+    static uint64_t sum(register uint64_t *ptr, register uint64_t num) throw() {
+        register uint64_t val;
+        ASM(
+            "xorq %0, %0;"
+        "1:"
+            "addq (%1), %0;"
+            "addq $8, %1;"
+            "decq %2;"
+            "jnz 1b;"
+            : "=&r"(val), "+r"(ptr), "+r"(num)
+        );
+        return val;
+    }
+
+
+    /// Test that the slow paths of watched accesses, which the null policy
+    /// moves out of line, are entered for watched addresses and correctly
+    /// return to the hot code.
+    static void cold_slow_paths_work(void) {
+        uint64_t *unwatched(&(WP_COLD_VALUES[0]));
+        uint64_t *watched(unwatched);
+        client::wp::taint(watched, 1);
+        ASSERT(client::wp::is_watched_address(watched));
+
+        granary::app_pc load_pc((granary::app_pc) load);
+        granary::basic_block call_load(granary::code_cache::find(
+            load_pc, granary::policy_for<client::watchpoint_null_policy>()));
+
+        for(unsigned i(0); i < 8; ++i) {
+            ASSERT((i + 1) == call_load.call<uint64_t, uint64_t *>(
+                unwatched + i));
+            ASSERT((i + 1) == call_load.call<uint64_t, uint64_t *>(
+                watched + i));
+        }
+
+        granary::app_pc sum_pc((granary::app_pc) sum);
+        granary::basic_block call_sum(granary::code_cache::find(
+            sum_pc, granary::policy_for<client::watchpoint_null_policy>()));
+
+        ASSERT(36 == call_sum.call<uint64_t, uint64_t *, uint64_t>(
+            unwatched, 8));
+        ASSERT(36 == call_sum.call<uint64_t, uint64_t *, uint64_t>(
+            watched, 8));
+    }
+
+
+    ADD_TEST(cold_slow_paths_work,
+        "Test that out-of-line watchpoint slow paths are correctly entered "
+        "and exited.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
@@ -0,0 +1,212 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_hoisted_checks.cc
+ *
+ *  Created on: 2014-02-17
+ *      Author: Peter Goodman
+ */
+
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "clients/watchpoints/clients/null/instrument.h"
+
+namespace test {
+
+    static uint64_t WP_HOISTED_VALUES[2] = {1, 2};
+
+
+    /// Sum the two elements of `ptr`, `num` times, within a loop that is a
+    /// single basic block, and where `R10` is a loop-invariant base register.
+    static uint64_t sum_loop(uint64_t *ptr, uint64_t num) throw() {
+        register uint64_t val;
+        ASM(
+            "movq %1, %%r10;"
+            "movq %2, %%rcx;"
+            "xorq %%r11, %%r11;"
+        "1:"
+            "addq (%%r10), %%r11;"
+            "addq 8(%%r10), %%r11;"
+            "decq %%rcx;"
+            "jnz 1b;"
+            "movq %%r11, %0;"
+            : "=r"(val)
+            : "r"(ptr), "r"(num)
+            : "%r10", "%r11", "%rcx"
+        );
+        return val;
+    }
+
+
+    /// Same as `sum_loop`, but where the loop spans several blocks of a trace
+    /// that are connected by JMPs.
+    static uint64_t sum_jmp_loop(uint64_t *ptr, uint64_t num) throw() {
+        register uint64_t val;
+        ASM(
+            "movq %1, %%r10;"
+            "movq %2, %%rcx;"
+            "xorq %%r11, %%r11;"
+            "jmp 1f;"
+        "1:"
+            "addq (%%r10), %%r11;"
+            "addq 8(%%r10), %%r11;"
+            "jmp 2f;"
+        "3:"
+            "movq %%r11, %0;"
+            "jmp 4f;"
+        "2:"
+            "decq %%rcx;"
+            "jnz 1b;"
+            "jmp 3b;"
+        "4:"
+            : "=r"(val)
+            : "r"(ptr), "r"(num)
+            : "%r10", "%r11", "%rcx"
+        );
+        return val;
+    }
+
+
+#if !CONFIG_ENV_KERNEL
+    /// Same as `sum_loop`, but where the redzone is live across the loop.
+    /// Returns the value that was stored into the redzone in `*redzone`.
+    static uint64_t sum_loop_redzone(
+        uint64_t *ptr,
+        uint64_t num,
+        uint64_t *redzone
+    ) throw() {
+        register uint64_t val;
+        register uint64_t redzone_val;
+        ASM(
+            "movq -8(%%rsp), %%rdx;"
+            "movq $42, -8(%%rsp);"
+            "movq %2, %%r10;"
+            "movq %3, %%rcx;"
+            "xorq %%r11, %%r11;"
+        "1:"
+            "addq (%%r10), %%r11;"
+            "addq 8(%%r10), %%r11;"
+            "decq %%rcx;"
+            "jnz 1b;"
+            "movq %%r11, %0;"
+            "movq -8(%%rsp), %1;"
+            "movq %%rdx, -8(%%rsp);"
+            : "=r"(val), "=r"(redzone_val)
+            : "r"(ptr), "r"(num)
+            : "%r10", "%r11", "%rcx", "%rdx"
+        );
+        *redzone = redzone_val;
+        return val;
+    }
+#endif
+
+
+    /// Test that the check of a loop-invariant base register is hoisted out
+    /// of a loop within a basic block, and that the back-edge of the loop
+    /// skips the hoisted check.
+    static void loop_invariant_checks_are_hoisted(void) {
+        granary::app_pc pc((granary::app_pc) sum_loop);
+        granary::instruction_list ls;
+        granary::instruction cbr;
+
+        // Decode from the first definition of `R10` up to the back-edge, and
+        // then add the block's fall-through JMP.
+        for(;;) {
+            granary::instruction in(granary::instruction::decode(&pc));
+            if(ls.length() || dynamorio::instr_writes_to_reg(
+                    in.instr, dynamorio::DR_REG_R10)) {
+                ls.append(in);
+            }
+            if(dynamorio::instr_is_cbr(in.instr)) {
+                cbr = in;
+                break;
+            }
+        }
+        ls.append(granary::jmp_(granary::pc_(pc)));
+
+        const granary::operand head_pc(cbr.cti_target());
+        granary::instruction head;
+        for(head = ls.first(); head.pc() != head_pc.value.pc;) {
+            head = head.next();
+        }
+
+        client::wp::watchpoint_tracker tracker;
+        client::wp::loop_invariant_check_hoister(tracker, ls, false);
+
+        // The back-edge now targets a label between the hoisted check and the
+        // loop head.
+        const granary::operand loop_head(cbr.cti_target());
+        ASSERT(dynamorio::INSTR_kind == loop_head.kind);
+        ASSERT(head.prev().instr == loop_head.value.instr);
+
+        // The hoisted check comes before the loop, and none of the loop's
+        // dereferences of `R10` are checked.
+        bool has_check(false);
+        for(granary::instruction in(ls.first()); in != head; in = in.next()) {
+            has_check = has_check
+                     || dynamorio::OP_prefetcht0 == in.op_code();
+        }
+        ASSERT(has_check);
+
+        for(granary::instruction in(head); in != cbr; in = in.next()) {
+            if(dynamorio::instr_reads_memory(in.instr)) {
+                ASSERT(in.is_mangled());
+            }
+        }
+
+        ls.clear();
+    }
+
+
+    /// Test that hoisted checks of loop-invariant base registers correctly
+    /// access watched memory within the loop.
+    static void hoisted_checks_unwatch_base(void) {
+        granary::instrumentation_policy policy =
+            granary::policy_for<client::watchpoint_null_policy>();
+
+        granary::basic_block call_loop(granary::code_cache::find(
+            (granary::app_pc) sum_loop, policy));
+        granary::basic_block call_jmp_loop(granary::code_cache::find(
+            (granary::app_pc) sum_jmp_loop, policy));
+
+        uint64_t *unwatched(&(WP_HOISTED_VALUES[0]));
+        uint64_t *watched(unwatched);
+        client::wp::taint(watched, 1);
+        ASSERT(client::wp::is_watched_address(watched));
+
+        ASSERT(30 == call_loop.call<uint64_t, uint64_t *, uint64_t>(
+            unwatched, 10));
+        ASSERT(30 == call_loop.call<uint64_t, uint64_t *, uint64_t>(
+            watched, 10));
+
+        ASSERT(30 == call_jmp_loop.call<uint64_t, uint64_t *, uint64_t>(
+            unwatched, 10));
+        ASSERT(30 == call_jmp_loop.call<uint64_t, uint64_t *, uint64_t>(
+            watched, 10));
+
+#if !CONFIG_ENV_KERNEL
+        granary::basic_block call_loop_redzone(granary::code_cache::find(
+            (granary::app_pc) sum_loop_redzone, policy));
+
+        uint64_t redzone(0);
+        ASSERT(30 == call_loop_redzone.call<
+            uint64_t, uint64_t *, uint64_t, uint64_t *>(
+                watched, 10, &redzone));
+        ASSERT(42 == redzone);
+#endif
+    }
+
+
+    ADD_TEST(loop_invariant_checks_are_hoisted,
+        "Test that watchpoint checks of loop-invariant base registers are "
+        "hoisted out of loops.")
+
+
+    ADD_TEST(hoisted_checks_unwatch_base,
+        "Test that accesses with hoisted watchpoint checks correctly access "
+        "watched memory.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
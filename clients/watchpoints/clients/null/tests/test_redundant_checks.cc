@@ -0,0 +1,186 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_redundant_checks.cc
+ *
+ *  Created on: 2014-02-17
+ *      Author: Peter Goodman
+ */
+
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "clients/watchpoints/clients/null/instrument.h"
+
+namespace test {
+
+    static uint64_t WP_REDUNDANT_VALUES[6] = {1, 2, 3, 4, 5, 6};
+
+
+    /// Sum the first three elements of `*ptr_ref` through the same (unchanged)
+    /// base register, and then return the base register in `*ptr_ref`.
+    static uint64_t sum_same_base(uint64_t **ptr_ref) throw() {
+        register uint64_t *ptr(*ptr_ref);
+        register uint64_t val;
+        ASM(
+            "movq %1, %%r10;"
+            "movq (%%r10), %%r11;"
+            "addq 8(%%r10), %%r11;"
+            "addq 16(%%r10), %%r11;"
+            "movq %%r10, %1;"
+            "movq %%r11, %0;"
+            : "=r"(val), "+r"(ptr)
+            :
+            : "%r10", "%r11"
+        );
+        *ptr_ref = ptr;
+        return val;
+    }
+
+
+    /// Sum all six elements of `*ptr_ref`, where the base register is
+    /// redefined between the first three and the last three accesses, and
+    /// then return the base register in `*ptr_ref`.
+    static uint64_t sum_redefined_base(uint64_t **ptr_ref) throw() {
+        register uint64_t *ptr(*ptr_ref);
+        register uint64_t val;
+        ASM(
+            "movq %1, %%r10;"
+            "movq (%%r10), %%r11;"
+            "addq 8(%%r10), %%r11;"
+            "addq 16(%%r10), %%r11;"
+            "addq $24, %%r10;"
+            "addq (%%r10), %%r11;"
+            "addq 8(%%r10), %%r11;"
+            "addq 16(%%r10), %%r11;"
+            "movq %%r10, %1;"
+            "movq %%r11, %0;"
+            : "=r"(val), "+r"(ptr)
+            :
+            : "%r10", "%r11"
+        );
+        *ptr_ref = ptr;
+        return val;
+    }
+
+
+    /// Returns true iff `in` dereferences `R10`.
+    static bool dereferences_r10(granary::instruction in) throw() {
+        const unsigned num_srcs(dynamorio::instr_num_srcs(in.instr));
+        for(unsigned i(0); i < num_srcs; ++i) {
+            const dynamorio::opnd_t op(dynamorio::instr_get_src(in.instr, i));
+            if(dynamorio::BASE_DISP_kind == op.kind
+            && dynamorio::DR_REG_R10 == op.value.base_disp.base_reg) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Decode the function at `pc`, starting at its first definition of `R10`
+    /// (so that the accesses of the compiler-generated code leading up to the
+    /// inline assembly don't form their own sequences), and run the redundant
+    /// check eliminator over it. Records in `elided` whether or not each of
+    /// the (at most `max_derefs`) dereferences of `R10` was elided. Returns
+    /// the number of dereferences of `R10`.
+    static unsigned find_elided_derefs(
+        granary::app_pc pc,
+        bool *elided,
+        unsigned max_derefs
+    ) throw() {
+        granary::instruction_list ls;
+        for(;;) {
+            granary::instruction in(granary::instruction::decode(&pc));
+            if(ls.length() || dynamorio::instr_writes_to_reg(
+                    in.instr, dynamorio::DR_REG_R10)) {
+                ls.append(in);
+            }
+            if(dynamorio::OP_ret == in.op_code()) {
+                break;
+            }
+        }
+
+        client::wp::watchpoint_tracker tracker;
+        client::wp::redundant_check_eliminator(tracker, ls, false);
+
+        unsigned num_derefs(0);
+        for(granary::instruction in(ls.first());
+            in.is_valid();
+            in = in.next()) {
+            if(!in.pc() || !dereferences_r10(in)) {
+                continue;
+            }
+            ASSERT(num_derefs < max_derefs);
+            elided[num_derefs++] = in.is_mangled();
+        }
+
+        ls.clear();
+        return num_derefs;
+    }
+
+
+    /// Test that only the first of a sequence of dereferences through the same
+    /// base register is checked, and that a redefinition of the base register
+    /// ends the sequence.
+    static void redundant_checks_are_elided(void) {
+        bool elided[6] = {false};
+        ASSERT(3 == find_elided_derefs(
+            (granary::app_pc) sum_same_base, elided, 6));
+        ASSERT(!elided[0] && elided[1] && elided[2]);
+
+        ASSERT(6 == find_elided_derefs(
+            (granary::app_pc) sum_redefined_base, elided, 6));
+        ASSERT(!elided[0] && elided[1] && elided[2]);
+        ASSERT(!elided[3] && elided[4] && elided[5]);
+    }
+
+
+    /// Test that dereferences whose checks were elided correctly access
+    /// watched memory, and that the watched base register is restored after
+    /// the elided dereferences.
+    static void elided_checks_unwatch_base(void) {
+        granary::instrumentation_policy policy =
+            granary::policy_for<client::watchpoint_null_policy>();
+
+        granary::basic_block call_same(granary::code_cache::find(
+            (granary::app_pc) sum_same_base, policy));
+        granary::basic_block call_redefined(granary::code_cache::find(
+            (granary::app_pc) sum_redefined_base, policy));
+
+        uint64_t *unwatched(&(WP_REDUNDANT_VALUES[0]));
+        uint64_t *watched(unwatched);
+        client::wp::taint(watched, 1);
+        ASSERT(client::wp::is_watched_address(watched));
+
+        uint64_t *ptr(unwatched);
+        ASSERT(6 == call_same.call<uint64_t, uint64_t **>(&ptr));
+        ASSERT(unwatched == ptr);
+
+        ptr = watched;
+        ASSERT(6 == call_same.call<uint64_t, uint64_t **>(&ptr));
+        ASSERT(watched == ptr);
+
+        ptr = unwatched;
+        ASSERT(21 == call_redefined.call<uint64_t, uint64_t **>(&ptr));
+        ASSERT((unwatched + 3) == ptr);
+
+        ptr = watched;
+        ASSERT(21 == call_redefined.call<uint64_t, uint64_t **>(&ptr));
+        ASSERT((watched + 3) == ptr);
+        ASSERT(client::wp::is_watched_address(ptr));
+    }
+
+
+    ADD_TEST(redundant_checks_are_elided,
+        "Test that redundant watchpoint checks through the same base register "
+        "are elided, but not across a redefinition of the base register.")
+
+
+    ADD_TEST(elided_checks_unwatch_base,
+        "Test that accesses with elided watchpoint checks correctly access "
+        "watched memory.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
@@ -0,0 +1,309 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * instrument.cc
+ *
+ *  Created on: 2014-02-07
+ *      Author: Peter Goodman
+ */
+
+#include "clients/watchpoints/clients/profiler/instrument.h"
+#include "clients/watchpoints/descriptor_allocator.h"
+#include "granary/emit_utils.h"
+
+
+using namespace granary;
+
+
+namespace client {
+
+    namespace wp {
+
+        /// Descriptors of all profiled objects.
+        profile_descriptor DESCRIPTORS[MAX_NUM_WATCHPOINTS];
+
+
+        /// Global pools of free descriptors, one per inherited index.
+        static descriptor_pool<profile_descriptor>
+            POOLS[WP_NUM_INHERITED_INDEXES];
+
+
+        /// All allocation sites.
+        allocation_site SITES[WP_PROFILE_MAX_NUM_SITES];
+
+
+        /// Head of the list of per-CPU counters.
+        std::atomic<cpu_counters *> CPU_COUNTERS = ATOMIC_VAR_INIT(nullptr);
+
+
+        /// Clean-callable version of `record_access`.
+        static app_pc RECORD_ACCESS = nullptr;
+
+
+        inline static uintptr_t index_of(const profile_descriptor *desc) throw() {
+            return desc - &(DESCRIPTORS[0]);
+        }
+
+
+        /// Returns the index of the allocation site identified by
+        /// `return_address`, adding the site if it doesn't exist. If there
+        /// are no more sites then the overflow site is returned.
+        static uint32_t site_index_of(const void *return_address) throw() {
+            enum {
+                MASK = WP_PROFILE_MAX_NUM_SITES - 1
+            };
+
+            const uintptr_t hash(
+                reinterpret_cast<uintptr_t>(return_address) >> 2);
+
+            for(uint32_t i(0); i < WP_PROFILE_MAX_NUM_SITES; ++i) {
+                const uint32_t index((hash + i) & MASK);
+                if(OVERFLOW_SITE_INDEX == index) {
+                    continue;
+                }
+
+                allocation_site &site(SITES[index]);
+                const void *site_address(
+                    site.return_address.load(std::memory_order_acquire));
+
+                if(site_address == return_address) {
+                    return index;
+                }
+
+                if(!site_address) {
+                    if(site.return_address.compare_exchange_strong(
+                        site_address, return_address)
+                    || site_address == return_address) {
+                        return index;
+                    }
+                }
+            }
+
+            return OVERFLOW_SITE_INDEX;
+        }
+
+
+        /// Allocate a watchpoint descriptor and assign `desc` and `index`
+        /// appropriately.
+        bool profile_descriptor::allocate(
+            profile_descriptor *&desc,
+            uintptr_t &counter_index,
+            const uintptr_t inherited_index
+        ) throw() {
+            desc = allocate_descriptor(
+                DESCRIPTORS, POOLS, counter_index, inherited_index);
+            return nullptr != desc;
+        }
+
+
+        /// Initialise a watchpoint descriptor, and attribute the object to
+        /// its allocation site.
+        bool profile_descriptor::allocate_and_init(
+            profile_descriptor *&desc,
+            uintptr_t &counter_index,
+            const uintptr_t inherited_index,
+            void *base_address,
+            size_t size,
+            void *return_address
+        ) throw() {
+
+            if(!size || size > ~uint32_t(0)) {
+                return false;
+            }
+
+#if WP_USE_INHERITED_INDEX
+            // Only the bounds checker duplicates descriptors across inherited
+            // indexes; don't watch objects that span more than one.
+            if(1 < num_inherited_indexes_spanned(
+                reinterpret_cast<uintptr_t>(base_address), size)) {
+                return false;
+            }
+#endif /* WP_USE_INHERITED_INDEX */
+
+            if(!allocate(desc, counter_index, inherited_index)) {
+                return false;
+            }
+
+            ASSERT(is_valid_address(desc));
+
+            const uint32_t site_index(site_index_of(return_address));
+            allocation_site &site(SITES[site_index]);
+            site.num_objects.fetch_add(1, std::memory_order_relaxed);
+            site.num_bytes.fetch_add(size, std::memory_order_relaxed);
+
+            desc->site_index = site_index;
+            desc->size = static_cast<uint32_t>(size);
+            desc->base_address = reinterpret_cast<uintptr_t>(base_address);
+
+            return true;
+        }
+
+
+        /// Get the descriptor of a watchpoint based on its index.
+        profile_descriptor *profile_descriptor::access(
+            uintptr_t index
+        ) throw() {
+            ASSERT(index < MAX_NUM_WATCHPOINTS);
+            return &(DESCRIPTORS[index]);
+        }
+
+
+        /// Free a watchpoint descriptor by adding it to a descriptor cache.
+        void profile_descriptor::free(
+            profile_descriptor *desc,
+            uintptr_t IF_TEST( index )
+        ) throw() {
+
+            ASSERT(is_valid_address(desc));
+            ASSERT(index == index_of(desc));
+
+            free_descriptor(DESCRIPTORS, POOLS, desc);
+        }
+
+
+        /// Returns this CPU's access counters, allocating them if necessary.
+        static cpu_counters *get_cpu_counters(cpu_state_handle state) throw() {
+            cpu_counters *counters(state->counters);
+            if(counters) {
+                return counters;
+            }
+
+            counters = allocate_memory<cpu_counters>();
+            state->counters = counters;
+
+            cpu_counters *head(CPU_COUNTERS.load());
+            do {
+                counters->next = head;
+            } while(!CPU_COUNTERS.compare_exchange_weak(head, counters));
+
+            return counters;
+        }
+
+
+        /// Record a sampled access to the watched address `addr`. The low
+        /// bit of `is_write_and_size` is set iff the access is a write, and
+        /// the remaining bits are the size (in bytes) of the access.
+        static void record_access(
+            uintptr_t addr,
+            uintptr_t is_write_and_size
+        ) throw() {
+            const profile_descriptor *desc(descriptor_of(addr));
+            const uint32_t site_index(desc->site_index);
+
+            IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+            cpu_state_handle state;
+            site_counters &counters(
+                get_cpu_counters(state)->sites[site_index]);
+
+            const uint64_t size(is_write_and_size >> 1);
+            if(1 & is_write_and_size) {
+                counters.num_writes += 1;
+                counters.num_bytes_written += size;
+            } else {
+                counters.num_reads += 1;
+                counters.num_bytes_read += size;
+            }
+            IF_KERNEL( granary_store_flags(flags); )
+        }
+
+
+        /// Add a sampled call to `record_access` for the `i`th watched operand
+        /// of `tracker`. The call is added after the operand's watchpoint
+        /// label, where the operand's register contains the watched address.
+        /// Accesses are counted down using this CPU's (kernel space) or
+        /// thread's (user space) client sampling counter, which starts at
+        /// zero, so the first access on each CPU / thread is sampled.
+        static void add_sampled_access(
+            instruction_list &ls,
+            watchpoint_tracker &tracker,
+            unsigned i,
+            bool is_write
+        ) throw() {
+            const operand addr(register_manager::scale(
+                tracker.regs[i].value.reg, REG_64));
+            const operand countdown(sample_counter_(SAMPLE_COUNTER_CLIENT));
+
+            instruction in(tracker.labels[i]);
+            instruction done(label_());
+
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+            in = ls.insert_after(in, pushf_());
+
+            // Use a signed comparison so that the initial zero countdown is
+            // also sampled.
+            in = ls.insert_after(in, sub_(countdown, int8_(1)));
+            in = ls.insert_after(in, mangled(jnle_(instr_(done))));
+            in = ls.insert_after(in, mov_st_(
+                countdown, int32_(WP_PROFILE_SAMPLE_PERIOD)));
+
+            // The clean call gets its own red zone guard so that the guards
+            // that the watchpoint framework adds around the call's argument
+            // spills (which shift to the nearest preceding `LEA` of `%RSP`)
+            // don't span the above conditional branch.
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+            in = insert_clean_call_after(
+                ls, in, RECORD_ACCESS, addr,
+                static_cast<uintptr_t>((tracker.sizes[i] << 1) | is_write));
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+
+            in = ls.insert_after(in, done);
+            in = ls.insert_after(in, popf_());
+            IF_USER( in = ls.insert_after(in,
+                lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+        }
+
+
+        /// Instrument a memory read.
+        void profile_policy::visit_read(
+            granary::basic_block_state &,
+            instruction_list &ls,
+            watchpoint_tracker &tracker,
+            unsigned i
+        ) throw() {
+            add_sampled_access(ls, tracker, i, false);
+        }
+
+
+        /// Instrument a memory write. Read-modify-write operands are counted
+        /// as both a read and a write.
+        void profile_policy::visit_write(
+            granary::basic_block_state &,
+            instruction_list &ls,
+            watchpoint_tracker &tracker,
+            unsigned i
+        ) throw() {
+            add_sampled_access(ls, tracker, i, true);
+        }
+
+
+#if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
+        interrupt_handled_state profile_policy::handle_interrupt(
+            cpu_state_handle,
+            thread_state_handle,
+            granary::basic_block_state &,
+            interrupt_stack_frame &,
+            interrupt_vector
+        ) throw() {
+            return INTERRUPT_DEFER;
+        }
+#endif /* CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT */
+
+    } /* wp namespace */
+
+
+    /// Initialise the clean-callable target for sampled accesses.
+    void init(void) throw() {
+        cpu_state_handle cpu;
+
+        IF_TEST( cpu->in_granary = false; )
+        cpu.free_transient_allocators();
+        wp::RECORD_ACCESS = generate_clean_callable_address(
+            wp::record_access);
+
+        IF_TEST( cpu->in_granary = false; )
+        cpu.free_transient_allocators();
+    }
+
+} /* client namespace */
@@ -0,0 +1,164 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * instrument.h
+ *
+ *  Created on: 2014-02-07
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_PROFILER_INSTRUMENT_H_
+#define WATCHPOINT_PROFILER_INSTRUMENT_H_
+
+#include <atomic>
+
+#include "clients/watchpoints/instrument.h"
+
+#ifndef GRANARY_INIT_POLICY
+#   define GRANARY_INIT_POLICY (client::watchpoint_profile_policy())
+#endif
+
+
+/// One out of every `WP_PROFILE_SAMPLE_PERIOD` watched accesses is recorded.
+#ifndef WP_PROFILE_SAMPLE_PERIOD
+#   define WP_PROFILE_SAMPLE_PERIOD 64
+#endif
+
+
+/// Number of allocation sites that are profiled separately. Accesses to
+/// objects allocated by any other sites are attributed to the overflow site.
+#ifndef WP_PROFILE_MAX_NUM_SITES
+#   define WP_PROFILE_MAX_NUM_SITES 1024
+#endif
+
+
+namespace client {
+
+    namespace wp {
+
+        enum {
+            /// Index of the site to which objects are attributed when there
+            /// are too many allocation sites.
+            OVERFLOW_SITE_INDEX = 0
+        };
+
+
+        static_assert(0 == (WP_PROFILE_MAX_NUM_SITES
+                          & (WP_PROFILE_MAX_NUM_SITES - 1)),
+            "The maximum number of allocation sites must be a power of two.");
+
+
+        /// An allocation site, identified by the return address of an
+        /// allocation wrapper.
+        struct allocation_site {
+
+            /// Return address of the allocator wrapper, or null if this
+            /// site is unused.
+            std::atomic<const void *> return_address;
+
+            /// Number of objects, and bytes, allocated by this site.
+            std::atomic<uint64_t> num_objects;
+            std::atomic<uint64_t> num_bytes;
+        };
+
+
+        /// Sampled per-CPU access counters of an allocation site.
+        struct site_counters {
+            uint64_t num_reads;
+            uint64_t num_writes;
+            uint64_t num_bytes_read;
+            uint64_t num_bytes_written;
+        };
+
+
+        /// A block of per-CPU counters for all sites. Blocks from all CPUs
+        /// are chained together so that they can be summed when reporting.
+        struct cpu_counters {
+            cpu_counters *next;
+            site_counters sites[WP_PROFILE_MAX_NUM_SITES];
+        };
+
+
+        /// Specifies the allocation site of a watched object.
+        struct profile_descriptor {
+
+            /// Index of this object's allocation site.
+            uint32_t site_index;
+
+            /// Size (in bytes) of the object.
+            uint32_t size;
+
+            /// Base address of the object.
+            union {
+                uintptr_t base_address;
+                profile_descriptor *next_free_descriptor;
+            } __attribute__((packed));
+
+
+            /// Allocate a watchpoint descriptor.
+            static bool allocate(
+                profile_descriptor *&,
+                uintptr_t &,
+                const uintptr_t
+            ) throw();
+
+
+            /// Free a watchpoint descriptor.
+            static void free(profile_descriptor *, uintptr_t) throw();
+
+
+            /// Initialise a watchpoint descriptor.
+            static bool allocate_and_init(
+                profile_descriptor *&,
+                uintptr_t &,
+                const uintptr_t,
+                void *base_address,
+                size_t size,
+                void *return_address
+            ) throw();
+
+
+            /// Notify the profile policy that the descriptor can be assigned
+            /// to the index.
+            static void assign(profile_descriptor *, uintptr_t) throw() { }
+
+
+            /// Get the assigned descriptor for a given index.
+            static profile_descriptor *access(uintptr_t index) throw();
+
+        } __attribute__((packed));
+
+
+        static_assert(16 == sizeof(profile_descriptor),
+            "Profile descriptor type should be 16 bytes.");
+
+
+        /// Specify the descriptor type to the generic watchpoint framework.
+        template <typename>
+        struct descriptor_type {
+            typedef profile_descriptor type;
+            enum {
+                ALLOC_AND_INIT = true,
+                REINIT_WATCHED_POINTERS = false
+            };
+        };
+
+
+#ifdef GRANARY_DONT_INCLUDE_CSTDLIB
+    } /* wp namespace */
+#else
+    } /* wp namespace */
+
+    DECLARE_READ_WRITE_POLICY(
+        profile_policy /* name */,
+        false /* auto-instrument */)
+
+    DECLARE_INSTRUMENTATION_POLICY(
+        watchpoint_profile_policy,
+        profile_policy /* app read/write policy */,
+        profile_policy /* host read/write policy */,
+        { /* override declarations */ })
+
+#endif /* GRANARY_DONT_INCLUDE_CSTDLIB */
+} /* namespace client */
+
+#endif /* WATCHPOINT_PROFILER_INSTRUMENT_H_ */
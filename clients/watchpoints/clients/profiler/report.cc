@@ -0,0 +1,106 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * report.cc
+ *
+ *  Created on: 2014-02-07
+ *      Author: Peter Goodman
+ */
+
+#include "clients/watchpoints/clients/profiler/instrument.h"
+
+
+using namespace granary;
+
+
+namespace client {
+
+    namespace wp {
+        extern allocation_site SITES[WP_PROFILE_MAX_NUM_SITES];
+        extern std::atomic<cpu_counters *> CPU_COUNTERS;
+    }
+
+
+    enum {
+        /// Number of the hottest allocation sites to report.
+        NUM_HOT_SITES = 16
+    };
+
+
+    /// Sampled access counts of every site, summed over all CPUs.
+    static wp::site_counters TOTALS[WP_PROFILE_MAX_NUM_SITES];
+
+
+    /// Returns the total number of sampled accesses of a site.
+    inline static uint64_t num_accesses(unsigned site_index) throw() {
+        return TOTALS[site_index].num_reads + TOTALS[site_index].num_writes;
+    }
+
+
+    /// Report the hottest allocation sites, along with their access densities
+    /// (sampled accesses per allocated kilobyte) and read ratios.
+    void report(void) throw() {
+
+        wp::cpu_counters *counters(wp::CPU_COUNTERS.load());
+        for(; counters; counters = counters->next) {
+            for(unsigned i(0); i < WP_PROFILE_MAX_NUM_SITES; ++i) {
+                TOTALS[i].num_reads += counters->sites[i].num_reads;
+                TOTALS[i].num_writes += counters->sites[i].num_writes;
+                TOTALS[i].num_bytes_read += counters->sites[i].num_bytes_read;
+                TOTALS[i].num_bytes_written += \
+                    counters->sites[i].num_bytes_written;
+            }
+        }
+
+        // Selection sort the hottest sites, ignoring any site that was never
+        // sampled.
+        unsigned hot_sites[NUM_HOT_SITES];
+        unsigned num_hot_sites(0);
+        for(; num_hot_sites < NUM_HOT_SITES; ++num_hot_sites) {
+            unsigned hottest(WP_PROFILE_MAX_NUM_SITES);
+            for(unsigned i(0); i < WP_PROFILE_MAX_NUM_SITES; ++i) {
+                bool already_reported(false);
+                for(unsigned j(0); j < num_hot_sites; ++j) {
+                    already_reported = already_reported || i == hot_sites[j];
+                }
+
+                if(!already_reported && num_accesses(i)
+                && (WP_PROFILE_MAX_NUM_SITES == hottest
+                    || num_accesses(i) > num_accesses(hottest))) {
+                    hottest = i;
+                }
+            }
+
+            if(WP_PROFILE_MAX_NUM_SITES == hottest) {
+                break;
+            }
+            hot_sites[num_hot_sites] = hottest;
+        }
+
+        printf("\nWatchpoint Profile (1 in %u accesses sampled)\n",
+            WP_PROFILE_SAMPLE_PERIOD);
+
+        for(unsigned i(0); i < num_hot_sites; ++i) {
+            const unsigned index(hot_sites[i]);
+            const wp::allocation_site &site(wp::SITES[index]);
+            const wp::site_counters &totals(TOTALS[index]);
+            const uint64_t num_bytes(site.num_bytes.load());
+            const uint64_t num_kbytes((num_bytes + 1023) / 1024);
+
+            const uint64_t num_bytes_accessed(
+                totals.num_bytes_read + totals.num_bytes_written);
+
+            printf("Site %p: %lu objects, %lu bytes, %lu sampled reads, "
+                   "%lu sampled writes, %lu%% reads, "
+                   "%lu sampled accesses per KB, "
+                   "%lu bytes per sampled access\n",
+                site.return_address.load(),
+                site.num_objects.load(),
+                num_bytes,
+                totals.num_reads,
+                totals.num_writes,
+                (100 * totals.num_reads) / num_accesses(index),
+                num_kbytes ? (num_accesses(index) / num_kbytes) : 0UL,
+                num_bytes_accessed / num_accesses(index));
+        }
+    }
+}
@@ -0,0 +1,37 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * state.h
+ *
+ *  Created on: 2014-02-07
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_PROFILER_STATE_H_
+#define WATCHPOINT_PROFILER_STATE_H_
+
+#include "clients/watchpoints/descriptor_cache.h"
+
+namespace client {
+
+    namespace wp {
+        struct profile_descriptor;
+        struct cpu_counters;
+    }
+
+
+#define CLIENT_cpu_state
+    struct cpu_state {
+
+        /// Caches of free profile descriptors for this CPU, one per inherited
+        /// index.
+        wp::descriptor_cache<wp::profile_descriptor>
+            free_list[WP_NUM_INHERITED_INDEXES];
+
+        /// This CPU's sampled access counters for every allocation site.
+        /// These are lazily allocated on the first sampled access.
+        wp::cpu_counters *counters;
+    };
+
+}
+
+#endif /* WATCHPOINT_PROFILER_STATE_H_ */
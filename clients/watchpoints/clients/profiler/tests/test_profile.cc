@@ -0,0 +1,127 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_profile.cc
+ *
+ *  Created on: 2014-02-14
+ *      Author: Peter Goodman
+ */
+
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "clients/watchpoints/clients/profiler/instrument.h"
+
+namespace client { namespace wp {
+    extern allocation_site SITES[WP_PROFILE_MAX_NUM_SITES];
+    extern std::atomic<cpu_counters *> CPU_COUNTERS;
+}}
+
+namespace test {
+
+    static uint64_t WP_PROFILE_VALUES[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+
+    static uint64_t load(register uint64_t *ptr) throw() {
+        register uint64_t val;
+        ASM(
+            "movq (%1), %0;"
+            : "=r"(val)
+            : "r"(ptr)
+        );
+        return val;
+    }
+
+
+    static void store(register uint64_t *ptr, register uint32_t val) throw() {
+        ASM(
+            "movl %1, (%0);"
+            :
+            : "r"(ptr), "r"(val)
+            : "memory"
+        );
+    }
+
+
+    /// Sum the sampled access counters of the site that allocated the object
+    /// identified by `return_address` over all CPUs.
+    static client::wp::site_counters sampled_counters_of(
+        const void *return_address
+    ) throw() {
+        client::wp::site_counters totals;
+        memset(&totals, 0, sizeof totals);
+
+        unsigned site_index(0);
+        for(; site_index < WP_PROFILE_MAX_NUM_SITES; ++site_index) {
+            if(return_address ==
+               client::wp::SITES[site_index].return_address.load()) {
+                break;
+            }
+        }
+        ASSERT(site_index < WP_PROFILE_MAX_NUM_SITES);
+
+        client::wp::cpu_counters *counters(client::wp::CPU_COUNTERS.load());
+        for(; counters; counters = counters->next) {
+            const client::wp::site_counters &site(counters->sites[site_index]);
+            totals.num_reads += site.num_reads;
+            totals.num_writes += site.num_writes;
+            totals.num_bytes_read += site.num_bytes_read;
+            totals.num_bytes_written += site.num_bytes_written;
+        }
+        return totals;
+    }
+
+
+    /// Test that sampled reads and writes of a watched object are attributed
+    /// to the object's allocation site, along with the sizes of the accesses.
+    static void sampled_accesses_are_counted(void) {
+        enum {
+            NUM_ACCESSES = 4 * WP_PROFILE_SAMPLE_PERIOD
+        };
+
+        const void *site(reinterpret_cast<const void *>(load));
+        uint64_t *watched(&(WP_PROFILE_VALUES[0]));
+        ASSERT(client::wp::ADDRESS_WATCHED == client::wp::add_watchpoint(
+            watched, &(WP_PROFILE_VALUES[0]), sizeof WP_PROFILE_VALUES,
+            const_cast<void *>(site)));
+
+        granary::instrumentation_policy policy =
+            granary::policy_for<client::watchpoint_profile_policy>();
+
+        granary::app_pc load_pc((granary::app_pc) load);
+        granary::basic_block call_load(
+            granary::code_cache::find(load_pc, policy));
+
+        for(unsigned i(0); i < NUM_ACCESSES; ++i) {
+            ASSERT(1 == call_load.call<uint64_t, uint64_t *>(watched));
+        }
+
+        client::wp::site_counters counters(sampled_counters_of(site));
+        ASSERT(4 <= counters.num_reads);
+        ASSERT(5 >= counters.num_reads);
+        ASSERT(8 * counters.num_reads == counters.num_bytes_read);
+        ASSERT(0 == counters.num_writes);
+
+        granary::app_pc store_pc((granary::app_pc) store);
+        granary::basic_block call_store(
+            granary::code_cache::find(store_pc, policy));
+
+        for(unsigned i(0); i < NUM_ACCESSES; ++i) {
+            call_store.call<void, uint64_t *, uint32_t>(watched + 1, i);
+        }
+        ASSERT((NUM_ACCESSES - 1) == WP_PROFILE_VALUES[1]);
+
+        counters = sampled_counters_of(site);
+        ASSERT(4 <= counters.num_writes);
+        ASSERT(5 >= counters.num_writes);
+        ASSERT(4 * counters.num_writes == counters.num_bytes_written);
+    }
+
+
+    ADD_TEST(sampled_accesses_are_counted,
+        "Test that sampled watched accesses are attributed to allocation "
+        "sites along with their sizes.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
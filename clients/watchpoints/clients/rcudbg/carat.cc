@@ -13,12 +13,6 @@
 namespace client {
 
 
-    enum {
-        MAX_NUM_LOCATION_IDS = 1ULL << 14,
-        MAX_NUM_SECTION_IDS = MAX_NUM_LOCATION_IDS
-    };
-
-
     static std::atomic<unsigned> NEXT_SECTION_ID = ATOMIC_VAR_INIT(1);
 
 
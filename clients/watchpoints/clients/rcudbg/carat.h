@@ -11,6 +11,12 @@
 
 namespace client {
 
+    enum {
+        MAX_NUM_LOCATION_IDS = 1ULL << 14,
+        MAX_NUM_SECTION_IDS = MAX_NUM_LOCATION_IDS
+    };
+
+
     /// Returns a unique ID for a string carat location. This unique ID will fit
     /// into 14 bits, and so it's suitable for use in watched addresses.
     unsigned get_location_id(const char *assign_carat_) throw();
@@ -9,7 +9,11 @@
 #include <atomic>
 
 #include "granary/client.h"
+#include "granary/allocator.h"
+#include "granary/spin_lock.h"
+#include "granary/state.h"
 
+#include "clients/watchpoints/clients/rcudbg/carat.h"
 #include "clients/watchpoints/clients/rcudbg/log.h"
 
 
@@ -27,9 +31,41 @@ using namespace granary;
 namespace client {
 
 
-    message_container MESSAGES[MAX_NUM_MESSAGES] = {{
-        ATOMIC_VAR_INIT(MESSAGE_NOT_READY), 0, {0, 0, 0, 0}
-    }};
+    static_assert(0 == (MAX_NUM_MESSAGES & (MAX_NUM_MESSAGES - 1)),
+        "The number of messages in a message log must be a power of two.");
+
+
+    /// A CPU-private ring buffer of messages. Only the owning CPU reserves
+    /// and commits messages, and it does so with interrupts disabled. Any CPU
+    /// can drain the committed messages.
+    ///
+    /// A message is reserved by advancing `tail`, and is committed by storing
+    /// its message id. Messages are drained in order, and draining stops at
+    /// the first reserved but uncommitted message.
+    struct message_log {
+
+        /// Index of the oldest undrained message.
+        std::atomic<uint64_t> head;
+
+        /// Index of the next message to reserve.
+        std::atomic<uint64_t> tail;
+
+        /// Number of messages that were overwritten or dropped.
+        std::atomic<uint64_t> num_lost_messages;
+
+        /// Next message log in the list of all message logs.
+        message_log *next;
+
+        message_container messages[MAX_NUM_MESSAGES];
+    };
+
+
+    /// List of all message logs.
+    static std::atomic<message_log *> MESSAGE_LOGS = ATOMIC_VAR_INIT(nullptr);
+
+
+    /// Serializes draining of the message logs.
+    static atomic_spin_lock DRAIN_LOCK;
 
 
     /// A generic printer function that operates on an untypes message
@@ -51,10 +87,6 @@ namespace client {
     );
 
 
-    /// Next offset into the log to which we can write.
-    std::atomic<uint64_t> NEXT_LOG_OFFSET = ATOMIC_VAR_INIT(0);
-
-
     /// Puts all the static info of each message into a common place.
     const message_info MESSAGE_INFO[] = {
         {INFO, ""},
@@ -190,62 +222,464 @@ namespace client {
     char BUFFER[BUFFER_SIZE] = {'\0'};
 
 
-    /// Log the reports.
-    void report(void) {
-        detach();
+    /// Kinds of records in a binary log. A binary log starts with a
+    /// `binary_log_header`, and is followed by a sequence of records, each of
+    /// which starts with its kind.
+    enum binary_record_kind : uint32_t {
+        RECORD_FORMAT = 1,
+        RECORD_STRING = 2,
+        RECORD_MESSAGE = 3,
+        RECORD_LOST_MESSAGES = 4
+    };
 
-        message_container cont;
-        int b(0);
-        unsigned num_messages(NEXT_LOG_OFFSET.load());
-        if(MAX_NUM_MESSAGES > num_messages) {
-            num_messages = MAX_NUM_MESSAGES;
+
+    enum : uint32_t {
+        BINARY_LOG_MAGIC = 0x47444352U, // "RCDG" in little endian.
+        BINARY_LOG_VERSION = 1,
+
+        /// Strings longer than this are truncated in binary logs.
+        MAX_BINARY_STRING_LENGTH = PAGE_SIZE / 8,
+
+        /// Number of strings whose addresses are remembered as having already
+        /// been written to the binary log.
+        MAX_NUM_WRITTEN_STRINGS = MAX_NUM_LOCATION_IDS * 2
+    };
+
+
+    struct binary_log_header {
+        uint32_t magic;
+        uint32_t version;
+    } __attribute__((packed));
+
+
+    /// The format of a message. This is followed by `length` bytes of the
+    /// format string. The `i`th conversion of the format string prints the
+    /// message's `arg_order[i]`th payload.
+    struct binary_format_record {
+        binary_record_kind kind;
+        uint32_t message_id;
+        uint32_t level;
+        uint32_t num_args;
+        uint8_t arg_order[4];
+        uint32_t length;
+    } __attribute__((packed));
+
+
+    /// A string (e.g. a carat) that is referenced by address in message
+    /// payloads. This is followed by `length` bytes of the string.
+    struct binary_string_record {
+        binary_record_kind kind;
+        uint32_t length;
+        uint64_t address;
+    } __attribute__((packed));
+
+
+    /// A logged message.
+    struct binary_message_record {
+        binary_record_kind kind;
+        uint32_t message_id;
+        uint64_t payload[4];
+    } __attribute__((packed));
+
+
+    /// The number of messages that were lost.
+    struct binary_lost_messages_record {
+        binary_record_kind kind;
+        uint32_t padding;
+        uint64_t num_lost_messages;
+    } __attribute__((packed));
+
+
+    /// Record the order in which a message's printer passes its arguments to
+    /// `sprintf`.
+    template <typename... Args>
+    static void arg_order(uint8_t *order, Args... args) throw() {
+        const uint64_t indexes[] = {unsafe_cast<uint64_t>(args)...};
+        for(unsigned i(0); i < sizeof...(Args); ++i) {
+            order[i] = static_cast<uint8_t>(indexes[i]);
+        }
+    }
+
+
+    /// Define functions that get the argument order of each message. These
+    /// are invoked with each argument being its own index.
+#define RCUDBG_MESSAGE(ident, kind, message, arg_defs, arg_splat) \
+    static void CAT(ORDER_, ident) ( \
+        uint8_t *order, \
+        SPLAT arg_defs \
+    ) throw() { \
+        arg_order(order, SPLAT arg_splat ); \
+    }
+#include "clients/watchpoints/clients/rcudbg/message.h"
+#undef RCUDBG_MESSAGE
+
+
+    typedef void (order_func)(
+        uint8_t *, uint64_t, uint64_t, uint64_t, uint64_t);
+
+
+    /// Define an array of argument order functions for the various log
+    /// messages.
+    static int_func *MESSAGE_ORDERS[] = {
+        nullptr,
+#define RCUDBG_MESSAGE(ident, kind, message, arg_defs, arg_splat) \
+    (int_func *) & CAT(ORDER_, ident) ,
+#include "clients/watchpoints/clients/rcudbg/message.h"
+#undef RCUDBG_MESSAGE
+        nullptr
+    };
+
+
+    /// Bit masks of which payloads of each message are strings, and so must
+    /// be written to the binary log as string records.
+    static unsigned STRING_PAYLOADS[MAX_MESSAGE_ID] = {0};
+
+
+    /// Addresses of strings that have already been written to the binary log.
+    static const char *WRITTEN_STRINGS[MAX_NUM_WRITTEN_STRINGS] = {nullptr};
+
+
+    /// Has the one-time header of the binary log been written?
+    static bool WROTE_BINARY_HEADER(false);
+
+
+    /// Add some binary data to the drain buffer, flushing the buffer through
+    /// `granary::log` if it is almost full.
+    static void drain_binary(const void *data, unsigned size, int &b) throw() {
+        if(b >= BUFFER_FLUSH_SIZE) {
+            granary::log(&(BUFFER[0]), b);
+            b = 0;
+        }
+
+        memcpy(&(BUFFER[b]), data, size);
+        b += static_cast<int>(size);
+    }
+
+
+    /// Add a string to the binary log, unless it's already been added.
+    static void drain_binary_string(const char *str, int &b) throw() {
+        if(!str) {
+            return;
+        }
+
+        // Check if the string was already written. If the table of written
+        // strings is full then the string is written again.
+        const uintptr_t hash(reinterpret_cast<uintptr_t>(str) >> 3);
+        for(unsigned i(0); i < MAX_NUM_WRITTEN_STRINGS; ++i) {
+            const char *&written(
+                WRITTEN_STRINGS[(hash + i) % MAX_NUM_WRITTEN_STRINGS]);
+            if(written == str) {
+                return;
+            } else if(!written) {
+                written = str;
+                break;
+            }
+        }
+
+        uint32_t length(0);
+        for(; str[length] && length < MAX_BINARY_STRING_LENGTH; ++length) { }
+
+        binary_string_record record = {
+            RECORD_STRING, length, reinterpret_cast<uint64_t>(str)};
+        drain_binary(&record, sizeof record, b);
+        drain_binary(str, length, b);
+    }
+
+
+    /// Add the one-time header of the binary log: the message formats, and
+    /// the known location carats.
+    static void drain_binary_header(int &b) throw() {
+        binary_log_header header = {BINARY_LOG_MAGIC, BINARY_LOG_VERSION};
+        drain_binary(&header, sizeof header, b);
+
+        for(unsigned id(MESSAGE_NOT_READY + 1); id < MAX_MESSAGE_ID; ++id) {
+            binary_format_record record;
+            record.kind = RECORD_FORMAT;
+            record.message_id = id;
+            record.level = MESSAGE_INFO[id].level;
+            record.arg_order[0] = record.arg_order[1] = 0xFF;
+            record.arg_order[2] = record.arg_order[3] = 0xFF;
+
+            // Get the argument order by passing each argument its own index.
+            ((order_func *) MESSAGE_ORDERS[id])(&(record.arg_order[0]),
+                                                0, 1, 2, 3);
+
+            // Find which arguments are strings.
+            const char *format(MESSAGE_INFO[id].format);
+            record.num_args = 0;
+            record.length = 0;
+            for(; format[record.length]; ++record.length) {
+                if('%' != format[record.length]) {
+                    continue;
+                }
+                ++record.length;
+                if('%' == format[record.length]) {
+                    continue;
+                } else if(!format[record.length]) {
+                    break;
+                }
+                if('s' == format[record.length]) {
+                    STRING_PAYLOADS[id] |= 1U << record.arg_order[
+                        record.num_args];
+                }
+                ++record.num_args;
+            }
+
+            drain_binary(&record, sizeof record, b);
+            drain_binary(format, record.length, b);
+        }
+
+        for(unsigned i(0); i < MAX_NUM_LOCATION_IDS; ++i) {
+            const char *carat(get_location_carat(i));
+            if(reinterpret_cast<const char *>(~0ULL) != carat) {
+                drain_binary_string(carat, b);
+            }
+        }
+    }
+
+
+    /// Add the one-time header of the binary log if it hasn't been added.
+    static void drain_binary_header_once(int &b) throw() {
+        if(!WROTE_BINARY_HEADER) {
+            WROTE_BINARY_HEADER = true;
+            drain_binary_header(b);
+        }
+    }
+
+
+    /// Add a message to the binary log, along with any strings that it
+    /// references that haven't yet been added.
+    static void drain_binary_message(
+        const message_container &cont,
+        log_message_id id,
+        int &b
+    ) throw() {
+        drain_binary_header_once(b);
+
+        for(unsigned i(0); i < cont.num_args; ++i) {
+            if(STRING_PAYLOADS[id] & (1U << i)) {
+                drain_binary_string(
+                    unsafe_cast<const char *>(cont.payload[i]), b);
+            }
+        }
+
+        binary_message_record record;
+        record.kind = RECORD_MESSAGE;
+        record.message_id = id;
+        memcpy(&(record.payload[0]), &(cont.payload[0]), sizeof cont.payload);
+        drain_binary(&record, sizeof record, b);
+    }
+
+
+    /// Format a message into the drain buffer, flushing the buffer through
+    /// `granary::log` if it is almost full.
+    static void drain_message(const message_container &cont, int &b) throw() {
+        const log_message_id id(
+            cont.message_id.load(std::memory_order_relaxed));
+
+        // Invalid message id.
+        if(MESSAGE_NOT_READY >= id || MAX_MESSAGE_ID <= id) {
+            return;
+        }
+
+        if(LOG_BINARY == LOG_FORMAT) {
+            drain_binary_message(cont, id, b);
+            return;
+        }
+
+        if(b >= BUFFER_FLUSH_SIZE) {
+            granary::log(&(BUFFER[0]), b);
+            b = 0;
         }
 
-        for(unsigned i(0); i < num_messages; ++i) {
-            const message_container &cont_(MESSAGES[i]);
-            if(MESSAGE_NOT_READY == cont_.message_id.load()) {
-                continue;
+        b += VARIADIC_PRINTERS[cont.num_args](
+            &(BUFFER[b]),
+            &cont,
+            MESSAGE_PRINTERS[id]);
+    }
+
+
+    /// Drain all committed messages of a message log.
+    ///
+    /// Note: `DRAIN_LOCK` must be held.
+    static void drain_log(message_log *ml, int &b) throw() {
+        message_container cont;
+
+        for(;;) {
+            uint64_t head(ml->head.load(std::memory_order_acquire));
+            if(head >= ml->tail.load(std::memory_order_acquire)) {
+                break;
             }
 
-            // Get a consistent view of the data structure.
-            log_message_id id(MESSAGE_NOT_READY);
-            log_message_id id_check(MESSAGE_NOT_READY);
-            do {
-                id = cont_.message_id.load();
-                memcpy(&cont, &cont_, sizeof cont);
-                id_check = cont.message_id.load(std::memory_order_relaxed);
-            } while(id_check != id && MESSAGE_NOT_READY != id_check);
-
-            // Invalid message id.
-            if(MESSAGE_NOT_READY >= id && MAX_MESSAGE_ID <= id) {
-                continue;
+            const message_container &cont_(
+                ml->messages[head & (MAX_NUM_MESSAGES - 1)]);
+            if(MESSAGE_NOT_READY == cont_.message_id.load(
+                std::memory_order_acquire)) {
+                break;
             }
 
-            if(b >= BUFFER_FLUSH_SIZE) {
-                granary::log(&(BUFFER[0]), b);
-                b = 0;
+            memcpy(&cont, &cont_, sizeof cont);
+
+            // If the head moved then the owning CPU overwrote this message
+            // while we were copying it.
+            if(ml->head.compare_exchange_strong(head, head + 1)) {
+                drain_message(cont, b);
             }
+        }
+    }
 
-            b += VARIADIC_PRINTERS[cont.num_args](
-                &(BUFFER[b]),
-                &cont,
-                MESSAGE_PRINTERS[id]);
+
+    /// Drain all committed messages of all message logs.
+    ///
+    /// Note: `DRAIN_LOCK` must be held.
+    static void drain_all_logs(void) throw() {
+        int b(0);
+        message_log *ml(MESSAGE_LOGS.load(std::memory_order_acquire));
+        for(; ml; ml = ml->next) {
+            drain_log(ml, b);
         }
 
         if(b) {
             granary::log(&(BUFFER[0]), b);
         }
+    }
 
-        NEXT_LOG_OFFSET.store(0);
+
+    /// Stream all committed messages of all CPUs out through `granary::log`.
+    ///
+    /// Note: Interrupts are disabled while draining so that a `log` from an
+    ///       interrupt on this CPU can't wait on this CPU's drain.
+    void drain_logs(void) throw() {
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        DRAIN_LOCK.acquire();
+        drain_all_logs();
+        DRAIN_LOCK.release();
+        IF_KERNEL( granary_store_flags(flags); )
     }
 
 
-    bool log_entry_is(unsigned offset, const log_message_id expect_id) throw() {
-        if(offset >= MAX_NUM_MESSAGES) {
-            return false;
+    /// Allocate a message log and add it to the list of all message logs.
+    static message_log *allocate_message_log(void) throw() {
+        message_log *ml(allocate_memory<message_log>());
+        message_log *next(MESSAGE_LOGS.load(std::memory_order_relaxed));
+        do {
+            ml->next = next;
+        } while(!MESSAGE_LOGS.compare_exchange_weak(next, ml));
+        return ml;
+    }
+
+
+    /// Reserve space for a new message in the current CPU's message log.
+    message_container *reserve_message(
+        IF_KERNEL( eflags &flags )
+    ) throw() {
+        IF_KERNEL( flags = granary_disable_interrupts(); )
+
+        cpu_state_handle cpu;
+        message_log *ml(cpu->messages);
+        if(!ml) {
+            ml = cpu->messages = allocate_message_log();
+        }
+
+        const uint64_t tail(ml->tail.load(std::memory_order_relaxed));
+        uint64_t head(ml->head.load(std::memory_order_acquire));
+
+        // The log is full.
+        if(MAX_NUM_MESSAGES <= (tail - head)) {
+            if(LOG_BACKPRESSURE == LOG_OVERFLOW_MODE) {
+                drain_logs();
+
+            // Overwrite the oldest message, unless it's being drained right
+            // now, in which case the head will have moved anyway.
+            } else if(ml->head.compare_exchange_strong(head, head + 1)) {
+                ml->num_lost_messages.fetch_add(1);
+            }
+
+            // Nothing could be drained, so drop the new message rather than
+            // overwrite one that hasn't been drained.
+            if(MAX_NUM_MESSAGES <= (tail - ml->head.load())) {
+                ml->num_lost_messages.fetch_add(1);
+                IF_KERNEL( granary_store_flags(flags); )
+                return nullptr;
+            }
         }
 
-        message_container &cont(MESSAGES[offset]);
-        return expect_id == cont.message_id.load();
+        message_container *cont(&(ml->messages[tail & (MAX_NUM_MESSAGES - 1)]));
+        cont->message_id.store(MESSAGE_NOT_READY, std::memory_order_relaxed);
+        ml->tail.store(tail + 1, std::memory_order_release);
+        return cont;
+    }
+
+
+    /// Log the reports.
+    void report(void) {
+        detach();
+
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        DRAIN_LOCK.acquire();
+        drain_all_logs();
+
+        uint64_t num_lost_messages(0);
+        message_log *ml(MESSAGE_LOGS.load(std::memory_order_acquire));
+        for(; ml; ml = ml->next) {
+            num_lost_messages += ml->num_lost_messages.exchange(0);
+        }
+
+        if(num_lost_messages && LOG_BINARY == LOG_FORMAT) {
+            binary_lost_messages_record record = {
+                RECORD_LOST_MESSAGES, 0, num_lost_messages};
+            int b(0);
+            drain_binary_header_once(b);
+            drain_binary(&record, sizeof record, b);
+            granary::log(&(BUFFER[0]), b);
+
+        } else if(num_lost_messages) {
+            const int b(sprintf(
+                &(BUFFER[0]), "Warning: %lu messages were lost.\n\n",
+                num_lost_messages));
+            granary::log(&(BUFFER[0]), b);
+        }
+
+        DRAIN_LOCK.release();
+        IF_KERNEL( granary_store_flags(flags); )
+    }
+
+
+    /// Used for testing. Discards all undrained messages.
+    void clear_log(void) throw() {
+        message_log *ml(MESSAGE_LOGS.load(std::memory_order_acquire));
+        for(; ml; ml = ml->next) {
+            ml->head.store(ml->tail.load());
+        }
+    }
+
+
+    /// Used for testing. Returns the number of undrained messages.
+    uint64_t log_size(void) throw() {
+        uint64_t size(0);
+        message_log *ml(MESSAGE_LOGS.load(std::memory_order_acquire));
+        for(; ml; ml = ml->next) {
+            size += ml->tail.load() - ml->head.load();
+        }
+        return size;
+    }
+
+
+    /// Used for testing. Returns true iff the undrained log entry at offset
+    /// `offset` has the expected log message identifier, `expect_id`. The
+    /// undrained entries of all message logs are treated as one log.
+    bool log_entry_is(unsigned offset, const log_message_id expect_id) throw() {
+        message_log *ml(MESSAGE_LOGS.load(std::memory_order_acquire));
+        for(; ml; ml = ml->next) {
+            const uint64_t head(ml->head.load());
+            const uint64_t size(ml->tail.load() - head);
+            if(offset < size) {
+                const message_container &cont(
+                    ml->messages[(head + offset) & (MAX_NUM_MESSAGES - 1)]);
+                return expect_id == cont.message_id.load();
+            }
+            offset -= static_cast<unsigned>(size);
+        }
+        return false;
     }
 }
@@ -48,19 +48,67 @@ namespace client {
     extern const message_info MESSAGE_INFO[];
 
 
-    /// Next offset into the log to which we can write.
-    extern std::atomic<uint64_t> NEXT_LOG_OFFSET;
+    /// Policies for handling a full message log.
+    enum log_overflow_mode {
 
+        /// Overwrite the oldest undrained message.
+        LOG_OVERWRITE,
 
-    /// Ring buffer for messages.
-    extern message_container MESSAGES[];
+        /// Drain the full log before adding the new message. This is lossless,
+        /// but the logging CPU might wait on the drain.
+        LOG_BACKPRESSURE
+    };
+
+
+    /// What to do when a CPU's message log is full.
+    static const log_overflow_mode LOG_OVERFLOW_MODE = LOG_BACKPRESSURE;
+
+
+    /// Formats of the drained log.
+    enum log_format {
+
+        /// Messages are formatted into text as they are drained.
+        LOG_TEXT,
+
+        /// Messages are drained as binary records, along with a one-time
+        /// table of message formats and carats. Binary logs are formatted
+        /// offline by `scripts/decode_rcudbg_log.py`.
+        LOG_BINARY
+    };
+
+
+    /// Format of the drained log.
+    static const log_format LOG_FORMAT = LOG_TEXT;
 
 
     enum {
+        /// Number of messages in each CPU's message log. This must be a power
+        /// of two.
         MAX_NUM_MESSAGES = 4096
     };
 
 
+    /// Reserve space for a new message in the current CPU's message log.
+    /// Interrupts are disabled until the message is committed with
+    /// `commit_message`. Returns `nullptr` (with interrupts restored) if the
+    /// message can't be logged.
+    message_container *reserve_message(
+        IF_KERNEL( granary::eflags &flags )
+    ) throw();
+
+
+    /// Commit a message that was reserved with `reserve_message`, making it
+    /// visible to the drain.
+    inline void commit_message(
+        message_container *cont,
+        log_message_id id
+        _IF_KERNEL( granary::eflags flags )
+    ) throw() {
+        cont->message_id.store(id, std::memory_order_release);
+        IF_KERNEL( granary_store_flags(flags); )
+    }
+
+
     template <typename A0>
     void log(log_message_id id, A0 a0) throw() {
 
@@ -68,17 +116,15 @@ namespace client {
             return;
         }
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
-
-        if(index >= MAX_NUM_MESSAGES) {
+        IF_KERNEL( granary::eflags flags; )
+        message_container *cont(reserve_message(IF_KERNEL(flags)));
+        if(!cont) {
             return;
         }
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 1;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.message_id.store(id);
+        cont->num_args = 1;
+        cont->payload[0] = granary::unsafe_cast<uint64_t>(a0);
+        commit_message(cont, id _IF_KERNEL(flags));
     }
 
 
@@ -89,18 +135,16 @@ namespace client {
             return;
         }
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
-
-        if(index >= MAX_NUM_MESSAGES) {
+        IF_KERNEL( granary::eflags flags; )
+        message_container *cont(reserve_message(IF_KERNEL(flags)));
+        if(!cont) {
             return;
         }
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 2;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.payload[1] = granary::unsafe_cast<uint64_t>(a1);
-        cont.message_id.store(id);
+        cont->num_args = 2;
+        cont->payload[0] = granary::unsafe_cast<uint64_t>(a0);
+        cont->payload[1] = granary::unsafe_cast<uint64_t>(a1);
+        commit_message(cont, id _IF_KERNEL(flags));
     }
 
 
@@ -111,19 +155,17 @@ namespace client {
             return;
         }
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
-
-        if(index >= MAX_NUM_MESSAGES) {
+        IF_KERNEL( granary::eflags flags; )
+        message_container *cont(reserve_message(IF_KERNEL(flags)));
+        if(!cont) {
             return;
         }
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 3;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.payload[1] = granary::unsafe_cast<uint64_t>(a1);
-        cont.payload[2] = granary::unsafe_cast<uint64_t>(a2);
-        cont.message_id.store(id);
+        cont->num_args = 3;
+        cont->payload[0] = granary::unsafe_cast<uint64_t>(a0);
+        cont->payload[1] = granary::unsafe_cast<uint64_t>(a1);
+        cont->payload[2] = granary::unsafe_cast<uint64_t>(a2);
+        commit_message(cont, id _IF_KERNEL(flags));
     }
 
 
@@ -134,35 +176,35 @@ namespace client {
             return;
         }
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
-
-        if(index >= MAX_NUM_MESSAGES) {
+        IF_KERNEL( granary::eflags flags; )
+        message_container *cont(reserve_message(IF_KERNEL(flags)));
+        if(!cont) {
             return;
         }
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 4;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.payload[1] = granary::unsafe_cast<uint64_t>(a1);
-        cont.payload[2] = granary::unsafe_cast<uint64_t>(a2);
-        cont.payload[3] = granary::unsafe_cast<uint64_t>(a3);
-        cont.message_id.store(id);
+        cont->num_args = 4;
+        cont->payload[0] = granary::unsafe_cast<uint64_t>(a0);
+        cont->payload[1] = granary::unsafe_cast<uint64_t>(a1);
+        cont->payload[2] = granary::unsafe_cast<uint64_t>(a2);
+        cont->payload[3] = granary::unsafe_cast<uint64_t>(a3);
+        commit_message(cont, id _IF_KERNEL(flags));
     }
 
 
-    inline void clear_log(void) throw() {
-        NEXT_LOG_OFFSET.store(0);
-    }
+    /// Stream all committed messages of all CPUs out through `granary::log`.
+    void drain_logs(void) throw();
 
 
-    inline uint64_t log_size(void) throw() {
-        return NEXT_LOG_OFFSET.load();
-    }
+    /// Used for testing. Discards all undrained messages.
+    void clear_log(void) throw();
+
+
+    /// Used for testing. Returns the number of undrained messages.
+    uint64_t log_size(void) throw();
 
 
-    /// Used for testing. Returns true iff the log entry at offset `offset` has
-    /// the expected log message identifier, `expect_id`.
+    /// Used for testing. Returns true iff the undrained log entry at offset
+    /// `offset` has the expected log message identifier, `expect_id`.
     bool log_entry_is(unsigned offset, const log_message_id expect_id) throw();
 }
 
@@ -12,9 +12,14 @@
 
 namespace client {
 
+    struct message_log;
+
 #   define CLIENT_cpu_state
     struct cpu_state {
 
+        /// This CPU's log of messages. This is allocated when the CPU first
+        /// logs a message.
+        message_log *messages;
     };
 
 #   define CLIENT_thread_state
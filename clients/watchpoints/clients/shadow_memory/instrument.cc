@@ -0,0 +1,351 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * instrument.cc
+ *
+ *  Created on: 2014-02-05
+ *      Author: Peter Goodman
+ */
+
+#include "clients/watchpoints/utils.h"
+#include "clients/watchpoints/clients/shadow_memory/instrument.h"
+#include "clients/watchpoints/descriptor_allocator.h"
+
+
+using namespace granary;
+
+
+namespace client { namespace wp {
+
+
+    /// Descriptors of all shadowed objects.
+    shadow_descriptor DESCRIPTORS[MAX_NUM_WATCHPOINTS];
+
+
+    /// Global pools of free descriptors, one per inherited index.
+    static descriptor_pool<shadow_descriptor> POOLS[WP_NUM_INHERITED_INDEXES];
+
+
+    /// Shadow buffers of freed objects.
+    static std::atomic<shadow_buffer *> FREED_SHADOW_BUFFERS = \
+        ATOMIC_VAR_INIT(nullptr);
+
+
+    inline static uintptr_t index_of(const shadow_descriptor *desc) throw() {
+        return desc - &(DESCRIPTORS[0]);
+    }
+
+
+    /// Allocate a watchpoint descriptor and assign `desc` and `index`
+    /// appropriately.
+    bool shadow_descriptor::allocate(
+        shadow_descriptor *&desc,
+        uintptr_t &counter_index,
+        const uintptr_t inherited_index
+    ) throw() {
+        desc = allocate_descriptor(
+            DESCRIPTORS, POOLS, counter_index, inherited_index);
+        return nullptr != desc;
+    }
+
+
+    /// Allocate a zeroed shadow buffer with `num_bytes` shadow bytes.
+    static shadow_buffer *allocate_shadow_buffer(unsigned num_bytes) throw() {
+        shadow_buffer *buffer(unsafe_cast<shadow_buffer *>(
+            allocate_memory<uint8_t>(
+                sizeof(shadow_buffer) + num_bytes + SHADOW_SLACK)));
+        buffer->num_bytes = num_bytes;
+        return buffer;
+    }
+
+
+    /// Initialise a watchpoint descriptor, and allocate its shadow buffer.
+    bool shadow_descriptor::allocate_and_init(
+        shadow_descriptor *&desc,
+        uintptr_t &counter_index,
+        const uintptr_t inherited_index,
+        void *base_address,
+        size_t size,
+        void *
+    ) throw() {
+
+        const uintptr_t base(reinterpret_cast<uintptr_t>(base_address));
+        const uint32_t lower_bound(static_cast<uint32_t>(base));
+        const uint32_t upper_bound(static_cast<uint32_t>(base + size));
+
+        // Objects that roll over a 4GB boundary can't be represented by the
+        // 32-bit bounds, so don't watch them.
+        if(!size || upper_bound <= lower_bound) {
+            return false;
+        }
+
+#if WP_USE_INHERITED_INDEX
+        // Only the bounds checker duplicates descriptors across inherited
+        // indexes; don't watch objects that span more than one.
+        if(1 < num_inherited_indexes_spanned(base, size)) {
+            return false;
+        }
+#endif /* WP_USE_INHERITED_INDEX */
+
+        if(!allocate(desc, counter_index, inherited_index)) {
+            return false;
+        }
+
+        ASSERT(is_valid_address(desc));
+
+        // Publish the shadow bytes before the bounds, and the lower bound
+        // before the upper bound, so that a racing inline shadow update never
+        // passes its bounds check with a mix of the old and new bounds.
+        desc->shadow = allocate_shadow_buffer(num_shadow_bytes(size))->bytes();
+        std::atomic_thread_fence(std::memory_order_release);
+        desc->lower_bound = lower_bound;
+        std::atomic_thread_fence(std::memory_order_release);
+        desc->upper_bound = upper_bound;
+
+        return true;
+    }
+
+
+    /// Get the descriptor of a watchpoint based on its index.
+    shadow_descriptor *shadow_descriptor::access(
+        uintptr_t index
+    ) throw() {
+        ASSERT(index < MAX_NUM_WATCHPOINTS);
+        return &(DESCRIPTORS[index]);
+    }
+
+
+    /// Free a watchpoint descriptor by adding the descriptor to a descriptor
+    /// cache. The descriptor's shadow buffer is kept for the report.
+    void shadow_descriptor::free(
+        shadow_descriptor *desc,
+        uintptr_t IF_TEST( index )
+    ) throw() {
+
+        ASSERT(is_valid_address(desc));
+        ASSERT(index == index_of(desc));
+
+        // Empty the bounds (upper bound first) so that later inline shadow
+        // updates fail their bounds checks. `desc->shadow` is left alone, as
+        // racing updates might still be about to update it.
+        desc->upper_bound = 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        desc->lower_bound = 0;
+
+        shadow_buffer *buffer(shadow_buffer::of(desc->shadow));
+        shadow_buffer *next(FREED_SHADOW_BUFFERS.load());
+        do {
+            buffer->next_freed = next;
+        } while(!FREED_SHADOW_BUFFERS.compare_exchange_weak(next, buffer));
+
+        free_descriptor(DESCRIPTORS, POOLS, desc);
+    }
+
+
+    /// Returns the shadow buffer of the most recently freed object.
+    const shadow_buffer *freed_shadow_buffers(void) throw() {
+        return FREED_SHADOW_BUFFERS.load();
+    }
+
+
+    /// Returns the shadow state of the granule containing the watched
+    /// address `addr`, or `SHADOW_UNTOUCHED` if `addr` is not within its
+    /// watched object.
+    uint8_t shadow_state_of(uintptr_t addr) throw() {
+        if(!is_watched_address(addr)) {
+            return SHADOW_UNTOUCHED;
+        }
+
+        const shadow_descriptor *desc(descriptor_of(addr));
+        const uint32_t low_32(static_cast<uint32_t>(addr));
+        if(low_32 < desc->lower_bound || low_32 >= desc->upper_bound) {
+            return SHADOW_UNTOUCHED;
+        }
+
+        const uint32_t offset(low_32 - desc->lower_bound);
+        return desc->shadow[offset >> SHADOW_GRANULARITY_SHIFT];
+    }
+
+
+    /// Registers that can be used to hold the descriptor and shadow offset
+    /// during an inline shadow update.
+    static const dynamorio::reg_id_t SCRATCH_REGS[] = {
+        dynamorio::DR_REG_RAX,
+        dynamorio::DR_REG_RCX,
+        dynamorio::DR_REG_RDX
+    };
+
+
+    /// Returns a memory operand of a specific size.
+    static operand_base_disp memory_operand(
+        operand_base_disp op,
+        int disp,
+        dynamorio::opnd_size_t size
+    ) throw() {
+        op.disp = disp;
+        op.size = size;
+        return op;
+    }
+
+
+    /// Add instructions after `in` that OR `state` into `num_bytes` shadow
+    /// bytes starting at `[shadow + offset]`.
+    static instruction mark_shadow_bytes(
+        instruction_list &ls,
+        instruction in,
+        operand shadow,
+        operand offset,
+        unsigned num_bytes,
+        uint8_t state
+    ) throw() {
+        const operand_base_disp shadow_bytes(shadow + offset);
+
+        if(1 == num_bytes) {
+            return ls.insert_after(in, or_(
+                memory_operand(shadow_bytes, 0, dynamorio::OPSZ_1),
+                int8_(state)));
+
+        } else if(2 == num_bytes) {
+            return ls.insert_after(in, or_(
+                memory_operand(shadow_bytes, 0, dynamorio::OPSZ_2),
+                int16_(state * 0x0101U)));
+        }
+
+        // Wide accesses are marked 4 shadow bytes at a time.
+        for(unsigned i(0); i < num_bytes; i += 4) {
+            in = ls.insert_after(in, or_(
+                memory_operand(shadow_bytes, i, dynamorio::OPSZ_4),
+                int32_(state * 0x01010101U)));
+        }
+        return in;
+    }
+
+
+    /// Add an inline update of the shadow memory for the `i`th watched operand
+    /// of `tracker`. The update is added after the operand's watchpoint
+    /// label, where the operand's register contains the watched address.
+    ///
+    /// Note: Shadow bytes are updated without a LOCK prefix. Racing updates to
+    ///       the same shadow byte might lose a state bit.
+    static void add_shadow_update(
+        instruction_list &ls,
+        watchpoint_tracker &tracker,
+        unsigned i,
+        uint8_t state
+    ) throw() {
+        const dynamorio::reg_id_t addr_reg(register_manager::scale(
+            tracker.regs[i].value.reg, REG_64));
+
+        dynamorio::reg_id_t scratch[2];
+        for(unsigned r(0), s(0); s < 2; ++r) {
+            if(addr_reg != SCRATCH_REGS[r]) {
+                scratch[s++] = SCRATCH_REGS[r];
+            }
+        }
+
+        const operand desc(scratch[0]);
+        const operand offset(scratch[1]);
+        const operand offset_32(register_manager::scale(scratch[1], REG_32));
+        const operand addr_32(register_manager::scale(addr_reg, REG_32));
+
+        // Number of shadow bytes covering the access. Accesses that straddle
+        // two granules in the 8-byte-granular mode only mark the first
+        // granule(s).
+        const unsigned num_bytes(num_shadow_bytes(tracker.sizes[i]));
+
+        instruction in(tracker.labels[i]);
+        instruction done(label_());
+
+        // The flags are saved last (and restored first) so that the last
+        // restore is a `POP`. In user space, the watchpoint framework's red
+        // zone guard begins at the last introduced `POP`, and so then also
+        // covers the `POPF`.
+        IF_USER( in = ls.insert_after(in,
+            lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+        in = ls.insert_after(in, push_(desc));
+        in = ls.insert_after(in, push_(offset));
+        in = ls.insert_after(in, pushf_());
+
+        // Compute the address of the descriptor of the watched address.
+        in = insert_descriptor_index_after(
+            ls, in, desc, operand(addr_reg), offset);
+        in = ls.insert_after(in, shl_(desc, int8_(5)));
+        in = ls.insert_after(in, mov_imm_(offset,
+            int64_(reinterpret_cast<uint64_t>(&(DESCRIPTORS[0])))));
+        in = ls.insert_after(in, add_(desc, offset));
+
+        // Bounds check the access, and compute the offset of the accessed
+        // shadow byte(s).
+        in = ls.insert_after(in, mov_ld_(offset_32, addr_32));
+        in = ls.insert_after(in, cmp_(offset_32,
+            memory_operand(*desc, 4, dynamorio::OPSZ_4)));
+        in = ls.insert_after(in, mangled(jnb_(instr_(done))));
+        in = ls.insert_after(in, sub_(offset_32,
+            memory_operand(*desc, 0, dynamorio::OPSZ_4)));
+        in = ls.insert_after(in, mangled(jb_(instr_(done))));
+
+        if(SHADOW_GRANULARITY_SHIFT) {
+            in = ls.insert_after(in,
+                shr_(offset_32, int8_(SHADOW_GRANULARITY_SHIFT)));
+        }
+
+        // Update the shadow byte(s), provided that they are within the shadow
+        // buffer. This only fails if the descriptor was freed and reused
+        // between the above bounds check and loading its shadow bytes.
+        in = ls.insert_after(in, mov_ld_(desc,
+            memory_operand(*desc, 8, dynamorio::OPSZ_8)));
+        in = ls.insert_after(in, cmp_(offset,
+            memory_operand(*desc, -8, dynamorio::OPSZ_8)));
+        in = ls.insert_after(in, mangled(jnb_(instr_(done))));
+        in = mark_shadow_bytes(ls, in, desc, offset, num_bytes, state);
+
+        in = ls.insert_after(in, done);
+        in = ls.insert_after(in, popf_());
+        in = ls.insert_after(in, pop_(offset));
+        in = ls.insert_after(in, pop_(desc));
+        IF_USER( in = ls.insert_after(in,
+            lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+    }
+
+
+    /// Instrument a memory read. Read-modify-write operands are marked as
+    /// both read and written.
+    void shadow_policy::visit_read(
+        granary::basic_block_state &,
+        instruction_list &ls,
+        watchpoint_tracker &tracker,
+        unsigned i
+    ) throw() {
+        if(DEST_OPERAND & tracker.ops[i].kind) {
+            add_shadow_update(ls, tracker, i, SHADOW_READ | SHADOW_WRITTEN);
+        } else {
+            add_shadow_update(ls, tracker, i, SHADOW_READ);
+        }
+    }
+
+
+    /// Instrument a memory write.
+    void shadow_policy::visit_write(
+        granary::basic_block_state &,
+        instruction_list &ls,
+        watchpoint_tracker &tracker,
+        unsigned i
+    ) throw() {
+        if(!(SOURCE_OPERAND & tracker.ops[i].kind)) {
+            add_shadow_update(ls, tracker, i, SHADOW_WRITTEN);
+        }
+    }
+
+
+#if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
+    interrupt_handled_state shadow_policy::handle_interrupt(
+        cpu_state_handle,
+        thread_state_handle,
+        granary::basic_block_state &,
+        interrupt_stack_frame &,
+        interrupt_vector
+    ) throw() {
+        return INTERRUPT_DEFER;
+    }
+#endif /* CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT */
+
+}} /* client::wp namespace */
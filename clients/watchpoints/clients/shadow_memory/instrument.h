@@ -0,0 +1,219 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * instrument.h
+ *
+ *  Created on: 2014-02-05
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_SHADOW_MEMORY_INSTRUMENT_H_
+#define WATCHPOINT_SHADOW_MEMORY_INSTRUMENT_H_
+
+#include "clients/watchpoints/instrument.h"
+
+#ifndef GRANARY_INIT_POLICY
+#   define GRANARY_INIT_POLICY (client::watchpoint_shadow_policy())
+#endif
+
+
+/// Granularity (in bytes) of the shadow memory. Each shadow byte tracks the
+/// accesses to this many bytes of its watched object. This should be either
+/// 1 (byte-granular) or 8 (8-byte-granular).
+#ifndef WP_SHADOW_GRANULARITY
+#   define WP_SHADOW_GRANULARITY 1
+#endif
+
+
+namespace client {
+
+    namespace wp {
+
+        enum : uint64_t {
+
+            /// Log2 of the shadow granularity.
+            SHADOW_GRANULARITY_SHIFT = (8 == WP_SHADOW_GRANULARITY) ? 3 : 0,
+
+            /// Number of extra shadow bytes allocated past the end of every
+            /// shadow buffer. This lets the inline shadow updates mark all of
+            /// the bytes of the widest (16 byte) access that begins within an
+            /// object, without checking its end.
+            SHADOW_SLACK = 16
+        };
+
+
+        static_assert(1 == WP_SHADOW_GRANULARITY || 8 == WP_SHADOW_GRANULARITY,
+            "The shadow memory granularity must be either 1 or 8 bytes.");
+
+
+        /// The states of a shadow byte. These are bits, and are accumulated
+        /// into the shadow byte as the granule is accessed.
+        enum shadow_state : uint8_t {
+            SHADOW_UNTOUCHED    = 0,
+            SHADOW_READ         = (1 << 0),
+            SHADOW_WRITTEN      = (1 << 1)
+        };
+
+
+        /// A shadow buffer of a watched object. The shadow bytes immediately
+        /// follow this header.
+        ///
+        /// Note: Shadow buffers are never freed. The shadow buffers of freed
+        ///       objects are chained together so that they can be reported
+        ///       on, and so that inline shadow updates that race with the
+        ///       freeing of an object never update freed memory.
+        struct shadow_buffer {
+
+            /// Next shadow buffer of a freed object.
+            shadow_buffer *next_freed;
+
+            /// Number of shadow bytes in this buffer (excluding the slack).
+            /// The inline shadow updates check their shadow offset against
+            /// this, so that an update that races with the reuse of its
+            /// object's descriptor never updates past the end of the buffer.
+            uint64_t num_bytes;
+
+
+            /// Returns the shadow bytes of this buffer.
+            inline uint8_t *bytes(void) throw() {
+                return reinterpret_cast<uint8_t *>(this + 1);
+            }
+
+
+            inline const uint8_t *bytes(void) const throw() {
+                return reinterpret_cast<const uint8_t *>(this + 1);
+            }
+
+
+            /// Returns the shadow buffer whose shadow bytes are `bytes`.
+            static inline shadow_buffer *of(uint8_t *bytes) throw() {
+                return reinterpret_cast<shadow_buffer *>(bytes) - 1;
+            }
+        };
+
+
+        static_assert(16 == sizeof(shadow_buffer),
+            "Shadow buffer header should be 16 bytes.");
+
+
+        /// Specifies the bounds of, and the shadow buffer for, a watched
+        /// object.
+        struct shadow_descriptor {
+
+            /// Bounds of the watched object. These are in the same (low
+            /// 32-bit) form as bound descriptors so that the inline shadow
+            /// update can check that an access is within the object before
+            /// updating the shadow buffer.
+            struct {
+                uint32_t lower_bound;
+                uint32_t upper_bound;
+            } __attribute__((packed));
+
+            /// Shadow bytes for this object, with one shadow byte per
+            /// `WP_SHADOW_GRANULARITY` bytes of the object. These remain valid
+            /// after the object is freed.
+            uint8_t *shadow;
+
+            /// Next free descriptor. This is separate from `shadow` so that
+            /// freeing a descriptor never changes the shadow bytes that a
+            /// racing inline shadow update might be about to update.
+            shadow_descriptor *next_free_descriptor;
+
+            /// Unused; pads descriptors to 32 bytes so that the inline shadow
+            /// update can find a descriptor by shifting its index.
+            uint64_t padding;
+
+
+            /// Allocate a watchpoint descriptor.
+            static bool allocate(
+                shadow_descriptor *&,
+                uintptr_t &,
+                const uintptr_t
+            ) throw();
+
+
+            /// Free a watchpoint descriptor.
+            static void free(shadow_descriptor *, uintptr_t) throw();
+
+
+            /// Initialise a watchpoint descriptor.
+            static bool allocate_and_init(
+                shadow_descriptor *&,
+                uintptr_t &,
+                const uintptr_t,
+                void *base_address,
+                size_t size,
+                void *return_address
+            ) throw();
+
+
+            /// Notify the shadow policy that the descriptor can be assigned
+            /// to the index.
+            static void assign(shadow_descriptor *, uintptr_t) throw() { }
+
+
+            /// Get the assigned descriptor for a given index.
+            static shadow_descriptor *access(uintptr_t index) throw();
+
+        } __attribute__((packed));
+
+
+        static_assert(32 == sizeof(shadow_descriptor),
+            "Shadow descriptor type should be 32 bytes.");
+
+
+        /// Specify the descriptor type to the generic watchpoint framework.
+        template <typename>
+        struct descriptor_type {
+            typedef shadow_descriptor type;
+            enum {
+                ALLOC_AND_INIT = true,
+                REINIT_WATCHED_POINTERS = false
+            };
+        };
+
+
+        /// Returns the number of shadow bytes needed for an object of size
+        /// `size`.
+        inline unsigned num_shadow_bytes(size_t size) throw() {
+            return static_cast<unsigned>(
+                (size + WP_SHADOW_GRANULARITY - 1) >> SHADOW_GRANULARITY_SHIFT);
+        }
+
+
+        /// Returns the shadow state of the granule containing the watched
+        /// address `addr`, or `SHADOW_UNTOUCHED` if `addr` is not within its
+        /// watched object.
+        uint8_t shadow_state_of(uintptr_t addr) throw();
+
+
+        template <typename T>
+        inline uint8_t shadow_state_of(T *addr) throw() {
+            return shadow_state_of(reinterpret_cast<uintptr_t>(addr));
+        }
+
+
+        /// Returns the shadow buffer of the most recently freed object, or
+        /// `nullptr` if no shadowed objects have been freed. The shadow
+        /// buffers of freed objects are chained through `next_freed`.
+        const shadow_buffer *freed_shadow_buffers(void) throw();
+
+
+#ifdef GRANARY_DONT_INCLUDE_CSTDLIB
+    } /* wp namespace */
+#else
+    } /* wp namespace */
+
+    DECLARE_READ_WRITE_POLICY(
+        shadow_policy /* name */,
+        false /* auto-instrument */)
+
+    DECLARE_INSTRUMENTATION_POLICY(
+        watchpoint_shadow_policy,
+        shadow_policy /* app read/write policy */,
+        shadow_policy /* host read/write policy */,
+        { /* override declarations */ })
+
+#endif /* GRANARY_DONT_INCLUDE_CSTDLIB */
+} /* namespace client */
+
+#endif /* WATCHPOINT_SHADOW_MEMORY_INSTRUMENT_H_ */
@@ -0,0 +1,106 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * report.cc
+ *
+ *  Created on: 2014-02-05
+ *      Author: Peter Goodman
+ */
+
+#include "clients/watchpoints/clients/shadow_memory/instrument.h"
+
+
+using namespace granary;
+
+
+namespace client {
+
+    namespace wp {
+        extern shadow_descriptor DESCRIPTORS[MAX_NUM_WATCHPOINTS];
+    }
+
+
+    /// Shadow state counts of a set of shadowed objects.
+    struct shadow_summary {
+        uint64_t num_objects;
+        uint64_t num_granules;
+        uint64_t num_read_granules;
+        uint64_t num_written_granules;
+        uint64_t num_untouched_granules;
+    };
+
+
+    /// Add the shadow states of an object's shadow buffer to a summary.
+    static void summarise(
+        shadow_summary &summary,
+        const wp::shadow_buffer *buffer
+    ) throw() {
+        const uint8_t *bytes(buffer->bytes());
+
+        summary.num_objects += 1;
+        summary.num_granules += buffer->num_bytes;
+
+        for(unsigned j(0); j < buffer->num_bytes; ++j) {
+            const uint8_t state(bytes[j]);
+            if(wp::SHADOW_READ & state) {
+                summary.num_read_granules += 1;
+            }
+            if(wp::SHADOW_WRITTEN & state) {
+                summary.num_written_granules += 1;
+            }
+            if(wp::SHADOW_UNTOUCHED == state) {
+                summary.num_untouched_granules += 1;
+            }
+        }
+    }
+
+
+    /// Print out a summary of shadowed objects.
+    static void print_summary(
+        const char *kind,
+        const shadow_summary &summary
+    ) throw() {
+        printf("Number of %s shadowed objects: %lu\n",
+            kind, summary.num_objects);
+
+        printf("Number of %s shadowed granules: %lu\n",
+            kind, summary.num_granules);
+
+        printf("Number of %s read granules: %lu\n",
+            kind, summary.num_read_granules);
+
+        printf("Number of %s written granules: %lu\n",
+            kind, summary.num_written_granules);
+
+        printf("Number of %s untouched granules: %lu\n",
+            kind, summary.num_untouched_granules);
+    }
+
+
+    /// Report on the shadow states of all live and freed shadowed objects.
+    void report(void) throw() {
+
+        shadow_summary live;
+        shadow_summary freed;
+        memset(&live, 0, sizeof live);
+        memset(&freed, 0, sizeof freed);
+
+        for(unsigned i(0); i < wp::MAX_NUM_WATCHPOINTS; ++i) {
+            const wp::shadow_descriptor &desc(wp::DESCRIPTORS[i]);
+            if(desc.upper_bound <= desc.lower_bound) {
+                continue;
+            }
+            summarise(live, wp::shadow_buffer::of(desc.shadow));
+        }
+
+        const wp::shadow_buffer *buffer(wp::freed_shadow_buffers());
+        for(; buffer; buffer = buffer->next_freed) {
+            summarise(freed, buffer);
+        }
+
+        printf("\nShadow Memory (%u-byte granularity)\n",
+            WP_SHADOW_GRANULARITY);
+
+        print_summary("live", live);
+        print_summary("freed", freed);
+    }
+}
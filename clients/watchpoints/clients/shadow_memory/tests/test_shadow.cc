@@ -0,0 +1,161 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_shadow.cc
+ *
+ *  Created on: 2014-02-15
+ *      Author: Peter Goodman
+ */
+
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "clients/watchpoints/clients/shadow_memory/instrument.h"
+
+namespace test {
+
+    static uint64_t WP_SHADOW_VALUES[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    static uint64_t WP_FREED_SHADOW_VALUES[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+
+    static uint64_t load(register uint64_t *ptr) throw() {
+        register uint64_t val;
+        ASM(
+            "movq (%1), %0;"
+            : "=r"(val)
+            : "r"(ptr)
+        );
+        return val;
+    }
+
+
+    static void store(register uint64_t *ptr, register uint32_t val) throw() {
+        ASM(
+            "movl %1, (%0);"
+            :
+            : "r"(ptr), "r"(val)
+            : "memory"
+        );
+    }
+
+
+    static void add(register uint64_t *ptr, register uint64_t val) throw() {
+        ASM(
+            "addq %1, (%0);"
+            :
+            : "r"(ptr), "r"(val)
+            : "memory"
+        );
+    }
+
+
+    /// Returns the shadow state of the byte at `offset` in the object
+    /// pointed to by the watched address `ptr`.
+    static uint8_t state_at(uint64_t *ptr, unsigned offset) throw() {
+        return client::wp::shadow_state_of(
+            reinterpret_cast<uint8_t *>(ptr) + offset);
+    }
+
+
+    /// Load, store, and read-modify-write different parts of the object
+    /// pointed to by the watched address `ptr`.
+    static void access_parts(uint64_t *ptr) throw() {
+        granary::instrumentation_policy policy =
+            granary::policy_for<client::watchpoint_shadow_policy>();
+
+        granary::app_pc load_pc((granary::app_pc) load);
+        granary::basic_block call_load(
+            granary::code_cache::find(load_pc, policy));
+
+        granary::app_pc store_pc((granary::app_pc) store);
+        granary::basic_block call_store(
+            granary::code_cache::find(store_pc, policy));
+
+        granary::app_pc add_pc((granary::app_pc) add);
+        granary::basic_block call_add(
+            granary::code_cache::find(add_pc, policy));
+
+        ASSERT(1 == call_load.call<uint64_t, uint64_t *>(ptr));
+        call_store.call<void, uint64_t *, uint32_t>(ptr + 2, 10);
+        call_add.call<void, uint64_t *, uint64_t>(ptr + 4, 10);
+    }
+
+
+    /// Test that loads, stores, and read-modify-writes of a watched object
+    /// mark the accessed granules of its shadow memory.
+    static void shadow_marks_reads_and_writes(void) {
+        using namespace client::wp;
+
+        uint64_t *watched(&(WP_SHADOW_VALUES[0]));
+        ASSERT(ADDRESS_WATCHED == add_watchpoint(
+            watched, &(WP_SHADOW_VALUES[0]), sizeof WP_SHADOW_VALUES,
+            nullptr));
+
+        for(unsigned i(0); i < sizeof WP_SHADOW_VALUES; ++i) {
+            ASSERT(SHADOW_UNTOUCHED == state_at(watched, i));
+        }
+
+        access_parts(watched);
+        ASSERT(10 == WP_SHADOW_VALUES[2]);
+        ASSERT(15 == WP_SHADOW_VALUES[4]);
+
+        ASSERT(SHADOW_READ == state_at(watched, 0));
+        ASSERT(SHADOW_READ == state_at(watched, 7));
+        ASSERT(SHADOW_WRITTEN == state_at(watched, 16));
+        ASSERT(SHADOW_WRITTEN == state_at(watched, 19));
+        ASSERT((SHADOW_READ | SHADOW_WRITTEN) == state_at(watched, 32));
+        ASSERT((SHADOW_READ | SHADOW_WRITTEN) == state_at(watched, 39));
+        ASSERT(SHADOW_UNTOUCHED == state_at(watched, 8));
+        ASSERT(SHADOW_UNTOUCHED == state_at(watched, 48));
+        ASSERT(SHADOW_UNTOUCHED == state_at(watched, 63));
+        ASSERT(SHADOW_UNTOUCHED == state_at(watched, 64));
+
+        free_descriptor_of(watched);
+    }
+
+
+    ADD_TEST(shadow_marks_reads_and_writes,
+        "Test that watched reads and writes are marked in the shadow memory.")
+
+
+    /// Test that the shadow memory of a freed object is kept, and that it is
+    /// not shared with the next object that reuses the freed object's
+    /// descriptor.
+    static void freed_shadow_is_kept(void) {
+        using namespace client::wp;
+
+        uint64_t *watched(&(WP_FREED_SHADOW_VALUES[0]));
+        ASSERT(ADDRESS_WATCHED == add_watchpoint(
+            watched, &(WP_FREED_SHADOW_VALUES[0]),
+            sizeof WP_FREED_SHADOW_VALUES, nullptr));
+
+        access_parts(watched);
+        free_descriptor_of(watched);
+        ASSERT(SHADOW_UNTOUCHED == state_at(watched, 0));
+
+        const shadow_buffer *freed(freed_shadow_buffers());
+        ASSERT(nullptr != freed);
+        ASSERT(num_shadow_bytes(sizeof WP_FREED_SHADOW_VALUES)
+            == freed->num_bytes);
+        ASSERT(SHADOW_READ == freed->bytes()[0]);
+        ASSERT((SHADOW_READ | SHADOW_WRITTEN)
+            == freed->bytes()[32 >> SHADOW_GRANULARITY_SHIFT]);
+
+        uint64_t *rewatched(&(WP_FREED_SHADOW_VALUES[0]));
+        ASSERT(ADDRESS_WATCHED == add_watchpoint(
+            rewatched, &(WP_FREED_SHADOW_VALUES[0]),
+            sizeof WP_FREED_SHADOW_VALUES, nullptr));
+        ASSERT(descriptor_of(watched) == descriptor_of(rewatched));
+        ASSERT(SHADOW_UNTOUCHED == state_at(rewatched, 0));
+        ASSERT(SHADOW_READ == freed->bytes()[0]);
+
+        free_descriptor_of(rewatched);
+    }
+
+
+    ADD_TEST(freed_shadow_is_kept,
+        "Test that the shadow memory of freed objects is kept.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
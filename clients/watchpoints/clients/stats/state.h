@@ -12,6 +12,12 @@
 #define CLIENT_basic_block_state
 #define CLIENT_commit_to_basic_block_state
 
+/// The state of a block only holds counts of the block's memory operations
+/// (known when the block is instrumented) and runtime counters, so it can be
+/// saved in a persisted code cache. `next` is re-linked when the loaded block
+/// is committed to.
+#define CLIENT_persist_basic_block_state
+
 namespace client {
 
     struct basic_block_state {
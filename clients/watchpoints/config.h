@@ -15,6 +15,22 @@
 #define WP_ENABLE_REGISTER_REGIONS 1
 
 
+/// Enable eliminating redundant watchpoint checks. When a base register is
+/// dereferenced several times in a row without being redefined, only the
+/// first dereference is checked, and the base register is then unwatched in
+/// place for the remaining ones. This only applies to read/write policies
+/// that opt in with `ELIDE_REDUNDANT_CHECKS`, because the remaining accesses
+/// are never visited by the policy.
+#define WP_ELIDE_REDUNDANT_CHECKS 1
+
+
+/// Enable hoisting the watchpoint check of a loop-invariant base register out
+/// of loops within basic blocks. This applies to the same read/write policies
+/// as `WP_ELIDE_REDUNDANT_CHECKS`. The base register is saved below the
+/// redzone across the loop.
+#define WP_HOIST_LOOP_INVARIANT_CHECKS 1
+
+
 /// Instrument less host code. This will instrument only basic blocks within
 /// a faulting host function, as well as basic blocks reached through indirect
 /// control-flow instructions.
@@ -43,8 +59,40 @@
 #define WP_COUNTER_INDEX_WIDTH 16
 
 
-/// Enable if inherited indexes should be used.
-#define WP_USE_INHERITED_INDEX 0
+/// Size (in bits) of the descriptor generation that is stored in a watched
+/// address. The generation takes the high-order bits of the counter index, so
+/// each generation bit halves the number of counter indexes. Clients that
+/// recycle descriptors tag each watched address with the generation of its
+/// descriptor, and compare the tag with the descriptor's current generation on
+/// access so that stale pointers to a freed object are not attributed to the
+/// next object that reuses its descriptor. Set to 0 to disable.
+#ifndef WP_GENERATION_WIDTH
+#   ifdef CLIENT_LIFETIME
+#       define WP_GENERATION_WIDTH 3
+#   else
+#       define WP_GENERATION_WIDTH 0
+#   endif
+#endif
+
+
+/// Enable if inherited indexes should be used. This is enabled by default in
+/// user space, where it lifts the limit on the number of watched objects, and
+/// disabled by default in kernel space.
+///
+/// Note: Inherited indexes multiply the number of watchpoints (and so the size
+///       of every descriptor table) by `2^WP_INHERITED_INDEX_WIDTH`. For
+///       example, with a width of 8, the bounds checker's descriptor table
+///       grows from 512KB to 128MB. In user space, the descriptor tables are
+///       zero-initialised data whose pages are only backed once touched; in
+///       kernel space, they are part of the module image, all of which is
+///       allocated up front when the module is loaded.
+#ifndef WP_USE_INHERITED_INDEX
+#   if CONFIG_ENV_KERNEL
+#       define WP_USE_INHERITED_INDEX 0
+#   else
+#       define WP_USE_INHERITED_INDEX 1
+#   endif
+#endif
 
 
 /// Size (in bits) of the inherited index. This should be a small, non-negative
@@ -69,6 +117,18 @@
 #define WP_INHERITED_INDEX_GRANULARITY 20
 
 
+/// Maximum number of free descriptors (per inherited index) that a CPU keeps
+/// in its private descriptor cache before it spills half of them into the
+/// global descriptor pool. This should be an even number.
+#define WP_DESCRIPTOR_CACHE_SIZE 64
+
+
+/// Number of batches of free descriptors (per inherited index) that the global
+/// descriptor pool can hold. Each batch holds `WP_DESCRIPTOR_CACHE_SIZE / 2`
+/// descriptors.
+#define WP_DESCRIPTOR_POOL_SIZE 32
+
+
 /// Backup for if the inherited index width is set to 0 but the inherited indexes
 /// are left enabled. Don't change.
 #if !WP_INHERITED_INDEX_WIDTH
@@ -85,6 +145,11 @@
 #endif
 
 
+/// Number of distinct inherited indexes. Each inherited index has its own
+/// space of counter indexes. Don't change.
+#define WP_NUM_INHERITED_INDEXES (1 << WP_INHERITED_INDEX_WIDTH)
+
+
 /// Feature toggler. Don't change.
 #if WP_USE_INHERITED_INDEX
 #   define IF_INHERITED_INDEX(...) __VA_ARGS__
@@ -98,6 +163,18 @@
 #   error "The counter index width must be 16 for kernel-space compatibility."
 #endif
 
+#if WP_GENERATION_WIDTH < 0 || 8 < WP_GENERATION_WIDTH
+#   error "The generation width must be in the range [0, 8]."
+#endif
+
+#if 32 < (WP_INHERITED_INDEX_WIDTH + WP_INHERITED_INDEX_GRANULARITY)
+#   error "The inherited index must be within the low 32 bits of an address."
+#endif
+
+#if (WP_DESCRIPTOR_CACHE_SIZE < 2) || (WP_DESCRIPTOR_CACHE_SIZE % 2)
+#   error "The descriptor cache size must be a positive, even number."
+#endif
+
 
 /// Left shift for inherited indexes to get the inherited index into the high
 /// position.
@@ -0,0 +1,80 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * descriptor_allocator.h
+ *
+ *  Created on: 2014-02-15
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_DESCRIPTOR_ALLOCATOR_H_
+#define WATCHPOINT_DESCRIPTOR_ALLOCATOR_H_
+
+#include "clients/watchpoints/instrument.h"
+#include "clients/watchpoints/descriptor_cache.h"
+
+namespace client { namespace wp {
+
+
+    /// Allocate a descriptor for an object whose inherited index is
+    /// `inherited_index`, and assign the descriptor's counter index to
+    /// `counter_index`. A free descriptor of the inherited index is reused if
+    /// this CPU's descriptor cache (the `free_list` of the client's CPU state)
+    /// or the global pool `pools[inherited_index]` has one. Otherwise, a new
+    /// counter index is allocated, and its descriptor is taken from the
+    /// descriptor table `descriptors`. Returns `nullptr` if the inherited
+    /// index has run out of counter indexes.
+    template <typename T>
+    T *allocate_descriptor(
+        T *descriptors,
+        descriptor_pool<T> *pools,
+        uintptr_t &counter_index,
+        const uintptr_t inherited_index
+    ) throw() {
+        IF_KERNEL( granary::eflags flags(granary_disable_interrupts()); )
+        granary::cpu_state_handle state;
+        T *desc(pop_free_descriptor(
+            state->free_list[inherited_index], pools[inherited_index]));
+        IF_KERNEL( granary_store_flags(flags); )
+
+        if(desc) {
+            uintptr_t inherited_index_(0);
+            destructure_combined_index(
+                static_cast<uintptr_t>(desc - descriptors),
+                counter_index, inherited_index_);
+            ASSERT(inherited_index == inherited_index_);
+            return desc;
+        }
+
+        counter_index = next_counter_index(inherited_index);
+        if(counter_index > MAX_COUNTER_INDEX) {
+            return nullptr;
+        }
+
+        return &(descriptors[combined_index(counter_index, inherited_index)]);
+    }
+
+
+    /// Free a descriptor from the descriptor table `descriptors` by adding it
+    /// to this CPU's descriptor cache of the descriptor's inherited index.
+    template <typename T>
+    void free_descriptor(
+        T *descriptors,
+        descriptor_pool<T> *pools,
+        T *desc
+    ) throw() {
+        uintptr_t counter_index(0);
+        uintptr_t inherited_index(0);
+        destructure_combined_index(
+            static_cast<uintptr_t>(desc - descriptors),
+            counter_index, inherited_index);
+
+        IF_KERNEL( granary::eflags flags(granary_disable_interrupts()); )
+        granary::cpu_state_handle state;
+        push_free_descriptor(
+            state->free_list[inherited_index], pools[inherited_index], desc);
+        IF_KERNEL( granary_store_flags(flags); )
+    }
+
+}}
+
+#endif /* WATCHPOINT_DESCRIPTOR_ALLOCATOR_H_ */
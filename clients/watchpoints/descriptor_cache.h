@@ -0,0 +1,166 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * descriptor_cache.h
+ *
+ *  Created on: 2014-02-10
+ *      Author: Peter Goodman
+ */
+
+#ifndef WATCHPOINT_DESCRIPTOR_CACHE_H_
+#define WATCHPOINT_DESCRIPTOR_CACHE_H_
+
+#include "clients/watchpoints/config.h"
+
+#ifndef GRANARY_DONT_INCLUDE_CSTDLIB
+#   include <atomic>
+#endif
+
+namespace client { namespace wp {
+
+
+    /// A CPU-private cache of free descriptors. Descriptors are linked
+    /// together through their `next_free_descriptor` fields.
+    ///
+    /// Note: This is zero-initialised as part of the CPU state, and so must
+    ///       remain a POD type.
+    template <typename T>
+    struct descriptor_cache {
+
+        /// First free descriptor in the cache.
+        T *head;
+
+        /// Number of descriptors in the cache.
+        unsigned num_descriptors;
+    };
+
+
+#ifndef GRANARY_DONT_INCLUDE_CSTDLIB
+
+    enum {
+        /// Number of descriptors moved between a CPU-private descriptor cache
+        /// and the global descriptor pool at once.
+        DESCRIPTOR_BATCH_SIZE = WP_DESCRIPTOR_CACHE_SIZE / 2
+    };
+
+
+    /// A global pool of batches of free descriptors, shared by all CPUs. A CPU
+    /// spills a batch of descriptors into the pool when its cache overflows,
+    /// and refills its cache with a batch from the pool when its cache is
+    /// empty. This keeps descriptors freed on one CPU from being stranded
+    /// there when the allocations happen on another CPU.
+    ///
+    /// Each slot holds either `nullptr` or a whole, `nullptr`-terminated batch
+    /// of exactly `DESCRIPTOR_BATCH_SIZE` descriptors. Batches are only ever
+    /// swapped into and out of slots as a whole, so the pool is lock-free
+    /// and isn't subject to the ABA problem of a linked free list.
+    ///
+    /// Note: This is zero-initialised static data, and so must not depend on
+    ///       a constructor running.
+    template <typename T>
+    struct descriptor_pool {
+        std::atomic<T *> batches[WP_DESCRIPTOR_POOL_SIZE];
+
+
+        /// Try to put a batch of descriptors into the pool. Returns false if
+        /// the pool is full.
+        bool put(T *batch) throw() {
+            for(unsigned i(0); i < WP_DESCRIPTOR_POOL_SIZE; ++i) {
+                T *expected(nullptr);
+                if(!batches[i].load(std::memory_order_relaxed)
+                && batches[i].compare_exchange_strong(
+                    expected, batch, std::memory_order_release)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+
+        /// Try to take a batch of descriptors out of the pool. Returns
+        /// `nullptr` if the pool is empty.
+        T *take(void) throw() {
+            for(unsigned i(0); i < WP_DESCRIPTOR_POOL_SIZE; ++i) {
+                if(batches[i].load(std::memory_order_relaxed)) {
+                    T *batch(batches[i].exchange(
+                        nullptr, std::memory_order_acquire));
+                    if(batch) {
+                        return batch;
+                    }
+                }
+            }
+            return nullptr;
+        }
+    };
+
+
+    /// Take a free descriptor from a CPU-private descriptor cache, refilling
+    /// the cache from the global pool if the cache is empty. Returns `nullptr`
+    /// if both the cache and the pool are empty.
+    ///
+    /// Note: In kernel space, this must be invoked with interrupts disabled.
+    template <typename T>
+    T *pop_free_descriptor(
+        descriptor_cache<T> &cache,
+        descriptor_pool<T> &pool
+    ) throw() {
+        if(!cache.head) {
+            cache.head = pool.take();
+            if(!cache.head) {
+                return nullptr;
+            }
+            cache.num_descriptors = DESCRIPTOR_BATCH_SIZE;
+        }
+
+        T *desc(cache.head);
+        cache.head = desc->next_free_descriptor;
+        --cache.num_descriptors;
+        return desc;
+    }
+
+
+    /// Add a free descriptor to a CPU-private descriptor cache. If the cache
+    /// overflows then a batch of descriptors is spilled into the global pool.
+    /// If the pool is full then the cache is allowed to grow past its bound,
+    /// and the spill is retried after another batch worth of frees.
+    ///
+    /// Note: In kernel space, this must be invoked with interrupts disabled.
+    template <typename T>
+    void push_free_descriptor(
+        descriptor_cache<T> &cache,
+        descriptor_pool<T> &pool,
+        T *desc
+    ) throw() {
+        desc->next_free_descriptor = cache.head;
+        cache.head = desc;
+
+        const unsigned num_descriptors(++cache.num_descriptors);
+        if(num_descriptors <= WP_DESCRIPTOR_CACHE_SIZE
+        || ((num_descriptors - WP_DESCRIPTOR_CACHE_SIZE - 1)
+                % DESCRIPTOR_BATCH_SIZE)) {
+            return;
+        }
+
+        // Split the first `DESCRIPTOR_BATCH_SIZE` descriptors off of the
+        // cache, and try to give them to the pool.
+        T *batch(cache.head);
+        T *last(batch);
+        for(unsigned i(1); i < DESCRIPTOR_BATCH_SIZE; ++i) {
+            last = last->next_free_descriptor;
+        }
+
+        T *rest(last->next_free_descriptor);
+        last->next_free_descriptor = nullptr;
+
+        if(pool.put(batch)) {
+            cache.head = rest;
+            cache.num_descriptors -= DESCRIPTOR_BATCH_SIZE;
+        } else {
+            last->next_free_descriptor = rest;
+        }
+    }
+
+#endif /* GRANARY_DONT_INCLUDE_CSTDLIB */
+
+}}
+
+#endif /* WATCHPOINT_DESCRIPTOR_CACHE_H_ */
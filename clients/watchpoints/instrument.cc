@@ -14,6 +14,70 @@ using namespace granary;
 namespace client { namespace wp {
 
 
+#if WP_USE_INHERITED_INDEX
+
+    /// Tracks the next counter index to be allocated for each inherited
+    /// index.
+    static std::atomic<uintptr_t> NEXT_COUNTER_INDEX[NUM_INHERITED_INDEXES];
+
+
+    /// One more than the highest counter index allocated for any inherited
+    /// index.
+    static std::atomic<uintptr_t> COUNTER_INDEX_LIMIT = ATOMIC_VAR_INIT(0);
+
+
+    /// Tracks the next spanning counter index to be allocated. Spanning
+    /// counter indexes are allocated downward.
+    static std::atomic<uintptr_t> NEXT_SPANNING_COUNTER_INDEX =
+        ATOMIC_VAR_INIT(MAX_COUNTER_INDEX);
+
+
+    /// Return the next counter index for an inherited index.
+    ///
+    /// Note: The counter and spanning counter allocators each publish their
+    ///       allocation before checking the other's, so that at least one of
+    ///       two racing allocations of the same counter index fails.
+    uintptr_t next_counter_index(uintptr_t inherited_index) throw() {
+        ASSERT(inherited_index < NUM_INHERITED_INDEXES);
+
+        const uintptr_t index(
+            NEXT_COUNTER_INDEX[inherited_index].fetch_add(1));
+
+        uintptr_t limit(COUNTER_INDEX_LIMIT.load());
+        while(limit <= index) {
+            if(COUNTER_INDEX_LIMIT.compare_exchange_weak(limit, index + 1)) {
+                break;
+            }
+        }
+
+        if(index > NEXT_SPANNING_COUNTER_INDEX.load()) {
+            return MAX_COUNTER_INDEX + 1;
+        }
+
+        return index;
+    }
+
+
+    /// Return the next counter index for an object that spans more than one
+    /// inherited index.
+    uintptr_t next_spanning_counter_index(void) throw() {
+        uintptr_t index(NEXT_SPANNING_COUNTER_INDEX.load());
+        do {
+            if(!index || index < COUNTER_INDEX_LIMIT.load()) {
+                return MAX_COUNTER_INDEX + 1;
+            }
+        } while(!NEXT_SPANNING_COUNTER_INDEX.compare_exchange_weak(
+            index, index - 1));
+
+        if(index < COUNTER_INDEX_LIMIT.load()) {
+            return MAX_COUNTER_INDEX + 1;
+        }
+
+        return index;
+    }
+
+#else
+
     /// Tracks the next counter index to be allocated.
     static std::atomic<uintptr_t> NEXT_COUNTER_INDEX = ATOMIC_VAR_INIT(0);
 
@@ -23,6 +87,8 @@ namespace client { namespace wp {
         return NEXT_COUNTER_INDEX.fetch_add(1);
     }
 
+#endif /* WP_USE_INHERITED_INDEX */
+
 
     /// Find memory operands that might need to be checked for watchpoints.
     /// If one is found, then num_ops is incremented, and the operand
@@ -383,6 +449,481 @@ namespace client { namespace wp {
     }
 
 
+    enum {
+        /// Maximum (absolute) displacement of a memory operand whose base
+        /// register can be unwatched in place. Larger displacements suggest
+        /// that the base register is an offset into some global data, and not
+        /// a (potentially) watched address.
+        MAX_ELIDED_DISPLACEMENT = 1 << 16
+    };
+
+
+    /// Returns the base register of every memory operand of `in` if all of
+    /// `in`'s memory operands are of the form `disp(R)`, where `R` is a 64-bit
+    /// general-purpose register, and if those operands would otherwise be
+    /// checked for watchpoints. Returns `DR_REG_NULL` otherwise.
+    static dynamorio::reg_id_t elidable_base_reg(
+        watchpoint_tracker &tracker,
+        instruction in
+    ) throw() {
+        if(in.is_mangled() || in.is_cti()
+        || dynamorio::OP_lea == in.op_code()
+        || dynamorio::OP_nop_modrm == in.op_code()
+        || dynamorio::OP_leave == in.op_code()
+        || dynamorio::OP_enter == in.op_code()
+        || dynamorio::OP_push == in.op_code()
+        || dynamorio::OP_pop == in.op_code()) {
+            return dynamorio::DR_REG_NULL;
+        }
+
+        memset(&tracker, 0, sizeof tracker);
+        tracker.in = in;
+        in.for_each_operand(wp::find_memory_operand, tracker);
+
+        if(!tracker.num_ops
+        || tracker.reads_from_rsp
+        || tracker.writes_to_rsp) {
+            return dynamorio::DR_REG_NULL;
+        }
+
+        dynamorio::reg_id_t base_reg(dynamorio::DR_REG_NULL);
+        for(unsigned i(0); i < tracker.num_ops; ++i) {
+            const operand op(*(tracker.ops[i]));
+            const int disp(op.value.base_disp.disp);
+
+            // Only 64-bit general-purpose base registers can hold a watched
+            // address, e.g. a 32-bit base (from an address-size prefix) can't
+            // be unwatched in place.
+            if(op.seg.segment
+            || op.value.base_disp.index_reg
+            || !op.value.base_disp.base_reg
+            || !dynamorio::reg_is_gpr(op.value.base_disp.base_reg)
+            || !dynamorio::reg_is_64bit(op.value.base_disp.base_reg)
+            || MAX_ELIDED_DISPLACEMENT <= disp
+            || -MAX_ELIDED_DISPLACEMENT >= disp
+            || (base_reg && base_reg != op.value.base_disp.base_reg)) {
+                return dynamorio::DR_REG_NULL;
+            }
+
+            base_reg = op.value.base_disp.base_reg;
+        }
+
+        return base_reg;
+    }
+
+
+    /// Returns true iff `in` uses `reg` for anything other than the base
+    /// register of a memory operand, or if `in` writes to `reg`.
+    static bool uses_reg_as_non_base(
+        instruction in,
+        dynamorio::reg_id_t reg
+    ) throw() {
+        if(dynamorio::instr_writes_to_reg(in.instr, reg)) {
+            return true;
+        }
+
+        const unsigned num_srcs(dynamorio::instr_num_srcs(in.instr));
+        for(unsigned i(0); i < num_srcs; ++i) {
+            const dynamorio::opnd_t op(dynamorio::instr_get_src(in.instr, i));
+            if(dynamorio::REG_kind == op.kind
+            && dynamorio::reg_overlap(op.value.reg, reg)) {
+                return true;
+            }
+
+            if(dynamorio::BASE_DISP_kind == op.kind
+            && dynamorio::reg_overlap(op.value.base_disp.index_reg, reg)) {
+                return true;
+            }
+        }
+
+        const unsigned num_dsts(dynamorio::instr_num_dsts(in.instr));
+        for(unsigned i(0); i < num_dsts; ++i) {
+            const dynamorio::opnd_t op(dynamorio::instr_get_dst(in.instr, i));
+            if(dynamorio::BASE_DISP_kind == op.kind
+            && dynamorio::reg_overlap(op.value.base_disp.index_reg, reg)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    /// Returns true iff the value of `reg` might be read after `in`. This is
+    /// conservative: it assumes that `reg` is live across CTIs.
+    static bool reg_might_be_live_after(
+        instruction in,
+        dynamorio::reg_id_t reg
+    ) throw() {
+        for(in = in.next(); in.is_valid(); in = in.next()) {
+            if(in.is_cti() || dynamorio::instr_reads_from_reg(in.instr, reg)) {
+                return true;
+            }
+
+            // Writes to the 32- or 64-bit version of `reg` redefine all of
+            // `reg`; writes to the 8- or 16-bit versions don't.
+            const unsigned num_dsts(dynamorio::instr_num_dsts(in.instr));
+            for(unsigned i(0); i < num_dsts; ++i) {
+                const dynamorio::opnd_t op(
+                    dynamorio::instr_get_dst(in.instr, i));
+                if(dynamorio::REG_kind != op.kind
+                || !dynamorio::reg_overlap(op.value.reg, reg)) {
+                    continue;
+                }
+
+                const dynamorio::opnd_size_t size(
+                    dynamorio::reg_get_size(op.value.reg));
+                if(dynamorio::OPSZ_8 == size || dynamorio::OPSZ_4 == size) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+
+    /// Returns true iff the carry flag is definitely written before it is
+    /// read, starting at `in`.
+    static bool carry_flag_is_dead_at(instruction in) throw() {
+        for(; in.is_valid(); in = in.next()) {
+            const unsigned eflags(dynamorio::instr_get_eflags(in));
+            if(eflags & EFLAGS_READ_CF) {
+                return false;
+            } else if(eflags & EFLAGS_WRITE_CF) {
+                return true;
+            } else if(in.is_cti()) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+
+    /// Returns true iff the carry flag is definitely written before it is
+    /// read after `in`.
+    static bool carry_flag_is_dead_after(instruction in) throw() {
+        return carry_flag_is_dead_at(in.next());
+    }
+
+
+    /// Add instructions after `in` that unwatch `reg` in place if it contains
+    /// a watched address. This clobbers the carry flag. Returns the last
+    /// added instruction.
+    static instruction insert_unwatch_after(
+        instruction_list &ls,
+        instruction in,
+        dynamorio::reg_id_t reg,
+        bool check_bit_47
+    ) throw() {
+        const operand addr(reg);
+        const operand addr_16(register_manager::scale(reg, REG_16));
+        instruction not_a_watchpoint(label_());
+
+        in = ls.insert_after(in,
+            mangled(bt_(addr, int8_(DISTINGUISHING_BIT_OFFSET))));
+        in = ls.insert_after(in, mangled(
+            IF_USER_ELSE(jnb_, jb_)(instr_(not_a_watchpoint))));
+
+        if(check_bit_47) {
+            in = ls.insert_after(in,
+                mangled(bt_(addr, int8_(DISTINGUISHING_BIT_OFFSET - 1))));
+            in = ls.insert_after(in, mangled(
+                IF_USER_ELSE(jb_, jnb_)(instr_(not_a_watchpoint))));
+        }
+
+        // Mask the high order 16 bits.
+        in = ls.insert_after(in, mangled(bswap_(addr)));
+        in = ls.insert_after(in, mangled(mov_imm_(
+            addr_16, int16_(IF_USER_ELSE(0ULL, ~0ULL)))));
+        in = ls.insert_after(in, mangled(bswap_(addr)));
+        return ls.insert_after(in, not_a_watchpoint);
+    }
+
+
+    /// Eliminate redundant watchpoint checks by recognising sequences of
+    /// instructions that dereference the same base register, where the base
+    /// register is not redefined (or otherwise used) within the sequence.
+    ///
+    /// The first instruction of the sequence is instrumented as usual. After
+    /// it, the base register is unwatched in place, which guards the
+    /// remaining dereferences. Those dereferences are then marked as mangled
+    /// so that they aren't instrumented. If the base register is live after
+    /// the sequence then it is saved before being unwatched, and restored
+    /// after the sequence, so that its watched bits are retained.
+    void redundant_check_eliminator(
+        watchpoint_tracker &tracker,
+        instruction_list &ls,
+        bool check_bit_47
+    ) throw() {
+        instruction next_in;
+        for(instruction in(ls.first()); in.is_valid(); in = next_in) {
+            next_in = in.next();
+
+            const dynamorio::reg_id_t base_reg(elidable_base_reg(tracker, in));
+            if(!base_reg || uses_reg_as_non_base(in, base_reg)) {
+                continue;
+            }
+
+            // Find the last instruction that can be guarded by checking `in`.
+            // The sequence is bounded by the same kinds of instructions as
+            // a register spilling region, as well as by any redefinitions or
+            // non-address uses of `base_reg`.
+            instruction last_elided;
+            unsigned num_elided(0);
+            for(instruction succ(in.next());
+                succ.is_valid();
+                succ = succ.next()) {
+
+                if(succ.is_cti() || succ.is_mangled()
+                || dynamorio::OP_push == succ.op_code()
+                || dynamorio::OP_pop == succ.op_code()
+                || dynamorio::instr_uses_reg(
+                       succ.instr, dynamorio::DR_REG_RSP)) {
+                    break;
+                }
+
+                if(base_reg == elidable_base_reg(tracker, succ)) {
+                    if(uses_reg_as_non_base(succ, base_reg)) {
+                        break;
+                    }
+                    last_elided = succ;
+                    ++num_elided;
+
+                } else if(dynamorio::instr_uses_reg(succ.instr, base_reg)) {
+                    break;
+                }
+            }
+
+            if(!num_elided || !carry_flag_is_dead_after(in)) {
+                continue;
+            }
+
+            // Only worthwhile if we eliminate more checks than the number of
+            // instructions needed to save and restore the base register.
+            const bool save_base_reg(
+                reg_might_be_live_after(last_elided, base_reg));
+            if(save_base_reg && 2 > num_elided) {
+                continue;
+            }
+
+            const operand base(base_reg);
+            instruction ret(in);
+
+            if(save_base_reg) {
+                ret = ls.insert_after(ret, mangled(push_(base)));
+            }
+
+            insert_unwatch_after(ls, ret, base_reg, check_bit_47);
+
+            // Prevent the remaining dereferences from being instrumented.
+            for(instruction succ(in.next()); ; succ = succ.next()) {
+                if(base_reg == elidable_base_reg(tracker, succ)) {
+                    succ.set_mangled();
+                }
+                if(succ == last_elided) {
+                    break;
+                }
+            }
+
+            if(save_base_reg) {
+                next_in = ls.insert_after(last_elided, mangled(pop_(base)));
+            } else {
+                next_in = last_elided;
+            }
+            next_in = next_in.next();
+        }
+    }
+
+
+    /// Find the loop head targeted by the direct CTI `cti`, if `cti` is a
+    /// back-edge to a decoded instruction of `ls` that comes before `end`.
+    static instruction find_loop_head(
+        instruction_list &ls,
+        instruction cti,
+        instruction end
+    ) throw() {
+        const operand target(cti.cti_target());
+        if(dynamorio::PC_kind != target.kind) {
+            return instruction();
+        }
+
+        for(instruction in(ls.first()); in.is_valid() && in != end;
+            in = in.next()) {
+            if(target.value.pc == in.pc()
+            && dynamorio::OP_LABEL != in.op_code()) {
+                return in;
+            }
+        }
+
+        return instruction();
+    }
+
+
+    /// Hoist the watchpoint check of a loop-invariant base register out of a
+    /// loop that is contained within a basic block. The back-edge of the loop
+    /// is either the block's conditional branch or its fall-through JMP (e.g.
+    /// if the conditional branch was inverted by PGO), and it targets any
+    /// decoded instruction of the block, i.e. a block of the form:
+    ///
+    ///             ...
+    ///     head:   ...
+    ///             jcc <head>
+    ///             jmp <exit>
+    ///
+    /// The base register must only be used as the base register of memory
+    /// operands within the loop. The block is converted into:
+    ///
+    ///             ...
+    ///             lea -(REDZONE_SIZE + 8)(%rsp), %rsp
+    ///             mov R, (%rsp)
+    ///             prefetcht0 disp(R)
+    ///             <unwatch R>
+    ///     head:   ...
+    ///             jcc <head>
+    ///             mov (%rsp), R
+    ///             lea (REDZONE_SIZE + 8)(%rsp), %rsp
+    ///             jmp <exit>
+    ///
+    /// where the `PREFETCHT0` is instrumented as usual, and stands in for all
+    /// dereferences of `R` within the loop, which are not instrumented. The
+    /// saved base register is kept below the redzone for the whole loop. It
+    /// is not saved with a `PUSH`/`POP` pair, because the redzone guards that
+    /// `post_process_instructions` adds around an introduced `POP` would stop
+    /// at the back-edge, and so would not cover the matching `PUSH`.
+    ///
+    /// In user space, the loop must not contain any other memory operands.
+    /// Their instrumentation could spill registers within a redzone guard
+    /// that spans the loop head, which the back-edge would enter unguarded.
+    ///
+    /// Back-edges into the middle of a block would otherwise be resolved by
+    /// `fixup_branches` splitting the block, and loops spanning several blocks
+    /// of a trace are coalesced into a single block by `fixup_branches`, so
+    /// both kinds of loop reach this pass as loops within one block.
+    void loop_invariant_check_hoister(
+        watchpoint_tracker &tracker,
+        instruction_list &ls,
+        bool check_bit_47
+    ) throw() {
+        instruction last(ls.last());
+        if(!last.is_valid() || last.is_mangled()
+        || dynamorio::OP_jmp != last.op_code()) {
+            return;
+        }
+
+        instruction cbr(last.prev());
+        if(!cbr.is_valid() || cbr.is_mangled()
+        || !dynamorio::instr_is_cbr(cbr.instr)) {
+            return;
+        }
+
+        // Figure out which of the two CTIs is the back-edge.
+        instruction back_edge(cbr);
+        instruction head(find_loop_head(ls, cbr, cbr));
+        if(!head.is_valid()) {
+            back_edge = last;
+            head = find_loop_head(ls, last, cbr);
+            if(!head.is_valid()) {
+                return;
+            }
+        }
+
+        // Make sure that the loop body is straight-line code that leaves the
+        // stack pointer alone.
+        for(instruction in(head); in != cbr; in = in.next()) {
+            if(in.is_cti() || in.is_mangled()
+            || dynamorio::OP_push == in.op_code()
+            || dynamorio::OP_pop == in.op_code()
+            || dynamorio::instr_uses_reg(in.instr, dynamorio::DR_REG_RSP)) {
+                return;
+            }
+        }
+
+        if(!carry_flag_is_dead_at(head)) {
+            return;
+        }
+
+        // Find the first loop-invariant base register.
+        instruction first_use;
+        dynamorio::reg_id_t base_reg(dynamorio::DR_REG_NULL);
+        for(first_use = head; first_use != cbr; first_use = first_use.next()) {
+            base_reg = elidable_base_reg(tracker, first_use);
+            if(!base_reg) {
+                continue;
+            }
+
+            for(instruction in(head); in != cbr; in = in.next()) {
+                if(!dynamorio::instr_uses_reg(in.instr, base_reg)) {
+                    continue;
+                }
+
+                if(base_reg != elidable_base_reg(tracker, in)
+                || uses_reg_as_non_base(in, base_reg)) {
+                    base_reg = dynamorio::DR_REG_NULL;
+                    break;
+                }
+            }
+
+            if(base_reg) {
+                break;
+            }
+        }
+
+        if(!base_reg) {
+            return;
+        }
+
+#if !CONFIG_ENV_KERNEL
+        for(instruction in(head); in != cbr; in = in.next()) {
+            if((dynamorio::instr_reads_memory(in.instr)
+                || dynamorio::instr_writes_memory(in.instr))
+            && base_reg != elidable_base_reg(tracker, in)) {
+                return;
+            }
+        }
+#endif
+
+        // Check the first dereferenced address before entering the loop.
+        elidable_base_reg(tracker, first_use);
+        operand first_op(*(tracker.ops[0]));
+        first_op.size = dynamorio::OPSZ_1;
+
+        const operand base(base_reg);
+        ls.insert_before(head, mangled(
+            lea_(reg::rsp, reg::rsp[-(REDZONE_SIZE + 8)])));
+        ls.insert_before(head, mangled(mov_st_(reg::rsp[0], base)));
+        insert_unwatch_after(
+            ls, ls.insert_before(head, prefetcht0_(first_op)),
+            base_reg, check_bit_47);
+
+        // Prevent the dereferences in the loop from being instrumented.
+        instruction loop_head(ls.insert_before(head, label_()));
+        for(instruction in(head); in != cbr; in = in.next()) {
+            if(base_reg == elidable_base_reg(tracker, in)) {
+                in.set_mangled();
+            }
+        }
+
+        // Loop back to after the check, and restore the watched base register
+        // when leaving the loop.
+        back_edge.set_cti_target(instr_(loop_head));
+        back_edge.set_mangled();
+
+        if(back_edge == cbr) {
+            ls.insert_after(
+                ls.insert_after(cbr, mangled(mov_ld_(base, reg::rsp[0]))),
+                mangled(lea_(reg::rsp, reg::rsp[REDZONE_SIZE + 8])));
+        } else {
+            const operand exit_target(cbr.cti_target());
+            instruction restore(ls.append(label_()));
+            ls.append(mangled(mov_ld_(base, reg::rsp[0])));
+            ls.append(mangled(lea_(reg::rsp, reg::rsp[REDZONE_SIZE + 8])));
+            ls.append(jmp_(exit_target));
+            cbr.set_cti_target(instr_(restore));
+            cbr.set_mangled();
+        }
+    }
+
+
     /// Mangle something of the form `PUSH ...(...)`.
     static instruction mangle_push(
         watchpoint_tracker &tracker,
@@ -649,9 +1190,8 @@ namespace client { namespace wp {
     /// into the instruction list.
     void watchpoint_tracker::post_process_instructions(instruction_list &ls) {
         UNUSED(ls);
-        /// TODO: Implement `TARGETED_BY_CTI` in instruction state bits, then
-        ///       look for PUSH X; POP X or PUSH X; untargeted labels; POP X and
-        ///       elide these instructions.
+        /// Note: `PUSH X; POP X` pairs (possibly separated by untargeted
+        ///       labels) are elided later by the trace peephole optimiser.
 
 #if !CONFIG_ENV_KERNEL
 
@@ -741,11 +1281,13 @@ namespace client { namespace wp {
                 } else if(in.pc()) {
 
                     // Boundary conditions; CALL and RET are caught by the CTI
-                    // check above, and PUSH and POP are the other two stack-
+                    // check above, and PUSH(F) and POP(F) are the other stack-
                     // based instructions where we can't change the displacement
                     // from RSP in the operand.
                     if(dynamorio::OP_push == in.op_code()
                     || dynamorio::OP_pop == in.op_code()
+                    || dynamorio::OP_pushf == in.op_code()
+                    || dynamorio::OP_popf == in.op_code()
                     || dynamorio::OP_enter == in.op_code()
                     || dynamorio::OP_leave == in.op_code()) {
                         guarded = false;
@@ -766,6 +1308,8 @@ namespace client { namespace wp {
                 // Introduced instruction.
                 } else if(dynamorio::OP_push != in.op_code()
                        && dynamorio::OP_pop != in.op_code()
+                       && dynamorio::OP_pushf != in.op_code()
+                       && dynamorio::OP_popf != in.op_code()
                        && dynamorio::OP_enter != in.op_code()
                        && dynamorio::OP_leave != in.op_code()
                        && !in.is_call()) {
@@ -1199,7 +1743,7 @@ namespace client { namespace wp {
             ls.insert_before(before, bswap_(original_addr));
 
             // target of the jump if this isn't a watched address.
-            ls.insert_before(before, not_a_watchpoint);
+            this->end_labels[i] = ls.insert_before(before, not_a_watchpoint);
 
             // Restore a register after the operand if necessary.
             if(restore_unwatched_reg) {
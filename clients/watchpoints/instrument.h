@@ -56,6 +56,9 @@ namespace client {
             /// Offset of inherited index bits.
             INHERITED_INDEX_OFFSET      = WP_INHERITED_INDEX_GRANULARITY,
 
+            /// Number of distinct inherited indexes.
+            NUM_INHERITED_INDEXES       = WP_NUM_INHERITED_INDEXES,
+
             /// Mask for extracting the inherited index.
 #if WP_USE_INHERITED_INDEX
             INHERITED_INDEX_MASK        = (
@@ -67,8 +70,25 @@ namespace client {
             INHERITED_INDEX_MASK        = (1 << NUM_INHERITED_INDEX_BITS) - 1,
 #endif
 
+            /// Maximum value (inclusive) of the index bits of a watched
+            /// address, i.e. of a counter index tagged with a generation.
+            MAX_TAINTED_INDEX           = 0x7FFFU,
+
+            /// Number of index bits of a watched address that hold the
+            /// generation of the address's descriptor.
+            NUM_GENERATION_BITS         = WP_GENERATION_WIDTH,
+
+            /// Number of index bits of a watched address that hold the
+            /// counter index.
+            NUM_COUNTER_INDEX_BITS      = (
+                WP_COUNTER_INDEX_WIDTH - 1 - NUM_GENERATION_BITS),
+
             /// Maximum counter index (inclusive).
-            MAX_COUNTER_INDEX           = 0x7FFFU,
+            MAX_COUNTER_INDEX           = (
+                MAX_TAINTED_INDEX >> NUM_GENERATION_BITS),
+
+            /// Maximum generation (inclusive).
+            MAX_GENERATION              = (1U << NUM_GENERATION_BITS) - 1,
 
             /// Maximum number of watchpoints for the given number of high-order
             /// bits.
@@ -170,6 +190,11 @@ namespace client {
             granary::instruction labels[MAX_NUM_OPERANDS];
 
 
+            /// Instruction labels that end the slow paths beginning at
+            /// `labels`. Unwatched addresses jump directly to these labels.
+            granary::instruction end_labels[MAX_NUM_OPERANDS];
+
+
             /// Conveniences for specific watchpoint implementations so that
             /// they can know where the watchpoint info is stored.
             granary::operand regs[MAX_NUM_OPERANDS];
@@ -259,6 +284,50 @@ namespace client {
         ) throw();
 
 
+        /// Eliminate redundant watchpoint checks by recognising sequences of
+        /// instructions that dereference the same base register, checking
+        /// only the first dereference, and then unwatching the base register
+        /// for the remaining ones.
+        void redundant_check_eliminator(
+            watchpoint_tracker &tracker,
+            granary::instruction_list &ls,
+            bool check_bit_47
+        ) throw();
+
+
+        /// Hoist the watchpoint check of a loop-invariant base register out of
+        /// a loop that is contained within a basic block.
+        void loop_invariant_check_hoister(
+            watchpoint_tracker &tracker,
+            granary::instruction_list &ls,
+            bool check_bit_47
+        ) throw();
+
+
+        /// Specifies whether or not a read/write policy needs to visit every
+        /// access through a watched base register, or only the first of a
+        /// sequence of accesses through the same (unchanged) base register.
+        /// Policies opt in to the latter with `ELIDE_REDUNDANT_CHECKS`.
+        template <typename>
+        struct elide_redundant_checks {
+            enum {
+                VALUE = false
+            };
+        };
+
+
+        /// Specifies whether or not accesses through watched addresses are
+        /// rare for a read/write policy. If so, then the slow paths that
+        /// handle watched addresses are marked as cold, and are moved to the
+        /// end of their traces. Policies opt in with `COLD_WATCHED_ACCESSES`.
+        template <typename>
+        struct cold_watched_accesses {
+            enum {
+                VALUE = false
+            };
+        };
+
+
 #endif /* GRANARY_DONT_INCLUDE_CSTDLIB */
 
 
@@ -351,7 +420,39 @@ namespace client {
 
         /// Return the counter index component of a combined index.
         inline uintptr_t counter_index_of(uintptr_t ptr) throw() {
-            return ptr >> (DISTINGUISHING_BIT_OFFSET + 1);
+            return (ptr >> (DISTINGUISHING_BIT_OFFSET + 1)) & MAX_COUNTER_INDEX;
+        }
+
+
+        /// Return the descriptor generation that a watched address was tainted
+        /// with. This is always 0 if generations are disabled.
+        inline uintptr_t generation_of(uintptr_t ptr) throw() {
+#if WP_GENERATION_WIDTH
+            return ptr >> (
+                DISTINGUISHING_BIT_OFFSET + 1 + NUM_COUNTER_INDEX_BITS);
+#else
+            UNUSED(ptr);
+            return 0;
+#endif
+        }
+
+
+        /// Return the descriptor generation of a watched address.
+        template <typename T>
+        inline uintptr_t generation_of(T *addr) throw() {
+            return generation_of(reinterpret_cast<uintptr_t>(addr));
+        }
+
+
+        /// Tag a counter index with a descriptor generation. The tagged index
+        /// can be returned as the counter index by a descriptor's allocator,
+        /// and is what is stored in the watched address.
+        inline uintptr_t tag_counter_index(
+            uintptr_t counter_index,
+            uintptr_t generation
+        ) throw() {
+            return counter_index | (
+                (generation & MAX_GENERATION) << NUM_COUNTER_INDEX_BITS);
         }
 
 
@@ -389,10 +490,40 @@ namespace client {
         }
 
 
-        /// Return the next counter index.
+        /// Return the next counter index for an object whose inherited index
+        /// is `inherited_index`. Each inherited index has its own space of
+        /// counter indexes. If that space is exhausted then the returned
+        /// index is greater than `MAX_COUNTER_INDEX`.
         uintptr_t next_counter_index(uintptr_t inherited_index=0) throw();
 
 
+#if WP_USE_INHERITED_INDEX
+        /// Return the next counter index for an object that spans more than
+        /// one inherited index. Spanning counter indexes are allocated down
+        /// from `MAX_COUNTER_INDEX`, and are never returned by
+        /// `next_counter_index`, so that a spanning object can duplicate its
+        /// descriptor into the tables of every inherited index that it
+        /// spans. If there are no more counter indexes then the returned index
+        /// is greater than `MAX_COUNTER_INDEX`.
+        uintptr_t next_spanning_counter_index(void) throw();
+
+
+        /// Returns the number of inherited indexes spanned by the object
+        /// `[addr, addr + size)`.
+        inline uintptr_t num_inherited_indexes_spanned(
+            uintptr_t addr,
+            size_t size
+        ) throw() {
+            const uintptr_t first(addr >> INHERITED_INDEX_OFFSET);
+            const uintptr_t last((addr + size - 1) >> INHERITED_INDEX_OFFSET);
+            const uintptr_t num_spanned(last - first + 1);
+            return num_spanned < NUM_INHERITED_INDEXES
+                ? num_spanned
+                : NUM_INHERITED_INDEXES;
+        }
+#endif /* WP_USE_INHERITED_INDEX */
+
+
         /// Destructure a combined index into its counter and inherited indexes.
         inline void destructure_combined_index(
             const uintptr_t index,
@@ -401,7 +532,7 @@ namespace client {
         ) throw() {
 #if WP_USE_INHERITED_INDEX
             counter_index = index >> NUM_INHERITED_INDEX_BITS;
-            inherited_index = index & INHERITED_INDEX_MASK;
+            inherited_index = index & (NUM_INHERITED_INDEXES - 1);
 #else
             counter_index = index;
             inherited_index = 0U;
@@ -482,11 +613,11 @@ namespace client {
                     return ADDRESS_NOT_WATCHED;
                 }
 
-                ASSERT(counter_index <= MAX_COUNTER_INDEX);
+                ASSERT(counter_index <= MAX_TAINTED_INDEX);
 
                 if(desc) {
-                    const uintptr_t index(
-                        combined_index(counter_index, inherited_index));
+                    const uintptr_t index(combined_index(
+                        counter_index & MAX_COUNTER_INDEX, inherited_index));
                     desc_type::assign(desc, index);
                 }
 
@@ -511,12 +642,12 @@ namespace client {
                     return ADDRESS_NOT_WATCHED;
                 }
 
-                ASSERT(counter_index <= MAX_COUNTER_INDEX);
+                ASSERT(counter_index <= MAX_TAINTED_INDEX);
 
                 // Construct the descriptor and add it to the table.
                 if(desc) {
-                    const uintptr_t index(
-                        combined_index(counter_index, inherited_index));
+                    const uintptr_t index(combined_index(
+                        counter_index & MAX_COUNTER_INDEX, inherited_index));
 
                     DescType::init(desc, init_args...);
                     DescType::assign(desc, index);
@@ -571,7 +702,7 @@ namespace client {
             }
 
             // Taint the pointer.
-            counter_index &= MAX_COUNTER_INDEX;
+            counter_index &= MAX_TAINTED_INDEX;
             counter_index <<= 1;
             counter_index |= DISTINGUISHING_BIT;
             counter_index <<= DISTINGUISHING_BIT_OFFSET;
@@ -595,7 +726,7 @@ namespace client {
                 return;
             }
 
-            counter_index &= MAX_COUNTER_INDEX;
+            counter_index &= MAX_TAINTED_INDEX;
             counter_index <<= 1;
             counter_index |= DISTINGUISHING_BIT;
             counter_index <<= DISTINGUISHING_BIT_OFFSET;
@@ -644,6 +775,20 @@ namespace client {
             IF_KERNEL( const bool in_user_access_zone(
                 WP_CHECK_FOR_USER_ADDRESS || accesses_user_data()); )
 
+#if WP_HOIST_LOOP_INVARIANT_CHECKS
+            if(wp::elide_redundant_checks<Watcher>::VALUE) {
+                loop_invariant_check_hoister(
+                    tracker, ls, IF_USER_ELSE(false, in_user_access_zone));
+            }
+#endif /* WP_HOIST_LOOP_INVARIANT_CHECKS */
+
+#if WP_ELIDE_REDUNDANT_CHECKS
+            if(wp::elide_redundant_checks<Watcher>::VALUE) {
+                redundant_check_eliminator(
+                    tracker, ls, IF_USER_ELSE(false, in_user_access_zone));
+            }
+#endif /* WP_ELIDE_REDUNDANT_CHECKS */
+
 #if WP_ENABLE_REGISTER_REGIONS
             region_register_spiller(tracker, ls);
 #endif /* WP_ENABLE_REGISTER_REGIONS */
@@ -737,6 +882,23 @@ namespace client {
                         Watcher::visit_write(bb, ls, tracker, i);
                     }
                 }
+
+#if CONFIG_OPTIMISE_HOT_COLD_SPLIT
+                // Watched addresses are rare for this policy, so keep the
+                // slow paths that handle them out of the hot code.
+                if(wp::cold_watched_accesses<Watcher>::VALUE) {
+                    for(unsigned i(0); i < tracker.num_ops; ++i) {
+                        if(!tracker.labels[i].is_valid()) {
+                            continue;
+                        }
+                        for(instruction slow_in(tracker.labels[i]);
+                            slow_in != tracker.end_labels[i];
+                            slow_in = slow_in.next()) {
+                            cold(slow_in);
+                        }
+                    }
+                }
+#endif /* CONFIG_OPTIMISE_HOT_COLD_SPLIT */
             }
 
             // Apply any minor peephole optimisations to get rid of redundant
@@ -851,6 +1013,32 @@ namespace client {
     }
 
 
+/// Used to declare that a read/write policy only needs to visit the first of a
+/// sequence of accesses through the same base register.
+#define ELIDE_REDUNDANT_CHECKS(rw_policy_name) \
+    namespace wp { \
+        template <> \
+        struct elide_redundant_checks<rw_policy_name> { \
+            enum { \
+                VALUE = true \
+            }; \
+        }; \
+    }
+
+
+/// Used to declare that accesses through watched addresses are rare for a
+/// read/write policy, and so its slow paths should be moved out of line.
+#define COLD_WATCHED_ACCESSES(rw_policy_name) \
+    namespace wp { \
+        template <> \
+        struct cold_watched_accesses<rw_policy_name> { \
+            enum { \
+                VALUE = true \
+            }; \
+        }; \
+    }
+
+
 #define DEFINE_READ_VISITOR(rw_policy_name, ...) \
     namespace wp { \
         void rw_policy_name::visit_read( \
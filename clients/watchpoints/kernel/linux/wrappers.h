@@ -26,6 +26,32 @@ using namespace client::wp;
 #endif
 
 
+/// Shadow memory watchpoint policy wrappers. These share the allocation
+/// wrappers of the bounds checking policy.
+#ifdef CLIENT_SHADOW_MEMORY
+#   define WRAP_CONTEXT APP
+#   include "clients/watchpoints/clients/bounds_checker/kernel/linux/wrappers.h"
+#   if CONFIG_FEATURE_INSTRUMENT_HOST
+#       undef WRAP_CONTEXT
+#       define WRAP_CONTEXT HOST
+#       include "clients/watchpoints/clients/bounds_checker/kernel/linux/wrappers.h"
+#   endif
+#endif
+
+
+/// Allocation site profiling watchpoint policy wrappers. These share the
+/// allocation wrappers of the bounds checking policy.
+#ifdef CLIENT_WATCHPOINT_PROFILE
+#   define WRAP_CONTEXT APP
+#   include "clients/watchpoints/clients/bounds_checker/kernel/linux/wrappers.h"
+#   if CONFIG_FEATURE_INSTRUMENT_HOST
+#       undef WRAP_CONTEXT
+#       define WRAP_CONTEXT HOST
+#       include "clients/watchpoints/clients/bounds_checker/kernel/linux/wrappers.h"
+#   endif
+#endif
+
+
 /// Null policy that taints all addresses.
 #ifdef CLIENT_WATCHPOINT_WATCHED
 #   include "clients/watchpoints/clients/everything_watched/kernel/linux/wrappers.h"
@@ -21,7 +21,10 @@
 #endif
 
 
-#ifdef CLIENT_WATCHPOINT_BOUND
+#if defined(CLIENT_WATCHPOINT_BOUND) \
+ || defined(CLIENT_WATCHPOINT_PROFILE) \
+ || defined(CLIENT_WATCHPOINT_LEAK) \
+ || defined(CLIENT_SHADOW_MEMORY)
 #   include "clients/watchpoints/clients/bounds_checker/user/posix/wrappers.h"
 #endif
 
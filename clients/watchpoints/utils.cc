@@ -68,5 +68,111 @@ namespace client { namespace wp {
     unsigned operand_size_order(operand_size size) throw() {
         return SIZE_TO_ORDER[size];
     }
-}}
 
+
+    /// Add instructions after `in` that compute the descriptor table index
+    /// of the watched address in `addr` into `index`.
+    instruction insert_descriptor_index_after(
+        instruction_list &ls,
+        instruction in,
+        operand index,
+        operand addr,
+        operand IF_INHERITED_INDEX( scratch )
+    ) throw() {
+        in = ls.insert_after(in, mov_ld_(index, addr));
+        in = ls.insert_after(in,
+            shr_(index, int8_(DISTINGUISHING_BIT_OFFSET + 1)));
+
+#if WP_GENERATION_WIDTH
+        in = ls.insert_after(in, and_(index, int32_(MAX_COUNTER_INDEX)));
+#endif /* WP_GENERATION_WIDTH */
+
+#if WP_USE_INHERITED_INDEX
+        in = ls.insert_after(in,
+            shl_(index, int8_(NUM_INHERITED_INDEX_BITS)));
+        in = ls.insert_after(in, mov_ld_(scratch, addr));
+        in = ls.insert_after(in,
+            shr_(scratch, int8_(INHERITED_INDEX_OFFSET)));
+        in = ls.insert_after(in,
+            and_(scratch, int32_(NUM_INHERITED_INDEXES - 1)));
+        in = ls.insert_after(in, or_(index, scratch));
+#endif /* WP_USE_INHERITED_INDEX */
+
+        return in;
+    }
+
+
+    /// Returns true iff the arithmetic flags are dead after `in`. Flags written
+    /// by instructions introduced by Granary or by instrumentation aren't
+    /// counted as killed, because those instructions might only restore some
+    /// of the flags (e.g. the `BT` that restores `CF`). Flags read by them
+    /// (e.g. by a `PUSHF`) are still counted as live.
+    bool arithmetic_flags_are_dead_after(instruction in) throw() {
+        enum : unsigned {
+            READ_ARITH_FLAGS = EFLAGS_READ_CF | EFLAGS_READ_PF
+                             | EFLAGS_READ_AF | EFLAGS_READ_ZF
+                             | EFLAGS_READ_SF | EFLAGS_READ_OF,
+
+            /// Distance between the `EFLAGS_READ_*` and `EFLAGS_WRITE_*` bits
+            /// of the same flag.
+            WRITE_TO_READ_SHIFT = 11
+        };
+
+        static_assert(
+            EFLAGS_WRITE_CF == (EFLAGS_READ_CF << WRITE_TO_READ_SHIFT)
+         && EFLAGS_WRITE_OF == (EFLAGS_READ_OF << WRITE_TO_READ_SHIFT),
+            "The `EFLAGS_WRITE_*` bits should mirror the `EFLAGS_READ_*` bits.");
+
+        // The arithmetic flags (as `EFLAGS_READ_*` bits) that are definitely
+        // written between `in` and the current instruction.
+        unsigned written_flags(0);
+
+        for(in = in.next(); in.is_valid(); in = in.next()) {
+            const unsigned eflags(dynamorio::instr_get_eflags(in));
+            if(eflags & READ_ARITH_FLAGS & ~written_flags) {
+                return false;
+            }
+
+            if(in.pc()) {
+                written_flags |=
+                    (eflags >> WRITE_TO_READ_SHIFT) & READ_ARITH_FLAGS;
+                if(READ_ARITH_FLAGS == written_flags) {
+                    return true;
+                }
+            }
+
+            if(in.is_cti()) {
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+
+    /// Returns true iff `in` is a REP-prefixed string instruction.
+    bool is_rep_string_instruction(instruction in) throw() {
+        switch(in.op_code()) {
+        case dynamorio::OP_rep_ins:
+        case dynamorio::OP_rep_outs:
+        case dynamorio::OP_rep_movs:
+        case dynamorio::OP_rep_stos:
+        case dynamorio::OP_rep_lods:
+        case dynamorio::OP_rep_cmps:
+        case dynamorio::OP_repne_cmps:
+        case dynamorio::OP_rep_scas:
+        case dynamorio::OP_repne_scas:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+
+    /// Returns the counter register operand of a REP-prefixed string
+    /// instruction. The counter is always the last destination operand.
+    operand rep_counter_of(instruction in) throw() {
+        ASSERT(is_rep_string_instruction(in));
+        return in.instr->u.o.dsts[in.instr->num_dsts - 1];
+    }
+}}
@@ -20,6 +20,35 @@ namespace client { namespace wp {
     /// Convert an operand size into an integer `i` such that `2^i` is the
     /// number of bytes required to represent an operand of that size.
     unsigned operand_size_order(operand_size) throw();
+
+
+    /// Add instructions after `in` that compute the descriptor table index
+    /// of the watched address in `addr` into `index`. This clobbers the
+    /// arithmetic flags, and also `scratch` if inherited indexes are enabled.
+    granary::instruction insert_descriptor_index_after(
+        granary::instruction_list &ls,
+        granary::instruction in,
+        granary::operand index,
+        granary::operand addr,
+        granary::operand scratch
+    ) throw();
+
+
+    /// Returns true iff the arithmetic flags are dead after `in`, i.e. iff
+    /// all six of them are written before any of them is read along the
+    /// fall-through path of the instruction list. This is conservative about
+    /// control-flow instructions, whose targets are assumed to read flags,
+    /// and only native instructions are trusted to kill the flags.
+    bool arithmetic_flags_are_dead_after(granary::instruction in) throw();
+
+
+    /// Returns true iff `in` is a REP-prefixed string instruction.
+    bool is_rep_string_instruction(granary::instruction in) throw();
+
+
+    /// Returns the counter register operand of a REP-prefixed string
+    /// instruction.
+    granary::operand rep_counter_of(granary::instruction in) throw();
 }}
 
 #endif /* CLIENT_WP_UTILS_H_ */
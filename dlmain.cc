@@ -14,6 +14,7 @@
 #include "granary/attach.h"
 #include "granary/detach.h"
 #include "granary/perf.h"
+#include "granary/persist.h"
 #include "clients/report.h"
 #include <ucontext.h>
 
@@ -90,11 +91,13 @@ extern "C" {
 #endif
 
         granary::init();
+        IF_PERSIST( granary::load_code_cache(); )
         granary::attach(granary::START_POLICY);
     }
 
     __attribute__((destructor, noinline, used))
     void granary_end_program(void) {
+        IF_PERSIST( granary::save_code_cache(); )
 #ifdef CLIENT_report
         client::report();
 #endif
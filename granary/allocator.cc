@@ -399,6 +399,16 @@ namespace granary { namespace detail {
 }}
 
 
+namespace granary {
+
+    /// Returns true iff an address is within Granary's heap.
+    bool is_heap_address(const const_app_pc addr) throw() {
+        return detail::is_heap_address(
+            unsafe_cast<void *>(const_cast<app_pc>(addr)));
+    }
+}
+
+
 /// Add some illegal detach points.
 GRANARY_DETACH_POINT_ERROR(granary::detail::global_allocate)
 GRANARY_DETACH_POINT_ERROR(granary::detail::global_free)
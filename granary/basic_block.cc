@@ -15,6 +15,7 @@
 #include "granary/emit_utils.h"
 #include "granary/code_cache.h"
 #include "granary/pgo.h"
+#include "granary/persist.h"
 
 #if CONFIG_ENV_KERNEL
 #   include "granary/kernel/linux/user_address.h"
@@ -39,6 +40,10 @@ namespace granary {
         BITS_PER_BYTE = 8,
         BITS_PER_STATE = BITS_PER_BYTE / BB_BYTE_STATES_PER_BYTE,
         BITS_PER_QWORD = BITS_PER_BYTE * 8,
+
+        /// Maximum number of blocks of a trace that can be coalesced into a
+        /// single block that loops back to itself.
+        MAX_COALESCED_LOOP_BLOCKS = 4
     };
 
 
@@ -447,7 +452,8 @@ namespace granary {
         instruction_list &ls,
         instrumentation_policy &policy,
         const app_pc start_pc,
-        app_pc &end_pc
+        app_pc &end_pc,
+        unsigned num_inlined_jumps
         _IF_KERNEL( void *&user_exception_metadata )
     ) throw() {
         app_pc local_pc(start_pc);
@@ -459,6 +465,7 @@ namespace granary {
         bool uses_xmm(policy.is_in_xmm_context());
         bool fall_through_detach(false);
         bool detach_tail_call(false);
+        bool inlined_jump(false);
         const app_pc detach_app_pc(unsafe_cast<app_pc>(&detach));
         unsigned byte_len(0);
         unsigned num_decoded(0);
@@ -520,8 +527,12 @@ namespace granary {
 
             // Keep track of the end of this basic block.
             //
-            // Note: This can sometimes get out of sync if we're eliding JMPs.
-            end_pc = *pc;
+            // Note: This can sometimes get out of sync if we're eliding JMPs,
+            //       so only the first contiguous range of instructions is
+            //       treated as being part of the block.
+            if(!inlined_jump) {
+                end_pc = *pc;
+            }
 
 #if CONFIG_ENV_KERNEL
             // Stop at IRET, SYSRET, SWAPGS, or SYSEXIT. If we also see a
@@ -584,8 +595,15 @@ namespace granary {
                 }
 
                 // Unconditional JMP; ends the block, without possibility
-                // of falling through.
+                // of falling through, unless we're decoding through it.
                 if(in.is_jump()) {
+                    if(num_inlined_jumps && dynamorio::opnd_is_pc(target)) {
+                        --num_inlined_jumps;
+                        inlined_jump = true;
+                        *pc = target.value.pc;
+                        ls.remove(in);
+                        continue;
+                    }
                     break;
 
                 // CALL, if direct returns are supported then the basic
@@ -674,6 +692,7 @@ namespace granary {
     struct block_translator {
         bool translated;
         bool can_split;
+        bool coalesced_loop;
 
         block_translator *next;
         basic_block_state *state;
@@ -693,12 +712,19 @@ namespace granary {
 
         instruction_list ls;
 
+#if CONFIG_OPTIMISE_HOT_COLD_SPLIT
+        instruction cold_start_label;
+        instruction cold_end_label;
+        instruction_list cold_ls;
+#endif
+
         unsigned num_decoded_instructions;
         unsigned num_encoded_instructions;
+        unsigned num_inlined_jumps;
 
         block_translator(void) throw();
 
-        void reinitialise_for_split(void) throw();
+        void reinitialise(app_pc new_end_pc) throw();
 
         void run(cpu_state_handle cpu) throw();
 
@@ -721,6 +747,7 @@ namespace granary {
     block_translator::block_translator(void) throw()
         : translated(false)
         , can_split(true)
+        , coalesced_loop(false)
         , next(nullptr)
         , state(nullptr)
         _IF_KERNEL( user_exception_metadata(nullptr) )
@@ -732,6 +759,7 @@ namespace granary {
         , end_label(label_())
         , num_decoded_instructions(0)
         , num_encoded_instructions(0)
+        , num_inlined_jumps(0)
     {
         if(basic_block_state::size()) {
             cpu_state_handle cpu;
@@ -740,13 +768,14 @@ namespace granary {
     }
 
 
-    void block_translator::reinitialise_for_split(void) throw() {
+    void block_translator::reinitialise(app_pc new_end_pc) throw() {
         translated = false;
 
         IF_KERNEL( user_exception_metadata = nullptr; )
         IF_KERNEL( num_state_bytes = 0; )
 
-        end_pc = split_end_pc;
+        end_pc = new_end_pc;
+        num_inlined_jumps = 0;
 
         ls.clear();
 
@@ -766,7 +795,7 @@ namespace granary {
 
         num_decoded_instructions = basic_block::decode(
             ls, incoming_policy,
-            start_pc, end_pc
+            start_pc, end_pc, num_inlined_jumps
             _IF_KERNEL(user_exception_metadata));
 
         // Invoke client code instrumentation on the basic block; the client
@@ -804,6 +833,73 @@ namespace granary {
     }
 
 
+#if CONFIG_OPTIMISE_COALESCE_LOOPS
+    /// Returns the block of the trace `trace` that `block` unconditionally
+    /// jumps to at its end, or `nullptr` if `block` doesn't end with a direct
+    /// JMP to the beginning of some block in the trace.
+    static block_translator *find_jump_successor(
+        block_translator *trace,
+        block_translator *block
+    ) throw() {
+        instruction jmp(block->ls.last());
+        if(!jmp.is_valid()
+        || dynamorio::OP_jmp != jmp.op_code()
+        || jmp.has_flag(instruction::COND_CTI_FALL_THROUGH)) {
+            return nullptr;
+        }
+
+        const operand target(jmp.cti_target());
+        for(; nullptr != trace; trace = trace->next) {
+            if(block->outgoing_policy.base_policy()
+                != trace->incoming_policy.base_policy()) {
+                continue;
+            }
+
+            if((dynamorio::INSTR_kind == target.kind
+                && target.value.instr == trace->start_label.instr)
+            || (dynamorio::PC_kind == target.kind
+                && target.value.pc == trace->start_pc)) {
+                return trace;
+            }
+        }
+
+        return nullptr;
+    }
+
+
+    /// Returns true iff `latch` is reached from `head` within the trace `trace`
+    /// only through blocks that end with unconditional, direct JMPs. If so,
+    /// then `num_jumps` is updated with the number of JMPs that are decoded
+    /// (as opposed to introduced by splitting blocks) along the way.
+    static bool find_loop_chain(
+        block_translator *trace,
+        block_translator *head,
+        block_translator *latch,
+        unsigned &num_jumps
+    ) throw() {
+        num_jumps = 0;
+        block_translator *block(head);
+        for(unsigned i(0); i < MAX_COALESCED_LOOP_BLOCKS; ++i) {
+            if(block == latch) {
+                return true;
+            }
+
+            block_translator *succ(find_jump_successor(trace, block));
+            if(!succ || succ == head) {
+                return false;
+            }
+
+            if(block->ls.last().pc()) {
+                ++num_jumps;
+            }
+
+            block = succ;
+        }
+        return false;
+    }
+#endif /* CONFIG_OPTIMISE_COALESCE_LOOPS */
+
+
     /// Try to aggressively follow and queue up translations for all
     /// fall-through targets of conditional branches.
     bool block_translator::visit_branches(
@@ -943,7 +1039,7 @@ namespace granary {
     /// trace.
     ///
     /// Returns true if, in the process of fixing up branches, a basic block
-    /// was split in two.
+    /// was split in two, or was re-decoded to contain a whole loop.
     bool block_translator::fixup_branches(
         block_translator *trace,
         app_pc trace_start_pc,
@@ -1001,6 +1097,29 @@ namespace granary {
             // We found and exact matching block; redirect the CTI back into
             // the trace.
             if(target_block->start_pc == target.value.pc) {
+
+#if CONFIG_OPTIMISE_COALESCE_LOOPS
+                // This is the back-edge of a loop that spans several blocks of
+                // the trace. If those blocks are only connected by JMPs then
+                // re-decode the loop's head so that it contains the whole loop
+                // and loops back to itself. This exposes the loop to the
+                // instrumentation of a single block. The other blocks remain
+                // in the trace, as they might be entered from elsewhere.
+                unsigned num_jumps(0);
+                if(target_block != this
+                && target_block->can_split
+                && !target_block->coalesced_loop
+                && dynamorio::instr_is_cbr(in)
+                && find_loop_chain(trace, target_block, this, num_jumps)) {
+                    target_block->split_end_pc = nullptr;
+                    target_block->reinitialise(nullptr);
+                    target_block->coalesced_loop = true;
+                    target_block->can_split = false;
+                    target_block->num_inlined_jumps = num_jumps;
+                    return true;
+                }
+#endif /* CONFIG_OPTIMISE_COALESCE_LOOPS */
+
                 in.set_cti_target(instr_(target_block->start_label));
                 in.set_mangled();
 
@@ -1068,6 +1187,459 @@ namespace granary {
     }
 
 
+#if CONFIG_OPTIMISE_PEEPHOLE || CONFIG_OPTIMISE_HOT_COLD_SPLIT
+    /// Mark every instruction that is targeted by an `instr_`-based operand,
+    /// e.g. a local branch, or an emulated return address, as being targeted
+    /// by a CTI.
+    static void mark_cti_targets(instruction_list &ls) throw() {
+        for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+            for(int i(0); i < dynamorio::instr_num_srcs(in); ++i) {
+                const operand op(dynamorio::instr_get_src(in, i));
+                if(dynamorio::INSTR_kind == op.kind
+                || dynamorio::MEM_INSTR_kind == op.kind) {
+                    instruction target(op.value.instr);
+                    target.add_flag(instruction::TARGETED_BY_CTI);
+                }
+            }
+        }
+    }
+#endif
+
+
+#if CONFIG_OPTIMISE_PEEPHOLE
+
+
+    /// Returns true iff the instruction `in` was introduced by mangling or
+    /// instrumentation, and can safely be removed.
+    static bool is_elidable(instruction in) throw() {
+        return in.is_valid()
+            && !in.pc()
+            && !in.is_patchable()
+            && !in.has_flag(instruction::TARGETED_BY_CTI)
+            IF_KERNEL( && !in.begins_delay_region()
+                       && !in.ends_delay_region() );
+    }
+
+
+    /// Returns the next non-label instruction after `in`, or an invalid
+    /// instruction if control can enter between `in` and that instruction,
+    /// i.e. if any instruction (label or not) after `in`, up to and including
+    /// that instruction, is the target of a CTI.
+    static instruction next_executable(instruction in) throw() {
+        for(in = in.next(); in.is_valid(); in = in.next()) {
+            if(in.has_flag(instruction::TARGETED_BY_CTI)) {
+                return instruction();
+            } else if(dynamorio::OP_LABEL != in.op_code()) {
+                break;
+            }
+        }
+        return in;
+    }
+
+
+    /// Returns true iff `in` is `LEA disp(%RSP), %RSP`, and returns the
+    /// displacement through `disp`.
+    static bool is_stack_shift(instruction in, int &disp) throw() {
+        if(dynamorio::OP_lea != in.op_code()) {
+            return false;
+        }
+
+        const operand dst(dynamorio::instr_get_dst(in, 0));
+        const operand src(dynamorio::instr_get_src(in, 0));
+        if(dynamorio::REG_kind != dst.kind
+        || dynamorio::DR_REG_RSP != dst.value.reg
+        || dynamorio::BASE_DISP_kind != src.kind
+        || dynamorio::DR_REG_RSP != src.value.base_disp.base_reg
+        || dynamorio::DR_REG_NULL != src.value.base_disp.index_reg) {
+            return false;
+        }
+
+        disp = src.value.base_disp.disp;
+        return true;
+    }
+
+
+    /// Look for a `POP X` that matches the `PUSH X` instruction `push`, such
+    /// that none of the instructions between the two observe the pushed value
+    /// or change `X`, and such that none of the instructions after `push`, up
+    /// to and including the `POP X`, are the target of a CTI.
+    static instruction find_matching_pop(instruction push) throw() {
+        enum {
+            MAX_PUSH_POP_DISTANCE = 8
+        };
+
+        const operand pushed(dynamorio::instr_get_src(push, 0));
+        if(dynamorio::REG_kind != pushed.kind
+        || dynamorio::DR_REG_RSP == pushed.value.reg) {
+            return instruction();
+        }
+
+        const dynamorio::reg_id_t reg(pushed.value.reg);
+        instruction in(push);
+        for(unsigned i(0); i < MAX_PUSH_POP_DISTANCE; ++i) {
+            in = next_executable(in);
+            if(!in.is_valid() || in.is_cti()) {
+                break;
+            }
+
+            if(dynamorio::OP_pop == in.op_code()) {
+                const operand popped(dynamorio::instr_get_dst(in, 0));
+                if(dynamorio::REG_kind == popped.kind
+                && reg == popped.value.reg
+                && is_elidable(in)) {
+                    return in;
+                }
+                break;
+            }
+
+            if(dynamorio::instr_uses_reg(in, dynamorio::DR_REG_RSP)
+            || dynamorio::instr_writes_to_reg(in, reg)
+            || dynamorio::instr_reads_memory(in)
+            || dynamorio::instr_writes_memory(in)) {
+                break;
+            }
+        }
+        return instruction();
+    }
+
+
+#if !CONFIG_ENV_KERNEL
+    /// Coalesce user-space redzone guards into larger regions. Instrumentation
+    /// that touches the stack brackets itself with
+    ///     LEA -REDZONE_SIZE(%RSP), %RSP; ...; LEA REDZONE_SIZE(%RSP), %RSP
+    /// and so a run of instrumentation points repeatedly closes and re-opens
+    /// the redzone-skip region. If nothing between a closing guard and the
+    /// next opening guard uses %RSP (explicitly or implicitly), and nothing in
+    /// between is the target of a CTI, then both are elided, which leaves one
+    /// region open across the whole run. The region is then only closed before
+    /// an instruction that touches the stack.
+    static void coalesce_redzone_regions(instruction_list &ls) throw() {
+        for(instruction in(ls.first()), next_in; in.is_valid(); in = next_in) {
+            next_in = in.next();
+
+            int disp(0);
+            if(!is_elidable(in)
+            || !is_stack_shift(in, disp)
+            || disp != REDZONE_SIZE) {
+                continue;
+            }
+
+            // Look for the next opening guard, so long as nothing in between
+            // observes the position of the stack pointer.
+            instruction open;
+            for(instruction curr(next_executable(in));
+                curr.is_valid();
+                curr = next_executable(curr)) {
+
+                if(is_elidable(curr)
+                && is_stack_shift(curr, disp)
+                && -disp == REDZONE_SIZE) {
+                    open = curr;
+                    break;
+                }
+
+                if(curr.is_cti()
+                || dynamorio::instr_uses_reg(curr, dynamorio::DR_REG_RSP)) {
+                    break;
+                }
+            }
+
+            if(!open.is_valid()) {
+                continue;
+            }
+
+            if(next_in == open) {
+                next_in = open.next();
+            }
+
+            ls.remove(in);
+            ls.remove(open);
+
+            IF_PERF( perf::visit_elided_redzone_guard(); )
+        }
+    }
+#endif /* CONFIG_ENV_KERNEL */
+
+
+    /// Peephole optimise a fully mangled and instrumented trace. Instrumentation
+    /// and mangling are applied one instruction at a time, which leaves behind
+    /// redundant sequences at the boundaries of adjacent instrumentation points.
+    /// This elides:
+    ///     1) `PUSHF; POPF` pairs. `POPF; PUSHF` pairs are left alone: the
+    ///        `POPF` restores the full flags image (including `DF`, `IF`,
+    ///        `TF` and `AC`), not just the arithmetic flags.
+    ///     2) `LEA -N(%RSP), %RSP; LEA N(%RSP), %RSP` redzone guard pairs (in
+    ///        either order). In user space, redzone guards are first coalesced
+    ///        into larger regions by `coalesce_redzone_regions`.
+    ///     3) `PUSH X; ...; POP X`, where the instructions in between don't
+    ///        touch the stack or memory, and don't change `X`.
+    ///
+    /// Only instructions introduced by Granary or by client instrumentation
+    /// are elided, and never across an instruction (label or not) that is the
+    /// target of a CTI.
+    static void peephole_optimise(
+        instruction_list &ls,
+        instruction_list &stubs
+    ) throw() {
+        mark_cti_targets(ls);
+        mark_cti_targets(stubs);
+
+        IF_USER( coalesce_redzone_regions(ls); )
+
+        for(instruction in(ls.first()), next_in; in.is_valid(); in = next_in) {
+            next_in = in.next();
+
+            if(!is_elidable(in)) {
+                continue;
+            }
+
+            const unsigned op_code(in.op_code());
+            instruction elide;
+            int disp(0);
+            int next_disp(0);
+
+            if(dynamorio::OP_push == op_code) {
+                elide = find_matching_pop(in);
+                IF_PERF( if(elide.is_valid()) {
+                    perf::visit_elided_push_pop(); } )
+
+            } else {
+                instruction next_exec(next_executable(in));
+                if(!is_elidable(next_exec)) {
+                    continue;
+                }
+
+                const unsigned next_op_code(next_exec.op_code());
+
+                if(dynamorio::OP_pushf == op_code
+                && dynamorio::OP_popf == next_op_code) {
+                    elide = next_exec;
+                    IF_PERF( perf::visit_elided_flags_save(); )
+
+                } else if(is_stack_shift(in, disp)
+                       && is_stack_shift(next_exec, next_disp)
+                       && 0 == (disp + next_disp)) {
+                    elide = next_exec;
+                    IF_PERF( perf::visit_elided_redzone_guard(); )
+                }
+            }
+
+            if(!elide.is_valid()) {
+                continue;
+            }
+
+            // Re-visit the instruction before the elided pair, as the
+            // elision might have made new pairs adjacent.
+            next_in = in.prev();
+            if(!next_in.is_valid()) {
+                next_in = elide.next();
+            }
+
+            ls.remove(in);
+            ls.remove(elide);
+        }
+    }
+#endif /* CONFIG_OPTIMISE_PEEPHOLE */
+
+
+#if CONFIG_OPTIMISE_HOT_COLD_SPLIT
+    /// Returns true iff control can fall through from `in` into the next
+    /// instruction.
+    static bool can_fall_through(instruction in) throw() {
+        return !in.is_unconditional_cti() || in.is_call();
+    }
+
+
+    /// Returns true iff `in` is a CTI with an 8-bit relative target, and so
+    /// can't reach between the trace and the cold region.
+    static bool is_short_cti(instruction in) throw() {
+        return in.is_cti()
+            && (dynamorio::instr_is_cti_short(in)
+                || dynamorio::instr_is_cti_loop(in));
+    }
+
+
+    /// Decide which instructions of the trace `ls` are cold. Client-marked
+    /// cold instructions are kept, and coldness is extended to introduced
+    /// instructions (e.g. from mangling a cold instruction) that can only be
+    /// reached by falling through from cold code. Hot-patchable instructions,
+    /// and short CTIs and their targets, must stay in the trace.
+    static void find_cold_code(instruction_list &ls) throw() {
+        for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+            instruction prev(in.prev());
+            if(!in.has_flag(instruction::COLD_CODE)
+            && prev.is_valid()
+            && prev.has_flag(instruction::COLD_CODE)
+            && can_fall_through(prev)
+            && !in.pc()
+            && !in.has_flag(instruction::TARGETED_BY_CTI)) {
+                in.add_flag(instruction::COLD_CODE);
+            }
+
+            if(in.is_patchable()) {
+                in.remove_flag(instruction::COLD_CODE);
+
+            } else if(is_short_cti(in)) {
+                in.remove_flag(instruction::COLD_CODE);
+
+                const operand target(in.cti_target());
+                if(dynamorio::INSTR_kind == target.kind) {
+                    instruction target_in(target.value.instr);
+                    target_in.remove_flag(instruction::COLD_CODE);
+                }
+            }
+        }
+    }
+
+
+    /// Returns true iff `in` is a conditional CTI whose taken path skips over
+    /// the instructions after it and lands on `after`, e.g. the jump around
+    /// an instrumentation slow path.
+    static bool jumps_around(instruction in, instruction after) throw() {
+        if(!in.is_cti()
+        || !dynamorio::instr_is_cbr(in)
+        || in.is_patchable()
+        || is_short_cti(in)) {
+            return false;
+        }
+
+        const operand target(in.cti_target());
+        return dynamorio::INSTR_kind == target.kind
+            && after == instruction(target.value.instr);
+    }
+
+
+    /// Move runs of cold instructions in the block of `ls` bounded by `start`
+    /// and `end` out of line and into the block's cold list `cold_ls`. A run
+    /// is moved if hot code can't fall through into it, or if it is only
+    /// entered by falling through a conditional CTI that otherwise jumps
+    /// around it. In the latter case, the CTI is inverted to jump to the
+    /// moved run. If control can fall through the end of a run then a jump
+    /// back into the block is added to the end of the moved run. Returns the
+    /// number of bytes of added jumps.
+    static unsigned split_cold_code(
+        instruction_list &ls,
+        instruction start,
+        instruction end,
+        instruction_list &cold_ls
+    ) throw() {
+        unsigned num_added_bytes(0);
+        instruction next_in;
+        for(instruction in(start); in != end; in = next_in) {
+            next_in = in.next();
+            if(!in.has_flag(instruction::COLD_CODE)) {
+                continue;
+            }
+
+            instruction last(in);
+            unsigned num_cold(1);
+            for(; next_in != end && next_in.has_flag(instruction::COLD_CODE);
+                next_in = next_in.next()) {
+                last = next_in;
+                ++num_cold;
+            }
+
+            // Hot code can fall through into this run, so leave it in place.
+            instruction prev(in.prev());
+            const bool is_jumped_around(jumps_around(prev, next_in));
+            if(can_fall_through(prev) && !is_jumped_around) {
+                continue;
+            }
+
+            if(is_jumped_around) {
+                dynamorio::instr_invert_cbr(prev);
+                prev.set_cti_target(instr_(in));
+            }
+
+            for(instruction cold_in(in), next_cold; ; cold_in = next_cold) {
+                next_cold = cold_in.next();
+                ls.remove(cold_in);
+                cold_ls.append(cold_in);
+                if(cold_in == last) {
+                    break;
+                }
+            }
+
+            if(can_fall_through(last)) {
+                next_in.add_flag(instruction::TARGETED_BY_CTI);
+                num_added_bytes += cold_ls.append(
+                    mangled(jmp_(instr_(next_in)))).encoded_size();
+            }
+
+            IF_PERF( perf::visit_cold_instructions(num_cold); )
+        }
+        return num_added_bytes;
+    }
+
+
+    /// Move the cold code of each block in the trace `ls` to the end of the
+    /// trace, so that the hot instructions of the trace are densely packed.
+    /// The cold code of the last block is placed at the end of that block,
+    /// and so is within its bounds. The cold code of every other block is
+    /// placed after the last block, between the block's cold labels. Returns
+    /// the number of bytes of added instructions.
+    static unsigned split_cold_code(
+        instruction_list &ls,
+        instruction_list &stubs,
+        block_translator *trace_bbs
+    ) throw() {
+
+        // Control must not fall through the end of the trace into the
+        // cold code.
+        instruction last_in(ls.last());
+        for(; last_in.is_valid() && dynamorio::OP_LABEL == last_in.op_code();
+            last_in = last_in.prev()) { }
+
+        if(!last_in.is_valid() || can_fall_through(last_in)) {
+            return 0;
+        }
+
+        mark_cti_targets(ls);
+        mark_cti_targets(stubs);
+        find_cold_code(ls);
+
+        unsigned num_added_bytes(0);
+        block_translator *last_block(nullptr);
+        for(block_translator *block(trace_bbs);
+            nullptr != block;
+            block = block->next) {
+
+            num_added_bytes += split_cold_code(
+                ls, block->start_label, block->end_label, block->cold_ls);
+            last_block = block;
+        }
+
+        for(block_translator *block(trace_bbs);
+            nullptr != block;
+            block = block->next) {
+
+            if(!block->cold_ls.length()) {
+                continue;
+            }
+
+            if(block == last_block) {
+                for(instruction in(block->cold_ls.first()), next_in;
+                    in.is_valid();
+                    in = next_in) {
+                    next_in = in.next();
+                    block->cold_ls.remove(in);
+                    ls.insert_before(block->end_label, in);
+                }
+                continue;
+            }
+
+            block->cold_start_label = label_();
+            block->cold_end_label = label_();
+            ls.append(block->cold_start_label);
+            ls.extend(block->cold_ls);
+            ls.append(block->cold_end_label);
+        }
+
+        return num_added_bytes;
+    }
+#endif /* CONFIG_OPTIMISE_HOT_COLD_SPLIT */
+
+
     /// Returns either an accurate (excluding labels) or an inaccurate
     /// (including labels) length for an instruction list.
     static unsigned debug_instruction_list_length(instruction_list &ls) throw() {
@@ -1134,7 +1706,7 @@ namespace granary {
                 // LOCK prefix).
                 const app_pc old_split_end_pc(block->split_end_pc);
                 if(old_split_end_pc) {
-                    block->reinitialise_for_split();
+                    block->reinitialise(old_split_end_pc);
                     block->split_end_pc = nullptr;
                 }
 
@@ -1207,6 +1779,11 @@ namespace granary {
             block->ls.prepend(block->start_label);
             block->ls.append(block->end_label);
 
+            // Basic blocks can be entered through their start labels, so
+            // make sure that no peephole optimisations cross these labels.
+            block->start_label.add_flag(instruction::TARGETED_BY_CTI);
+            block->end_label.add_flag(instruction::TARGETED_BY_CTI);
+
             instruction_list_mangler mangler(
                 cpu, *block->state, block->ls, patch_stubs,
                 block->outgoing_policy, estimator_pc);
@@ -1248,6 +1825,18 @@ namespace granary {
 
         IF_KERNEL( UNUSED(trace_num_state_bytes); )
 
+#if CONFIG_OPTIMISE_PEEPHOLE
+        // Clean up redundancies at the boundaries of adjacent instrumentation
+        // points, now that all mangling and instrumentation is done.
+        peephole_optimise(ls, patch_stubs);
+#endif
+
+#if CONFIG_OPTIMISE_HOT_COLD_SPLIT
+        // Move slow paths to the end of the trace, so that the hot code of
+        // the trace is densely packed.
+        trace_max_size += split_cold_code(ls, patch_stubs, trace_bbs);
+#endif
+
         // Guarantee enough space to allocate the instructions of this basic
         // block so that we can get an exact estimator pc for the beginning of
         // the basic block. This estimator pc will tell us the current cache
@@ -1286,7 +1875,18 @@ namespace granary {
         // TODO: Block info is likely better suited to a bump-pointer
         //       allocator to get better spatial locality when binary searching
         //       for the block info containing a given PC.
-        trace.info = allocate_memory<basic_block_info>(trace.num_blocks);
+#if CONFIG_OPTIMISE_HOT_COLD_SPLIT
+        for(block_translator *block(trace_bbs);
+            nullptr != block;
+            block = block->next) {
+            if(block->cold_start_label.is_valid()) {
+                trace.num_cold_blocks += 1;
+            }
+        }
+#endif
+
+        trace.info = allocate_memory<basic_block_info>(
+            trace.num_blocks + trace.num_cold_blocks);
 
         // Calculate the size of the stubs and then encode the stubs.
         app_pc stub_pc(nullptr);
@@ -1361,15 +1961,46 @@ namespace granary {
             }
         }
 
+#if CONFIG_OPTIMISE_HOT_COLD_SPLIT
+        // Give each block whose cold code was moved after the last block of
+        // the trace a second info that covers its cold code, so that code
+        // cache addresses in the cold code still resolve to the block.
+        unsigned j(trace.num_blocks);
+        i = 0;
+        for(block_translator *block(trace_bbs);
+            nullptr != block;
+            block = block->next, ++i) {
+
+            if(!block->cold_start_label.is_valid()) {
+                continue;
+            }
+
+            basic_block_info *info(&(trace.info[j++]));
+            *info = trace.info[i];
+            info->start_pc = block->cold_start_label.pc();
+            info->num_bytes = static_cast<uint16_t>(
+                block->cold_end_label.pc() - info->start_pc);
+        }
+#endif
+
         // After everything is emitted, store the meta-information in a way
         // that can be later queried by interrupt handlers, GDB, etc.
         store_trace_meta_info(trace);
 
+        IF_PERSIST( persist_trace(
+            cpu, trace, ls, patch_stubs, stub_pc, stub_size); )
+
 #if CONFIG_DEBUG_ASSERTIONS
         for(block_translator *block(trace_bbs);
             nullptr != block;
             block = block->next) {
             ASSERT(nullptr != find_basic_block_info(block->start_label.pc()));
+#   if CONFIG_OPTIMISE_HOT_COLD_SPLIT
+            if(block->cold_start_label.is_valid()) {
+                ASSERT(find_basic_block_info(block->cold_start_label.pc())
+                    ->state == block->state);
+            }
+#   endif
         }
 #endif
 
@@ -101,16 +101,23 @@ namespace granary {
         /// The number of basic blocks in the trace.
         unsigned num_blocks;
 
+        /// The number of basic blocks in the trace whose cold code was moved
+        /// to the end of the trace, away from the rest of the block.
+        unsigned num_cold_blocks;
+
         /// The number of total bytes of all blocks in the trace.
         unsigned num_bytes;
 
-        /// An array of `num_blocks` block info structures.
+        /// An array of `num_blocks` block info structures, followed by
+        /// `num_cold_blocks` info structures that each cover the cold code of
+        /// one of the blocks.
         basic_block_info *info;
 
         /// Zero-initialize the trace data structure.
         inline trace_info(void) throw()
             : start_pc(nullptr)
             , num_blocks(0)
+            , num_cold_blocks(0)
             , num_bytes(0)
             , info(nullptr)
         { }
@@ -182,12 +189,15 @@ namespace granary {
 
 
         /// Decode instructions at a starting program counter and end decoding
-        /// when we've met the ending conditions for a basic block.
+        /// when we've met the ending conditions for a basic block. Up to
+        /// `num_inlined_jumps` direct unconditional JMPs are decoded through
+        /// instead of ending the block.
         static unsigned decode(
             instruction_list &ls,
             instrumentation_policy &policy,
             const app_pc start_pc,
-            app_pc &end_pc
+            app_pc &end_pc,
+            unsigned num_inlined_jumps
             _IF_KERNEL( void *&user_exception_metadata )
         ) throw();
 
@@ -74,7 +74,9 @@ namespace granary {
                 untraced_ptr.is_trace = false;
                 const trace_info *raw_trace(untraced_ptr.trace);
                 const basic_block_info *blocks(raw_trace->info);
-                for(unsigned i(0); i < raw_trace->num_blocks; ++i) {
+                const unsigned num_infos(
+                    raw_trace->num_blocks + raw_trace->num_cold_blocks);
+                for(unsigned i(0); i < num_infos; ++i) {
                     if(blocks[i].start_pc <= cache_pc
                     && cache_pc < (blocks[i].start_pc + blocks[i].num_bytes)) {
                         return &(blocks[i]);
@@ -168,7 +170,7 @@ namespace granary {
 
         generic_info_ptr &info_ptr(slab->fragments[slab->next_index++]);
 
-        if(1 == trace.num_blocks) {
+        if(1 == trace.num_blocks && !trace.num_cold_blocks) {
             info_ptr.block = trace.info;
         } else {
             trace_info *perm_trace(allocate_memory<trace_info>());
@@ -30,6 +30,7 @@
 #   include "granary/dynamorio.h"
 #   include "granary/code_cache.h"
 #   include "granary/basic_block.h"
+#   include "granary/sampling.h"
 #   define DECLARE_POLICY(policy_name, auto_instrument_host) \
         struct policy_name : public granary::instrumentation_policy { \
         public: \
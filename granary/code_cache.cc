@@ -16,6 +16,7 @@
 #include "granary/emit_utils.h"
 #include "granary/detach.h"
 #include "granary/ibl.h"
+#include "granary/persist.h"
 
 
 #if CONFIG_DEBUG_ASSERTIONS
@@ -90,6 +91,119 @@ namespace granary {
     }
 
 
+    /// Code cache entries whose unmangled addresses are within a range.
+    struct code_cache_range {
+        app_pc begin;
+        app_pc end;
+        app_pc *keys;
+        unsigned num_keys;
+        unsigned max_num_keys;
+    };
+
+
+    /// Count, and if possible collect, a code cache entry if its unmangled
+    /// address is within a range.
+    static void collect_entry_in_range(
+        app_pc source,
+        app_pc,
+        code_cache_range &range
+    ) throw() {
+        mangled_address addr;
+        addr.as_address = source;
+        const app_pc pc(addr.unmangled_address());
+        if(pc < range.begin || range.end <= pc) {
+            return;
+        }
+
+        if(range.num_keys < range.max_num_keys) {
+            range.keys[range.num_keys] = source;
+        }
+        ++range.num_keys;
+    }
+
+
+    /// Returns the address under which the translation of `app_addr` is kept
+    /// for force-attach policies once `app_addr` becomes a detach point.
+    /// Entries are otherwise stored under base policies, which drop
+    /// `force_attach`.
+    static mangled_address force_attach_address(
+        app_pc app_addr,
+        instrumentation_policy base_policy
+    ) throw() {
+        base_policy.force_attach(true);
+        return mangled_address(app_addr, base_policy);
+    }
+
+
+    /// Re-resolve the code cache entries of any addresses in the range
+    /// `[begin, end)` that have since become detach points.
+    void code_cache::invalidate_detach_targets(
+        app_pc begin,
+        app_pc end
+    ) throw() {
+        code_cache_range range = {begin, end, nullptr, 0, 0};
+        CODE_CACHE->for_each_entry(collect_entry_in_range, range);
+        if(!range.num_keys) {
+            return;
+        }
+
+        // Entries might be added between counting and collecting them, but
+        // those entries were translated after the detach points were added.
+        range.max_num_keys = range.num_keys;
+        range.num_keys = 0;
+        range.keys = allocate_memory<app_pc>(range.max_num_keys);
+        CODE_CACHE->for_each_entry(collect_entry_in_range, range);
+
+        const unsigned num_keys(
+            range.num_keys < range.max_num_keys ?
+                range.num_keys : range.max_num_keys);
+
+        for(unsigned i(0); i < num_keys; ++i) {
+            mangled_address addr;
+            addr.as_address = range.keys[i];
+            instrumentation_policy policy(addr);
+
+            if(policy.is_indirect_cti_target() || policy.is_return_target()) {
+                continue;
+            }
+
+            // Resolve the detach target in the same context, and under the
+            // same conditions, as `code_cache::find`.
+            const app_pc app_target_addr(addr.unmangled_address());
+            policy.in_host_context(
+                IF_USER_ELSE(false, is_host_address(app_target_addr)));
+
+            if(!policy.can_detach()) {
+                continue;
+            }
+
+            const app_pc redirect_addr(find_detach_target(
+                app_target_addr, policy.context()));
+
+            if(!redirect_addr) {
+                continue;
+            }
+
+            // Force-attach look-ups of this address must still find its
+            // translation, even though they fall back on this entry.
+            app_pc translated_addr(nullptr);
+            if(CODE_CACHE->load(addr.as_address, translated_addr)
+            && translated_addr != redirect_addr) {
+                CODE_CACHE->store(
+                    force_attach_address(
+                        app_target_addr, policy.base_policy()).as_address,
+                    translated_addr,
+                    HASH_KEEP_PREV_ENTRY);
+            }
+
+            CODE_CACHE->store(
+                addr.as_address, redirect_addr, HASH_OVERWRITE_PREV_ENTRY);
+        }
+
+        free_memory<app_pc>(range.keys, range.max_num_keys);
+    }
+
+
     /// Perform both lookup and insertion (basic block translation) into
     /// the code cache.
     app_pc code_cache::find(
@@ -146,6 +260,15 @@ namespace granary {
         instrumentation_policy base_policy(policy.base_policy());
         mangled_address base_addr(app_target_addr, base_policy);
 
+        // Force-attach policies must not enter a detach point whose code was
+        // translated before it became a detach point. Check to see if we
+        // kept that translation (see `invalidate_detach_targets`).
+        if(!target_addr && !policy.can_detach()) {
+            CODE_CACHE->load(
+                force_attach_address(app_target_addr, base_policy).as_address,
+                target_addr);
+        }
+
         // Policy has gone through a property conversion (e.g. host->app,
         // app->host, indirect->direct, return->direct). Check to see if we
         // actually have the converted version in the code cache.
@@ -231,6 +354,7 @@ namespace granary {
                 if(!stored_base_addr) {
                     client::discard_basic_block(*info->state);
                     remove_basic_block_info(target_addr);
+                    IF_PERSIST( remove_persisted_trace(target_addr); )
 
                     cpu->current_fragment_allocator->free_last();
                     cpu->stub_allocator.free_last();
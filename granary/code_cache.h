@@ -94,6 +94,18 @@ namespace granary {
 
         /// Force add an entry into the code cache.
         static void add(app_pc, app_pc) throw();
+
+
+        /// Re-resolve the code cache entries of any addresses in the range
+        /// `[begin, end)` that have since become detach points, so that later
+        /// look-ups of those addresses detach instead of entering previously
+        /// translated code. Look-ups by force-attach policies keep entering
+        /// the translated code.
+        ///
+        /// Note: Code that has already been patched to directly jump to the
+        ///       previously translated code, as well as IBL/RBL exit stubs
+        ///       leading to that code, are not affected.
+        static void invalidate_detach_targets(app_pc begin, app_pc end) throw();
     };
 
 }
@@ -17,6 +17,15 @@
 #include "granary/basic_block.h"
 #include "granary/basic_block_info.h"
 
+#if CONFIG_OPTIMISE_HOT_PATCH_JMP_SHORT
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#   ifndef __NR_membarrier
+#       define __NR_membarrier 324
+#   endif
+#endif
+
 namespace granary {
 
 
@@ -59,6 +68,57 @@ namespace granary {
     };
 
 
+#if CONFIG_OPTIMISE_HOT_PATCH_JMP_SHORT
+    enum {
+
+        // Little-endian encoding of `JMP rel8` with a displacement of -2,
+        // i.e. `EB FE`, which jumps to itself.
+        JMP_SHORT_TO_SELF = 0xFEEB,
+
+        // Commands of the `membarrier` system call (`linux/membarrier.h`).
+        MEMBARRIER_SYNC_CORE = (1 << 5),
+        MEMBARRIER_REGISTER_SYNC_CORE = (1 << 6),
+
+        SYNC_PAGE_SIZE = 4096
+    };
+
+
+    /// True iff this process is registered to use `membarrier` to serialise
+    /// the instruction streams of all CPUs running its threads.
+    static bool CAN_MEMBARRIER_SYNC_CORE = false;
+
+
+    /// Page whose protection is toggled to serialise the instruction streams
+    /// of all CPUs when `membarrier` is unavailable.
+    static uint8_t SYNC_PAGE[SYNC_PAGE_SIZE] \
+        __attribute__((aligned (SYNC_PAGE_SIZE))) = {0};
+
+
+    STATIC_INITIALISE_ID(membarrier_sync_core, {
+        CAN_MEMBARRIER_SYNC_CORE = 0 == syscall(
+            __NR_membarrier, MEMBARRIER_REGISTER_SYNC_CORE, 0);
+    })
+
+
+    /// Serialise the instruction streams of all CPUs that are running threads
+    /// of this process, so that none of them executes stale bytes of a CTI
+    /// that is being patched. This is done with an expedited `membarrier`,
+    /// or failing that, by forcing a TLB shootdown. Either way, the other CPUs
+    /// are interrupted, and return from an interrupt is serialising.
+    static void sync_all_cpus(void) throw() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(CAN_MEMBARRIER_SYNC_CORE
+        && 0 == syscall(__NR_membarrier, MEMBARRIER_SYNC_CORE, 0)) {
+            return;
+        }
+
+        mprotect(&(SYNC_PAGE[0]), SYNC_PAGE_SIZE, PROT_READ | PROT_WRITE);
+        *unsafe_cast<volatile uint8_t *>(&(SYNC_PAGE[0])) += 1;
+        mprotect(&(SYNC_PAGE[0]), SYNC_PAGE_SIZE, PROT_NONE);
+    }
+#endif
+
+
     /// Patch a direct control-flow instruction.
     GRANARY_ENTRYPOINT
     static void patch_instruction(app_pc *ret_address_addr) throw() {
@@ -153,6 +213,29 @@ namespace granary {
 
         ASSERT(old_cti_len == new_cti_len);
 
+#if CONFIG_OPTIMISE_HOT_PATCH_JMP_SHORT
+        // Park concurrently executing threads on a `JMP rel8` to itself by
+        // overwriting the head (first two bytes) of the CTI, and then make
+        // sure that no CPU can still be executing the old CTI. With threads
+        // unable to execute past the head, the tail of the CTI can be written
+        // non-atomically. Finally, the new head is written, which releases
+        // the parked threads. Only the head needs to be atomically written,
+        // so only it needs to be within a single cache line (see
+        // `instruction_list_mangler::align`).
+        volatile uint16_t *head(unsafe_cast<uint16_t *>(patch_address));
+        const uint16_t new_head(*unsafe_cast<uint16_t *>(staged_data));
+
+        *head = JMP_SHORT_TO_SELF;
+        sync_all_cpus();
+
+        for(unsigned i(sizeof new_head); i < new_cti_len; ++i) {
+            unsafe_cast<volatile uint8_t *>(patch_address)[i] = staged_data[i];
+        }
+        sync_all_cpus();
+
+        *head = new_head;
+        sync_all_cpus();
+#else
         const unsigned rel32_offset(new_cti_len - sizeof(uint32_t));
         const uint32_t new_rel32(
             *unsafe_cast<uint32_t *>(&(staged_data[rel32_offset])));
@@ -162,6 +245,7 @@ namespace granary {
         std::atomic_thread_fence(std::memory_order_acquire);
         *old_rel32 = new_rel32;
         std::atomic_thread_fence(std::memory_order_release);
+#endif
 
         patch->lock.release();
     }
@@ -313,6 +397,55 @@ namespace granary {
         // Replace the CTI.
         ls.insert_before(cti, instruction(&(patch->in_to_patch)));
     }
+
+
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+    /// If `slot` is the patcher function slot that a direct branch lookup stub
+    /// calls through, then fill in the code cache address of the CTI that the
+    /// stub patches, the target of that CTI, and the kind of the patch, and
+    /// return true.
+    bool find_dbl_patch(
+        app_pc slot,
+        app_pc &cti_pc,
+        mangled_address &target_address,
+        unsigned &kind
+    ) throw() {
+        direct_branch_patch_info *patch(
+            unsafe_cast<direct_branch_patch_info *>(slot));
+
+        if(!is_heap_address(slot) || PATCH_INSTRUCTION != patch->patcher_func) {
+            return false;
+        }
+
+        cti_pc = patch->in_to_patch.translation;
+        target_address = patch->target_address;
+        kind = patch->kind;
+        return true;
+    }
+
+
+    /// Make a new patch for the CTI at `cti_pc` (as described by
+    /// `find_dbl_patch`), and return the patcher function slot that the CTI's
+    /// direct branch lookup stub must call through.
+    ///
+    /// Note: Only `in_to_patch.translation` is needed to patch the CTI; its
+    ///       operands are never accessed at patch time.
+    app_pc make_dbl_patch(
+        app_pc cti_pc,
+        mangled_address target_address,
+        unsigned kind
+    ) throw() {
+        direct_branch_patch_info *patch(
+            allocate_memory<direct_branch_patch_info>());
+
+        patch->in_to_patch.translation = cti_pc;
+        patch->target_address = target_address;
+        patch->kind = static_cast<decltype(patch->kind)>(kind);
+        patch->patcher_func = PATCH_INSTRUCTION;
+
+        return unsafe_cast<app_pc>(&(patch->patcher_func));
+    }
+#endif /* CONFIG_FEATURE_PERSIST_CODE_CACHE */
 }
 
 
@@ -20,6 +20,29 @@ namespace granary {
         mangled_address target_address
     ) throw();
 
+
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+    /// If `slot` is the patcher function slot that a direct branch lookup stub
+    /// calls through, then fill in the code cache address of the CTI that the
+    /// stub patches, the target of that CTI, and the kind of the patch, and
+    /// return true.
+    bool find_dbl_patch(
+        app_pc slot,
+        app_pc &cti_pc,
+        mangled_address &target_address,
+        unsigned &kind
+    ) throw();
+
+
+    /// Make a new patch for the CTI at `cti_pc` (as described by
+    /// `find_dbl_patch`), and return the patcher function slot that the CTI's
+    /// direct branch lookup stub must call through.
+    app_pc make_dbl_patch(
+        app_pc cti_pc,
+        mangled_address target_address,
+        unsigned kind
+    ) throw();
+#endif /* CONFIG_FEATURE_PERSIST_CODE_CACHE */
 }
 
 #endif /* GRANARY_DBL_H_ */
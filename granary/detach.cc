@@ -11,15 +11,57 @@
 #include "granary/utils.h"
 #include "granary/state.h"
 #include "granary/cpu_code_cache.h"
+#include "granary/spin_lock.h"
 
 namespace granary {
 
 
-    /// Define two context-specific hash tables for finding detach points. These
-    /// hash tables are only updated during Granary's initialisation.
+    /// Define two context-specific hash tables for finding detach points.
+    /// Detach points are added to these hash tables during Granary's
+    /// initialisation, after which the hash tables are frozen into
+    /// `FROZEN_DETACH_TABLE`, and emptied. From then on, these hash tables
+    /// only hold detach points that are added later (e.g. by `dlopen`).
     static static_data<cpu_private_code_cache> DETACH_HASH_TABLE[2];
 
 
+    /// Protects late additions to `DETACH_HASH_TABLE` against concurrent
+    /// look-ups, as growing a hash table frees its old entries. Once Granary
+    /// is initialised, every access to `DETACH_HASH_TABLE` is made while
+    /// holding this lock.
+    static atomic_spin_lock DETACH_HASH_TABLE_LOCK[2];
+
+
+    /// Set once a detach point has been added to `DETACH_HASH_TABLE` after it
+    /// was frozen, so that look-ups can skip the lock in the common case.
+    static std::atomic<bool> HAS_LATE_DETACH_TARGETS[2] = {
+        ATOMIC_VAR_INIT(false),
+        ATOMIC_VAR_INIT(false)
+    };
+
+
+    enum {
+        NUM_KEYS_PER_CACHE_LINE = CACHE_LINE_SIZE / sizeof(app_pc)
+    };
+
+
+    /// A read-mostly table of detach points, built once from the detach
+    /// points added during Granary's initialisation. The keys are sorted
+    /// and then stored in Eytzinger (i.e. breadth-first) order, so that a
+    /// look-up is a descent of an implicit binary search tree whose first few
+    /// levels share cache lines, and whose deeper levels can be prefetched.
+    /// Unlike `DETACH_HASH_TABLE`, there is no probe length cutoff.
+    ///
+    /// Note: Keys are 1-indexed; `keys[0]` and `values[0]` are unused.
+    struct frozen_detach_table {
+        const_app_pc *keys;
+        app_pc *values;
+        uint64_t num_entries;
+    };
+
+
+    static frozen_detach_table FROZEN_DETACH_TABLE[2];
+
+
     STATIC_INITIALISE_ID(detach_hash_table, {
 
         DETACH_HASH_TABLE[RUNNING_AS_APP].construct();
@@ -48,13 +90,175 @@ namespace granary {
     })
 
 
-    /// Add a detach target to the hash table.
+    /// Returns the index of `key` in a frozen detach table, or 0 if `key`
+    /// isn't in the table.
+    static uint64_t frozen_index_of(
+        const frozen_detach_table &table,
+        const_app_pc key
+    ) throw() {
+        uint64_t index(1);
+        for(; index <= table.num_entries; ) {
+
+            // Prefetch the cache line holding this node's descendants a few
+            // levels down, as long as that line is within the table.
+            const uint64_t prefetch_index(index * NUM_KEYS_PER_CACHE_LINE);
+            if(prefetch_index <= table.num_entries) {
+                __builtin_prefetch(&(table.keys[prefetch_index]));
+            }
+            index = 2 * index + (table.keys[index] < key);
+        }
+
+        // Undo the right turns taken after the last left turn, which leads
+        // to the smallest key that is greater than or equal to `key`.
+        index >>= __builtin_ffsll(static_cast<long long>(~index));
+        if(index && key == table.keys[index]) {
+            return index;
+        }
+        return 0;
+    }
+
+
+    /// Sift an entry down into a max-heap of detach entries ordered by their
+    /// source addresses.
+    static void sift_down(
+        cpu_private_code_cache_entry *entries,
+        uint64_t root,
+        uint64_t num_entries
+    ) throw() {
+        for(uint64_t child(2 * root + 1); child < num_entries; ) {
+            if((child + 1) < num_entries
+            && entries[child].source < entries[child + 1].source) {
+                ++child;
+            }
+            if(entries[child].source <= entries[root].source) {
+                return;
+            }
+
+            const cpu_private_code_cache_entry entry(entries[root]);
+            entries[root] = entries[child];
+            entries[child] = entry;
+
+            root = child;
+            child = 2 * root + 1;
+        }
+    }
+
+
+    /// Heap sort detach entries by their source addresses.
+    static void sort_entries(
+        cpu_private_code_cache_entry *entries,
+        uint64_t num_entries
+    ) throw() {
+        for(uint64_t i(num_entries / 2); i-- > 0; ) {
+            sift_down(entries, i, num_entries);
+        }
+        for(uint64_t end(num_entries); end-- > 1; ) {
+            const cpu_private_code_cache_entry entry(entries[0]);
+            entries[0] = entries[end];
+            entries[end] = entry;
+            sift_down(entries, 0, end);
+        }
+    }
+
+
+    /// Lay out sorted entries into a frozen detach table in Eytzinger order.
+    /// Returns the index of the next sorted entry to lay out.
+    static uint64_t lay_out_entries(
+        frozen_detach_table &table,
+        const cpu_private_code_cache_entry *sorted_entries,
+        uint64_t next_sorted_entry,
+        uint64_t index
+    ) throw() {
+        if(index <= table.num_entries) {
+            next_sorted_entry = lay_out_entries(
+                table, sorted_entries, next_sorted_entry, 2 * index);
+
+            table.keys[index] = sorted_entries[next_sorted_entry].source;
+            table.values[index] = sorted_entries[next_sorted_entry].dest;
+
+            next_sorted_entry = lay_out_entries(
+                table, sorted_entries, next_sorted_entry + 1, 2 * index + 1);
+        }
+        return next_sorted_entry;
+    }
+
+
+    /// Freeze the detach points of one context.
+    static void freeze_detach_table(runtime_context context) throw() {
+        cpu_private_code_cache &hash_table(*(DETACH_HASH_TABLE[context].self));
+        if(!hash_table.entries) {
+            return;
+        }
+
+        const uint64_t num_slots(hash_table.bit_mask + 1);
+        uint64_t num_entries(0);
+        for(uint64_t i(0); i < num_slots; ++i) {
+            if(hash_table.entries[i].source) {
+                hash_table.entries[num_entries++] = hash_table.entries[i];
+            }
+        }
+
+        sort_entries(hash_table.entries, num_entries);
+
+        // Align the keys to a cache line so that each prefetch covers a whole
+        // level of a sub-tree.
+        frozen_detach_table &table(FROZEN_DETACH_TABLE[context]);
+        const_app_pc *keys(allocate_memory<const_app_pc>(
+            num_entries + 1 + NUM_KEYS_PER_CACHE_LINE));
+        table.keys = reinterpret_cast<const_app_pc *>(
+            (reinterpret_cast<uintptr_t>(keys) + CACHE_LINE_SIZE - 1)
+            & ~static_cast<uintptr_t>(CACHE_LINE_SIZE - 1));
+        table.values = allocate_memory<app_pc>(num_entries + 1);
+        table.num_entries = num_entries;
+        lay_out_entries(table, hash_table.entries, 0, 1);
+
+        free_memory<cpu_private_code_cache_entry>(
+            hash_table.entries, num_slots);
+        DETACH_HASH_TABLE[context].construct();
+        HAS_LATE_DETACH_TARGETS[context].store(false);
+    }
+
+
+    namespace detail {
+
+        /// Freeze the detach points added during Granary's initialisation
+        /// into `FROZEN_DETACH_TABLE`.
+        ///
+        /// Note: This must be invoked before any other threads or CPUs can
+        ///       look up detach points.
+        void freeze_detach_targets(void) throw() {
+            freeze_detach_table(RUNNING_AS_APP);
+            freeze_detach_table(RUNNING_AS_HOST);
+        }
+    }
+
+
+    /// Add a detach target to the hash table. If the detach target is already
+    /// in the frozen table then it is updated in place.
     void add_detach_target(
         app_pc detach_addr,
         app_pc redirect_addr,
         runtime_context context
     ) throw() {
+        frozen_detach_table &table(FROZEN_DETACH_TABLE[context]);
+        const uint64_t index(frozen_index_of(table, detach_addr));
+
+        // The keys of the frozen table never change once it's built, so
+        // `index` remains valid without a lock. The store to the value is a
+        // naturally aligned pointer store, which is single-copy atomic on
+        // x86-64, so a concurrent `find_detach_target` sees either the old
+        // or the new redirect address, and both are valid targets. Nothing
+        // else is published along with the value, so no ordering is needed.
+        if(index) {
+            table.values[index] = redirect_addr;
+            return;
+        }
+
+        DETACH_HASH_TABLE_LOCK[context].acquire();
         DETACH_HASH_TABLE[context]->store(detach_addr, redirect_addr);
+        DETACH_HASH_TABLE_LOCK[context].release();
+
+        HAS_LATE_DETACH_TARGETS[context].store(true, std::memory_order_release);
     }
 
 
@@ -83,8 +287,26 @@ namespace granary {
         }
 #endif
 
+        const frozen_detach_table &table(FROZEN_DETACH_TABLE[context]);
+        const uint64_t index(frozen_index_of(table, detach_addr));
+        if(index) {
+            ASSERT(unsafe_cast<app_pc>(&granary_fault) != table.values[index]);
+            return table.values[index];
+        }
+
+        // Only look in the hash table if any detach points have been added to
+        // it since it was frozen.
+        if(!HAS_LATE_DETACH_TARGETS[context].load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+
         app_pc redirect_addr(nullptr);
-        if(DETACH_HASH_TABLE[context]->load(detach_addr, redirect_addr)) {
+        DETACH_HASH_TABLE_LOCK[context].acquire();
+        const bool found(
+            DETACH_HASH_TABLE[context]->load(detach_addr, redirect_addr));
+        DETACH_HASH_TABLE_LOCK[context].release();
+
+        if(found) {
             ASSERT(unsafe_cast<app_pc>(&granary_fault) != redirect_addr);
             return redirect_addr;
         }
@@ -102,7 +102,9 @@ namespace granary {
     extern function_wrapper FUNCTION_WRAPPERS[];
 
 
-    /// Add a detach target to the hash table.
+    /// Add a detach target to the hash table. This can be invoked after
+    /// Granary has been initialised (e.g. when an object is `dlopen`ed), and
+    /// concurrently with `find_detach_target`.
     void add_detach_target(
         app_pc detach_addr,
         app_pc redirect_addr,
@@ -124,6 +126,13 @@ namespace granary {
 	/// Detach Granary.
 	DONT_OPTIMISE void detach(void) throw();
 
+
+#if !CONFIG_ENV_KERNEL
+    /// Add the detach points of any objects that have been loaded (e.g. by
+    /// `dlopen`) since the last time that the loaded objects were visited.
+    void register_loaded_objects(void) throw();
+#endif
+
 }
 
 #endif /* GRANARY_DETACH_H_ */
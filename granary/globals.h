@@ -110,6 +110,39 @@
 #define CONFIG_OPTIMISE_DIRECT_RETURN CONFIG_ENV_KERNEL
 
 
+/// Should a peephole optimisation pass be run over fully mangled and
+/// instrumented traces? This removes redundant flag saves/restores, redzone
+/// guards, and register saves/restores that are left behind at the boundaries
+/// of adjacent instrumentation points.
+#define CONFIG_OPTIMISE_PEEPHOLE 1
+
+
+/// Should loops that span several basic blocks of a trace be coalesced into a
+/// single basic block that loops back to itself? This only applies if the
+/// blocks are connected by unconditional JMPs, and exposes the whole loop to
+/// the instrumentation of one block, e.g. so that checks can be hoisted out
+/// of it.
+#define CONFIG_OPTIMISE_COALESCE_LOOPS 1
+
+
+/// Should instructions that are marked as cold (e.g. instrumentation slow
+/// paths) be moved to the end of their traces? This is not available for
+/// kernel space code, where the interrupt delay states of a block only cover
+/// the block's contiguous code.
+#define CONFIG_OPTIMISE_HOT_COLD_SPLIT !CONFIG_ENV_KERNEL
+
+
+/// Should direct CTIs be hot-patched by first parking executing threads on a
+/// two-byte `JMP rel8` to itself, then writing the rest of the CTI, and then
+/// writing the CTI's first two bytes, with the instruction streams of all CPUs
+/// serialised between each step? If not, then the rel32 of every hot-
+/// patchable CTI is aligned so that it can be atomically written, which
+/// requires a lot of alignment padding in the code cache. This is not
+/// available for kernel space code, where CTIs are patched with interrupts
+/// disabled, and so the other CPUs can't be serialised.
+#define CONFIG_OPTIMISE_HOT_PATCH_JMP_SHORT !CONFIG_ENV_KERNEL
+
+
 /// Should profile guided optimisation be enabled? This can / should only be
 /// toggled from the Makefile when a profile file is supplied to the
 /// `GR_PGO_PROFILE` command-line argument.
@@ -198,6 +231,15 @@
 #define CONFIG_FOLLOW_CONDITIONAL_BRANCHES 0
 
 
+/// Parameters for sampled policies (see `granary/sampling.h`). The checking
+/// version of a sampled policy counts down one sample period at each function
+/// entry and loop back-edge; once the period expires, execution switches into
+/// the fully instrumented version for a burst of basic blocks, then switches
+/// back.
+#define CONFIG_SAMPLING_PERIOD 10000
+#define CONFIG_SAMPLING_BURST_LENGTH 256
+
+
 /// Enable performance counters and reporting. Performance counters measure
 /// things like number of translated bytes, number of code cache bytes, etc.
 /// These counters allow us to get a sense of how (in)efficient Granary is with
@@ -228,6 +270,22 @@
 #endif
 
 
+/// Persist the code cache across runs? If enabled, then the traces that are
+/// committed to the code cache are saved to `CONFIG_PERSIST_CODE_CACHE_FILE`
+/// at exit, along with the relocations, basic block meta-data, and (if the
+/// client opts in with `CLIENT_persist_basic_block_state`) client basic block
+/// state needed to move them into the code cache of a later run of the same
+/// build of Granary. Traces that refer to unregistered run-specific memory
+/// (e.g. lazily generated gencode, wrappers, or heap-allocated data) are not
+/// saved.
+#if CONFIG_ENV_KERNEL
+#   define CONFIG_FEATURE_PERSIST_CODE_CACHE 0 // Can't change.
+#elif !defined(CONFIG_FEATURE_PERSIST_CODE_CACHE)
+#   define CONFIG_FEATURE_PERSIST_CODE_CACHE 0
+#endif
+#define CONFIG_PERSIST_CODE_CACHE_FILE "granary.cache"
+
+
 /// The maximum wrapping depth for argument wrappers.
 #ifndef CONFIG_MAX_PRE_WRAP_DEPTH
 #   define CONFIG_MAX_PRE_WRAP_DEPTH 1
@@ -425,6 +483,7 @@ namespace granary {
     extern bool is_code_cache_address(const const_app_pc) throw();
     extern bool is_wrapper_address(const const_app_pc) throw();
     extern bool is_gencode_address(const const_app_pc) throw();
+    extern bool is_heap_address(const const_app_pc) throw();
 
 
 #if CONFIG_ENV_KERNEL
@@ -12,6 +12,10 @@
 #include "granary/emit_utils.h"
 #include "granary/spin_lock.h"
 
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+#   include "granary/persist.h"
+#endif
+
 
 extern "C" {
     extern uint16_t granary_bswap16(uint16_t);
@@ -336,5 +340,20 @@ namespace granary {
         }
     });
 
+
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+    /// Returns the aligned beginning of the jump table. Its alignment within
+    /// Granary's image varies with the image's load address, so persisted code
+    /// can't refer to it relative to the image.
+    static app_pc ibl_jump_table(void) throw() {
+        return unsafe_cast<app_pc>(IBL_JUMP_TABLE);
+    }
+
+
+    STATIC_INITIALISE_ID(persist_ibl_jump_table, {
+        persist_address(ibl_jump_table);
+    })
+#endif /* CONFIG_FEATURE_PERSIST_CODE_CACHE */
+
 }
 
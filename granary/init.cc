@@ -69,6 +69,7 @@ namespace granary {
 
     namespace detail {
         extern void init_code_cache(void) throw();
+        extern void freeze_detach_targets(void) throw();
     }
 
 
@@ -107,6 +108,9 @@ namespace granary {
             IF_KERNEL( granary_store_flags(flags); )
         }
 
+        // All static initialisers have added their detach targets.
+        detail::freeze_detach_targets();
+
         IF_KERNEL( cpu_state::init_late(); )
 
 #ifdef CLIENT_init
@@ -288,7 +288,12 @@ namespace granary {
             COND_CTI_FALL_THROUGH   = (1 << 5),
 
             /// Is this a native instruction? That is, did we decode it?
-            NATIVE_INSTRUCTION      = (1 << 6)
+            NATIVE_INSTRUCTION      = (1 << 6),
+
+            /// Is this instruction part of a rarely executed path, e.g. an
+            /// instrumentation slow path? Cold instructions can be moved to
+            /// the end of the trace.
+            COLD_CODE               = (1 << 7)
         };
 
         typename dynamorio::instr_t *instr;
@@ -658,6 +663,13 @@ namespace granary {
     }
 
 
+    /// Mark this instruction as being part of a rarely executed path.
+    inline instruction cold(instruction in) throw() {
+        in.add_flag(instruction::COLD_CODE);
+        return in;
+    }
+
+
     /// Convert a persistent instruction into a label to the persistent
     /// instruction. This label can be embedded into an instruction list, and
     /// then the persistent instruction can later access the location in memory
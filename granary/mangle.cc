@@ -788,7 +788,8 @@ namespace granary {
         enum {
             JCC_OPCODE_SIZE = 2,
             CALL_JMP_OPCODE_SIZE = 1,
-            REL32_OFFSET_SIZE = 4
+            REL32_OFFSET_SIZE = 4,
+            JMP_SHORT_SIZE = 2
         };
 
         instruction in;
@@ -821,6 +822,23 @@ namespace granary {
 
             const unsigned cache_line_offset(curr_align % CACHE_LINE_SIZE);
 
+#if CONFIG_OPTIMISE_HOT_PATCH_JMP_SHORT
+            // Hot-patching atomically writes only the first two bytes of the
+            // instruction (see `patch_instruction` in `dbl.cc`), so only those
+            // bytes need to be within a single cache line.
+            if(CACHE_LINE_SIZE < (cache_line_offset + JMP_SHORT_SIZE)) {
+                ASSERT(in.prev().is_valid());
+
+                const unsigned forward_align(
+                    CACHE_LINE_SIZE - cache_line_offset);
+                insert_nops_after(ls, in.prev(), forward_align);
+                IF_PERF( perf::visit_align_nop(forward_align); )
+                in_size += forward_align;
+            }
+
+            curr_align += in_size;
+            size += in_size;
+#else
             // Make sure that hot-patchable instructions don't cross cache
             // line boundaries.
             if(CACHE_LINE_SIZE >= (cache_line_offset + in_size)) {
@@ -872,6 +890,7 @@ namespace granary {
 
             curr_align += in_size;
             size += in_size;
+#endif /* CONFIG_OPTIMISE_HOT_PATCH_JMP_SHORT */
         }
 
         return size;
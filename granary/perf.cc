@@ -73,6 +73,22 @@ namespace granary {
     static std::atomic<unsigned> NUM_FUNCTIONAL_UNITS(ATOMIC_VAR_INIT(0U));
 
 
+    /// Track the number of sample checks added by sampled policies.
+    static std::atomic<unsigned> NUM_SAMPLE_CHECKS(ATOMIC_VAR_INIT(0U));
+
+
+    /// Performance counters for tracking redundant instruction sequences
+    /// removed by the peephole optimiser.
+    static std::atomic<unsigned> NUM_ELIDED_FLAGS_SAVES(ATOMIC_VAR_INIT(0U));
+    static std::atomic<unsigned> NUM_ELIDED_REDZONE_GUARDS(ATOMIC_VAR_INIT(0U));
+    static std::atomic<unsigned> NUM_ELIDED_PUSH_POPS(ATOMIC_VAR_INIT(0U));
+
+
+    /// Track the number of instructions moved out of traces and into cold
+    /// code.
+    static std::atomic<unsigned> NUM_COLD_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
+
+
     /// Performance counters for tracking instructions added in order to mangle
     /// memory references.
     static std::atomic<unsigned> NUM_MEM_REF_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
@@ -91,6 +107,14 @@ namespace granary {
     static std::atomic<unsigned> NUM_ADDRESS_LOOKUPS_CPU_MISPREDICT(ATOMIC_VAR_INIT(0U));
 
 
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+    /// Tracking the persisting and loading of traces.
+    static std::atomic<unsigned> NUM_PERSISTED_TRACES(ATOMIC_VAR_INIT(0U));
+    static std::atomic<unsigned> NUM_UNPERSISTABLE_TRACES(ATOMIC_VAR_INIT(0U));
+    static std::atomic<unsigned> NUM_LOADED_TRACES(ATOMIC_VAR_INIT(0U));
+#endif
+
+
 #if CONFIG_ENV_KERNEL
     static std::atomic<unsigned long> NUM_INTERRUPTS(ATOMIC_VAR_INIT(0UL));
     static std::atomic<unsigned> NUM_RECURSIVE_INTERRUPTS(ATOMIC_VAR_INIT(0U));
@@ -119,6 +143,22 @@ namespace granary {
     }
 
 
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+    void perf::visit_persist_trace(bool persisted) throw() {
+        if(persisted) {
+            NUM_PERSISTED_TRACES.fetch_add(1);
+        } else {
+            NUM_UNPERSISTABLE_TRACES.fetch_add(1);
+        }
+    }
+
+
+    void perf::visit_load_trace(void) throw() {
+        NUM_LOADED_TRACES.fetch_add(1);
+    }
+#endif
+
+
     void perf::visit_decoded(const instruction in) throw() {
         if(in.is_valid()) {
             NUM_DECODED_INSTRUCTIONS.fetch_add(1);
@@ -271,6 +311,31 @@ namespace granary {
     }
 
 
+    void perf::visit_sample_check(void) throw() {
+        NUM_SAMPLE_CHECKS.fetch_add(1);
+    }
+
+
+    void perf::visit_elided_flags_save(void) throw() {
+        NUM_ELIDED_FLAGS_SAVES.fetch_add(1);
+    }
+
+
+    void perf::visit_elided_redzone_guard(void) throw() {
+        NUM_ELIDED_REDZONE_GUARDS.fetch_add(1);
+    }
+
+
+    void perf::visit_elided_push_pop(void) throw() {
+        NUM_ELIDED_PUSH_POPS.fetch_add(1);
+    }
+
+
+    void perf::visit_cold_instructions(unsigned num) throw() {
+        NUM_COLD_INSTRUCTIONS.fetch_add(num);
+    }
+
+
 #if CONFIG_ENV_KERNEL
 
     void perf::visit_takeover_interrupt(void) throw() {
@@ -333,6 +398,8 @@ namespace granary {
             NUM_UNSPLITTABLE_BBS.load());
         printf("Number of functional units: %u\n",
             NUM_FUNCTIONAL_UNITS.load());
+        printf("Number of sample checks: %u\n",
+            NUM_SAMPLE_CHECKS.load());
         printf("Number of application instruction bytes: %u\n\n",
             NUM_BB_INSTRUCTION_BYTES.load());
 
@@ -375,6 +442,16 @@ namespace granary {
         printf("Number of extra instructions to mangle memory refs: %u\n\n",
             NUM_MEM_REF_INSTRUCTIONS.load());
 
+        printf("Number of elided PUSHF/POPF pairs: %u\n",
+            NUM_ELIDED_FLAGS_SAVES.load());
+        printf("Number of elided redzone guard pairs: %u\n",
+            NUM_ELIDED_REDZONE_GUARDS.load());
+        printf("Number of elided PUSH/POP pairs: %u\n\n",
+            NUM_ELIDED_PUSH_POPS.load());
+
+        printf("Number of instructions moved into cold code: %u\n\n",
+            NUM_COLD_INSTRUCTIONS.load());
+
         printf("Number of alignment NOPs: %u\n",
             NUM_ALIGN_NOP_INSTRUCTIONS.load());
         printf("Number of alignment prefixes: %u\n\n",
@@ -389,6 +466,15 @@ namespace granary {
         printf("Number misses in the cpu code cache(s): %u\n\n",
             NUM_ADDRESS_LOOKUPS_CPU_MISS.load());
 
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+        printf("Number of persistable traces: %u\n",
+            NUM_PERSISTED_TRACES.load());
+        printf("Number of unpersistable traces: %u\n",
+            NUM_UNPERSISTABLE_TRACES.load());
+        printf("Number of traces loaded from the persisted code cache: %u\n\n",
+            NUM_LOADED_TRACES.load());
+#endif
+
 #if CONFIG_ENV_KERNEL
         printf("Number of interrupts: %lu\n",
             NUM_INTERRUPTS.load());
@@ -56,10 +56,23 @@ namespace granary {
 
         static void visit_functional_unit(void) throw();
 
+        static void visit_sample_check(void) throw();
+
+        static void visit_elided_flags_save(void) throw();
+        static void visit_elided_redzone_guard(void) throw();
+        static void visit_elided_push_pop(void) throw();
+
+        static void visit_cold_instructions(unsigned) throw();
+
         static void visit_address_lookup(void) throw();
         static void visit_address_lookup_hit(void) throw();
         static void visit_address_lookup_cpu(bool) throw();
 
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+        static void visit_persist_trace(bool) throw();
+        static void visit_load_trace(void) throw();
+#endif
+
 #if CONFIG_ENV_KERNEL
         static void visit_takeover_interrupt(void) throw();
         static void visit_interrupt(void) throw();
@@ -0,0 +1,77 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * persist.h
+ *
+ *  Created on: 2014-02-24
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_PERSIST_H_
+#define GRANARY_PERSIST_H_
+
+#include "granary/globals.h"
+
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+
+namespace granary {
+
+    /// Forward declarations.
+    struct trace_info;
+    struct instruction_list;
+    struct cpu_state_handle;
+
+
+    /// Record a newly encoded trace so that it can be saved by
+    /// `save_code_cache`. The trace's instructions (`ls`) and its direct
+    /// branch lookup stubs (`stub_ls`, encoded at `stub_pc`) are inspected
+    /// for the addresses that they refer to; traces that refer to anything
+    /// that can't be relocated into a later run are not recorded.
+    ///
+    /// Note: This must be invoked after the trace's meta-data is stored, and
+    ///       before the trace is committed to by the code cache.
+    void persist_trace(
+        cpu_state_handle cpu,
+        const trace_info &trace,
+        instruction_list &ls,
+        instruction_list &stub_ls,
+        app_pc stub_pc,
+        unsigned stub_size
+    ) throw();
+
+
+    /// Forget the recorded trace (if any) containing `cache_pc`. This must
+    /// be invoked before the memory of a trace is freed.
+    void remove_persisted_trace(app_pc cache_pc) throw();
+
+
+    /// Allow persisted code to refer to the address returned by
+    /// `get_address`. This is for run-specific addresses (e.g. lazily
+    /// generated gencode) that persisted code can't refer to relative to
+    /// the module that contains them.
+    ///
+    /// Note: This must be invoked from a static initialiser, so that every
+    ///       run of the same build of Granary registers the same addresses in
+    ///       the same order.
+    void persist_address(app_pc (*get_address)(void)) throw();
+
+
+    /// Save every recorded trace that is still in the code cache to
+    /// `file_name`. Returns the number of saved traces.
+    unsigned save_code_cache(
+        const char *file_name=CONFIG_PERSIST_CODE_CACHE_FILE
+    ) throw();
+
+
+    /// Validate the traces saved by `save_code_cache` in `file_name`, and
+    /// load the ones that are valid into the code cache. Returns the number
+    /// of loaded traces.
+    ///
+    /// Note: This must be invoked after Granary is initialised, and before it
+    ///       attaches.
+    unsigned load_code_cache(
+        const char *file_name=CONFIG_PERSIST_CODE_CACHE_FILE
+    ) throw();
+}
+
+#endif /* CONFIG_FEATURE_PERSIST_CODE_CACHE */
+#endif /* GRANARY_PERSIST_H_ */
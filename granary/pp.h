@@ -98,6 +98,13 @@
 #endif
 
 
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+#   define IF_PERSIST(...) __VA_ARGS__
+#else
+#   define IF_PERSIST(...)
+#endif
+
+
 #define FAULT (granary_break_on_fault(), granary_fault())
 #define FAULT_IF(...) if(__VA_ARGS__) { FAULT; }
 #define BARRIER ASM("" : : : "memory")
@@ -0,0 +1,241 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * sampling.cc
+ *
+ *  Created on: 2014-02-03
+ *      Author: Peter Goodman
+ */
+
+#include "granary/sampling.h"
+#include "granary/perf.h"
+
+namespace granary {
+
+
+#if CONFIG_ENV_KERNEL
+    extern "C" {
+
+        /// Returns the `%gs`-relative offset of the per-CPU sampling counters
+        /// (see `module.c`).
+        extern uintptr_t kernel_get_sample_counters(void);
+    }
+
+
+    enum {
+        /// Number of per-CPU sampling counters allocated by `module.c`.
+        MAX_NUM_SAMPLE_COUNTERS = 4
+    };
+
+
+    static_assert(
+        static_cast<unsigned>(NUM_SAMPLE_COUNTERS)
+            <= static_cast<unsigned>(MAX_NUM_SAMPLE_COUNTERS),
+        "Too many sampling counters; update `module.c`.");
+#else
+
+    /// Per-thread sampling counters. The initial-exec TLS model places these
+    /// at the same offset from the thread pointer (`%fs`) in every thread.
+    static __thread uint64_t SAMPLE_COUNTERS[NUM_SAMPLE_COUNTERS]
+        __attribute__((tls_model("initial-exec")));
+#endif
+
+
+    /// Returns an 8-byte memory operand for the current CPU's (kernel space)
+    /// or thread's (user space) copy of the sampling counter `counter`.
+    operand sample_counter_(sample_counter counter) throw() {
+#if CONFIG_ENV_KERNEL
+        const dynamorio::reg_id_t seg(dynamorio::DR_SEG_GS);
+        intptr_t offset(static_cast<intptr_t>(kernel_get_sample_counters()));
+#else
+        const dynamorio::reg_id_t seg(dynamorio::DR_SEG_FS);
+        uintptr_t thread_pointer(0);
+        ASM("movq %%fs:0, %0;" : "=r"(thread_pointer));
+        intptr_t offset(static_cast<intptr_t>(
+            reinterpret_cast<uintptr_t>(&(SAMPLE_COUNTERS[0]))
+                - thread_pointer));
+#endif
+        offset += static_cast<intptr_t>(counter * sizeof(uint64_t));
+        ASSERT(static_cast<intptr_t>(static_cast<int>(offset)) == offset);
+
+        return dynamorio::opnd_create_far_base_disp(
+            seg, dynamorio::DR_REG_NULL, dynamorio::DR_REG_NULL,
+            0, static_cast<int>(offset), dynamorio::OPSZ_8);
+    }
+
+
+    /// Add instructions that count down `counter` after `in`, and branch to
+    /// `expired` if the counter has run out. The flags are saved before the
+    /// count down, and are left saved on the stack when branching to
+    /// `expired`.
+    static instruction insert_countdown_after(
+        instruction_list &ls,
+        instruction in,
+        sample_counter counter,
+        instruction expired
+    ) throw() {
+        IF_USER( in = ls.insert_after(in,
+            lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+        in = ls.insert_after(in, pushf_());
+        in = ls.insert_after(in, sub_(sample_counter_(counter), int8_(1)));
+
+        // Use `JBE` instead of `JZ` so that a counter that starts at zero
+        // expires on its first check.
+        in = ls.insert_after(in, mangled(jbe_(instr_(expired))));
+        in = ls.insert_after(in, popf_());
+        IF_USER( in = ls.insert_after(in,
+            lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+        return in;
+    }
+
+
+    /// Add the out-of-line code that resets the sampling counters and then
+    /// switches policies. This goes after `in`, which must be an unconditional
+    /// CTI, so that it can only be reached through `expired`.
+    static instruction insert_switch_after(
+        instruction_list &ls,
+        instruction in,
+        instruction expired,
+        sample_counter counter,
+        uint64_t reset_value,
+        app_pc target_pc,
+        instrumentation_policy target_policy
+    ) throw() {
+        in = ls.insert_after(in, expired);
+        in = ls.insert_after(in, mov_st_(
+            sample_counter_(counter), int32_(reset_value)));
+
+        if(SAMPLE_COUNTER_PERIOD == counter) {
+            in = ls.insert_after(in, mov_st_(
+                sample_counter_(SAMPLE_COUNTER_BURST),
+                int32_(CONFIG_SAMPLING_BURST_LENGTH)));
+        }
+
+        in = ls.insert_after(in, popf_());
+        IF_USER( in = ls.insert_after(in,
+            lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+
+        in = ls.insert_after(in, jmp_(pc_(target_pc)));
+        in.set_policy(target_policy);
+        return in;
+    }
+
+
+    /// Returns true iff out-of-line code can be added to the end of the
+    /// instruction list without being reachable through a fall-through.
+    static bool can_append_out_of_line_code(instruction_list &ls) throw() {
+        instruction last(ls.last());
+        return last.is_valid()
+            && last.is_unconditional_cti()
+            && !last.is_call();
+    }
+
+
+    /// Returns the label that marks the native beginning of the basic block,
+    /// or an invalid instruction if there is no such label. Client
+    /// instrumentation might have added instructions before this label.
+    static instruction find_start_label(instruction_list &ls) throw() {
+        for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+            if(dynamorio::OP_LABEL == in.op_code() && in.pc()) {
+                return in;
+            }
+        }
+        return instruction();
+    }
+
+
+    namespace detail {
+
+        /// Add sample checks into the checking version of a basic block. A
+        /// sample check is added to the beginning of the block if it begins
+        /// a functional unit, and to every direct back-edge in the block. If
+        /// the check expires then control transfers to the same code, but
+        /// instrumented by `full_policy`.
+        void insert_sample_checks(
+            instruction_list &ls,
+            instrumentation_policy check_policy,
+            instrumentation_policy full_policy
+        ) throw() {
+            if(ls.is_stub() || !can_append_out_of_line_code(ls)) {
+                return;
+            }
+
+            instruction first(find_start_label(ls));
+            instruction tail(ls.last());
+
+            // Function entry.
+            if(check_policy.is_beginning_of_functional_unit()
+            && first.is_valid()) {
+                instruction expired(label_());
+                insert_countdown_after(
+                    ls, first, SAMPLE_COUNTER_PERIOD, expired);
+                tail = insert_switch_after(
+                    ls, tail, expired,
+                    SAMPLE_COUNTER_PERIOD, CONFIG_SAMPLING_PERIOD,
+                    first.pc(), full_policy);
+
+                IF_PERF( perf::visit_sample_check(); )
+            }
+
+            // Loop back-edges. Each back-edge is redirected through some out-
+            // of-line code that counts down and then continues on to the
+            // original target in either the current or the full policy.
+            //
+            // Note: The out-of-line code has no PCs, and so is skipped.
+            for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+                if(!in.is_cti() || in.is_mangled() || in.is_call()
+                || !in.pc()) {
+                    continue;
+                }
+
+                const operand target(in.cti_target());
+                if(dynamorio::PC_kind != target.kind
+                || target.value.pc > in.pc()) {
+                    continue;
+                }
+
+                instruction check(label_());
+                instruction expired(label_());
+                const app_pc target_pc(target.value.pc);
+
+                tail = ls.insert_after(tail, check);
+                tail = insert_countdown_after(
+                    ls, tail, SAMPLE_COUNTER_PERIOD, expired);
+                tail = ls.insert_after(tail, jmp_(pc_(target_pc)));
+                tail = insert_switch_after(
+                    ls, tail, expired,
+                    SAMPLE_COUNTER_PERIOD, CONFIG_SAMPLING_PERIOD,
+                    target_pc, full_policy);
+
+                in.set_cti_target(instr_(check));
+                in.set_mangled();
+
+                IF_PERF( perf::visit_sample_check(); )
+            }
+        }
+
+
+        /// Add a burst check to the beginning of the fully instrumented
+        /// version of a basic block. When the burst expires, control transfers
+        /// to the same basic block, but instrumented by `check_policy`.
+        void insert_sample_burst_check(
+            instruction_list &ls,
+            instrumentation_policy check_policy
+        ) throw() {
+            if(ls.is_stub() || !can_append_out_of_line_code(ls)) {
+                return;
+            }
+
+            instruction first(find_start_label(ls));
+            if(!first.is_valid()) {
+                return;
+            }
+
+            instruction expired(label_());
+            insert_countdown_after(ls, first, SAMPLE_COUNTER_BURST, expired);
+            insert_switch_after(
+                ls, ls.last(), expired,
+                SAMPLE_COUNTER_BURST, 0,
+                first.pc(), check_policy);
+        }
+    }
+}
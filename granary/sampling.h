@@ -0,0 +1,228 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * sampling.h
+ *
+ *  Created on: 2014-02-03
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_SAMPLING_H_
+#define GRANARY_SAMPLING_H_
+
+#include "granary/globals.h"
+#include "granary/policy.h"
+#include "granary/instruction.h"
+
+namespace granary {
+
+
+    /// Sampling counters. Every CPU (kernel space) or thread (user space) has
+    /// its own copy of each counter, so that updating a counter from within
+    /// the code cache neither needs a LOCK prefix nor races with updates made
+    /// on other CPUs. Counters start at zero, and so the first check of a
+    /// counter on any given CPU / thread expires.
+    enum sample_counter {
+
+        /// Number of sample checks remaining before the checking version of
+        /// a sampled policy switches into the fully instrumented version.
+        SAMPLE_COUNTER_PERIOD,
+
+        /// Number of basic blocks remaining before the fully instrumented
+        /// version of a sampled policy switches back into the checking
+        /// version.
+        SAMPLE_COUNTER_BURST,
+
+        /// Available for clients that do their own sampling within their
+        /// instrumentation (e.g. the watchpoint profiler).
+        SAMPLE_COUNTER_CLIENT,
+
+        NUM_SAMPLE_COUNTERS
+    };
+
+
+    /// Returns an 8-byte memory operand for the current CPU's (kernel space)
+    /// or thread's (user space) copy of the sampling counter `counter`. The
+    /// operand is segment-relative, and so refers to the copy belonging to
+    /// whichever CPU / thread executes the instruction that uses it.
+    operand sample_counter_(sample_counter counter) throw();
+
+
+    namespace detail {
+
+        /// Add sample checks into the checking version of a basic block. A
+        /// sample check is added to the beginning of the block if it begins
+        /// a functional unit, and to every direct back-edge in the block. If
+        /// the check expires then control transfers to the same code, but
+        /// instrumented by `full_policy`.
+        void insert_sample_checks(
+            instruction_list &ls,
+            instrumentation_policy check_policy,
+            instrumentation_policy full_policy
+        ) throw();
+
+
+        /// Add a burst check to the beginning of the fully instrumented
+        /// version of a basic block. When the burst expires, control transfers
+        /// to the same basic block, but instrumented by `check_policy`.
+        void insert_sample_burst_check(
+            instruction_list &ls,
+            instrumentation_policy check_policy
+        ) throw();
+    }
+
+
+    /// Forward declaration.
+    template <typename CheckPolicy, typename FullPolicy>
+    struct sampled_full_policy;
+
+
+    /// Generic "duplicate code" sampling, in the style of Arnold and Ryder.
+    /// Every basic block has two versions: a cheap checking version that is
+    /// instrumented by `CheckPolicy`, and a fully instrumented version that is
+    /// instrumented by `FullPolicy`. The checking version counts down a per-CPU
+    /// sampling counter at function entries and loop back-edges; when the
+    /// counter expires, execution switches into the fully instrumented version
+    /// for `CONFIG_SAMPLING_BURST_LENGTH` basic blocks, after which it switches
+    /// back.
+    ///
+    /// Client code opts in by using `sampled_policy<CheckPolicy, FullPolicy>`
+    /// in place of `FullPolicy`, e.g. as its `GRANARY_INIT_POLICY`.
+    ///
+    /// Note: Neither `CheckPolicy` nor `FullPolicy` should explicitly change
+    ///       the policies of CTIs, as that would leave the sampled code.
+    template <typename CheckPolicy, typename FullPolicy>
+    struct sampled_policy : public instrumentation_policy {
+    public:
+
+
+        typedef sampled_policy<CheckPolicy, FullPolicy> self_type;
+        typedef sampled_full_policy<CheckPolicy, FullPolicy> full_type;
+
+
+        enum {
+            AUTO_INSTRUMENT_HOST = CheckPolicy::AUTO_INSTRUMENT_HOST
+        };
+
+
+        /// Instrument a basic block.
+        instrumentation_policy visit_app_instructions(
+            cpu_state_handle cpu,
+            basic_block_state &bb,
+            instruction_list &ls
+        ) throw() {
+            unsafe_cast<CheckPolicy *>(this)->visit_app_instructions(
+                cpu, bb, ls);
+            return add_sample_checks(ls);
+        }
+
+
+        /// Instrument a basic block.
+        instrumentation_policy visit_host_instructions(
+            cpu_state_handle cpu,
+            basic_block_state &bb,
+            instruction_list &ls
+        ) throw() {
+            unsafe_cast<CheckPolicy *>(this)->visit_host_instructions(
+                cpu, bb, ls);
+            return add_sample_checks(ls);
+        }
+
+
+#if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
+        /// Handle an interrupt in code instrumented by the checking version.
+        interrupt_handled_state handle_interrupt(
+            cpu_state_handle cpu,
+            thread_state_handle thread,
+            basic_block_state &bb,
+            interrupt_stack_frame &isf,
+            interrupt_vector vector
+        ) throw() {
+            return unsafe_cast<CheckPolicy *>(this)->handle_interrupt(
+                cpu, thread, bb, isf, vector);
+        }
+#endif
+
+    private:
+
+        /// Add in the sample checks, and make sure that all CTIs out of this
+        /// basic block stay within the checking version.
+        instrumentation_policy add_sample_checks(
+            instruction_list &ls
+        ) throw() {
+            instrumentation_policy full_policy = policy_for<full_type>();
+            full_policy.inherit_properties(*this, INHERIT_JMP);
+            detail::insert_sample_checks(ls, *this, full_policy);
+            return policy_for<self_type>();
+        }
+    };
+
+
+    /// The fully instrumented version of a sampled policy.
+    template <typename CheckPolicy, typename FullPolicy>
+    struct sampled_full_policy : public instrumentation_policy {
+    public:
+
+
+        typedef sampled_policy<CheckPolicy, FullPolicy> check_type;
+        typedef sampled_full_policy<CheckPolicy, FullPolicy> self_type;
+
+
+        enum {
+            AUTO_INSTRUMENT_HOST = FullPolicy::AUTO_INSTRUMENT_HOST
+        };
+
+
+        /// Instrument a basic block.
+        instrumentation_policy visit_app_instructions(
+            cpu_state_handle cpu,
+            basic_block_state &bb,
+            instruction_list &ls
+        ) throw() {
+            unsafe_cast<FullPolicy *>(this)->visit_app_instructions(
+                cpu, bb, ls);
+            return add_burst_check(ls);
+        }
+
+
+        /// Instrument a basic block.
+        instrumentation_policy visit_host_instructions(
+            cpu_state_handle cpu,
+            basic_block_state &bb,
+            instruction_list &ls
+        ) throw() {
+            unsafe_cast<FullPolicy *>(this)->visit_host_instructions(
+                cpu, bb, ls);
+            return add_burst_check(ls);
+        }
+
+
+#if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
+        /// Handle an interrupt in code instrumented by the full version.
+        interrupt_handled_state handle_interrupt(
+            cpu_state_handle cpu,
+            thread_state_handle thread,
+            basic_block_state &bb,
+            interrupt_stack_frame &isf,
+            interrupt_vector vector
+        ) throw() {
+            return unsafe_cast<FullPolicy *>(this)->handle_interrupt(
+                cpu, thread, bb, isf, vector);
+        }
+#endif
+
+    private:
+
+        /// Add in the burst check, and make sure that all CTIs out of this
+        /// basic block stay within the fully instrumented version.
+        instrumentation_policy add_burst_check(
+            instruction_list &ls
+        ) throw() {
+            instrumentation_policy check_policy = policy_for<check_type>();
+            check_policy.inherit_properties(*this, INHERIT_JMP);
+            detail::insert_sample_burst_check(ls, check_policy);
+            return policy_for<self_type>();
+        }
+    };
+}
+
+#endif /* GRANARY_SAMPLING_H_ */
@@ -48,12 +48,20 @@ extern "C" {
 namespace granary {
 
 
+    /// Optional hook through which test cases can inspect the instructions of
+    /// the basic blocks that are translated with `TEST_POLICY`.
+    void (*TEST_VISIT_INSTRUCTIONS)(instruction_list &) = nullptr;
+
+
     /// Instruction a basic block.
     instrumentation_policy test_policy::visit_app_instructions(
         cpu_state_handle,
         basic_block_state &,
-        instruction_list &
+        instruction_list &ls
     ) throw() {
+        if(TEST_VISIT_INSTRUCTIONS) {
+            TEST_VISIT_INSTRUCTIONS(ls);
+        }
         return granary::policy_for<test_policy>();
     }
 
@@ -62,8 +70,11 @@ namespace granary {
     instrumentation_policy test_policy::visit_host_instructions(
         cpu_state_handle,
         basic_block_state &,
-        instruction_list &
+        instruction_list &ls
     ) throw() {
+        if(TEST_VISIT_INSTRUCTIONS) {
+            TEST_VISIT_INSTRUCTIONS(ls);
+        }
         return granary::policy_for<test_policy>();
     }
 
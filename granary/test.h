@@ -24,6 +24,11 @@ namespace granary {
     extern instrumentation_policy TEST_POLICY;
 
 
+    /// Optional hook through which test cases can inspect the instructions of
+    /// the basic blocks that are translated with `TEST_POLICY`.
+    extern void (*TEST_VISIT_INSTRUCTIONS)(instruction_list &);
+
+
     /// Instrumentation policy for basic blocks using tests.
     struct test_policy : public instrumentation_policy {
     public:
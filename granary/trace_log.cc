@@ -13,6 +13,9 @@
 #   include "granary/instruction.h"
 #   include "granary/emit_utils.h"
 #   include "granary/state.h"
+#   if CONFIG_FEATURE_PERSIST_CODE_CACHE
+#       include "granary/persist.h"
+#   endif
 #endif
 
 
@@ -164,6 +167,15 @@ namespace granary {
         IF_USER( in = ls.insert_after(in,
             lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
     }
+
+
+#   if CONFIG_FEATURE_PERSIST_CODE_CACHE
+    /// Every persisted block calls the trace logger, which is lazily
+    /// generated into gencode.
+    STATIC_INITIALISE_ID(persist_trace_logger, {
+        persist_address(trace_logger);
+    })
+#   endif
 #endif /* CONFIG_DEBUG_TRACE_EXECUTION */
 
 
@@ -10,243 +10,406 @@
 #include "granary/utils.h"
 #include "granary/state.h"
 #include "granary/cpu_code_cache.h"
+#include "granary/code_cache.h"
+#include "granary/hash_table.h"
+#include "granary/spin_lock.h"
 
 #ifndef _GNU_SOURCE
 #   define _GNU_SOURCE
 #endif
 
-#include <dlfcn.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
+#include <link.h>
+#include <elf.h>
 
 namespace granary {
 
 
-    static void add_detach_alias(
-        void *handle,
-        const char *alias,
-        function_wrapper &wrapper
-    ) throw() {
-        void *detach_addr(dlsym(handle, alias));
-        if(!detach_addr || wrapper.original_address == detach_addr) {
-            return;
-        }
+    /// A symbol whose definitions, in any loaded object, should be detach
+    /// points. If the symbol is an alias of a wrapped function then `wrapper`
+    /// is the function's wrapper; otherwise, Granary detaches to the symbol's
+    /// definition.
+    struct detach_symbol {
+        const char * const name;
+        function_wrapper * const wrapper;
+        uint32_t gnu_hash;
+        uint32_t sysv_hash;
+    };
 
-        app_pc detach_app_pc(unsafe_cast<app_pc>(detach_addr));
 
-        // Note: We don't check if we've already got the entry, because if
-        //       added a detach version in one place, then we want to overwrite
-        //       it with
+#if CONFIG_FEATURE_WRAPPERS
+#   define WRAP_FOR_DETACH(func)
+#   define WRAP_ALIAS(func, alias) \
+        {TO_STRING(alias), &(FUNCTION_WRAPPERS[CAT(DETACH_ID_, func)]), 0, 0},
+#   define DETACH(func) {TO_STRING(func), nullptr, 0, 0},
+#   define TYPED_DETACH(func)
+#endif
 
-        if(wrapper.app_wrapper_address) {
-            add_detach_target(
-                detach_app_pc,
-                wrapper.app_wrapper_address,
-                RUNNING_AS_APP);
-        }
 
-        if(wrapper.host_wrapper_address) {
-            add_detach_target(
-                detach_app_pc,
-                wrapper.host_wrapper_address,
-                RUNNING_AS_HOST);
+    /// All symbols to look up in each loaded object.
+    static detach_symbol DETACH_SYMBOLS[] = {
+#if CONFIG_FEATURE_WRAPPERS
+#   include "granary/gen/user_detach.inc"
+#endif
+        {nullptr, nullptr, 0, 0}
+    };
+
+
+    /// The symbol tables of a loaded object, as found through the object's
+    /// dynamic section.
+    struct symbol_tables {
+        const ElfW(Dyn) *dynamic;
+        uintptr_t base;
+        const ElfW(Sym) *symbols;
+        const char *strings;
+        const uint32_t *gnu_hash;
+        const ElfW(Word) *sysv_hash;
+    };
+
+
+    /// Hash a symbol name as in `.gnu.hash`.
+    static uint32_t gnu_hash_of(const char *name) throw() {
+        uint32_t hash(5381);
+        for(; *name; ++name) {
+            hash = (hash << 5) + hash + static_cast<uint8_t>(*name);
         }
+        return hash;
     }
 
 
-    static void add_detach_entry(void *handle, const char *name) throw() {
-        void *detach_addr(dlsym(handle, name));
-        app_pc detach_app_pc(unsafe_cast<app_pc>(detach_addr));
-
-        if(!find_detach_target(detach_app_pc, RUNNING_AS_APP)) {
-            add_detach_target(
-                detach_app_pc,
-                detach_app_pc,
-                RUNNING_AS_APP);
+    /// Hash a symbol name as in `.hash`.
+    static uint32_t sysv_hash_of(const char *name) throw() {
+        uint32_t hash(0);
+        for(; *name; ++name) {
+            hash = (hash << 4) + static_cast<uint8_t>(*name);
+            const uint32_t high(hash & 0xF0000000U);
+            if(high) {
+                hash ^= high >> 24;
+            }
+            hash &= ~high;
         }
+        return hash;
+    }
 
-        if(!find_detach_target(detach_app_pc, RUNNING_AS_HOST)) {
-            add_detach_target(
-                detach_app_pc,
-                detach_app_pc,
-                RUNNING_AS_HOST);
-        }
+
+    /// Compare two NUL-terminated symbol names.
+    static bool names_match(const char *a, const char *b) throw() {
+        for(; *a && *a == *b; ++a, ++b) { }
+        return *a == *b;
     }
 
 
-#if CONFIG_FEATURE_WRAPPERS
-#   define WRAP_FOR_DETACH(func)
-#   define WRAP_ALIAS(func, alias) do { \
-        add_detach_alias( \
-            handle, \
-            TO_STRING(alias), \
-            FUNCTION_WRAPPERS[CAT(DETACH_ID_, func)] \
-        ); \
-    } while(0);
-#   define DETACH(func) add_detach_entry(handle, TO_STRING(func));
-#   define TYPED_DETACH(func)
-#endif
+    /// Add a detach point for a definition of `symbol` at `detach_app_pc`.
+    static void add_detach_symbol(
+        const detach_symbol &symbol,
+        app_pc detach_app_pc
+    ) throw() {
+
+        // Wrapped function.
+        if(symbol.wrapper) {
+            function_wrapper &wrapper(*(symbol.wrapper));
+            if(wrapper.original_address == detach_app_pc) {
+                return;
+            }
 
+            // Note: We don't check if we've already got the entry, because if
+            //       added a detach version in one place, then we want to
+            //       overwrite it with
 
-    /// Build up the map file name without depending on any of the cstring
-    /// functions.
-    static void make_map_file_name(uint64_t pid, char *buff) throw() {
-        memcpy(buff, "/proc/", 6);
-        buff += 6;
-        if(!pid) {
-            *buff++ = '0';
+            if(wrapper.app_wrapper_address) {
+                add_detach_target(
+                    detach_app_pc,
+                    wrapper.app_wrapper_address,
+                    RUNNING_AS_APP);
+            }
+
+            if(wrapper.host_wrapper_address) {
+                add_detach_target(
+                    detach_app_pc,
+                    wrapper.host_wrapper_address,
+                    RUNNING_AS_HOST);
+            }
+
+        // Un-wrapped function; detach to the function itself.
         } else {
-            uint64_t max_base(10);
-            for(; pid / max_base; max_base *= 10) {
-                // loop
+            if(!find_detach_target(detach_app_pc, RUNNING_AS_APP)) {
+                add_detach_target(
+                    detach_app_pc,
+                    detach_app_pc,
+                    RUNNING_AS_APP);
             }
-            for(max_base /= 10; max_base; max_base /= 10) {
-                const uint64_t digit(pid / max_base);
-                *buff++ = digit + '0';
-                pid -= digit * max_base;
+
+            if(!find_detach_target(detach_app_pc, RUNNING_AS_HOST)) {
+                add_detach_target(
+                    detach_app_pc,
+                    detach_app_pc,
+                    RUNNING_AS_HOST);
             }
         }
-
-        memcpy(buff, "/maps", 6); // including null-terminator
     }
 
 
-    /// Parse the /proc/<pid>/maps file and apply a function to each path in
-    /// the mapping.
-    static void parse_proc_maps(
-        void (*for_each_path)(const char *, unsigned, char *),
-        char *last_path
+    /// If the `index`th symbol of `tables` is a definition of `symbol`, then
+    /// add it as a detach point.
+    static void visit_symbol(
+        const symbol_tables &tables,
+        const detach_symbol &symbol,
+        uint32_t index
     ) throw() {
-        char map_file[30];
-        make_map_file_name(getpid(), &(map_file[0]));
+        const ElfW(Sym) &sym(tables.symbols[index]);
+        if(SHN_UNDEF == sym.st_shndx
+        || !names_match(symbol.name, tables.strings + sym.st_name)) {
+            return;
+        }
 
-        const int fd(open(&(map_file[0]), O_RDONLY));
-        if(-1 == fd) {
+        const unsigned type(ELF64_ST_TYPE(sym.st_info));
+        if(STT_FUNC != type && STT_GNU_IFUNC != type) {
             return;
         }
 
+        uintptr_t addr(tables.base + sym.st_value);
+
+        // Like `dlsym`, resolve indirect functions to their implementation.
+        if(STT_GNU_IFUNC == type) {
+            addr = unsafe_cast<uintptr_t (*)(void)>(addr)();
+        }
+
+        add_detach_symbol(symbol, unsafe_cast<app_pc>(addr));
+    }
+
+
+    /// Look up every definition of `symbol` using the object's `.gnu.hash`.
+    /// All versions of the symbol that are defined in the object are visited.
+    static void find_gnu_symbol(
+        const symbol_tables &tables,
+        const detach_symbol &symbol
+    ) throw() {
+        const uint32_t *header(tables.gnu_hash);
+        const uint32_t num_buckets(header[0]);
+        const uint32_t first_symbol(header[1]);
+        const uint32_t bloom_size(header[2]);
+        const uint32_t bloom_shift(header[3]);
+        const ElfW(Addr) *bloom(
+            reinterpret_cast<const ElfW(Addr) *>(&(header[4])));
+        const uint32_t *buckets(
+            reinterpret_cast<const uint32_t *>(&(bloom[bloom_size])));
+        const uint32_t *chain(&(buckets[num_buckets]));
+
         enum {
-            LINE_SIZE = 4095
+            BLOOM_WORD_BITS = sizeof(ElfW(Addr)) * 8
         };
 
-        char path_buff[LINE_SIZE + 1] = {'\0'};
-        char read_buff[LINE_SIZE + 1] = {'\0'};
+        // Consult the bloom filter, which rejects most symbols that aren't in
+        // this object.
+        const uint32_t hash(symbol.gnu_hash);
+        const ElfW(Addr) word(bloom[(hash / BLOOM_WORD_BITS) % bloom_size]);
+        const ElfW(Addr) mask(
+            (ElfW(Addr)(1) << (hash % BLOOM_WORD_BITS))
+          | (ElfW(Addr)(1) << ((hash >> bloom_shift) % BLOOM_WORD_BITS)));
+        if(mask != (word & mask)) {
+            return;
+        }
+
+        uint32_t index(buckets[hash % num_buckets]);
+        if(index < first_symbol) {
+            return;
+        }
+
+        for(;; ++index) {
+            const uint32_t chain_hash(chain[index - first_symbol]);
+            if((hash | 1U) == (chain_hash | 1U)) {
+                visit_symbol(tables, symbol, index);
+            }
+            if(chain_hash & 1U) {
+                return;
+            }
+        }
+    }
+
 
-        bool can_read(true);
-        bool read_buff_empty(true);
-        bool find_path(true);
+    /// Look up every definition of `symbol` using the object's `.hash`.
+    static void find_sysv_symbol(
+        const symbol_tables &tables,
+        const detach_symbol &symbol
+    ) throw() {
+        const ElfW(Word) num_buckets(tables.sysv_hash[0]);
+        const ElfW(Word) *buckets(&(tables.sysv_hash[2]));
+        const ElfW(Word) *chain(&(buckets[num_buckets]));
+
+        ElfW(Word) index(buckets[symbol.sysv_hash % num_buckets]);
+        for(; STN_UNDEF != index; index = chain[index]) {
+            visit_symbol(tables, symbol, index);
+        }
+    }
 
-        char *read_ch(nullptr);
-        char *path_ch(nullptr);
 
-        for(unsigned num_bytes(0), path_len(0); ;) {
+    /// Find the dynamic symbol tables of a loaded object.
+    ///
+    /// Note: The dynamic loader relocates the pointers in the dynamic sections
+    ///       of most objects, but not of all (e.g. the vDSO).
+    static bool find_symbol_tables(
+        const dl_phdr_info *info,
+        symbol_tables &tables
+    ) throw() {
+        const ElfW(Dyn) *dyn(nullptr);
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            if(PT_DYNAMIC == info->dlpi_phdr[i].p_type) {
+                dyn = reinterpret_cast<const ElfW(Dyn) *>(
+                    info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+                break;
+            }
+        }
 
-            // Fill up the read buffer if necessary.
-            if(can_read && read_buff_empty) {
-                const unsigned read_num_bytes(
-                    read(fd, &(read_buff[0]), LINE_SIZE));
-                num_bytes += read_num_bytes;
-                can_read = read_num_bytes > 0;
-                read_buff_empty = false;
+        if(!dyn) {
+            return false;
+        }
 
-                read_buff[read_num_bytes] = '\0';
-                read_ch = &(read_buff[0]);
+        tables.dynamic = dyn;
+        tables.base = info->dlpi_addr;
+        tables.symbols = nullptr;
+        tables.strings = nullptr;
+        tables.gnu_hash = nullptr;
+        tables.sysv_hash = nullptr;
+
+        for(; DT_NULL != dyn->d_tag; ++dyn) {
+            uintptr_t addr(dyn->d_un.d_ptr);
+            if(addr < tables.base) {
+                addr += tables.base;
             }
 
-            // Try to find the beginning of a path.
-            if(find_path) {
-
-                // We're looking for a path, but we need to re-fill the read
-                // buff.
-                if(read_buff_empty) {
-                    if(!can_read) {
-                        break;
-                    }
-                    continue;
-                }
-
-                for(; *read_ch && '/' != *read_ch; ++read_ch) { }
-
-                // No path in the read buff; refill it.
-                if('/' != *read_ch) {
-                    read_buff_empty = true;
-                    continue;
-                }
-
-                // We've found the beginning of a path; try to complete it.
-                path_ch = &(path_buff[0]);
-                for(path_len = 0; *read_ch && '\n' != *read_ch; ++path_len) {
-                    *path_ch++ = *read_ch++;
-                    *path_ch = '\0';
-                }
-
-                // We completed a path.
-                if('\n' == *read_ch) {
-                    for_each_path(path_buff, path_len, last_path);
-                    path_len = 0;
-                } else {
-                    find_path = false;
-                }
-
-            // Try to complete a path.
-            } else {
-                for(; *read_ch && '\n' != *read_ch; ++path_len) {
-                    *path_ch++ = *read_ch++;
-                    *path_ch = '\0';
-                }
-
-                // We completed a path.
-                if('\n' == *read_ch) {
-                    find_path = true;
-
-                    for_each_path(path_buff, path_len, last_path);
-                    path_len = 0;
-
-                // Need more characters for the path.
-                } else {
-                    read_buff_empty = true;
-                }
+            switch(dyn->d_tag) {
+            case DT_SYMTAB:
+                tables.symbols = reinterpret_cast<const ElfW(Sym) *>(addr);
+                break;
+            case DT_STRTAB:
+                tables.strings = reinterpret_cast<const char *>(addr);
+                break;
+            case DT_GNU_HASH:
+                tables.gnu_hash = reinterpret_cast<const uint32_t *>(addr);
+                break;
+            case DT_HASH:
+                tables.sysv_hash = reinterpret_cast<const ElfW(Word) *>(addr);
+                break;
+            default: break;
             }
         }
 
-        close(fd);
+        return tables.symbols && tables.strings
+            && (tables.gnu_hash || tables.sysv_hash);
     }
 
 
-    /// Visit a potential dynamic (or static) library, and try to find detach
-    /// addresses.
-    static void visit_elf_path(
-        const char *path,
-        unsigned path_len,
-        char *last_path
-    ) throw() {
+    /// The dynamic sections of the objects whose detach points have been
+    /// added, mapped to the most recent visit of the loaded objects in which
+    /// each object was seen.
+    static static_data<hash_table<uintptr_t, uint32_t>> LOADED_OBJECTS;
 
-        // Don't re-visit the same ELF path name twice in a row.
-        if(0 == memcmp(path, last_path, path_len)) {
-            return;
-        } else {
-            memcpy(last_path, path, path_len);
+
+    /// Serialises visits of the loaded objects.
+    static atomic_spin_lock LOADED_OBJECTS_LOCK;
+
+
+    /// The current visit of the loaded objects.
+    struct loaded_objects_visit {
+        uint32_t generation;
+        bool invalidate_code_cache;
+    };
+
+
+    /// Re-resolve any code cache entries for code in a newly loaded object
+    /// that was translated before the object's detach points were added.
+    static void invalidate_object(const dl_phdr_info *info) throw() {
+        uintptr_t begin(~uintptr_t(0));
+        uintptr_t end(0);
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_LOAD != phdr.p_type) {
+                continue;
+            }
+            if(phdr.p_vaddr < begin) {
+                begin = phdr.p_vaddr;
+            }
+            if((phdr.p_vaddr + phdr.p_memsz) > end) {
+                end = phdr.p_vaddr + phdr.p_memsz;
+            }
         }
 
-        void *handle(dlopen(path, RTLD_NOW));
-        if(nullptr == handle) {
-            return;
+        if(begin < end) {
+            code_cache::invalidate_detach_targets(
+                unsafe_cast<app_pc>(info->dlpi_addr + begin),
+                unsafe_cast<app_pc>(info->dlpi_addr + end));
         }
+    }
 
-#if CONFIG_FEATURE_WRAPPERS
-#   include "granary/gen/user_detach.inc"
-#endif
 
-        dlclose(handle);
+    /// Visit a loaded object, and resolve all detach symbols against its
+    /// dynamic symbol table. Objects that were also seen by the previous visit
+    /// of the loaded objects are skipped.
+    static int visit_loaded_object(dl_phdr_info *info, size_t, void *data) {
+        const loaded_objects_visit &visit(
+            *reinterpret_cast<loaded_objects_visit *>(data));
+
+        symbol_tables tables;
+        if(!find_symbol_tables(info, tables)) {
+            return 0;
+        }
+
+        const uintptr_t key(reinterpret_cast<uintptr_t>(tables.dynamic));
+        uint32_t last_generation(0);
+        LOADED_OBJECTS->load(key, last_generation);
+        LOADED_OBJECTS->store(key, visit.generation);
+
+        if(last_generation && (last_generation + 1) == visit.generation) {
+            return 0;
+        }
+
+        for(unsigned i(0); DETACH_SYMBOLS[i].name; ++i) {
+            if(tables.gnu_hash) {
+                find_gnu_symbol(tables, DETACH_SYMBOLS[i]);
+            } else {
+                find_sysv_symbol(tables, DETACH_SYMBOLS[i]);
+            }
+        }
+
+        if(visit.invalidate_code_cache) {
+            invalidate_object(info);
+        }
+
+        return 0;
+    }
+
+
+    /// Visit all loaded objects, and add the detach points of any objects that
+    /// weren't loaded at the time of the previous visit.
+    static void visit_loaded_objects(bool invalidate_code_cache) throw() {
+        static uint32_t generation(0);
+
+        LOADED_OBJECTS_LOCK.acquire();
+        loaded_objects_visit visit = {++generation, invalidate_code_cache};
+        dl_iterate_phdr(visit_loaded_object, &visit);
+        LOADED_OBJECTS_LOCK.release();
+    }
+
+
+    /// Add the detach points of any objects that have been loaded (e.g. by
+    /// `dlopen`) since the last time that the loaded objects were visited.
+    void register_loaded_objects(void) throw() {
+        visit_loaded_objects(true);
     }
 
 
+    /// Find the detach points of every loaded object. This reads each object's
+    /// dynamic symbol table in place, rather than going through `dlopen` and
+    /// `dlsym`, which would force the dynamic loader to eagerly bind each
+    /// object's symbols.
+    ///
+    /// Note: The code cache doesn't need to be invalidated here, as nothing
+    ///       has been translated yet.
     STATIC_INITIALISE_ID(init_user_detach, {
-        char last_path[256] = {'\0'};
-        parse_proc_maps(visit_elf_path, &(last_path[0]));
+        for(unsigned i(0); DETACH_SYMBOLS[i].name; ++i) {
+            DETACH_SYMBOLS[i].gnu_hash = gnu_hash_of(DETACH_SYMBOLS[i].name);
+            DETACH_SYMBOLS[i].sysv_hash = sysv_hash_of(DETACH_SYMBOLS[i].name);
+        }
+        LOADED_OBJECTS.construct();
+        visit_loaded_objects(false);
     })
 }
@@ -0,0 +1,1717 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * persist.cc
+ *
+ *  Created on: 2014-02-24
+ *      Author: Peter Goodman
+ */
+
+#include "granary/persist.h"
+
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE
+
+#include "granary/state.h"
+#include "granary/policy.h"
+#include "granary/instruction.h"
+#include "granary/basic_block.h"
+#include "granary/basic_block_info.h"
+#include "granary/code_cache.h"
+#include "granary/detach.h"
+#include "granary/dbl.h"
+#include "granary/hash_table.h"
+#include "granary/perf.h"
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#include <link.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+extern "C" {
+    extern uintptr_t GRANARY_EXEC_START;
+    extern uintptr_t GRANARY_EXEC_END;
+}
+
+
+namespace granary {
+
+
+    enum : uint32_t {
+
+        /// "GRCC", read as a little-endian integer.
+        PERSIST_MAGIC = 0x43435247U,
+        PERSIST_VERSION = 1U
+    };
+
+
+    enum {
+        MAX_NUM_MODULES = 1024,
+        MAX_NUM_PERSISTED_ADDRESSES = 16,
+        MAX_BUILD_ID_SIZE = 32,
+
+        /// Non-CTI immediates and displacements below this are never treated
+        /// as addresses.
+        MIN_ADDRESS = 0x10000,
+
+        /// Shift of the policy bits of a mangled address.
+        POLICY_SHIFT = 64 - mangled_address::NUM_MANGLED_BITS
+    };
+
+
+    /// Can the client's basic block state be persisted? Clients that have
+    /// basic block state must opt in, because the state is snapshotted right
+    /// after the block is instrumented, which might not mean anything in a
+    /// later run.
+#if defined(CLIENT_basic_block_state) && !defined(CLIENT_persist_basic_block_state)
+    enum { CAN_PERSIST = false };
+#else
+    enum { CAN_PERSIST = true };
+#endif
+
+
+    /// Kinds of addresses that persisted code can refer to.
+    enum persisted_target_kind : uint8_t {
+
+        /// An offset into the code of the trace.
+        TARGET_TRACE,
+
+        /// An offset into the direct branch lookup stubs of the trace.
+        TARGET_STUBS,
+
+        /// An offset into the client state of one of the trace's blocks.
+        TARGET_STATE,
+
+        /// An address registered with `persist_address`.
+        TARGET_REGISTERED,
+
+        /// The patcher function slot of one of the trace's direct branch
+        /// lookup stubs.
+        TARGET_PATCH,
+
+        /// The code cache address of a policy-mangled module address.
+        TARGET_CODE_CACHE,
+
+        /// An address inside of a module.
+        TARGET_ADDRESS
+    };
+
+
+    /// Kinds of instruction fields that hold an address.
+    enum persisted_field_kind : uint8_t {
+        FIELD_REL32,
+        FIELD_ABS32,
+        FIELD_ABS64
+    };
+
+
+    /// An address that persisted code refers to. In memory, the offset of a
+    /// `TARGET_CODE_CACHE` target is a mangled address, and the offset of a
+    /// `TARGET_ADDRESS` target is an address. In a file, both are relative
+    /// to the load address of module `index`.
+    struct persisted_target {
+        uint64_t offset;
+        uint32_t index;
+        uint16_t policy_bits;
+        uint8_t kind;
+
+        /// Is the target referred to indirectly, through a slot in global
+        /// gencode?
+        uint8_t via_slot;
+    };
+
+
+    /// An instruction field in a trace's code or stubs that must be changed
+    /// when the trace is moved.
+    struct persisted_relocation {
+        persisted_target target;
+        uint32_t field_offset;
+
+        /// Offset of the instruction following the field's instruction, for
+        /// relative fields.
+        uint32_t next_pc_offset;
+
+        uint8_t field;
+        uint8_t in_stubs;
+        uint8_t _[6];
+    };
+
+
+    /// Meta-data of a block in a trace. The blocks of a trace are followed
+    /// by the trace's cold blocks, each of which covers the cold code of
+    /// hot block `state_index`.
+    struct persisted_block {
+        persisted_target generating_pc;
+        uint32_t start_offset;
+        uint16_t num_bytes;
+        uint16_t generating_num_instructions;
+        uint16_t num_instructions;
+        uint16_t state_index;
+        uint32_t _;
+    };
+
+
+    /// A direct branch lookup stub patch of a trace.
+    struct persisted_patch {
+        persisted_target target;
+        uint32_t cti_offset;
+        uint32_t kind;
+    };
+
+
+    /// A persisted trace. This is followed by its blocks, relocations,
+    /// patches, client state, code, and stubs, each of which is padded to
+    /// 8 bytes.
+    struct persisted_trace {
+        uint32_t size;
+        uint32_t num_bytes;
+        uint32_t num_stub_bytes;
+        uint32_t num_relocations;
+        uint16_t num_blocks;
+        uint16_t num_cold_blocks;
+        uint16_t num_patches;
+        uint16_t cache_line_offset;
+    };
+
+
+    /// A loaded module, identified by its GNU build ID. The bounds of the
+    /// module are relative to its load address.
+    struct persisted_module {
+        uint8_t build_id[MAX_BUILD_ID_SIZE];
+        uint32_t build_id_size;
+        uint32_t _;
+        uint64_t begin;
+        uint64_t end;
+    };
+
+
+    /// Header of a persisted code cache file. This is followed by the
+    /// modules that persisted addresses are relative to, then the traces.
+    struct persisted_header {
+        uint32_t magic;
+        uint32_t version;
+        persisted_module granary;
+        uint32_t state_size;
+        uint32_t num_modules;
+        uint32_t num_traces;
+        uint32_t _;
+    };
+
+
+    static_assert(16 == sizeof(persisted_target),
+        "Invalid structure packing of `persisted_target`.");
+    static_assert(32 == sizeof(persisted_relocation),
+        "Invalid structure packing of `persisted_relocation`.");
+    static_assert(32 == sizeof(persisted_block),
+        "Invalid structure packing of `persisted_block`.");
+    static_assert(24 == sizeof(persisted_patch),
+        "Invalid structure packing of `persisted_patch`.");
+    static_assert(24 == sizeof(persisted_trace),
+        "Invalid structure packing of `persisted_trace`.");
+    static_assert(56 == sizeof(persisted_module),
+        "Invalid structure packing of `persisted_module`.");
+    static_assert(80 == sizeof(persisted_header),
+        "Invalid structure packing of `persisted_header`.");
+
+
+    /// A trace that can be saved. The trace, in the persisted format (but with
+    /// in-memory targets), follows the record.
+    struct persist_record {
+        persist_record *next;
+
+        /// Where the trace's code and stubs are in this run.
+        app_pc start_pc;
+        app_pc stub_pc;
+
+        /// Was the trace's memory freed?
+        bool is_dead;
+    };
+
+
+    /// Pointers to the parts of a persisted trace.
+    struct trace_view {
+        persisted_block *blocks;
+        persisted_relocation *relocations;
+        persisted_patch *patches;
+        uint8_t *states;
+        uint8_t *code;
+        uint8_t *stubs;
+    };
+
+
+    /// A module that is loaded in this run.
+    struct loaded_module {
+        persisted_module persisted;
+        uintptr_t load_address;
+    };
+
+
+    /// Recorded traces, newest first.
+    static std::atomic<persist_record *> RECORDS(ATOMIC_VAR_INIT(nullptr));
+
+
+    /// Functions returning run-specific addresses that persisted code can
+    /// refer to.
+    static app_pc (*PERSISTED_ADDRESSES[MAX_NUM_PERSISTED_ADDRESSES])(void);
+    static unsigned NUM_PERSISTED_ADDRESSES = 0;
+
+
+    /// Modules loaded in this run, as of the last `find_modules`.
+    static loaded_module MODULES[MAX_NUM_MODULES];
+    static unsigned NUM_MODULES = 0;
+    static unsigned GRANARY_MODULE = 0;
+
+
+    /// Maps the modules of a file being loaded to `MODULES`.
+    static unsigned MODULE_MAP[MAX_NUM_MODULES];
+
+
+    /// Round `size` up to a multiple of 8.
+    static uint64_t pad(uint64_t size) throw() {
+        return size + ALIGN_TO(size, 8);
+    }
+
+
+    /// Returns the size of a persisted trace, as given by its counts.
+    static uint64_t size_of(const persisted_trace &trace) throw() {
+        return sizeof trace
+            + (uint64_t(trace.num_blocks) + trace.num_cold_blocks)
+                * sizeof(persisted_block)
+            + uint64_t(trace.num_relocations) * sizeof(persisted_relocation)
+            + uint64_t(trace.num_patches) * sizeof(persisted_patch)
+            + pad(uint64_t(trace.num_blocks) * basic_block_state::size())
+            + pad(trace.num_bytes)
+            + pad(trace.num_stub_bytes);
+    }
+
+
+    /// Find the parts of a persisted trace.
+    static void view(persisted_trace *trace, trace_view &parts) throw() {
+        uint8_t *next(unsafe_cast<uint8_t *>(trace + 1));
+
+        parts.blocks = unsafe_cast<persisted_block *>(next);
+        next += (trace->num_blocks + trace->num_cold_blocks)
+              * sizeof(persisted_block);
+
+        parts.relocations = unsafe_cast<persisted_relocation *>(next);
+        next += trace->num_relocations * sizeof(persisted_relocation);
+
+        parts.patches = unsafe_cast<persisted_patch *>(next);
+        next += trace->num_patches * sizeof(persisted_patch);
+
+        parts.states = next;
+        next += pad(trace->num_blocks * basic_block_state::size());
+
+        parts.code = next;
+        next += pad(trace->num_bytes);
+
+        parts.stubs = next;
+    }
+
+
+    /// Returns the persisted trace of a record.
+    static persisted_trace *trace_of(persist_record *record) throw() {
+        return unsafe_cast<persisted_trace *>(record + 1);
+    }
+
+
+    /// Allocate a record for a persisted trace of `size` bytes.
+    static persist_record *allocate_record(uint32_t size) throw() {
+        return unsafe_cast<persist_record *>(
+            allocate_memory<uint8_t>(sizeof(persist_record) + size));
+    }
+
+
+    /// Free a record allocated by `allocate_record`.
+    static void free_record(persist_record *record) throw() {
+        free_memory<uint8_t>(
+            unsafe_cast<uint8_t *>(record),
+            sizeof(persist_record) + trace_of(record)->size);
+    }
+
+
+    /// Add a record to the recorded traces.
+    static void push_record(persist_record *record) throw() {
+        persist_record *next(RECORDS.load());
+        do {
+            record->next = next;
+        } while(!RECORDS.compare_exchange_weak(next, record));
+    }
+
+
+    /// Returns true iff `addr` is within `[begin, begin + size)`.
+    static bool is_within(
+        const_app_pc addr,
+        const_app_pc begin,
+        uint64_t size
+    ) throw() {
+        return begin <= addr && addr < (begin + size);
+    }
+
+
+    /// Returns true iff `addr` is on a mapped page.
+    static bool is_mapped(const_app_pc addr) throw() {
+        const uintptr_t page(
+            reinterpret_cast<uintptr_t>(addr) & ~uintptr_t(PAGE_SIZE - 1));
+        return !msync(reinterpret_cast<void *>(page), PAGE_SIZE, MS_ASYNC);
+    }
+
+
+    /// Returns true iff `value` fits in a sign-extended 32-bit field.
+    static bool fits_int32(int64_t value) throw() {
+        return value == static_cast<int64_t>(static_cast<int32_t>(value));
+    }
+
+
+    /// Returns true iff persisted code must not be entered through `addr`,
+    /// because `addr` is a detach point.
+    static bool is_detach_key(mangled_address addr) throw() {
+        instrumentation_policy policy(addr);
+        return policy.can_detach()
+            && find_detach_target(addr.unmangled_address(), policy.context());
+    }
+
+
+    /// Find the GNU build ID of a loaded object.
+    static bool find_build_id(
+        const dl_phdr_info *info,
+        persisted_module &module
+    ) throw() {
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_NOTE != phdr.p_type) {
+                continue;
+            }
+
+            const unsigned align(8 == phdr.p_align ? 8 : 4);
+            const uint8_t *note(reinterpret_cast<const uint8_t *>(
+                info->dlpi_addr + phdr.p_vaddr));
+            const uint8_t *end(note + phdr.p_memsz);
+
+            while((note + sizeof(ElfW(Nhdr))) <= end) {
+                const ElfW(Nhdr) *header(
+                    reinterpret_cast<const ElfW(Nhdr) *>(note));
+                const uint8_t *name(note + sizeof *header);
+                const uint8_t *desc(
+                    name + header->n_namesz + ALIGN_TO(header->n_namesz, align));
+
+                note = desc + header->n_descsz + ALIGN_TO(header->n_descsz, align);
+                if(note > end) {
+                    break;
+                }
+
+                if(NT_GNU_BUILD_ID != header->n_type
+                || 4 != header->n_namesz
+                || 0 != memcmp(name, "GNU", 4)
+                || !header->n_descsz
+                || MAX_BUILD_ID_SIZE < header->n_descsz) {
+                    continue;
+                }
+
+                memcpy(&(module.build_id[0]), desc, header->n_descsz);
+                module.build_id_size = header->n_descsz;
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Record a loaded object in `MODULES` if it has a build ID.
+    static int visit_module(dl_phdr_info *info, size_t, void *) {
+        if(MAX_NUM_MODULES <= NUM_MODULES) {
+            return 1;
+        }
+
+        loaded_module &module(MODULES[NUM_MODULES]);
+        memset(&module, 0, sizeof module);
+        if(!find_build_id(info, module.persisted)) {
+            return 0;
+        }
+
+        uintptr_t begin(~uintptr_t(0));
+        uintptr_t end(0);
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_LOAD != phdr.p_type) {
+                continue;
+            }
+            if(phdr.p_vaddr < begin) {
+                begin = phdr.p_vaddr;
+            }
+            if((phdr.p_vaddr + phdr.p_memsz) > end) {
+                end = phdr.p_vaddr + phdr.p_memsz;
+            }
+        }
+
+        if(begin < end) {
+            module.persisted.begin = begin;
+            module.persisted.end = end;
+            module.load_address = info->dlpi_addr;
+            ++NUM_MODULES;
+        }
+        return 0;
+    }
+
+
+    /// Returns the index of the module containing `addr`, or `NUM_MODULES`
+    /// if no module contains it.
+    static unsigned module_of(uintptr_t addr) throw() {
+        for(unsigned i(0); i < NUM_MODULES; ++i) {
+            const loaded_module &module(MODULES[i]);
+            if((module.load_address + module.persisted.begin) <= addr
+            && addr < (module.load_address + module.persisted.end)) {
+                return i;
+            }
+        }
+        return NUM_MODULES;
+    }
+
+
+    /// Find the loaded modules. Returns true iff Granary's own module was
+    /// found.
+    static bool find_modules(void) throw() {
+        NUM_MODULES = 0;
+        dl_iterate_phdr(visit_module, nullptr);
+        GRANARY_MODULE = module_of(reinterpret_cast<uintptr_t>(find_modules));
+        return GRANARY_MODULE < NUM_MODULES;
+    }
+
+
+    /// Returns true iff two modules are the same.
+    static bool same_module(
+        const persisted_module &a,
+        const persisted_module &b
+    ) throw() {
+        return a.build_id_size == b.build_id_size
+            && a.begin == b.begin
+            && a.end == b.end
+            && 0 == memcmp(&(a.build_id[0]), &(b.build_id[0]), a.build_id_size);
+    }
+
+
+    /// Make an in-memory target relative to the module that contains it.
+    static bool make_module_relative(persisted_target &target) throw() {
+        uintptr_t addr(target.offset);
+        if(TARGET_CODE_CACHE == target.kind) {
+            mangled_address mangled;
+            mangled.as_uint = target.offset;
+            addr = reinterpret_cast<uintptr_t>(mangled.unmangled_address());
+            target.policy_bits = static_cast<uint16_t>(
+                mangled.as_uint >> POLICY_SHIFT);
+
+        } else if(TARGET_ADDRESS != target.kind) {
+            return true;
+        }
+
+        const unsigned index(module_of(addr));
+        if(NUM_MODULES <= index) {
+            return false;
+        }
+
+        target.index = index;
+        target.offset = addr - MODULES[index].load_address;
+        return true;
+    }
+
+
+    /// Make a module-relative target from a file into an in-memory target.
+    static bool make_absolute(
+        persisted_target &target,
+        unsigned num_file_modules
+    ) throw() {
+        if(TARGET_CODE_CACHE != target.kind && TARGET_ADDRESS != target.kind) {
+            target.policy_bits = 0;
+            target.index = (TARGET_STATE == target.kind
+                         || TARGET_REGISTERED == target.kind
+                         || TARGET_PATCH == target.kind) ? target.index : 0;
+            return TARGET_ADDRESS > target.kind;
+        }
+
+        if(num_file_modules <= target.index
+        || NUM_MODULES <= MODULE_MAP[target.index]) {
+            return false;
+        }
+
+        const loaded_module &module(MODULES[MODULE_MAP[target.index]]);
+        if(target.offset < module.persisted.begin
+        || module.persisted.end <= target.offset) {
+            return false;
+        }
+
+        uint64_t addr(module.load_address + target.offset);
+        if(TARGET_CODE_CACHE == target.kind) {
+            mangled_address mangled;
+            mangled.as_uint = addr;
+            if(mangled.unmangled_address() != reinterpret_cast<app_pc>(addr)) {
+                return false;
+            }
+            addr |= uint64_t(target.policy_bits) << POLICY_SHIFT;
+        }
+
+        target.offset = addr;
+        target.index = 0;
+        target.policy_bits = 0;
+        return true;
+    }
+
+
+    /// Find the field of an instruction that holds `value`. Exactly one field
+    /// must hold `value`.
+    static bool find_field(
+        const uint8_t *bytes,
+        unsigned length,
+        uintptr_t next_pc,
+        uintptr_t value,
+        unsigned &field_offset,
+        persisted_field_kind &field
+    ) throw() {
+        const int64_t rel(static_cast<int64_t>(value - next_pc));
+        unsigned num_fields(0);
+
+        for(unsigned i(1); i < length; ++i) {
+            const unsigned num_bytes(length - i);
+
+            if(8 <= num_bytes) {
+                uint64_t value64(0);
+                memcpy(&value64, &(bytes[i]), sizeof value64);
+                if(value64 == value) {
+                    field_offset = i;
+                    field = FIELD_ABS64;
+                    ++num_fields;
+                    continue;
+                }
+            }
+
+            if(4 <= num_bytes) {
+                int32_t value32(0);
+                memcpy(&value32, &(bytes[i]), sizeof value32);
+                if(fits_int32(rel) && value32 == rel) {
+                    field_offset = i;
+                    field = FIELD_REL32;
+                    ++num_fields;
+                }
+                if(fits_int32(static_cast<int64_t>(value))
+                && value32 == static_cast<int64_t>(value)) {
+                    field_offset = i;
+                    field = FIELD_ABS32;
+                    ++num_fields;
+                }
+            }
+        }
+
+        return 1 == num_fields;
+    }
+
+
+    /// Returns the size of a field.
+    static unsigned size_of_field(uint8_t field) throw() {
+        return FIELD_ABS64 == field ? 8 : 4;
+    }
+
+
+    /// Write `value` into the field of `reloc`, where the field is relative
+    /// to `base`. Returns false if `value` doesn't fit in the field. If
+    /// `write` is false, then only check that it fits.
+    static bool relocate_field(
+        uint8_t *base,
+        const persisted_relocation &reloc,
+        uintptr_t value,
+        bool write
+    ) throw() {
+        uint8_t *field(base + reloc.field_offset);
+        int64_t field_value(static_cast<int64_t>(value));
+
+        if(FIELD_ABS64 == reloc.field) {
+            if(write) {
+                memcpy(field, &value, sizeof value);
+            }
+            return true;
+        }
+
+        if(FIELD_REL32 == reloc.field) {
+            field_value -= reinterpret_cast<int64_t>(base + reloc.next_pc_offset);
+        }
+
+        if(!fits_int32(field_value)) {
+            return false;
+        }
+
+        if(write) {
+            const int32_t value32(static_cast<int32_t>(field_value));
+            memcpy(field, &value32, sizeof value32);
+        }
+        return true;
+    }
+
+
+    /// Read the address held in the field of `reloc`.
+    static app_pc read_field(
+        uint8_t *base,
+        const persisted_relocation &reloc
+    ) throw() {
+        const uint8_t *field(base + reloc.field_offset);
+        if(FIELD_ABS64 == reloc.field) {
+            uintptr_t value(0);
+            memcpy(&value, field, sizeof value);
+            return reinterpret_cast<app_pc>(value);
+        }
+
+        int32_t value32(0);
+        memcpy(&value32, field, sizeof value32);
+        if(FIELD_REL32 == reloc.field) {
+            return base + reloc.next_pc_offset + value32;
+        }
+        return reinterpret_cast<app_pc>(static_cast<intptr_t>(value32));
+    }
+
+
+    /// The outcome of classifying an address that a trace refers to.
+    enum target_class {
+        TARGET_IS_CONSTANT,
+        TARGET_IS_RELOCATABLE,
+        TARGET_IS_UNPERSISTABLE
+    };
+
+
+    /// State for recording the relocations of a trace.
+    struct trace_recorder {
+        const trace_info *trace;
+        app_pc stub_pc;
+        unsigned stub_size;
+
+        persisted_relocation *relocations;
+        unsigned num_relocations;
+        persisted_patch *patches;
+        unsigned num_patches;
+
+        /// The instruction whose operands are being recorded, and where it
+        /// is.
+        instruction in;
+        app_pc blob_pc;
+        bool in_stubs;
+        bool is_native;
+        bool is_slot;
+
+        /// Index of the first relocation of `in`.
+        unsigned first_relocation;
+
+        bool is_persistable;
+    };
+
+
+    /// Classify an address that a trace refers to. If `is_definite` is false
+    /// then `addr` might not be an address at all.
+    static target_class classify_target(
+        trace_recorder &rec,
+        app_pc addr,
+        bool is_definite,
+        bool is_slot,
+        persisted_target &target
+    ) throw() {
+        const trace_info &trace(*(rec.trace));
+        const uintptr_t addr_uint(reinterpret_cast<uintptr_t>(addr));
+
+        memset(&target, 0, sizeof target);
+
+        if(!is_definite && static_cast<intptr_t>(addr_uint) < MIN_ADDRESS) {
+            return TARGET_IS_CONSTANT;
+        }
+
+        if(is_within(addr, trace.start_pc, trace.num_bytes)) {
+            target.kind = TARGET_TRACE;
+            target.offset = addr - trace.start_pc;
+            return TARGET_IS_RELOCATABLE;
+        }
+
+        if(is_within(addr, rec.stub_pc, rec.stub_size)) {
+            target.kind = TARGET_STUBS;
+            target.offset = addr - rec.stub_pc;
+            return TARGET_IS_RELOCATABLE;
+        }
+
+        for(unsigned i(0); basic_block_state::size() && i < trace.num_blocks; ++i) {
+            const app_pc state(unsafe_cast<app_pc>(trace.info[i].state));
+            if(state && is_within(addr, state, basic_block_state::size())) {
+                target.kind = TARGET_STATE;
+                target.index = i;
+                target.offset = addr - state;
+                return TARGET_IS_RELOCATABLE;
+            }
+        }
+
+        for(unsigned i(0); i < NUM_PERSISTED_ADDRESSES; ++i) {
+            if(addr == PERSISTED_ADDRESSES[i]()) {
+                target.kind = TARGET_REGISTERED;
+                target.index = i;
+                return TARGET_IS_RELOCATABLE;
+            }
+        }
+
+        // Another block in the code cache; it must be the block that the code
+        // cache currently maps its generating address to.
+        if(is_code_cache_address(addr)) {
+            const basic_block_info *info(find_basic_block_info(addr));
+            if(!info
+            || addr != info->start_pc
+            || addr != code_cache::lookup(info->generating_pc.as_address)) {
+                return TARGET_IS_UNPERSISTABLE;
+            }
+
+            target.kind = TARGET_CODE_CACHE;
+            target.offset = info->generating_pc.as_uint;
+            return TARGET_IS_RELOCATABLE;
+        }
+
+        // Far CTIs go through slots in global gencode; persist what's in the
+        // slot, and give the loaded trace a new slot.
+        if(is_gencode_address(addr)) {
+            if(!is_slot || TARGET_IS_RELOCATABLE != classify_target(
+                    rec, *unsafe_cast<app_pc *>(addr), true, false, target)) {
+                return TARGET_IS_UNPERSISTABLE;
+            }
+            target.via_slot = true;
+            return TARGET_IS_RELOCATABLE;
+        }
+
+        // The only heap memory that persisted code can refer to is the patcher
+        // function slot of a direct branch lookup stub that patches a CTI of
+        // this trace.
+        if(is_heap_address(addr)) {
+            app_pc cti_pc(nullptr);
+            mangled_address patch_target;
+            unsigned patch_kind(0);
+            if(!is_slot
+            || !find_dbl_patch(addr, cti_pc, patch_target, patch_kind)
+            || !is_within(cti_pc, trace.start_pc, trace.num_bytes)) {
+                return TARGET_IS_UNPERSISTABLE;
+            }
+
+            const uint32_t cti_offset(cti_pc - trace.start_pc);
+            unsigned i(0);
+            for(; i < rec.num_patches; ++i) {
+                if(cti_offset == rec.patches[i].cti_offset) {
+                    break;
+                }
+            }
+
+            if(i == rec.num_patches) {
+                persisted_patch &patch(rec.patches[rec.num_patches++]);
+                memset(&patch, 0, sizeof patch);
+                patch.target.kind = TARGET_CODE_CACHE;
+                patch.target.offset = patch_target.as_uint;
+                patch.cti_offset = cti_offset;
+                patch.kind = patch_kind;
+            }
+
+            target.kind = TARGET_PATCH;
+            target.index = i;
+            return TARGET_IS_RELOCATABLE;
+        }
+
+        // Wrappers, and any other gencode.
+        if(GRANARY_EXEC_START <= addr_uint && addr_uint < GRANARY_EXEC_END) {
+            return TARGET_IS_UNPERSISTABLE;
+        }
+
+        if(!is_definite && !is_mapped(addr)) {
+            return TARGET_IS_CONSTANT;
+        }
+
+        // Resolved against the loaded modules when the trace is saved.
+        target.kind = TARGET_ADDRESS;
+        target.offset = addr_uint;
+        return TARGET_IS_RELOCATABLE;
+    }
+
+
+    /// Record the relocation (if any) needed by an operand of the instruction
+    /// being recorded.
+    static void record_operand(
+        const operand_ref op,
+        trace_recorder &rec
+    ) throw() {
+        if(!rec.is_persistable) {
+            return;
+        }
+
+        const operand opnd(*op);
+        app_pc addr(nullptr);
+        bool is_definite(true);
+        bool is_cti_target(false);
+
+        if(dynamorio::PC_kind == opnd.kind) {
+            addr = dynamorio::opnd_get_pc(opnd);
+            is_cti_target = true;
+
+        } else if(dynamorio::INSTR_kind == opnd.kind) {
+            addr = unsafe_cast<app_pc>(opnd.value.instr->note);
+            is_cti_target = true;
+
+        } else if(dynamorio::FAR_PC_kind == opnd.kind
+               || dynamorio::FAR_INSTR_kind == opnd.kind) {
+            rec.is_persistable = false;
+            return;
+
+        } else if(dynamorio::MEM_INSTR_kind == opnd.kind) {
+            addr = unsafe_cast<app_pc>(opnd.value.instr->note)
+                 + dynamorio::opnd_get_mem_instr_disp(opnd);
+
+        } else if(dynamorio::REL_ADDR_kind == opnd.kind
+               || dynamorio::ABS_ADDR_kind == opnd.kind) {
+            if(dynamorio::DR_SEG_FS == opnd.seg.segment
+            || dynamorio::DR_SEG_GS == opnd.seg.segment) {
+                return;
+            }
+            addr = reinterpret_cast<app_pc>(dynamorio::opnd_get_addr(opnd));
+
+        // Immediates and displacements of application instructions are left
+        // as-is; they can only be addresses if their module can't move.
+        } else if(rec.is_native) {
+            return;
+
+        } else if(dynamorio::BASE_DISP_kind == opnd.kind) {
+            if(dynamorio::DR_SEG_FS == opnd.seg.segment
+            || dynamorio::DR_SEG_GS == opnd.seg.segment) {
+                return;
+            }
+            addr = reinterpret_cast<app_pc>(static_cast<intptr_t>(
+                dynamorio::opnd_get_disp(opnd)));
+            is_definite = false;
+
+        } else if(dynamorio::IMMED_INTEGER_kind == opnd.kind) {
+            addr = reinterpret_cast<app_pc>(dynamorio::opnd_get_immed_int(opnd));
+            is_definite = false;
+
+        } else {
+            return;
+        }
+
+        persisted_target target;
+        switch(classify_target(rec, addr, is_definite, rec.is_slot, target)) {
+        case TARGET_IS_CONSTANT: return;
+        case TARGET_IS_RELOCATABLE: break;
+        case TARGET_IS_UNPERSISTABLE:
+            rec.is_persistable = false;
+            return;
+        }
+
+        // Relative CTIs within the same code move along with the code.
+        const uint8_t same_kind(rec.in_stubs ? TARGET_STUBS : TARGET_TRACE);
+        if(is_cti_target && same_kind == target.kind) {
+            return;
+        }
+
+        const app_pc in_pc(rec.in.pc());
+        const unsigned length(rec.in.instr->length);
+        unsigned field_offset(0);
+        persisted_field_kind field(FIELD_ABS64);
+
+        if(!find_field(
+                in_pc, length, reinterpret_cast<uintptr_t>(in_pc + length),
+                reinterpret_cast<uintptr_t>(addr), field_offset, field)) {
+            rec.is_persistable = false;
+            return;
+        }
+
+        if(FIELD_REL32 == field && same_kind == target.kind) {
+            return;
+        }
+
+        // Code cache targets are only resolved after every trace is loaded,
+        // and can't be range checked beforehand.
+        if(FIELD_ABS32 == field
+        && TARGET_CODE_CACHE == target.kind
+        && !target.via_slot) {
+            rec.is_persistable = false;
+            return;
+        }
+
+        persisted_relocation reloc;
+        memset(&reloc, 0, sizeof reloc);
+        reloc.target = target;
+        reloc.field_offset = (in_pc - rec.blob_pc) + field_offset;
+        reloc.next_pc_offset = (in_pc - rec.blob_pc) + length;
+        reloc.field = field;
+        reloc.in_stubs = rec.in_stubs;
+
+        // The same operand can appear as both a source and a destination.
+        for(unsigned i(rec.first_relocation); i < rec.num_relocations; ++i) {
+            const persisted_relocation &prev(rec.relocations[i]);
+            const unsigned prev_end(
+                prev.field_offset + size_of_field(prev.field));
+            const unsigned end(reloc.field_offset + size_of_field(field));
+
+            if(prev_end <= reloc.field_offset || end <= prev.field_offset) {
+                continue;
+            }
+
+            if(prev.field_offset != reloc.field_offset
+            || prev.field != reloc.field
+            || 0 != memcmp(&(prev.target), &target, sizeof target)) {
+                rec.is_persistable = false;
+            }
+            return;
+        }
+
+        rec.relocations[rec.num_relocations++] = reloc;
+    }
+
+
+    /// Record the relocations needed by the encoded instructions in `ls`.
+    static void record_instructions(
+        trace_recorder &rec,
+        instruction_list &ls,
+        app_pc blob_pc,
+        bool in_stubs
+    ) throw() {
+        rec.blob_pc = blob_pc;
+        rec.in_stubs = in_stubs;
+
+        for(instruction in(ls.first());
+            in.is_valid() && rec.is_persistable;
+            in = in.next()) {
+
+            if(dynamorio::OP_LABEL == in.op_code() || !in.instr->length) {
+                continue;
+            }
+
+            if(!(in.instr->flags & dynamorio::INSTR_OPERANDS_VALID)) {
+                rec.is_persistable = false;
+                return;
+            }
+
+            rec.in = in;
+            rec.is_native = in.has_flag(instruction::NATIVE_INSTRUCTION);
+            rec.is_slot = dynamorio::OP_call_ind == in.op_code()
+                       || dynamorio::OP_jmp_ind == in.op_code();
+            rec.first_relocation = rec.num_relocations;
+
+            in.for_each_operand(record_operand, rec);
+        }
+    }
+
+
+    /// Returns the number of operands of the instructions in `ls`.
+    static unsigned num_operands(instruction_list &ls) throw() {
+        unsigned num(0);
+        for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+            num += in.instr->num_srcs + in.instr->num_dsts;
+        }
+        return num;
+    }
+
+
+    /// Record a newly encoded trace so that it can be saved by
+    /// `save_code_cache`.
+    void persist_trace(
+        cpu_state_handle cpu,
+        const trace_info &trace,
+        instruction_list &ls,
+        instruction_list &stub_ls,
+        app_pc stub_pc,
+        unsigned stub_size
+    ) throw() {
+        if(!CAN_PERSIST) {
+            return;
+        }
+
+        const unsigned max_num_relocations(
+            num_operands(ls) + num_operands(stub_ls));
+
+        trace_recorder rec;
+        memset(&rec, 0, sizeof rec);
+        rec.trace = &trace;
+        rec.stub_pc = stub_pc;
+        rec.stub_size = stub_size;
+        rec.is_persistable = (trace.num_blocks + trace.num_cold_blocks) <= 0xFFFFU
+                          && max_num_relocations <= 0xFFFFU;
+
+        if(rec.is_persistable && max_num_relocations) {
+            rec.relocations = cpu->transient_allocator. \
+                allocate_array<persisted_relocation>(max_num_relocations);
+            rec.patches = cpu->transient_allocator. \
+                allocate_array<persisted_patch>(max_num_relocations);
+        }
+
+        record_instructions(rec, ls, trace.start_pc, false);
+        record_instructions(rec, stub_ls, stub_pc, true);
+
+        IF_PERF( perf::visit_persist_trace(rec.is_persistable); )
+        if(!rec.is_persistable) {
+            return;
+        }
+
+        persisted_trace header;
+        memset(&header, 0, sizeof header);
+        header.num_bytes = trace.num_bytes;
+        header.num_stub_bytes = stub_size;
+        header.num_relocations = rec.num_relocations;
+        header.num_blocks = trace.num_blocks;
+        header.num_cold_blocks = trace.num_cold_blocks;
+        header.num_patches = rec.num_patches;
+        header.cache_line_offset = static_cast<uint16_t>(
+            reinterpret_cast<uintptr_t>(trace.start_pc) % CACHE_LINE_SIZE);
+        header.size = static_cast<uint32_t>(size_of(header));
+
+        persist_record *record(allocate_record(header.size));
+        record->start_pc = trace.start_pc;
+        record->stub_pc = stub_pc;
+
+        persisted_trace *persisted(trace_of(record));
+        *persisted = header;
+
+        trace_view parts;
+        view(persisted, parts);
+
+        const unsigned num_infos(trace.num_blocks + trace.num_cold_blocks);
+        for(unsigned i(0); i < num_infos; ++i) {
+            const basic_block_info &info(trace.info[i]);
+            persisted_block &block(parts.blocks[i]);
+
+            block.generating_pc.kind = TARGET_CODE_CACHE;
+            block.generating_pc.offset = info.generating_pc.as_uint;
+            block.start_offset = info.start_pc - trace.start_pc;
+            block.num_bytes = info.num_bytes;
+            block.generating_num_instructions = info.generating_num_instructions;
+            block.num_instructions = info.num_instructions;
+
+            // Cold blocks share the state of their hot block.
+            for(unsigned j(0); j < trace.num_blocks; ++j) {
+                if(info.generating_pc.as_uint
+                == trace.info[j].generating_pc.as_uint) {
+                    block.state_index = j;
+                    break;
+                }
+            }
+
+            if(i < trace.num_blocks && info.state) {
+                memcpy(
+                    parts.states + i * basic_block_state::size(),
+                    info.state,
+                    basic_block_state::size());
+            }
+        }
+
+        memcpy(parts.relocations, rec.relocations,
+            rec.num_relocations * sizeof(persisted_relocation));
+        memcpy(parts.patches, rec.patches,
+            rec.num_patches * sizeof(persisted_patch));
+        memcpy(parts.code, trace.start_pc, trace.num_bytes);
+        memcpy(parts.stubs, stub_pc, stub_size);
+
+        push_record(record);
+    }
+
+
+    /// Forget the recorded trace (if any) containing `cache_pc`.
+    void remove_persisted_trace(app_pc cache_pc) throw() {
+        for(persist_record *record(RECORDS.load());
+            record;
+            record = record->next) {
+
+            if(!record->is_dead && is_within(
+                    cache_pc, record->start_pc, trace_of(record)->num_bytes)) {
+                record->is_dead = true;
+                return;
+            }
+        }
+    }
+
+
+    /// Allow persisted code to refer to the address returned by
+    /// `get_address`.
+    void persist_address(app_pc (*get_address)(void)) throw() {
+        ASSERT(NUM_PERSISTED_ADDRESSES < MAX_NUM_PERSISTED_ADDRESSES);
+        PERSISTED_ADDRESSES[NUM_PERSISTED_ADDRESSES++] = get_address;
+    }
+
+
+    /// Returns true iff a block of a recorded trace is still what the code
+    /// cache maps the block's generating address to.
+    static bool is_live(persist_record *record) throw() {
+        persisted_trace *trace(trace_of(record));
+        trace_view parts;
+        view(trace, parts);
+
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            mangled_address generating_pc;
+            generating_pc.as_uint = parts.blocks[i].generating_pc.offset;
+            if((record->start_pc + parts.blocks[i].start_offset)
+            == code_cache::lookup(generating_pc.as_address)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Make every target of a persisted trace relative to its module.
+    static bool make_module_relative(persisted_trace *trace) throw() {
+        trace_view parts;
+        view(trace, parts);
+
+        for(unsigned i(0); i < (trace->num_blocks + trace->num_cold_blocks); ++i) {
+            if(!make_module_relative(parts.blocks[i].generating_pc)) {
+                return false;
+            }
+        }
+        for(unsigned i(0); i < trace->num_relocations; ++i) {
+            if(!make_module_relative(parts.relocations[i].target)) {
+                return false;
+            }
+        }
+        for(unsigned i(0); i < trace->num_patches; ++i) {
+            if(!make_module_relative(parts.patches[i].target)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+    /// Write all of `data` to `fd`.
+    static bool write_all(int fd, const void *data, uint64_t size) throw() {
+        const uint8_t *bytes(unsafe_cast<const uint8_t *>(data));
+        while(size) {
+            const ssize_t written(write(fd, bytes, size));
+            if(written <= 0) {
+                return false;
+            }
+            bytes += written;
+            size -= written;
+        }
+        return true;
+    }
+
+
+    /// Write the recorded traces that are still in the code cache to `fd`, in
+    /// the order that they were recorded. Returns false on failure.
+    static bool write_traces(int fd, persisted_header &header) throw() {
+        unsigned num_records(0);
+        for(persist_record *record(RECORDS.load());
+            record;
+            record = record->next) {
+            ++num_records;
+        }
+
+        persist_record **records(allocate_memory<persist_record *>(num_records));
+        unsigned i(0);
+        for(persist_record *record(RECORDS.load());
+            record && i < num_records;
+            record = record->next) {
+            records[i++] = record;
+        }
+
+        bool written(true);
+        for(; written && i--; ) {
+            persist_record *record(records[i]);
+            if(record->is_dead || !is_live(record)) {
+                continue;
+            }
+
+            const persisted_trace *trace(trace_of(record));
+            persisted_trace *copy(unsafe_cast<persisted_trace *>(
+                allocate_memory<uint8_t>(trace->size)));
+            memcpy(copy, trace, trace->size);
+
+            if(make_module_relative(copy)) {
+                written = write_all(fd, copy, copy->size);
+                header.num_traces += 1;
+            }
+
+            free_memory<uint8_t>(unsafe_cast<uint8_t *>(copy), trace->size);
+        }
+
+        free_memory<persist_record *>(records, num_records);
+        return written;
+    }
+
+
+    /// Save every recorded trace that is still in the code cache to
+    /// `file_name`.
+    unsigned save_code_cache(const char *file_name) throw() {
+        if(!RECORDS.load() || !find_modules()) {
+            return 0;
+        }
+
+        persisted_header header;
+        memset(&header, 0, sizeof header);
+        header.version = PERSIST_VERSION;
+        header.granary = MODULES[GRANARY_MODULE].persisted;
+        header.state_size = basic_block_state::size();
+        header.num_modules = NUM_MODULES;
+
+        const int fd(open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if(0 > fd) {
+            return 0;
+        }
+
+        // The magic number is only written once everything else is, so that
+        // partially written files are rejected.
+        bool written(write_all(fd, &header, sizeof header));
+        for(unsigned i(0); written && i < NUM_MODULES; ++i) {
+            written = write_all(
+                fd, &(MODULES[i].persisted), sizeof(persisted_module));
+        }
+
+        written = written && write_traces(fd, header);
+
+        header.magic = PERSIST_MAGIC;
+        written = written
+               && sizeof header == pwrite(fd, &header, sizeof header, 0);
+
+        close(fd);
+        if(!written) {
+            unlink(file_name);
+            return 0;
+        }
+
+        return header.num_traces;
+    }
+
+
+    /// Check that a persisted trace's offsets and indices are in bounds, and
+    /// make its targets absolute.
+    static bool validate_trace(
+        persisted_trace *trace,
+        unsigned num_file_modules
+    ) throw() {
+        trace_view parts;
+        view(trace, parts);
+
+        if(!trace->num_blocks || !trace->num_bytes) {
+            return false;
+        }
+
+        for(unsigned i(0); i < (trace->num_blocks + trace->num_cold_blocks); ++i) {
+            persisted_block &block(parts.blocks[i]);
+            mangled_address generating_pc;
+
+            if(TARGET_CODE_CACHE != block.generating_pc.kind
+            || !make_absolute(block.generating_pc, num_file_modules)
+            || trace->num_blocks <= block.state_index
+            || trace->num_bytes < (uint64_t(block.start_offset) + block.num_bytes)) {
+                return false;
+            }
+
+            generating_pc.as_uint = block.generating_pc.offset;
+            if(i < trace->num_blocks && is_detach_key(generating_pc)) {
+                return false;
+            }
+        }
+
+        for(unsigned i(0); i < trace->num_patches; ++i) {
+            persisted_patch &patch(parts.patches[i]);
+            if(TARGET_CODE_CACHE != patch.target.kind
+            || !make_absolute(patch.target, num_file_modules)
+            || trace->num_bytes <= patch.cti_offset) {
+                return false;
+            }
+        }
+
+        for(unsigned i(0); i < trace->num_relocations; ++i) {
+            persisted_relocation &reloc(parts.relocations[i]);
+            persisted_target &target(reloc.target);
+            const uint64_t num_bytes(
+                reloc.in_stubs ? trace->num_stub_bytes : trace->num_bytes);
+
+            if(FIELD_ABS64 < reloc.field
+            || num_bytes < (uint64_t(reloc.field_offset) + size_of_field(reloc.field))
+            || num_bytes < reloc.next_pc_offset
+            || !make_absolute(target, num_file_modules)) {
+                return false;
+            }
+
+            mangled_address generating_pc;
+            generating_pc.as_uint = target.offset;
+
+            switch(target.kind) {
+            case TARGET_TRACE:
+                if(trace->num_bytes <= target.offset) return false;
+                break;
+            case TARGET_STUBS:
+                if(trace->num_stub_bytes <= target.offset) return false;
+                break;
+            case TARGET_STATE:
+                if(trace->num_blocks <= target.index
+                || basic_block_state::size() <= target.offset) return false;
+                break;
+            case TARGET_REGISTERED:
+                if(NUM_PERSISTED_ADDRESSES <= target.index) return false;
+                break;
+            case TARGET_PATCH:
+                if(trace->num_patches <= target.index) return false;
+                break;
+            case TARGET_CODE_CACHE:
+                if(is_detach_key(generating_pc)
+                || (FIELD_ABS32 == reloc.field && !target.via_slot)) {
+                    return false;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        return true;
+    }
+
+
+    /// Returns the address of a non-code cache target of a loaded trace.
+    static uintptr_t target_address(
+        const persisted_target &target,
+        persist_record *record,
+        uint8_t *states,
+        app_pc *patch_slots
+    ) throw() {
+        switch(target.kind) {
+        case TARGET_TRACE:
+            return reinterpret_cast<uintptr_t>(record->start_pc + target.offset);
+        case TARGET_STUBS:
+            return reinterpret_cast<uintptr_t>(record->stub_pc + target.offset);
+        case TARGET_STATE:
+            return reinterpret_cast<uintptr_t>(
+                states + target.index * basic_block_state::size() + target.offset);
+        case TARGET_REGISTERED:
+            return reinterpret_cast<uintptr_t>(
+                PERSISTED_ADDRESSES[target.index]());
+        case TARGET_PATCH:
+            return reinterpret_cast<uintptr_t>(patch_slots[target.index]);
+        default:
+            return target.offset;
+        }
+    }
+
+
+    /// Move a validated trace into the code cache on this CPU. The trace's
+    /// code cache targets are resolved later by `link_trace`. Returns false
+    /// if the trace can't be moved.
+    static bool place_trace(
+        cpu_state_handle cpu,
+        persist_record *record
+    ) throw() {
+        persisted_trace *trace(trace_of(record));
+        trace_view parts;
+        view(trace, parts);
+
+        generic_fragment_allocator *allocator(cpu->current_fragment_allocator);
+        const unsigned num_infos(trace->num_blocks + trace->num_cold_blocks);
+        const unsigned state_size(basic_block_state::size());
+
+        allocator->lock_coarse(IF_TEST(cpu->id));
+
+        record->start_pc = allocator->allocate_array<uint8_t>(trace->num_bytes);
+        if(trace->num_stub_bytes) {
+            record->stub_pc = cpu->stub_allocator.allocate_array<uint8_t>(
+                trace->num_stub_bytes);
+        }
+
+        uint8_t *states(nullptr);
+        if(state_size) {
+            states = unsafe_cast<uint8_t *>(cpu->block_allocator. \
+                allocate_array<basic_block_state>(trace->num_blocks));
+            memcpy(states, parts.states, trace->num_blocks * state_size);
+        }
+
+        uintptr_t *values(cpu->transient_allocator. \
+            allocate_array<uintptr_t>(trace->num_relocations));
+        app_pc *patch_slots(cpu->transient_allocator. \
+            allocate_array<app_pc>(trace->num_patches));
+
+        // Check that everything whose address is already known fits before
+        // making patches and slots, which can't be taken back.
+        bool fits(trace->cache_line_offset == (
+            reinterpret_cast<uintptr_t>(record->start_pc) % CACHE_LINE_SIZE));
+
+        for(unsigned i(0); fits && i < trace->num_relocations; ++i) {
+            const persisted_relocation &reloc(parts.relocations[i]);
+            if(reloc.target.via_slot
+            || TARGET_PATCH == reloc.target.kind
+            || TARGET_CODE_CACHE == reloc.target.kind) {
+                continue;
+            }
+
+            values[i] = target_address(
+                reloc.target, record, states, patch_slots);
+            fits = relocate_field(
+                reloc.in_stubs ? record->stub_pc : record->start_pc,
+                reloc, values[i], false);
+        }
+
+        for(unsigned i(0); fits && i < trace->num_patches; ++i) {
+            mangled_address target_address;
+            target_address.as_uint = parts.patches[i].target.offset;
+            patch_slots[i] = make_dbl_patch(
+                record->start_pc + parts.patches[i].cti_offset,
+                target_address,
+                parts.patches[i].kind);
+        }
+
+        for(unsigned i(0); fits && i < trace->num_relocations; ++i) {
+            const persisted_relocation &reloc(parts.relocations[i]);
+            if(reloc.target.via_slot) {
+                app_pc *slot(global_state::FRAGMENT_ALLOCATOR-> \
+                    allocate<app_pc>());
+                if(TARGET_CODE_CACHE != reloc.target.kind) {
+                    *slot = reinterpret_cast<app_pc>(target_address(
+                        reloc.target, record, states, patch_slots));
+                }
+                values[i] = reinterpret_cast<uintptr_t>(slot);
+
+            } else if(TARGET_PATCH == reloc.target.kind) {
+                values[i] = target_address(
+                    reloc.target, record, states, patch_slots);
+
+            } else {
+                continue;
+            }
+
+            fits = relocate_field(
+                reloc.in_stubs ? record->stub_pc : record->start_pc,
+                reloc, values[i], false);
+        }
+
+        // Patches and slots that were made before finding out that something
+        // doesn't fit are leaked, as with the patches of discarded blocks.
+        if(!fits) {
+            if(state_size) {
+                cpu->block_allocator.free_last();
+            }
+            if(trace->num_stub_bytes) {
+                cpu->stub_allocator.free_last();
+            }
+            allocator->free_last();
+            allocator->unlock_coarse();
+            return false;
+        }
+
+        memcpy(record->start_pc, parts.code, trace->num_bytes);
+        memcpy(record->stub_pc, parts.stubs, trace->num_stub_bytes);
+
+        for(unsigned i(0); i < trace->num_relocations; ++i) {
+            const persisted_relocation &reloc(parts.relocations[i]);
+            if(TARGET_CODE_CACHE != reloc.target.kind || reloc.target.via_slot) {
+                relocate_field(
+                    reloc.in_stubs ? record->stub_pc : record->start_pc,
+                    reloc, values[i], true);
+            }
+        }
+
+        trace_info info;
+        info.start_pc = record->start_pc;
+        info.num_blocks = trace->num_blocks;
+        info.num_cold_blocks = trace->num_cold_blocks;
+        info.num_bytes = trace->num_bytes;
+        info.info = allocate_memory<basic_block_info>(num_infos);
+
+        for(unsigned i(0); i < num_infos; ++i) {
+            const persisted_block &block(parts.blocks[i]);
+            basic_block_info &block_info(info.info[i]);
+
+            block_info.num_bbs_in_trace = trace->num_blocks;
+            block_info.start_pc = record->start_pc + block.start_offset;
+            block_info.num_bytes = block.num_bytes;
+            block_info.generating_pc.as_uint = block.generating_pc.offset;
+            block_info.generating_num_instructions =
+                block.generating_num_instructions;
+            block_info.num_instructions = block.num_instructions;
+            block_info.state = unsafe_cast<basic_block_state *>(
+                states ? states + block.state_index * state_size : nullptr);
+            block_info.allocator = allocator;
+        }
+
+        store_trace_meta_info(info);
+        allocator->unlock_coarse();
+        return true;
+    }
+
+
+    /// Resolve the code cache targets of a placed trace. Targets that weren't
+    /// loaded are translated.
+    static void link_trace(
+        cpu_state_handle cpu,
+        persist_record *record,
+        hash_table<app_pc, app_pc> &loaded_blocks
+    ) throw() {
+        persisted_trace *trace(trace_of(record));
+        trace_view parts;
+        view(trace, parts);
+
+        for(unsigned i(0); i < trace->num_relocations; ++i) {
+            const persisted_relocation &reloc(parts.relocations[i]);
+            if(TARGET_CODE_CACHE != reloc.target.kind) {
+                continue;
+            }
+
+            mangled_address generating_pc;
+            generating_pc.as_uint = reloc.target.offset;
+
+            app_pc target_pc(nullptr);
+            if(!loaded_blocks.load(generating_pc.as_address, target_pc)) {
+                target_pc = code_cache::find(cpu, generating_pc);
+            }
+
+            ASSERT(is_code_cache_address(target_pc));
+
+            uint8_t *base(reloc.in_stubs ? record->stub_pc : record->start_pc);
+            if(reloc.target.via_slot) {
+                *unsafe_cast<app_pc *>(read_field(base, reloc)) = target_pc;
+            } else {
+                IF_TEST( const bool fits = ) relocate_field(
+                    base, reloc, reinterpret_cast<uintptr_t>(target_pc), true);
+                ASSERT(fits);
+            }
+        }
+    }
+
+
+    /// Load the traces of a mapped persisted code cache file.
+    static unsigned load_traces(const uint8_t *file, uint64_t size) throw() {
+        const persisted_header *header(
+            unsafe_cast<const persisted_header *>(file));
+
+        if(!CAN_PERSIST
+        || size < sizeof *header
+        || PERSIST_MAGIC != header->magic
+        || PERSIST_VERSION != header->version
+        || basic_block_state::size() != header->state_size
+        || MAX_NUM_MODULES < header->num_modules
+        || size < (sizeof *header
+                 + header->num_modules * sizeof(persisted_module))
+        || !find_modules()
+        || !same_module(header->granary, MODULES[GRANARY_MODULE].persisted)) {
+            return 0;
+        }
+
+        const persisted_module *file_modules(
+            unsafe_cast<const persisted_module *>(header + 1));
+
+        for(unsigned i(0); i < header->num_modules; ++i) {
+            MODULE_MAP[i] = NUM_MODULES;
+            for(unsigned j(0); j < NUM_MODULES; ++j) {
+                if(same_module(file_modules[i], MODULES[j].persisted)) {
+                    MODULE_MAP[i] = j;
+                    break;
+                }
+            }
+        }
+
+        cpu_state_handle cpu;
+        enter(cpu);
+
+        hash_table<app_pc, app_pc> loaded_blocks;
+        persist_record *loaded(nullptr);
+        persist_record **next_loaded(&loaded);
+
+        uint64_t offset(sizeof *header
+                      + header->num_modules * sizeof(persisted_module));
+
+        for(unsigned i(0); i < header->num_traces; ++i) {
+            if((size - offset) < sizeof(persisted_trace)) {
+                break;
+            }
+
+            const persisted_trace *trace(
+                unsafe_cast<const persisted_trace *>(file + offset));
+            if(trace->size != size_of(*trace) || (size - offset) < trace->size) {
+                break;
+            }
+            offset += trace->size;
+
+            persist_record *record(allocate_record(trace->size));
+            memcpy(trace_of(record), trace, trace->size);
+
+            if(!validate_trace(trace_of(record), header->num_modules)
+            || !place_trace(cpu, record)) {
+                free_record(record);
+                continue;
+            }
+
+            trace_view parts;
+            view(trace_of(record), parts);
+            for(unsigned j(0); j < trace->num_blocks; ++j) {
+                mangled_address generating_pc;
+                generating_pc.as_uint = parts.blocks[j].generating_pc.offset;
+                loaded_blocks.store(
+                    generating_pc.as_address,
+                    record->start_pc + parts.blocks[j].start_offset);
+            }
+
+            *next_loaded = record;
+            next_loaded = &(record->next);
+        }
+
+        for(persist_record *record(loaded); record; record = record->next) {
+            link_trace(cpu, record, loaded_blocks);
+        }
+
+        // Commit to the loaded traces in the order that they were saved, so
+        // that later traces replace the entries of earlier ones, as they did
+        // when they were translated.
+        unsigned num_loaded(0);
+        for(persist_record *record(loaded), *next(nullptr);
+            record;
+            record = next) {
+
+            next = record->next;
+
+            persisted_trace *trace(trace_of(record));
+            trace_view parts;
+            view(trace, parts);
+
+            for(unsigned j(0); j < trace->num_blocks; ++j) {
+                const app_pc block_pc(
+                    record->start_pc + parts.blocks[j].start_offset);
+                mangled_address generating_pc;
+                generating_pc.as_uint = parts.blocks[j].generating_pc.offset;
+
+                code_cache::add(generating_pc.as_address, block_pc);
+                client::commit_to_basic_block(
+                    *(find_basic_block_info(block_pc)->state));
+            }
+
+            push_record(record);
+            IF_PERF( perf::visit_load_trace(); )
+            ++num_loaded;
+        }
+
+        return num_loaded;
+    }
+
+
+    /// Validate the traces saved by `save_code_cache` in `file_name`, and
+    /// load the ones that are valid into the code cache.
+    unsigned load_code_cache(const char *file_name) throw() {
+        const int fd(open(file_name, O_RDONLY));
+        if(0 > fd) {
+            return 0;
+        }
+
+        struct stat info;
+        if(fstat(fd, &info) || !info.st_size) {
+            close(fd);
+            return 0;
+        }
+
+        const uint64_t size(info.st_size);
+        void *file(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+        close(fd);
+
+        if(MAP_FAILED == file) {
+            return 0;
+        }
+
+        const unsigned num_loaded(
+            load_traces(unsafe_cast<const uint8_t *>(file), size));
+        munmap(file, size);
+        return num_loaded;
+    }
+}
+
+#endif /* CONFIG_FEATURE_PERSIST_CODE_CACHE */
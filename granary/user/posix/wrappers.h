@@ -108,7 +108,23 @@
 #if defined(CAN_WRAP_dlopen) && CAN_WRAP_dlopen
 #   define APP_WRAPPER_FOR_dlopen
     FUNCTION_WRAPPER(APP, dlopen, (void *), (const char *filename, int flag), {
-        return dlopen(VALID_ADDRESS(filename), flag);
+        void *handle(dlopen(VALID_ADDRESS(filename), flag));
+        if(handle) {
+            register_loaded_objects();
+        }
+        return handle;
+    })
+#endif
+
+
+/// Unloading an object lets a later `dlopen` map a different object at the
+/// same address, so note which objects are no longer loaded.
+#if defined(CAN_WRAP_dlclose) && CAN_WRAP_dlclose
+#   define APP_WRAPPER_FOR_dlclose
+    FUNCTION_WRAPPER(APP, dlclose, (int), (void *handle), {
+        const int ret(dlclose(VALID_ADDRESS(handle)));
+        register_loaded_objects();
+        return ret;
     })
 #endif
 
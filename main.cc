@@ -10,13 +10,25 @@
 #include <cstdlib>
 #include "granary/globals.h"
 #include "granary/test.h"
+#include "granary/persist.h"
 
 int main(void) throw() {
     using namespace granary;
 
     init();
+
+    // Test cases inspect their blocks as they are translated, so they are
+    // run against an empty code cache.
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE && !CONFIG_DEBUG_RUN_TEST_CASES
+    load_code_cache();
+#endif
+
     run_tests();
 
+#if CONFIG_FEATURE_PERSIST_CODE_CACHE && !CONFIG_DEBUG_RUN_TEST_CASES
+    save_code_cache();
+#endif
+
     IF_PERF( perf::report(); )
     return 0;
 }
@@ -85,6 +85,19 @@ void **kernel_get_cpu_state(void *ptr[]) {
 }
 
 
+/// Per-CPU counters used by Granary's sampled instrumentation policies. The
+/// size must be at least `NUM_SAMPLE_COUNTERS` (see granary/sampling.h).
+static DEFINE_PER_CPU(u64 [4], granary_sample_counters);
+
+
+/// Get the `%gs`-relative offset of the per-CPU sampling counters. Code in
+/// the code cache adds this offset to `%gs` to access the current CPU's
+/// counters, in the same way as `this_cpu_*` operations do.
+unsigned long kernel_get_sample_counters(void) {
+    return (unsigned long) &granary_sample_counters;
+}
+
+
 /// Get access to the per-task Granary state. The Granary state field might
 /// be as small as a pointer, or might be a larger structure, depending on how
 /// the kernel's task struct has been changed.
@@ -0,0 +1,122 @@
+"""Decode a binary log from the rcudbg tool into the same text that the tool
+prints when its log format is `LOG_TEXT`.
+
+Usage: python decode_rcudbg_log.py <binary log file>
+
+See `clients/watchpoints/clients/rcudbg/log.cc` for the binary log format.
+
+Copyright:    Copyright 2012-2013 Peter Goodman, all rights reserved.
+"""
+
+import re
+import struct
+import sys
+
+BINARY_LOG_MAGIC = 0x47444352
+BINARY_LOG_VERSION = 1
+
+RECORD_FORMAT = 1
+RECORD_STRING = 2
+RECORD_MESSAGE = 3
+RECORD_LOST_MESSAGES = 4
+
+HEADER = struct.Struct("<II")
+FORMAT_RECORD = struct.Struct("<III4BI")  # After the kind.
+STRING_RECORD = struct.Struct("<IQ")      # After the kind.
+MESSAGE_RECORD = struct.Struct("<I4Q")    # After the kind.
+LOST_MESSAGES_RECORD = struct.Struct("<IQ")
+KIND = struct.Struct("<I")
+
+CONVERSION = re.compile(r"%(%|[^a-zA-Z%]*[a-zA-Z])")
+
+
+class Reader(object):
+  __slots__ = ('data', 'offset')
+  def __init__(self, data):
+    self.data = data
+    self.offset = 0
+
+  def at_end(self):
+    return self.offset >= len(self.data)
+
+  def read(self, size):
+    if self.offset + size > len(self.data):
+      raise EOFError("Truncated rcudbg log.")
+    data = self.data[self.offset:self.offset + size]
+    self.offset += size
+    return data
+
+  def unpack(self, s):
+    return s.unpack(self.read(s.size))
+
+
+class Format(object):
+  __slots__ = ('format', 'arg_order')
+  def __init__(self, format, arg_order):
+    self.format = format
+    self.arg_order = arg_order
+
+
+def decode_string(data):
+  return data.decode("utf-8", "replace")
+
+
+def format_message(fmt, strings, payload):
+  """Format a message the way that `sprintf` would in the kernel."""
+  args = iter(fmt.arg_order)
+  def convert(match):
+    conversion = match.group(1)
+    if "%" == conversion:
+      return "%"
+    value = payload[next(args)]
+    if conversion.endswith("s"):
+      if not value:
+        return "(null)"
+      return strings.get(value, "<unknown string 0x%x>" % value)
+    elif conversion.endswith("p"):
+      return "0x%x" % value if value else "(null)"
+    return str(value)
+  return CONVERSION.sub(convert, fmt.format)
+
+
+def decode(data, out):
+  reader = Reader(data)
+  magic, version = reader.unpack(HEADER)
+  if BINARY_LOG_MAGIC != magic or BINARY_LOG_VERSION != version:
+    raise ValueError("Not an rcudbg binary log (version %d)." %
+                     BINARY_LOG_VERSION)
+
+  formats = {}
+  strings = {}
+  while not reader.at_end():
+    kind, = reader.unpack(KIND)
+    if RECORD_FORMAT == kind:
+      message_id, _, num_args, o0, o1, o2, o3, length = \
+          reader.unpack(FORMAT_RECORD)
+      formats[message_id] = Format(
+          decode_string(reader.read(length)), (o0, o1, o2, o3)[:num_args])
+
+    elif RECORD_STRING == kind:
+      length, address = reader.unpack(STRING_RECORD)
+      strings[address] = decode_string(reader.read(length))
+
+    elif RECORD_MESSAGE == kind:
+      fields = reader.unpack(MESSAGE_RECORD)
+      message_id, payload = fields[0], fields[1:]
+      out.write(format_message(formats[message_id], strings, payload))
+
+    elif RECORD_LOST_MESSAGES == kind:
+      _, num_lost_messages = reader.unpack(LOST_MESSAGES_RECORD)
+      out.write("Warning: %d messages were lost.\n\n" % num_lost_messages)
+
+    else:
+      raise ValueError("Unknown record kind %d at offset %d." % (
+          kind, reader.offset - KIND.size))
+
+
+if "__main__" == __name__:
+  if 2 != len(sys.argv):
+    sys.stderr.write(__doc__)
+    sys.exit(1)
+  with open(sys.argv[1], "rb") as f:
+    decode(f.read(), sys.stdout)
@@ -0,0 +1,83 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_late_detach.cc
+ *
+ *  Created on: 2014-02-16
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && !CONFIG_ENV_KERNEL
+
+#include "granary/detach.h"
+
+namespace test {
+
+
+    static int late_detach_func(void) throw() {
+        register int ret;
+        ASM("movl $1, %0;" : "=r"(ret));
+        return ret;
+    }
+
+
+    static int late_attach_func(void) throw() {
+        register int ret;
+        ASM("movl $2, %0;" : "=r"(ret));
+        return ret;
+    }
+
+
+    static int late_detach_target(void) throw() {
+        register int ret;
+        ASM("movl $3, %0;" : "=r"(ret));
+        return ret;
+    }
+
+
+    /// Test that re-resolving the code cache entries of code that becomes a
+    /// detach point after it was translated only redirects the entries of
+    /// policies that can detach.
+    static void late_detach_respects_force_attach(void) {
+        granary::instrumentation_policy policy =
+            granary::policy_for<granary::test_policy>();
+        policy.in_host_context(false);
+
+        granary::instrumentation_policy attach_policy(policy);
+        attach_policy.force_attach(true);
+
+        granary::app_pc detach_pc((granary::app_pc) late_detach_func);
+        granary::app_pc attach_pc((granary::app_pc) late_attach_func);
+        granary::app_pc target_pc((granary::app_pc) late_detach_target);
+
+        const granary::app_pc detach_cache_pc(
+            granary::code_cache::find(detach_pc, policy));
+        const granary::app_pc attach_cache_pc(
+            granary::code_cache::find(attach_pc, attach_policy));
+
+        ASSERT(target_pc != detach_cache_pc);
+        ASSERT(target_pc != attach_cache_pc);
+
+        granary::add_detach_target(
+            detach_pc, target_pc, granary::RUNNING_AS_APP);
+        granary::add_detach_target(
+            attach_pc, target_pc, granary::RUNNING_AS_APP);
+
+        granary::code_cache::invalidate_detach_targets(
+            detach_pc, detach_pc + 1);
+        granary::code_cache::invalidate_detach_targets(
+            attach_pc, attach_pc + 1);
+
+        ASSERT(target_pc == granary::code_cache::find(detach_pc, policy));
+        ASSERT(attach_cache_pc ==
+            granary::code_cache::find(attach_pc, attach_policy));
+    }
+
+
+    ADD_TEST(late_detach_respects_force_attach,
+        "Test that late detach points only redirect code cache entries of "
+        "policies that can detach.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
@@ -9,6 +9,7 @@
 #include "granary/mangle.h"
 #include "granary/test.h"
 #include "clients/instrument.h"
+#include "clients/lifetime/metadata.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -71,6 +72,90 @@ static void test_find_const(void) {
 
 ADD_TEST(test_find_const,
     "Test the `lifetime` tool.")
+
+#if WP_GENERATION_WIDTH
+static void test_stale_pointer_generation(void) {
+  using namespace client;
+
+  void *mem = malloc(sizeof(my_struct_t));
+  void *old_ptr = mem;
+  ASSERT(wp::ADDRESS_WATCHED == wp::add_watchpoint(
+      old_ptr, mem, sizeof(my_struct_t), nullptr));
+  ASSERT(is_current_object(old_ptr));
+
+  // Freeing the object recycles its meta-data, which is then reused by the
+  // next object allocated on this CPU.
+  wp::free_descriptor_of(old_ptr);
+  ASSERT(!is_current_object(old_ptr));
+
+  void *new_ptr = mem;
+  ASSERT(wp::ADDRESS_WATCHED == wp::add_watchpoint(
+      new_ptr, mem, sizeof(my_struct_t), nullptr));
+  ASSERT(wp::combined_index_of(old_ptr) == wp::combined_index_of(new_ptr));
+  ASSERT(wp::descriptor_of(old_ptr) == wp::descriptor_of(new_ptr));
+
+  // Only the generation in the tainted pointer tells the two objects apart.
+  ASSERT(wp::generation_of(old_ptr) != wp::generation_of(new_ptr));
+  ASSERT(is_current_object(new_ptr));
+  ASSERT(!is_current_object(old_ptr));
+
+  wp::free_descriptor_of(new_ptr);
+  free(mem);
+}
+
+ADD_TEST(test_stale_pointer_generation,
+    "Test that stale pointers to a freed object don't alias its successor.")
+#endif  // WP_GENERATION_WIDTH
+
+#if WP_USE_INHERITED_INDEX
+enum {
+  NUM_ZONE_BYTES = 1 << client::wp::INHERITED_INDEX_OFFSET,
+
+  // Watch twice as many objects as fit in a single inherited index, with each
+  // inherited index holding only half of its capacity.
+  NUM_ZONE_OBJECTS = (client::wp::MAX_COUNTER_INDEX + 1) / 2,
+  NUM_OBJECTS = 2 * (client::wp::MAX_COUNTER_INDEX + 1),
+  OBJECT_STRIDE = NUM_ZONE_BYTES / NUM_ZONE_OBJECTS,
+  NUM_ZONES = NUM_OBJECTS / NUM_ZONE_OBJECTS
+};
+
+static char INHERITED_INDEX_HEAP[(NUM_ZONES + 1) * NUM_ZONE_BYTES];
+static void *INHERITED_INDEX_OBJECTS[NUM_OBJECTS];
+
+static void test_inherited_index_capacity(void) {
+  using namespace client;
+
+  const uintptr_t heap(reinterpret_cast<uintptr_t>(INHERITED_INDEX_HEAP));
+  char *first_zone(reinterpret_cast<char *>(
+      (heap + NUM_ZONE_BYTES - 1) & ~(uintptr_t) (NUM_ZONE_BYTES - 1)));
+
+  for (unsigned i = 0; i < NUM_OBJECTS; ++i) {
+    void *mem = first_zone + i * OBJECT_STRIDE;
+    void *ptr = mem;
+    ASSERT(wp::ADDRESS_WATCHED == wp::add_watchpoint(
+        ptr, mem, sizeof(my_struct_t), nullptr));
+    ASSERT(wp::inherited_index_of(mem) == wp::inherited_index_of(ptr));
+    INHERITED_INDEX_OBJECTS[i] = ptr;
+  }
+
+  // Objects in different zones can share counter indexes, but never their
+  // meta-data.
+  for (unsigned i = 0; i < NUM_OBJECTS; ++i) {
+    void *ptr = INHERITED_INDEX_OBJECTS[i];
+    ASSERT(wp::descriptor_of(ptr)->base_addr ==
+           reinterpret_cast<uintptr_t>(first_zone + i * OBJECT_STRIDE));
+    ASSERT(is_current_object(ptr));
+  }
+
+  for (unsigned i = 0; i < NUM_OBJECTS; ++i) {
+    wp::free_descriptor_of(INHERITED_INDEX_OBJECTS[i]);
+  }
+}
+
+ADD_TEST(test_inherited_index_capacity,
+    "Test that inherited indexes allow more objects to be watched than there "
+    "are counter indexes.")
+#endif  // WP_USE_INHERITED_INDEX
 }
 
 #endif
@@ -0,0 +1,66 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_persist.cc
+ *
+ *  Created on: 2014-02-24
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && CONFIG_FEATURE_PERSIST_CODE_CACHE
+
+#include "granary/persist.h"
+
+#include <unistd.h>
+
+#define PERSIST_TEST_FILE "granary.test.cache"
+
+namespace test {
+
+    static volatile uint64_t PERSIST_VALUE = 1;
+
+
+    static DONT_OPTIMISE uint64_t persist_callee(uint64_t val) {
+        return val + 1;
+    }
+
+
+    static DONT_OPTIMISE uint64_t persist_caller(void) {
+        return persist_callee(PERSIST_VALUE) * 2;
+    }
+
+
+    /// Test that a saved trace can be loaded back into the code cache, and
+    /// that the loaded code refers to the same data and code as the original.
+    ///
+    /// Note: Tests are run with a stack that is only 8-byte aligned, whereas
+    ///       `dl_iterate_phdr` expects a 16-byte aligned stack.
+    __attribute__((force_align_arg_pointer))
+    static void persisted_code_is_relocated(void) {
+        granary::app_pc caller((granary::app_pc) persist_caller);
+        granary::basic_block bb_caller(granary::code_cache::find(
+            caller, granary::TEST_POLICY));
+
+        PERSIST_VALUE = 1;
+        ASSERT(4 == bb_caller.call<uint64_t>());
+
+        ASSERT(0 < granary::save_code_cache(PERSIST_TEST_FILE));
+        ASSERT(0 < granary::load_code_cache(PERSIST_TEST_FILE));
+        unlink(PERSIST_TEST_FILE);
+
+        granary::basic_block bb_loaded(granary::code_cache::find(
+            caller, granary::TEST_POLICY));
+        ASSERT(bb_loaded.cache_pc_start != bb_caller.cache_pc_start);
+
+        ASSERT(4 == bb_loaded.call<uint64_t>());
+        PERSIST_VALUE = 2;
+        ASSERT(6 == bb_loaded.call<uint64_t>());
+    }
+
+
+    ADD_TEST(persisted_code_is_relocated,
+        "Test that saved traces are correctly relocated when loaded.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES && CONFIG_FEATURE_PERSIST_CODE_CACHE */
@@ -0,0 +1,134 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_sampling.cc
+ *
+ *  Created on: 2014-02-14
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#include "granary/sampling.h"
+
+namespace test {
+
+    namespace {
+        static uint64_t NUM_FULL_EXECUTIONS = 0;
+    }
+
+
+    /// An instrumentation policy that counts the number of times that basic
+    /// blocks are executed. This is the fully instrumented version of the
+    /// sampled policy under test.
+    struct sample_count_policy : public granary::instrumentation_policy {
+    public:
+
+        enum {
+            AUTO_INSTRUMENT_HOST = false
+        };
+
+
+        /// Instrument a basic block.
+        granary::instrumentation_policy visit_app_instructions(
+            granary::cpu_state_handle,
+            granary::basic_block_state &,
+            granary::instruction_list &ls
+        ) throw() {
+            using namespace granary;
+
+            if(ls.is_stub()) {
+                return *this;
+            }
+
+            instruction in(ls.first());
+            IF_USER( ls.insert_before(in,
+                lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+            ls.insert_before(in, pushf_());
+            ls.insert_before(in,
+                inc_(absmem_(&NUM_FULL_EXECUTIONS, dynamorio::OPSZ_8)));
+            ls.insert_before(in, popf_());
+            IF_USER( ls.insert_before(in,
+                lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+            return *this;
+        }
+
+
+        /// Instrument a basic block.
+        granary::instrumentation_policy visit_host_instructions(
+            granary::cpu_state_handle cpu,
+            granary::basic_block_state &bb,
+            granary::instruction_list &ls
+        ) throw() {
+            return visit_app_instructions(cpu, bb, ls);
+        }
+
+
+#if CONFIG_FEATURE_CLIENT_HANDLE_INTERRUPT
+        /// Handle an interrupt in module code. Returns true iff the client
+        /// handles the interrupt.
+        granary::interrupt_handled_state handle_interrupt(
+            granary::cpu_state_handle,
+            granary::thread_state_handle,
+            granary::basic_block_state &,
+            granary::interrupt_stack_frame &,
+            granary::interrupt_vector
+        ) throw() {
+            return granary::INTERRUPT_DEFER;
+        }
+#endif
+    };
+
+
+    /// Loop `num` times. The loop back-edge is where the checking version
+    /// counts down the sampling period.
+    static void sample_loop(register uint64_t num) throw() {
+        ASM(
+        "1:"
+            "decq %0;"
+            "jnz 1b;"
+            : "+r"(num)
+        );
+    }
+
+
+    /// Test that the sampling period expires, which switches execution into
+    /// the fully instrumented version of the code, and that the following
+    /// burst expires, which switches execution back into the checking
+    /// version.
+    static void sampled_policy_switches(void) {
+        enum {
+            NUM_ITERATIONS = 4 * CONFIG_SAMPLING_PERIOD,
+            MAX_NUM_EXPIRIES = NUM_ITERATIONS / CONFIG_SAMPLING_PERIOD + 2,
+            MAX_NUM_FULL_EXECUTIONS = \
+                MAX_NUM_EXPIRIES * (CONFIG_SAMPLING_BURST_LENGTH + 2)
+        };
+
+        typedef granary::sampled_policy<
+            granary::test_policy, sample_count_policy> sampled_count_policy;
+
+        granary::instrumentation_policy policy =
+            granary::policy_for<sampled_count_policy>();
+        policy.force_attach(true);
+        policy.return_address_in_code_cache(true);
+        policy.begins_functional_unit(true);
+        policy.in_host_context(false);
+
+        granary::app_pc func((granary::app_pc) sample_loop);
+        granary::basic_block bb_func(granary::code_cache::find(func, policy));
+
+        NUM_FULL_EXECUTIONS = 0;
+        bb_func.call<void, uint64_t>(NUM_ITERATIONS);
+
+        ASSERT(0 < NUM_FULL_EXECUTIONS);
+        ASSERT(MAX_NUM_FULL_EXECUTIONS >= NUM_FULL_EXECUTIONS);
+    }
+
+
+    ADD_TEST(sampled_policy_switches,
+        "Test that sampled policies switch into and back out of their fully "
+        "instrumented versions.")
+}
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
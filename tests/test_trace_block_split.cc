@@ -44,6 +44,92 @@ namespace test {
     ADD_TEST(test_block_split,
         "Test that basic block splitting in traces works.")
 
+
+    /// A loop whose body JMPs to its condition. The body and condition are
+    /// separate blocks of the trace, which are then coalesced into a single
+    /// block that loops back to itself.
+    static int jmp_loop(void) throw() {
+        register int64_t ret asm("rcx") = 0;
+        ASM(
+            "mov $10, %%rdx;"
+            "xor %%rax, %%rax;"
+            "jmp 1f;"
+        "1:"
+            "add $3, %%rax;"
+            "jmp 2f;"
+        "3:"
+            "movq %%rax, %0;"
+            "jmp 4f;"
+        "2:"
+            "sub $1, %%rdx;"
+            "jnz 1b;"
+            "jmp 3b;"
+        "4:"
+            : "=r"(ret)
+            :
+            : "rax", "rdx"
+        );
+        return ret;
+    }
+
+
+    static bool SAW_COALESCED_LOOP = false;
+
+
+    /// Look for a block that contains the whole loop of `jmp_loop`, i.e. that
+    /// ends with a conditional branch back to an earlier instruction of the
+    /// same block, where the loop contains both the `ADD` and the `SUB`.
+    static void find_coalesced_loop(granary::instruction_list &ls) throw() {
+        for(granary::instruction cbr(ls.first());
+            cbr.is_valid();
+            cbr = cbr.next()) {
+
+            if(!dynamorio::instr_is_cbr(cbr.instr)) {
+                continue;
+            }
+
+            const granary::operand target(cbr.cti_target());
+            if(dynamorio::PC_kind != target.kind) {
+                continue;
+            }
+
+            granary::instruction head(ls.first());
+            for(; head.is_valid() && head != cbr; head = head.next()) {
+                if(head.pc() == target.value.pc) {
+                    break;
+                }
+            }
+
+            bool has_add(false);
+            bool has_sub(false);
+            for(granary::instruction in(head); in != cbr; in = in.next()) {
+                has_add = has_add || dynamorio::OP_add == in.op_code();
+                has_sub = has_sub || dynamorio::OP_sub == in.op_code();
+            }
+
+            SAW_COALESCED_LOOP = SAW_COALESCED_LOOP || (has_add && has_sub);
+        }
+    }
+
+
+    static void test_loop_coalesce(void) {
+        SAW_COALESCED_LOOP = false;
+        granary::TEST_VISIT_INSTRUCTIONS = find_coalesced_loop;
+
+        granary::app_pc func((granary::app_pc) jmp_loop);
+        granary::basic_block bb_func(granary::code_cache::find(
+            func, granary::TEST_POLICY));
+
+        granary::TEST_VISIT_INSTRUCTIONS = nullptr;
+
+        ASSERT(!CONFIG_OPTIMISE_COALESCE_LOOPS || SAW_COALESCED_LOOP);
+        ASSERT(30 == bb_func.call<int>());
+    }
+
+
+    ADD_TEST(test_loop_coalesce,
+        "Test that loops spanning several blocks of a trace are coalesced.")
+
 }
 
 #endif